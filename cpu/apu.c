@@ -0,0 +1,529 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "apu.h"
+#include "audio.h"
+#include "io.h"
+
+#define SHIFT		14 //fraction bits of the steps and the sums
+#define BASS		9 //DC leak, a sample's worth of it is sum >> BASS
+#define GAIN		64 //sample of a level of 1 at full volume, 4 channels stay under 32768
+#define CUTOFF		0.9 //of half the rate, where the steps roll off
+
+//register of channel n, NRx0 to NRx4
+#define NR(n, x)	(IO_NR10 + 5 * (n) + (x))
+
+static void	sync(apu *a, bus *mem, uint64_t to);
+static void	run(apu *a, bus *mem, uint64_t to);
+static void	run_chan(apu *a, bus *mem, int n, uint64_t to);
+static void	sequence(apu *a, bus *mem, uint64_t t);
+static uint16_t	sweep(bus *mem);
+static void	trigger(bus *mem, int n, uint64_t t);
+static int	dac(const bus *mem, int n);
+static uint32_t	period(const bus *mem, int n);
+static uint16_t	lfsr(const bus *mem, uint16_t pos);
+static uint8_t	level(const bus *mem, int n);
+static void	mix(apu *a, const bus *mem, int n, uint64_t t);
+static void	remix(apu *a, const bus *mem, uint64_t t);
+static void	add_step(apu *a, int side, uint64_t t, int32_t delta);
+static void	readout(apu *a, uint64_t t);
+static void	make_kernel(apu *a);
+
+//square waves, a bit per duty step, the first one high
+static const uint8_t duty[4] = { 0x01, 0x81, 0x87, 0x7E };
+
+//noise clock divisors by NR43 bits 0-2, in T-cycles
+static const uint8_t divisor[8] = { 8, 16, 32, 48, 64, 80, 96, 112 };
+
+//bits of 0x10-0x2F that read as 1 whatever was written
+static const uint8_t readmask[0x20] = {
+	0x80, 0x3F, 0x00, 0xFF, 0xBF,
+	0xFF, 0x3F, 0x00, 0xFF, 0xBF,
+	0x7F, 0xFF, 0x9F, 0xFF, 0xBF,
+	0xFF, 0xFF, 0x00, 0x00, 0xBF,
+	0x00, 0x00, 0x70,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+
+/**
+ * Make a sound unit sending rate samples a second to sink, which may be
+ * NULL.
+ *
+ * Return NULL if there's no memory or the rate is out of range.
+ */
+apu *apu_new(unsigned rate, struct audio *sink)
+{
+	apu *a;
+
+	if (rate == 0 || rate > APU_MAXRATE)
+		return (NULL);
+	if (!(a = (apu *)calloc(1, sizeof(apu))))
+		return (NULL);
+	a->rate = rate;
+	a->sink = sink;
+	a->step = ((uint64_t)rate << 32) / APU_CLOCK;
+	make_kernel(a);
+	return (a);
+}
+
+void apu_free(apu *a)
+{
+	free(a);
+}
+
+/**
+ * Go on from mem's clock, when a is put on its bus or the bus has been
+ * loaded from a save state. What was made up to then goes out first, what
+ * the channels did before they were heard isn't made at all.
+ */
+void apu_start(apu *a, bus *mem)
+{
+	readout(a, a->time);
+	run(NULL, mem, mem->sched.now);
+	a->time = a->base = mem->sched.now;
+	a->frac = 0;
+	remix(a, mem, a->time);
+}
+
+/**
+ * Sound register read, reg is 0x10-0x3F.
+ */
+uint8_t apu_read(bus *mem, uint8_t reg)
+{
+	uint8_t *io = mem->io;
+	uint8_t on = 0x0;
+	int n;
+
+	if (reg >= IO_WAVE)
+		return (io[reg]);
+	if (reg != IO_NR52)
+		return (io[reg] | readmask[reg - IO_NR10]);
+
+	//lengths may have run out since
+	sync(mem->apu, mem, mem->sched.now);
+	for (n = 0; n < 4; n++)
+		on |= mem->snd.ch[n].on << n;
+	return ((io[IO_NR52] & 0x80) | readmask[IO_NR52 - IO_NR10] | on);
+}
+
+/**
+ * Sound register write, reg is 0x10-0x3F. The channels are brought up
+ * to the clock first, the write counts from there on.
+ */
+void apu_write(bus *mem, uint8_t reg, uint8_t val)
+{
+	apu *a = mem->apu;
+	uint8_t *io = mem->io;
+	uint64_t now = mem->sched.now;
+	sndchan *c;
+	uint32_t was;
+	int n;
+
+	sync(a, mem, now);
+	if (reg == IO_NR52) {
+		//off clears every register but wave RAM, on starts the sequencer over
+		if (!(val & 0x80)) {
+			memset(io + IO_NR10, 0x0, IO_NR52 - IO_NR10);
+			for (n = 0; n < 4; n++)
+				mem->snd.ch[n].on = 0x0;
+		} else if (!(io[IO_NR52] & 0x80)) {
+			mem->snd.seq = 0;
+		}
+		io[IO_NR52] = val & 0x80;
+		remix(a, mem, now);
+		return;
+	}
+	//wave RAM takes writes with the sound off, nothing else does
+	if (reg < IO_WAVE && !(io[IO_NR52] & 0x80))
+		return;
+	io[reg] = val;
+	if (reg > NR(3, 4)) {
+		remix(a, mem, now);
+		return;
+	}
+
+	n = (reg - IO_NR10) / 5;
+	c = &mem->snd.ch[n];
+	switch ((reg - IO_NR10) % 5) {
+	case 0:
+		if (n == 2 && !dac(mem, n))
+			c->on = 0x0;
+		break;
+	case 1:
+		c->length = n == 2 ? 256 - val : 64 - (val & 0x3F);
+		break;
+	case 2:
+		if (n != 2 && !dac(mem, n))
+			c->on = 0x0;
+		break;
+	case 3:
+	case 4:
+		//a new period takes over at the next step, unless it was stopped
+		was = c->period;
+		c->period = period(mem, n);
+		if (!was)
+			c->next = now + c->period;
+		if ((reg - IO_NR10) % 5 == 4 && (val & 0x80))
+			trigger(mem, n, now);
+		break;
+	}
+	remix(a, mem, now);
+}
+
+/**
+ * Bring the channels up to the clock and send off the samples made.
+ */
+void apu_flush(apu *a, bus *mem)
+{
+	sync(a, mem, mem->sched.now);
+	readout(a, mem->sched.now);
+}
+
+/*
+ * Run the channels up to to, reading a's buffer out whenever it holds
+ * as much as it can. Without an apu there's no buffer to fill.
+ */
+static void sync(apu *a, bus *mem, uint64_t to)
+{
+	uint64_t stop;
+
+	if (!a) {
+		run(NULL, mem, to);
+		return;
+	}
+	while (mem->snd.time < to) {
+		stop = to < a->base + APU_SPAN ? to : a->base + APU_SPAN;
+		run(a, mem, stop);
+		if (stop < to)
+			readout(a, stop);
+	}
+	a->time = mem->snd.time;
+}
+
+/*
+ * Run the channels from one frame sequencer step to the next, for a to
+ * hear unless it's NULL.
+ */
+static void run(apu *a, bus *mem, uint64_t to)
+{
+	sndstate *s = &mem->snd;
+	uint64_t end;
+	int n;
+
+	while (s->time < to) {
+		end = (s->time / APU_SEQ + 1) * APU_SEQ;
+		if (end > to)
+			end = to;
+		for (n = 0; n < 4; n++)
+			run_chan(a, mem, n, end);
+		s->time = end;
+		if (end % APU_SEQ == 0)
+			sequence(a, mem, end);
+	}
+}
+
+/*
+ * Take channel n through its steps up to to. Each one that changes its
+ * level is a step in a's output, if there is one.
+ */
+static void run_chan(apu *a, bus *mem, int n, uint64_t to)
+{
+	sndchan *c = &mem->snd.ch[n];
+	uint64_t k;
+	uint8_t lv;
+
+	if (!c->on || !c->period || c->next > to)
+		return;
+
+	//nothing to hear, only the position moves
+	if (!a || (n == 2 ? !(mem->io[IO_NR32] & 0x60) : !c->vol)) {
+		k = (to - c->next) / c->period + 1;
+		c->next += k * c->period;
+		if (n == 3) {
+			while (k-- > 0)
+				c->pos = lfsr(mem, c->pos);
+		} else {
+			c->pos = (c->pos + k) & (n == 2 ? 31 : 7);
+		}
+		return;
+	}
+
+	while (c->next <= to) {
+		c->pos = n == 3 ? lfsr(mem, c->pos) : (c->pos + 1) & (n == 2 ? 31 : 7);
+		if ((lv = level(mem, n)) != a->level[n]) {
+			a->level[n] = lv;
+			mix(a, mem, n, c->next);
+		}
+		c->next += c->period;
+	}
+}
+
+/*
+ * Frame sequencer step at t: lengths every other step, the sweep on 2
+ * and 6, envelopes on 7.
+ */
+static void sequence(apu *a, bus *mem, uint64_t t)
+{
+	sndstate *snd = &mem->snd;
+	uint8_t *io = mem->io;
+	uint8_t s = snd->seq, p;
+	uint16_t f;
+	sndchan *c;
+	int n;
+
+	snd->seq = (s + 1) & 0x7;
+	if (!(io[IO_NR52] & 0x80))
+		return;
+
+	for (n = 0; n < 4 && !(s & 0x1); n++) {
+		c = &snd->ch[n];
+		if ((io[NR(n, 4)] & 0x40) && c->length && --c->length == 0)
+			c->on = 0x0;
+	}
+
+	if ((s == 2 || s == 6) && (snd->sweeptimer == 0 || --snd->sweeptimer == 0)) {
+		p = io[IO_NR10] >> 4 & 0x7;
+		snd->sweeptimer = p ? p : 8;
+		if (snd->sweepon && p) {
+			f = sweep(mem);
+			if (f < 2048 && (io[IO_NR10] & 0x7)) {
+				snd->shadow = f;
+				io[IO_NR13] = f & 0xFF;
+				io[IO_NR14] = (io[IO_NR14] & ~0x7) | f >> 0x8;
+				snd->ch[0].period = period(mem, 0);
+				sweep(mem);
+			}
+		}
+	}
+
+	for (n = 0; n < 4 && s == 7; n++) {
+		c = &snd->ch[n];
+		p = io[NR(n, 2)] & 0x7;
+		if (n == 2 || !p || !c->on)
+			continue;
+		if (c->envtimer == 0 || --c->envtimer == 0) {
+			c->envtimer = p;
+			if ((io[NR(n, 2)] & 0x8) && c->vol < 15)
+				c->vol++;
+			else if (!(io[NR(n, 2)] & 0x8) && c->vol > 0)
+				c->vol--;
+		}
+	}
+	remix(a, mem, t);
+}
+
+/*
+ * The period the sweep goes to next, which stops square 1 if it's out
+ * of range.
+ */
+static uint16_t sweep(bus *mem)
+{
+	uint8_t nr10 = mem->io[IO_NR10];
+	uint16_t d = mem->snd.shadow >> (nr10 & 0x7);
+	uint16_t f = nr10 & 0x8 ? mem->snd.shadow - d : mem->snd.shadow + d;
+
+	if (f >= 2048)
+		mem->snd.ch[0].on = 0x0;
+	return (f);
+}
+
+/*
+ * NRx4 bit 7: start channel n over at t, if its DAC is on.
+ */
+static void trigger(bus *mem, int n, uint64_t t)
+{
+	const uint8_t *io = mem->io;
+	sndstate *s = &mem->snd;
+	sndchan *c = &s->ch[n];
+	uint8_t p;
+
+	c->on = dac(mem, n) != 0;
+	if (c->length == 0)
+		c->length = n == 2 ? 256 : 64;
+	c->vol = io[NR(n, 2)] >> 4;
+	c->envtimer = io[NR(n, 2)] & 0x7;
+	c->next = t + c->period;
+	if (n == 2)
+		c->pos = 0;
+	else if (n == 3)
+		c->pos = 0x7FFF;
+
+	if (n == 0) {
+		p = io[IO_NR10] >> 4 & 0x7;
+		s->shadow = io[IO_NR13] | (io[IO_NR14] & 0x7) << 0x8;
+		s->sweeptimer = p ? p : 8;
+		s->sweepon = (io[IO_NR10] & 0x77) != 0;
+		if (io[IO_NR10] & 0x7)
+			sweep(mem);
+	}
+}
+
+static int dac(const bus *mem, int n)
+{
+	return (n == 2 ? mem->io[IO_NR30] & 0x80 : mem->io[NR(n, 2)] & 0xF8);
+}
+
+/*
+ * T-cycles from one step of channel n to the next. The noise isn't
+ * clocked at all with the two top shifts.
+ */
+static uint32_t period(const bus *mem, int n)
+{
+	const uint8_t *io = mem->io;
+	uint16_t f = io[NR(n, 3)] | (io[NR(n, 4)] & 0x7) << 0x8;
+
+	if (n == 3)
+		return ((io[IO_NR43] >> 4) >= 14 ? 0 : divisor[io[IO_NR43] & 0x7] << (io[IO_NR43] >> 4));
+	return ((2048 - f) * (n == 2 ? 2 : 4));
+}
+
+/*
+ * Next noise LFSR, 15 bits or 7 with NR43 bit 3.
+ */
+static uint16_t lfsr(const bus *mem, uint16_t pos)
+{
+	uint16_t bit = (pos ^ pos >> 1) & 0x1;
+
+	pos = pos >> 1 | bit << 14;
+	if (mem->io[IO_NR43] & 0x8)
+		pos = (pos & ~0x40) | bit << 6;
+	return (pos);
+}
+
+/*
+ * What channel n puts out at its position.
+ */
+static uint8_t level(const bus *mem, int n)
+{
+	const sndchan *c = &mem->snd.ch[n];
+	uint8_t s, code;
+
+	if (!c->on)
+		return (0);
+	switch (n) {
+	case 2:
+		s = mem->io[IO_WAVE + (c->pos >> 1)];
+		s = c->pos & 0x1 ? s & 0xF : s >> 4;
+		code = mem->io[IO_NR32] >> 5 & 0x3;
+		return (code ? s >> (code - 1) : 0);
+	case 3:
+		return (c->pos & 0x1 ? 0 : c->vol);
+	default:
+		return (duty[mem->io[NR(n, 1)] >> 6] >> (7 - c->pos) & 0x1 ? c->vol : 0);
+	}
+}
+
+/*
+ * Put channel n's level at t through the panning and master volume into
+ * each side, as a step wherever it changes what the side had from it.
+ */
+static void mix(apu *a, const bus *mem, int n, uint64_t t)
+{
+	uint8_t pan = mem->io[IO_NR51], vol = mem->io[IO_NR50];
+	int32_t amp[2];
+	int side;
+
+	amp[0] = pan >> (4 + n) & 0x1 ? a->level[n] * ((vol >> 4 & 0x7) + 1) * GAIN : 0;
+	amp[1] = pan >> n & 0x1 ? a->level[n] * ((vol & 0x7) + 1) * GAIN : 0;
+	for (side = 0; side < 2; side++) {
+		if (amp[side] != a->amp[n][side]) {
+			add_step(a, side, t, amp[side] - a->amp[n][side]);
+			a->amp[n][side] = amp[side];
+		}
+	}
+}
+
+/*
+ * Every channel's level again at t, after a register or the sequencer
+ * changed what it may be. Nothing to do without an apu.
+ */
+static void remix(apu *a, const bus *mem, uint64_t t)
+{
+	int n;
+
+	for (n = 0; n < 4 && a; n++) {
+		a->level[n] = level(mem, n);
+		mix(a, mem, n, t);
+	}
+}
+
+/*
+ * A step of delta at t, spread over the samples around it. t is in the
+ * buffer, at most APU_SPAN past its start.
+ */
+static void add_step(apu *a, int side, uint64_t t, int32_t delta)
+{
+	uint64_t x = (t - a->base) * a->step + a->frac;
+	const int16_t *k = a->kernel[(x & 0xFFFFFFFF) * APU_PHASES >> 32];
+	int32_t *b = a->buf[side] + (x >> 32);
+	int i;
+
+	for (i = 0; i < APU_TAPS; i++)
+		b[i] += delta * k[i];
+	a->steps++;
+}
+
+/*
+ * Sum up the samples before t, hand them on, and start the buffer at t
+ * with what the steps put past it.
+ */
+static void readout(apu *a, uint64_t t)
+{
+	uint64_t x = (t - a->base) * a->step + a->frac;
+	size_t n = x >> 32, i;
+	int32_t *b, sum, s;
+	int side;
+
+	for (side = 0; side < 2; side++) {
+		b = a->buf[side];
+		sum = a->sum[side];
+		for (i = 0; i < n; i++) {
+			s = sum >> SHIFT;
+			sum += b[i];
+			sum -= s << (SHIFT - BASS);
+			a->out[i * 2 + side] = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+		}
+		a->sum[side] = sum;
+		memmove(b, b + n, APU_TAPS * sizeof(int32_t));
+		memset(b + APU_TAPS, 0x0, n * sizeof(int32_t));
+	}
+	if (n && a->sink)
+		audio_push(a->sink, a->out, n);
+	a->samples += n;
+	a->base = t;
+	a->frac = x & 0xFFFFFFFF;
+}
+
+/*
+ * A Blackman windowed sinc summed up into a step, then cut into a set
+ * of differences from one sample to the next per phase. Each set adds up
+ * to exactly one so steps leave no DC error behind.
+ */
+static void make_kernel(apu *a)
+{
+	const int n = APU_TAPS * APU_PHASES;
+	double step[APU_TAPS * APU_PHASES + 1], x, w, sum = 0.0;
+	int i, p, k, lo, hi, total;
+
+	step[0] = 0.0;
+	for (i = 0; i < n; i++) {
+		x = M_PI * CUTOFF * (i + 0.5 - n / 2) / APU_PHASES;
+		w = 0.42 - 0.5 * cos(2 * M_PI * (i + 0.5) / n) + 0.08 * cos(4 * M_PI * (i + 0.5) / n);
+		sum += w * sin(x) / x;
+		step[i + 1] = sum;
+	}
+
+	for (p = 0; p < APU_PHASES; p++) {
+		total = 0;
+		for (k = 0; k < APU_TAPS; k++) {
+			hi = (k + 1) * APU_PHASES - p;
+			lo = k * APU_PHASES - p;
+			a->kernel[p][k] = lrint((step[hi] - (lo > 0 ? step[lo] : 0.0)) / sum *
+			    (1 << SHIFT));
+			total += a->kernel[p][k];
+		}
+		a->kernel[p][APU_TAPS / 2] += (1 << SHIFT) - total;
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef APU_H
+#define APU_H
+
+#include <stdint.h>
+
+#include "mem.h"
+
+struct audio;
+
+/*
+ * Sound unit. Nothing runs per cycle: the four channels are brought up to
+ * the clock when a sound register is read or written, through apu_read()
+ * and apu_write(), and at the end of every frame by apu_flush(), which
+ * hands the samples made so far to the output. A channel jumps from one
+ * step of its timer to the next and only does any work when its level
+ * changes, and a silent one moves its counters on in one go.
+ *
+ * Levels go out as band-limited steps. Every change adds a windowed sinc
+ * step, picked by where between two samples it fell, to a buffer of
+ * differences per side. Reading the buffer out sums them up with a small
+ * leak that takes out DC, so the samples don't alias like ones taken off
+ * the levels every so many cycles would, at any rate.
+ *
+ * What the guest sees, the channels' counters, the sequencer and the
+ * sweep, is in the bus and part of save states, and every machine keeps
+ * it whether it has an apu on the bus or not, so sound never changes how
+ * a game runs. The apu only makes the samples.
+ */
+#define APU_CLOCK	4194304 //T-cycles a second
+#define APU_RATE	44100 //samples a second, unless asked for otherwise
+#define APU_MAXRATE	96000
+#define APU_SPAN	65536 //T-cycles made at most before they're read out
+#define APU_BUF		2048 //samples those make at most, at APU_MAXRATE
+#define APU_TAPS	16 //samples a step is spread over
+#define APU_PHASES	32 //steps, by where one falls between two samples
+#define APU_SEQ		8192 //T-cycles between frame sequencer steps
+
+typedef struct apu {
+	uint8_t		level[4]; //each channel's output, 0-15
+	int32_t		amp[4][2]; //what the mix has from each, left and right
+	uint64_t	time; //clock the channels were run up to for it
+	uint64_t	base; //clock at the start of the buffer
+	uint64_t	frac; //where between two samples base falls, 32 bit fraction
+	uint64_t	step; //samples per T-cycle, same
+	int32_t		sum[2]; //samples read out so far, left and right
+	int32_t		buf[2][APU_BUF + APU_TAPS]; //differences from one sample to the next
+	int16_t		kernel[APU_PHASES][APU_TAPS]; //steps, as differences
+	int16_t		out[APU_BUF * 2]; //samples read out, left and right
+	unsigned	rate; //samples a second
+	struct audio	*sink; //where they go, NULL to nowhere
+	uint64_t	samples; //made
+	uint64_t	steps; //level changes put in
+} apu;
+
+apu		*apu_new(unsigned rate, struct audio *sink);
+void		apu_free(apu *a);
+void		apu_start(apu *a, bus *mem);
+uint8_t		apu_read(bus *mem, uint8_t reg);
+void		apu_write(bus *mem, uint8_t reg, uint8_t val);
+void		apu_flush(apu *a, bus *mem);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * Growable arrays: a pointer, the number of elements there's room for,
+ * and how many are used, kept by whoever owns them. Room doubles, so
+ * appending an element at a time is amortized constant.
+ */
+
+/*
+ * Grow the array *p points to, with room for cap elements of elem bytes,
+ * to hold at least need. A failed grow leaves it as it was.
+ *
+ * Return -1 if it can't be grown.
+ */
+static inline int array_reserve(void *p, size_t *cap, size_t need, size_t elem)
+{
+	void *grown;
+	size_t n = *cap;
+
+	if (need <= n)
+		return (0);
+	while (n < need)
+		n = n ? 2 * n : 64;
+	if (!(grown = realloc(*(void **)p, n * elem)))
+		return (-1);
+	*(void **)p = grown;
+	*cap = n;
+	return (0);
+}
+
+#endif
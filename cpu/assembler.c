@@ -0,0 +1,1046 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "assembler.h"
+#include "mem.h"
+#include "rom.h"
+
+#define MAXLINE		512
+#define MAXNAME		64
+#define MAXSYM		(2 * MAXNAME) //with the scope of a .local one
+#define MAXBANKS	512 //8M, the largest ROM size code
+
+//operand kinds
+#define OPD_NONE	0
+#define OPD_R8		1 //B C D E H L [HL] A as 0-7
+#define OPD_R16		2 //BC DE HL SP as 0-3
+#define OPD_AF		3
+#define OPD_MBC		4
+#define OPD_MDE		5
+#define OPD_MHLI	6
+#define OPD_MHLD	7
+#define OPD_MC		8 //[C], 0xFF00 + C
+#define OPD_MEM		9 //[n16]
+#define OPD_IMM		10
+#define OPD_SPE		11 //SP + e8
+#define OPD_CC		12 //NZ Z NC as 0-2, C is an R8 until a jump takes it
+
+typedef struct {
+	int		kind;
+	int		reg;
+	int32_t		val;
+} operand;
+
+typedef struct {
+	char		name[MAXSYM];
+	int32_t		value;
+	uint32_t	bank;
+	int		pass; //last pass that defined it
+} asmsym;
+
+typedef struct {
+	int		pass;
+	int		line;
+	asmerror	*err;
+	int		failed;
+
+	asmsym		*syms;
+	size_t		nsyms;
+	size_t		capsyms;
+	char		scope[MAXNAME]; //last global label, for .local ones
+
+	uint32_t	pc; //CPU address
+	uint32_t	bank;
+	uint32_t	maxbank;
+	uint8_t		*rom; //NULL in the first pass
+	size_t		size;
+	uint8_t		*written; //a byte per ROM byte, set once emitted
+
+	char		title[16];
+	uint8_t		type;
+	uint8_t		ramsize;
+	uint8_t		cgb;
+} asmctx;
+
+static const uint8_t logo[48] = {
+	0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83,
+	0x00, 0x0C, 0x00, 0x0D, 0x00, 0x08, 0x11, 0x1F, 0x88, 0x89, 0x00, 0x0E,
+	0xDC, 0xCC, 0x6E, 0xE6, 0xDD, 0xDD, 0xD9, 0x99, 0xBB, 0xBB, 0x67, 0x63,
+	0x6E, 0x0E, 0xEC, 0xCC, 0xDD, 0xDC, 0x99, 0x9F, 0xBB, 0xB9, 0x33, 0x3E
+};
+
+//ALU A,x operations in opcode order, then CB shifts in opcode order
+static const char *const aluops[8] = { "add", "adc", "sub", "sbc", "and", "xor", "or", "cp" };
+static const char *const shiftops[8] = { "rlc", "rrc", "rl", "rr", "sla", "sra", "swap", "srl" };
+
+//operands without an expression, matched with spaces taken out
+static const struct {
+	const char	*text;
+	int		kind;
+	int		reg;
+} regs[] = {
+	{ "b", OPD_R8, 0 }, { "c", OPD_R8, 1 }, { "d", OPD_R8, 2 }, { "e", OPD_R8, 3 },
+	{ "h", OPD_R8, 4 }, { "l", OPD_R8, 5 }, { "[hl]", OPD_R8, 6 }, { "(hl)", OPD_R8, 6 },
+	{ "a", OPD_R8, 7 },
+	{ "bc", OPD_R16, 0 }, { "de", OPD_R16, 1 }, { "hl", OPD_R16, 2 }, { "sp", OPD_R16, 3 },
+	{ "af", OPD_AF, 0 },
+	{ "[bc]", OPD_MBC, 0 }, { "(bc)", OPD_MBC, 0 }, { "[de]", OPD_MDE, 0 }, { "(de)", OPD_MDE, 0 },
+	{ "[hl+]", OPD_MHLI, 0 }, { "(hl+)", OPD_MHLI, 0 }, { "[hli]", OPD_MHLI, 0 },
+	{ "(hli)", OPD_MHLI, 0 },
+	{ "[hl-]", OPD_MHLD, 0 }, { "(hl-)", OPD_MHLD, 0 }, { "[hld]", OPD_MHLD, 0 },
+	{ "(hld)", OPD_MHLD, 0 },
+	{ "[c]", OPD_MC, 0 }, { "(c)", OPD_MC, 0 }, { "[$ff00+c]", OPD_MC, 0 },
+	{ "($ff00+c)", OPD_MC, 0 }, { "[0xff00+c]", OPD_MC, 0 },
+	{ "nz", OPD_CC, 0 }, { "z", OPD_CC, 1 }, { "nc", OPD_CC, 2 }
+};
+
+static int	run_pass(asmctx *as, const char *src);
+static void	statement(asmctx *as, char *line);
+static void	directive(asmctx *as, const char *op, char *args, int *done);
+static void	instruction(asmctx *as, const char *op, char *args);
+static int	split(asmctx *as, char *args, char **out, int max);
+static void	parse_operand(asmctx *as, const char *text, operand *o);
+static int32_t	expr(asmctx *as, const char **p, int level);
+static int32_t	atom(asmctx *as, const char **p);
+static int	ident(const char **p, char *buf);
+static asmsym	*lookup(asmctx *as, const char *name);
+static void	define(asmctx *as, const char *name, int32_t value);
+static void	scoped(asmctx *as, const char *name, char *buf);
+static void	emit(asmctx *as, int32_t b);
+static void	emit_imm8(asmctx *as, int32_t v);
+static void	emit_imm16(asmctx *as, int32_t v);
+static void	finish(asmctx *as);
+static void	fail(asmctx *as, const char *fmt, ...);
+static char	*trim(char *s);
+
+
+/**
+ * Assemble src into a new cartridge image, malloc'd, sized to the banks
+ * used rounded up to a power of two and at least 32K.
+ *
+ * Return 0, -1 with err filled in.
+ */
+int asm_build(const char *src, uint8_t **rom, size_t *size, asmerror *err)
+{
+	asmctx as;
+	uint32_t nbanks;
+
+	memset(&as, 0, sizeof(as));
+	memset(err, 0, sizeof(asmerror));
+	as.err = err;
+
+	if (run_pass(&as, src) < 0)
+		goto bad;
+
+	for (nbanks = 2; nbanks < as.maxbank + 1; nbanks *= 2)
+		;
+	as.size = (size_t)nbanks * ROMBANK;
+	as.rom = (uint8_t *)calloc(1, as.size);
+	as.written = (uint8_t *)calloc(1, as.size);
+	if (!as.rom || !as.written) {
+		fail(&as, "out of memory");
+		goto bad;
+	}
+	if (run_pass(&as, src) < 0)
+		goto bad;
+	finish(&as);
+	if (as.failed)
+		goto bad;
+
+	free(as.written);
+	free(as.syms);
+	*rom = as.rom;
+	*size = as.size;
+	return (0);
+
+bad:
+	free(as.rom);
+	free(as.written);
+	free(as.syms);
+	return (-1);
+}
+
+/**
+ * Assemble the file src into the ROM file rom.
+ *
+ * Return 0, -1 with err filled in.
+ */
+int asm_file(const char *src, const char *rom, asmerror *err)
+{
+	FILE *fp;
+	char *text;
+	uint8_t *img;
+	size_t size;
+	long len;
+	int ok;
+
+	memset(err, 0, sizeof(asmerror));
+	if (!(fp = fopen(src, "r"))) {
+		snprintf(err->msg, sizeof(err->msg), "can't read source");
+		return (-1);
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (len < 0 || !(text = (char *)malloc(len + 1))) {
+		fclose(fp);
+		snprintf(err->msg, sizeof(err->msg), "can't read source");
+		return (-1);
+	}
+	len = fread(text, 1, len, fp);
+	text[len] = '\0';
+	fclose(fp);
+
+	ok = asm_build(text, &img, &size, err) == 0;
+	free(text);
+	if (!ok)
+		return (-1);
+
+	if (!(fp = fopen(rom, "wb"))) {
+		free(img);
+		snprintf(err->msg, sizeof(err->msg), "can't write ROM");
+		return (-1);
+	}
+	ok = fwrite(img, 1, size, fp) == size;
+	if (fclose(fp) != 0)
+		ok = 0;
+	free(img);
+	if (!ok) {
+		snprintf(err->msg, sizeof(err->msg), "can't write ROM");
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * One pass over the source, from bank 0 at address 0.
+ */
+static int run_pass(asmctx *as, const char *src)
+{
+	char line[MAXLINE];
+	const char *end;
+	size_t len;
+
+	as->pass++;
+	as->line = 0;
+	as->pc = 0;
+	as->bank = 0;
+	as->scope[0] = '\0';
+
+	while (*src && !as->failed) {
+		as->line++;
+		end = strchr(src, '\n');
+		len = end ? (size_t)(end - src) : strlen(src);
+		if (len >= sizeof(line)) {
+			fail(as, "line too long");
+			break;
+		}
+		memcpy(line, src, len);
+		line[len] = '\0';
+		statement(as, line);
+		src += end ? len + 1 : len;
+	}
+	return (as->failed ? -1 : 0);
+}
+
+/*
+ * A line: an optional label, then a directive or an instruction.
+ */
+static void statement(asmctx *as, char *line)
+{
+	char name[MAXNAME], op[MAXNAME];
+	const char *p;
+	char *s;
+	int quoted = 0, done = 0;
+
+	for (s = line; *s; s++) {
+		if (*s == '"' || *s == '\'')
+			quoted = quoted == *s ? 0 : (quoted ? quoted : *s);
+		else if (*s == ';' && !quoted) {
+			*s = '\0';
+			break;
+		}
+	}
+
+	p = line;
+	while (isspace((unsigned char)*p))
+		p++;
+	if (!*p)
+		return;
+
+	//NAME equ value, or a label
+	s = (char *)p;
+	if (ident(&p, name)) {
+		const char *q = p;
+
+		while (isspace((unsigned char)*q))
+			q++;
+		if (strncasecmp(q, "equ", 3) == 0 && isspace((unsigned char)q[3])) {
+			q += 3;
+			define(as, name, expr(as, &q, 0));
+			while (isspace((unsigned char)*q))
+				q++;
+			if (*q)
+				fail(as, "junk after expression");
+			return;
+		}
+		if (*p == ':') {
+			while (*p == ':')
+				p++;
+			if (name[0] != '.')
+				snprintf(as->scope, sizeof(as->scope), "%s", name);
+			define(as, name, as->pc);
+			while (isspace((unsigned char)*p))
+				p++;
+			if (!*p)
+				return;
+			s = (char *)p;
+		} else {
+			p = s;
+		}
+	}
+
+	if (!ident(&p, op)) {
+		fail(as, "expected an instruction");
+		return;
+	}
+	for (s = op; *s; s++)
+		*s = tolower((unsigned char)*s);
+	directive(as, op, (char *)p, &done);
+	if (!done)
+		instruction(as, op, (char *)p);
+}
+
+static void directive(asmctx *as, const char *op, char *args, int *done)
+{
+	char *item[256];
+	const char *p;
+	int32_t v, fill;
+	int n, i;
+
+	*done = 1;
+	if (strcmp(op, "db") == 0 || strcmp(op, "dw") == 0) {
+		n = split(as, args, item, 256);
+		for (i = 0; i < n; i++) {
+			if (item[i][0] == '"' && op[1] == 'b') {
+				for (p = item[i] + 1; *p && *p != '"'; p++) {
+					if (*p == '\\' && p[1]) {
+						p++;
+						emit(as, *p == 'n' ? '\n' : *p == 't' ? '\t' : *p == '0' ? 0 : *p);
+					} else {
+						emit(as, (uint8_t)*p);
+					}
+				}
+				continue;
+			}
+			p = item[i];
+			v = expr(as, &p, 0);
+			if (*p)
+				fail(as, "junk after expression");
+			if (op[1] == 'b')
+				emit_imm8(as, v);
+			else
+				emit_imm16(as, v);
+		}
+	} else if (strcmp(op, "ds") == 0) {
+		n = split(as, args, item, 2);
+		p = item[0];
+		v = n > 0 ? expr(as, &p, 0) : -1;
+		fill = 0;
+		if (n > 1) {
+			p = item[1];
+			fill = expr(as, &p, 0);
+		}
+		if (n < 1 || v < 0 || v > 0x800000)
+			fail(as, "bad count");
+		for (i = 0; i < v && !as->failed; i++)
+			emit_imm8(as, fill);
+	} else if (strcmp(op, "org") == 0 || strcmp(op, "bank") == 0) {
+		p = args;
+		v = expr(as, &p, 0);
+		if (op[0] == 'o') {
+			if (v < 0 || v > 0x7FFF || (as->bank && v < 0x4000))
+				fail(as, "address outside the bank");
+			as->pc = v;
+		} else {
+			if (v < 0 || v >= MAXBANKS)
+				fail(as, "bad bank");
+			as->bank = v;
+			as->pc = v ? 0x4000 : 0x0;
+			if (as->bank > as->maxbank)
+				as->maxbank = as->bank;
+		}
+	} else if (strcmp(op, "title") == 0) {
+		p = trim(args);
+		if (*p != '"' || !strchr(p + 1, '"') || strchr(p + 1, '"') - p - 1 > 15) {
+			fail(as, "title is a string of up to 15 characters");
+			return;
+		}
+		memset(as->title, 0, sizeof(as->title));
+		memcpy(as->title, p + 1, strchr(p + 1, '"') - p - 1);
+	} else if (strcmp(op, "cart") == 0 || strcmp(op, "ramsize") == 0 ||
+	    strcmp(op, "cgb") == 0) {
+		p = args;
+		v = expr(as, &p, 0);
+		if (v < 0 || v > 0xFF)
+			fail(as, "header byte out of range");
+		if (op[0] == 'c' && op[1] == 'a')
+			as->type = v;
+		else if (op[0] == 'r')
+			as->ramsize = v;
+		else
+			as->cgb = v;
+	} else {
+		*done = 0;
+	}
+}
+
+static void instruction(asmctx *as, const char *op, char *args)
+{
+	char *text[3];
+	operand o[2];
+	operand *d = &o[0], *s = &o[1];
+	int n, i, jump;
+	int32_t rel;
+
+	memset(o, 0, sizeof(o));
+	n = split(as, args, text, 3);
+	if (n > 2) {
+		fail(as, "too many operands");
+		return;
+	}
+	for (i = 0; i < n; i++)
+		parse_operand(as, text[i], &o[i]);
+	if (as->failed)
+		return;
+
+	//C is a condition for jumps, calls and returns that take one
+	jump = strcmp(op, "jp") == 0 || strcmp(op, "jr") == 0 || strcmp(op, "call") == 0 ||
+	    strcmp(op, "ret") == 0;
+	if (jump && (n == 2 || strcmp(op, "ret") == 0) && d->kind == OPD_R8 && d->reg == 1) {
+		d->kind = OPD_CC;
+		d->reg = 3;
+	}
+
+#define IS(k, r)	(o[0].kind == (k) && (r < 0 || o[0].reg == r))
+#define IS2(k, r)	(o[1].kind == (k) && (r < 0 || o[1].reg == r))
+	//no operands
+	if (n == 0) {
+		static const struct { const char *name; uint8_t opc; } plain[] = {
+			{ "nop", 0x00 }, { "rlca", 0x07 }, { "rrca", 0x0F }, { "rla", 0x17 },
+			{ "rra", 0x1F }, { "daa", 0x27 }, { "cpl", 0x2F }, { "scf", 0x37 },
+			{ "ccf", 0x3F }, { "halt", 0x76 }, { "ret", 0xC9 }, { "reti", 0xD9 },
+			{ "di", 0xF3 }, { "ei", 0xFB }
+		};
+
+		for (i = 0; i < (int)(sizeof(plain) / sizeof(plain[0])); i++) {
+			if (strcmp(op, plain[i].name) == 0) {
+				emit(as, plain[i].opc);
+				return;
+			}
+		}
+		if (strcmp(op, "stop") == 0) {
+			emit(as, 0x10);
+			emit(as, 0x00);
+			return;
+		}
+	}
+
+	if (strcmp(op, "ld") == 0 && n == 2) {
+		if (IS(OPD_R8, -1) && IS2(OPD_R8, -1) && !(d->reg == 6 && s->reg == 6))
+			emit(as, 0x40 | d->reg << 3 | s->reg);
+		else if (IS(OPD_R8, -1) && IS2(OPD_IMM, -1)) {
+			emit(as, 0x06 | d->reg << 3);
+			emit_imm8(as, s->val);
+		} else if (IS(OPD_R16, -1) && IS2(OPD_IMM, -1)) {
+			emit(as, 0x01 | d->reg << 4);
+			emit_imm16(as, s->val);
+		} else if (IS(OPD_R16, 3) && IS2(OPD_R16, 2))
+			emit(as, 0xF9);
+		else if (IS(OPD_R16, 2) && IS2(OPD_SPE, -1)) {
+			emit(as, 0xF8);
+			emit_imm8(as, s->val);
+		} else if (IS2(OPD_R8, 7) && d->kind >= OPD_MBC && d->kind <= OPD_MHLD)
+			emit(as, 0x02 | (d->kind - OPD_MBC) << 4);
+		else if (IS(OPD_R8, 7) && s->kind >= OPD_MBC && s->kind <= OPD_MHLD)
+			emit(as, 0x0A | (s->kind - OPD_MBC) << 4);
+		else if (IS(OPD_MEM, -1) && IS2(OPD_R8, 7)) {
+			emit(as, 0xEA);
+			emit_imm16(as, d->val);
+		} else if (IS(OPD_R8, 7) && IS2(OPD_MEM, -1)) {
+			emit(as, 0xFA);
+			emit_imm16(as, s->val);
+		} else if (IS(OPD_MEM, -1) && IS2(OPD_R16, 3)) {
+			emit(as, 0x08);
+			emit_imm16(as, d->val);
+		} else if (IS(OPD_MC, -1) && IS2(OPD_R8, 7))
+			emit(as, 0xE2);
+		else if (IS(OPD_R8, 7) && IS2(OPD_MC, -1))
+			emit(as, 0xF2);
+		else
+			fail(as, "bad operands for ld");
+		return;
+	}
+
+	if (strcmp(op, "ldh") == 0 && n == 2) {
+		if (IS(OPD_MC, -1) && IS2(OPD_R8, 7))
+			emit(as, 0xE2);
+		else if (IS(OPD_R8, 7) && IS2(OPD_MC, -1))
+			emit(as, 0xF2);
+		else if ((IS(OPD_MEM, -1) && IS2(OPD_R8, 7)) || (IS(OPD_R8, 7) && IS2(OPD_MEM, -1))) {
+			rel = d->kind == OPD_MEM ? d->val : s->val;
+			if (rel >= 0xFF00)
+				rel -= 0xFF00;
+			if (as->pass > 1 && (rel < 0 || rel > 0xFF))
+				fail(as, "ldh address out of range");
+			emit(as, d->kind == OPD_MEM ? 0xE0 : 0xF0);
+			emit(as, rel & 0xFF);
+		} else
+			fail(as, "bad operands for ldh");
+		return;
+	}
+
+	if ((strcmp(op, "inc") == 0 || strcmp(op, "dec") == 0) && n == 1) {
+		if (IS(OPD_R8, -1))
+			emit(as, (op[0] == 'i' ? 0x04 : 0x05) | d->reg << 3);
+		else if (IS(OPD_R16, -1))
+			emit(as, (op[0] == 'i' ? 0x03 : 0x0B) | d->reg << 4);
+		else
+			fail(as, "bad operand for %s", op);
+		return;
+	}
+
+	if (strcmp(op, "add") == 0 && n == 2 && IS(OPD_R16, 2)) {
+		if (IS2(OPD_R16, -1))
+			emit(as, 0x09 | s->reg << 4);
+		else
+			fail(as, "bad operands for add");
+		return;
+	}
+	if (strcmp(op, "add") == 0 && n == 2 && IS(OPD_R16, 3)) {
+		if (IS2(OPD_IMM, -1)) {
+			emit(as, 0xE8);
+			emit_imm8(as, s->val);
+		} else
+			fail(as, "bad operands for add");
+		return;
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (strcmp(op, aluops[i]) != 0)
+			continue;
+		//ALU A,x or ALU x
+		if (n == 2 && IS(OPD_R8, 7))
+			o[0] = o[1];
+		else if (n != 1) {
+			fail(as, "bad operands for %s", op);
+			return;
+		}
+		if (IS(OPD_R8, -1))
+			emit(as, 0x80 | i << 3 | d->reg);
+		else if (IS(OPD_IMM, -1)) {
+			emit(as, 0xC6 | i << 3);
+			emit_imm8(as, d->val);
+		} else
+			fail(as, "bad operand for %s", op);
+		return;
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (strcmp(op, shiftops[i]) != 0)
+			continue;
+		if (n == 1 && IS(OPD_R8, -1)) {
+			emit(as, 0xCB);
+			emit(as, i << 3 | d->reg);
+		} else
+			fail(as, "bad operand for %s", op);
+		return;
+	}
+
+	if ((strcmp(op, "bit") == 0 || strcmp(op, "res") == 0 || strcmp(op, "set") == 0) &&
+	    n == 2) {
+		if (!IS(OPD_IMM, -1) || !IS2(OPD_R8, -1) || d->val < 0 || d->val > 7) {
+			fail(as, "bad operands for %s", op);
+			return;
+		}
+		emit(as, 0xCB);
+		emit(as, (op[0] == 'b' ? 0x40 : op[0] == 'r' ? 0x80 : 0xC0) | d->val << 3 | s->reg);
+		return;
+	}
+
+	if (strcmp(op, "jp") == 0 || strcmp(op, "call") == 0) {
+		if (strcmp(op, "jp") == 0 && n == 1 && (IS(OPD_R16, 2) || IS(OPD_R8, 6)))
+			emit(as, 0xE9);
+		else if (n == 1 && IS(OPD_IMM, -1)) {
+			emit(as, op[0] == 'j' ? 0xC3 : 0xCD);
+			emit_imm16(as, d->val);
+		} else if (n == 2 && IS(OPD_CC, -1) && IS2(OPD_IMM, -1)) {
+			emit(as, (op[0] == 'j' ? 0xC2 : 0xC4) | d->reg << 3);
+			emit_imm16(as, s->val);
+		} else
+			fail(as, "bad operands for %s", op);
+		return;
+	}
+
+	if (strcmp(op, "jr") == 0) {
+		operand *t = n == 2 ? s : d;
+
+		if ((n == 1 && IS(OPD_IMM, -1)) || (n == 2 && IS(OPD_CC, -1) && IS2(OPD_IMM, -1))) {
+			rel = t->val - (int32_t)(as->pc + 2);
+			if (as->pass > 1 && (rel < -128 || rel > 127))
+				fail(as, "jr target out of range");
+			emit(as, n == 1 ? 0x18 : 0x20 | d->reg << 3);
+			emit(as, rel & 0xFF);
+		} else
+			fail(as, "bad operands for jr");
+		return;
+	}
+
+	if (strcmp(op, "ret") == 0 && n == 1 && IS(OPD_CC, -1)) {
+		emit(as, 0xC0 | d->reg << 3);
+		return;
+	}
+
+	if (strcmp(op, "rst") == 0 && n == 1 && IS(OPD_IMM, -1)) {
+		if (d->val & ~0x38)
+			fail(as, "rst vector has to be one of $00, $08, ... $38");
+		emit(as, 0xC7 | (d->val & 0x38));
+		return;
+	}
+
+	if ((strcmp(op, "push") == 0 || strcmp(op, "pop") == 0) && n == 1) {
+		if (IS(OPD_R16, -1) && d->reg != 3)
+			emit(as, (op[1] == 'u' ? 0xC5 : 0xC1) | d->reg << 4);
+		else if (IS(OPD_AF, -1))
+			emit(as, op[1] == 'u' ? 0xF5 : 0xF1);
+		else
+			fail(as, "bad operand for %s", op);
+		return;
+	}
+#undef IS
+#undef IS2
+
+	fail(as, "unknown instruction %s", op);
+}
+
+/*
+ * Split comma separated operands in place, commas inside brackets,
+ * parentheses or quotes don't count.
+ *
+ * Return how many there are.
+ */
+static int split(asmctx *as, char *args, char **out, int max)
+{
+	char *s = args;
+	int n = 0, depth = 0, quoted = 0;
+
+	if (!*trim(args))
+		return (0);
+	out[n++] = s;
+	for (; *s; s++) {
+		if (*s == '"' && !quoted)
+			quoted = 1;
+		else if (*s == '"')
+			quoted = 0;
+		else if (!quoted && (*s == '(' || *s == '['))
+			depth++;
+		else if (!quoted && (*s == ')' || *s == ']'))
+			depth--;
+		else if (!quoted && !depth && *s == ',') {
+			*s = '\0';
+			if (n == max) {
+				fail(as, "too many operands");
+				return (n);
+			}
+			out[n++] = s + 1;
+		}
+	}
+	for (depth = 0; depth < n; depth++)
+		out[depth] = trim(out[depth]);
+	return (n);
+}
+
+static void parse_operand(asmctx *as, const char *text, operand *o)
+{
+	char key[MAXLINE];
+	const char *p;
+	size_t i, k = 0;
+
+	for (p = text; *p && k < sizeof(key) - 1; p++)
+		if (!isspace((unsigned char)*p))
+			key[k++] = tolower((unsigned char)*p);
+	key[k] = '\0';
+
+	for (i = 0; i < sizeof(regs) / sizeof(regs[0]); i++) {
+		if (strcmp(key, regs[i].text) == 0) {
+			o->kind = regs[i].kind;
+			o->reg = regs[i].reg;
+			return;
+		}
+	}
+
+	p = text;
+	if (strncmp(key, "sp+", 3) == 0 || strncmp(key, "sp-", 3) == 0) {
+		o->kind = OPD_SPE;
+		p = strpbrk(text, "+-");
+	} else if (*text == '[') {
+		o->kind = OPD_MEM;
+		p++;
+	} else {
+		o->kind = OPD_IMM;
+	}
+
+	o->val = expr(as, &p, 0);
+	while (isspace((unsigned char)*p))
+		p++;
+	if (o->kind == OPD_MEM && *p++ != ']')
+		fail(as, "missing ]");
+	while (isspace((unsigned char)*p))
+		p++;
+	if (*p)
+		fail(as, "junk after operand");
+}
+
+/*
+ * Binary operators by precedence, loosest first.
+ */
+static int32_t expr(asmctx *as, const char **p, int level)
+{
+	static const char *const ops[6][3] = {
+		{ "|" }, { "^" }, { "&" }, { "<<", ">>" }, { "+", "-" }, { "*", "/", "%" }
+	};
+	int32_t a, b;
+	int i, matched;
+
+	if (level == 6)
+		return (atom(as, p));
+
+	a = expr(as, p, level + 1);
+	do {
+		matched = 0;
+		while (isspace((unsigned char)**p))
+			(*p)++;
+		for (i = 0; i < 3 && ops[level][i]; i++) {
+			const char *o = ops[level][i];
+
+			if (strncmp(*p, o, strlen(o)) != 0)
+				continue;
+			*p += strlen(o);
+			b = expr(as, p, level + 1);
+			switch (o[0]) {
+			case '|': a |= b; break;
+			case '^': a ^= b; break;
+			case '&': a &= b; break;
+			case '<': a = (uint32_t)a << (b & 0x1F); break;
+			case '>': a >>= (b & 0x1F); break;
+			case '+': a += b; break;
+			case '-': a -= b; break;
+			case '*': a *= b; break;
+			case '/':
+			case '%':
+				if (b == 0) {
+					//symbols the first pass hasn't seen yet are 0
+					if (as->pass > 1)
+						fail(as, "division by zero");
+					return (0);
+				}
+				a = o[0] == '/' ? a / b : a % b;
+				break;
+			}
+			matched = 1;
+			break;
+		}
+	} while (matched && !as->failed);
+	return (a);
+}
+
+static int32_t atom(asmctx *as, const char **p)
+{
+	char name[MAXNAME], full[MAXSYM];
+	asmsym *sym = NULL;
+	int32_t v = 0;
+	int base = 10, digits = 0, fn;
+
+	while (isspace((unsigned char)**p))
+		(*p)++;
+
+	switch (**p) {
+	case '-': (*p)++; return (-atom(as, p));
+	case '~': (*p)++; return (~atom(as, p));
+	case '+': (*p)++; return (atom(as, p));
+	case '(':
+		(*p)++;
+		v = expr(as, p, 0);
+		while (isspace((unsigned char)**p))
+			(*p)++;
+		if (**p != ')')
+			fail(as, "missing )");
+		else
+			(*p)++;
+		return (v);
+	case '@':
+		(*p)++;
+		return (as->pc);
+	case '\'':
+		if (!(*p)[1] || (*p)[2] != '\'') {
+			fail(as, "bad character constant");
+			return (0);
+		}
+		v = (uint8_t)(*p)[1];
+		*p += 3;
+		return (v);
+	case '$': base = 16; (*p)++; break;
+	case '%': base = 2; (*p)++; break;
+	}
+	if (base == 10 && (*p)[0] == '0' && ((*p)[1] == 'x' || (*p)[1] == 'X')) {
+		base = 16;
+		*p += 2;
+	}
+
+	if (base != 10 || isdigit((unsigned char)**p)) {
+		for (;; (*p)++, digits++) {
+			int d = isdigit((unsigned char)**p) ? **p - '0' :
+			    isxdigit((unsigned char)**p) ? tolower((unsigned char)**p) - 'a' + 10 : 99;
+
+			if (d >= base)
+				break;
+			v = v * base + d;
+		}
+		if (!digits)
+			fail(as, "bad number");
+		return (v);
+	}
+
+	if (!ident(p, name)) {
+		fail(as, "expected an expression");
+		return (0);
+	}
+	fn = strcasecmp(name, "high") == 0 ? 1 : strcasecmp(name, "low") == 0 ? 2 :
+	    strcasecmp(name, "bank") == 0 ? 3 : 0;
+	while (fn && isspace((unsigned char)**p))
+		(*p)++;
+	if (fn && **p == '(') {
+		(*p)++;
+		if (fn == 3) {
+			while (isspace((unsigned char)**p))
+				(*p)++;
+			if (!ident(p, name)) {
+				fail(as, "bank() takes a label");
+				return (0);
+			}
+			scoped(as, name, full);
+			sym = lookup(as, full);
+			v = sym && sym->pass == as->pass ? (int32_t)sym->bank : 0;
+		} else {
+			v = expr(as, p, 0);
+			v = fn == 1 ? (v >> 0x8) & 0xFF : v & 0xFF;
+		}
+		while (isspace((unsigned char)**p))
+			(*p)++;
+		if (**p != ')')
+			fail(as, "missing )");
+		else
+			(*p)++;
+		if (fn == 3 && as->pass > 1 && !(sym && sym->pass == as->pass))
+			fail(as, "undefined symbol %s", full);
+		return (v);
+	}
+
+	scoped(as, name, full);
+	sym = lookup(as, full);
+	//forward references only resolve in the second pass
+	if (sym && (sym->pass == as->pass || as->pass > 1))
+		return (sym->value);
+	if (as->pass > 1)
+		fail(as, "undefined symbol %s", full);
+	return (0);
+}
+
+/*
+ * Read a name: a letter, _ or . then letters, digits, _ and .
+ *
+ * Return 0 if there isn't one.
+ */
+static int ident(const char **p, char *buf)
+{
+	const char *s = *p;
+	size_t n = 0;
+
+	if (!isalpha((unsigned char)*s) && *s != '_' && *s != '.')
+		return (0);
+	while ((isalnum((unsigned char)*s) || *s == '_' || *s == '.') && n < MAXNAME - 1)
+		buf[n++] = *s++;
+	buf[n] = '\0';
+	*p = s;
+	return (1);
+}
+
+static asmsym *lookup(asmctx *as, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < as->nsyms; i++)
+		if (strcmp(as->syms[i].name, name) == 0)
+			return (&as->syms[i]);
+	return (NULL);
+}
+
+static void define(asmctx *as, const char *name, int32_t value)
+{
+	char full[MAXSYM];
+	asmsym *sym, *grown;
+
+	scoped(as, name, full);
+	if ((sym = lookup(as, full))) {
+		if (sym->pass == as->pass) {
+			fail(as, "%s is already defined", full);
+			return;
+		}
+	} else {
+		if (as->nsyms == as->capsyms) {
+			as->capsyms = as->capsyms ? 2 * as->capsyms : 64;
+			grown = (asmsym *)realloc(as->syms, as->capsyms * sizeof(asmsym));
+			if (!grown) {
+				fail(as, "out of memory");
+				return;
+			}
+			as->syms = grown;
+		}
+		sym = &as->syms[as->nsyms++];
+		snprintf(sym->name, sizeof(sym->name), "%s", full);
+	}
+	sym->value = value;
+	sym->bank = as->bank ? as->bank : as->pc >= 0x4000;
+	sym->pass = as->pass;
+}
+
+/*
+ * .local names belong to the global label before them.
+ */
+static void scoped(asmctx *as, const char *name, char *buf)
+{
+	if (name[0] == '.')
+		snprintf(buf, MAXSYM, "%s%s", as->scope, name);
+	else
+		snprintf(buf, MAXSYM, "%s", name);
+}
+
+/*
+ * Put a byte at the current address. Only the second pass has an image
+ * to put it in, the first one just counts.
+ */
+static void emit(asmctx *as, int32_t b)
+{
+	uint32_t bank = as->bank, off;
+
+	if (as->pc > 0x7FFF || (bank && as->pc < 0x4000)) {
+		fail(as, "code runs out of the bank");
+		return;
+	}
+	if (as->pc >= 0x4000 && bank == 0)
+		bank = 1;
+	if (bank > as->maxbank)
+		as->maxbank = bank;
+	off = as->pc < 0x4000 ? as->pc : bank * ROMBANK + (as->pc - 0x4000);
+	as->pc++;
+
+	if (!as->rom)
+		return;
+	if (as->written[off]) {
+		fail(as, "overlaps code before it at $%04X", as->pc - 1);
+		return;
+	}
+	as->rom[off] = b;
+	as->written[off] = 0x1;
+}
+
+static void emit_imm8(asmctx *as, int32_t v)
+{
+	if (as->pass > 1 && (v < -128 || v > 0xFF))
+		fail(as, "%d doesn't fit in a byte", v);
+	emit(as, v & 0xFF);
+}
+
+static void emit_imm16(asmctx *as, int32_t v)
+{
+	if (as->pass > 1 && (v < -32768 || v > 0xFFFF))
+		fail(as, "%d doesn't fit in a word", v);
+	emit(as, v & 0xFF);
+	emit(as, (v >> 0x8) & 0xFF);
+}
+
+/*
+ * Fill in the entry point if the source didn't, the header and both
+ * checksums.
+ */
+static void finish(asmctx *as)
+{
+	uint8_t *rom = as->rom, sum = 0;
+	uint16_t global = 0;
+	uint32_t nbanks = as->size / ROMBANK, code = 0;
+	size_t i;
+
+	as->line = 0;
+	for (i = 0x104; i < HDR_END; i++) {
+		if (as->written[i]) {
+			fail(as, "code overlaps the cartridge header at $%04X", (unsigned)i);
+			return;
+		}
+	}
+	if (!as->written[0x100] && !as->written[0x101]) {
+		rom[0x100] = 0x00;
+		rom[0x101] = 0xC3;
+		rom[0x102] = 0x50;
+		rom[0x103] = 0x01;
+	}
+
+	memcpy(rom + 0x104, logo, sizeof(logo));
+	memcpy(rom + HDR_TITLE, as->title, as->cgb ? 15 : 16);
+	if (as->cgb)
+		rom[HDR_CGB] = as->cgb;
+	rom[HDR_TYPE] = as->type;
+	while ((2u << code) < nbanks)
+		code++;
+	rom[HDR_ROMSIZE] = code;
+	rom[HDR_RAMSIZE] = as->ramsize;
+	rom[0x14A] = 0x01; //overseas
+	rom[0x14B] = 0x33; //licensee in 0x144
+
+	for (i = HDR_TITLE; i < HDR_CHECKSUM; i++)
+		sum = sum - rom[i] - 1;
+	rom[HDR_CHECKSUM] = sum;
+	for (i = 0; i < as->size; i++)
+		if (i != HDR_GLOBALSUM && i != HDR_GLOBALSUM + 1)
+			global += rom[i];
+	rom[HDR_GLOBALSUM] = global >> 0x8;
+	rom[HDR_GLOBALSUM + 1] = global & 0xFF;
+}
+
+static void fail(asmctx *as, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (as->failed)
+		return;
+	as->failed = 1;
+	as->err->line = as->line;
+	va_start(ap, fmt);
+	vsnprintf(as->err->msg, sizeof(as->err->msg), fmt, ap);
+	va_end(ap);
+}
+
+static char *trim(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return (s);
+}
@@ -0,0 +1,43 @@
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SM83 assembler, for building test and benchmark ROMs from source. Two
+ * passes over the text: the first sizes everything and collects labels,
+ * the second emits code into a cartridge image, which then gets a valid
+ * header and both checksums.
+ *
+ * One statement per line, ; starts a comment:
+ *
+ *	title "ALU"		; header fields, raw bytes for the rest
+ *	cart $01		; cartridge type at 0x147
+ *	ramsize $02		; RAM size code at 0x149
+ *	cgb $80			; CGB flag at 0x143
+ *	COUNT equ 16
+ *	bank 1			; code from here on goes to 0x4000 in bank 1
+ *	org $4000
+ *	start:	ld hl, $C000
+ *	.loop:	ld [hl+], a	; .local labels belong to the label before
+ *		jr nz, .loop
+ *		db 1, 2, "text"
+ *		dw start
+ *		ds 16, $FF	; count bytes of fill
+ *
+ * Memory operands take brackets, [hl] [hl+] [hl-] [bc] [de] [c] [n16],
+ * or parentheses around a register. Expressions have C operators and
+ * precedence, $hex, %binary, 'c', @ for the current address and
+ * high(), low() and bank(). Bank 0 code that runs past 0x4000 goes on
+ * into bank 1. Without code at 0x100 the entry point jumps to 0x150.
+ */
+typedef struct {
+	int		line; //0 if not about a line
+	char		msg[96];
+} asmerror;
+
+int	asm_build(const char *src, uint8_t **rom, size_t *size, asmerror *err);
+int	asm_file(const char *src, const char *rom, asmerror *err);
+
+#endif
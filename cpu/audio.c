@@ -0,0 +1,229 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio.h"
+
+#define CHUNK		4096 //frames the writer takes at a time, at most
+
+static size_t	put(audio *a, const int16_t *frames, size_t n);
+static int	keep(audio *a, const int16_t *frames, size_t n);
+static void	*writer(void *arg);
+static int	header(FILE *fp, unsigned rate, uint32_t bytes);
+static uint8_t	*put16(uint8_t *p, uint16_t v);
+static uint8_t	*put32(uint8_t *p, uint32_t v);
+
+
+/**
+ * Create path and start the thread writing rate frames a second to it.
+ *
+ * Return NULL if it can't be written or there's no memory or thread.
+ */
+audio *audio_open(const char *path, unsigned rate)
+{
+	audio *a;
+
+	if (!(a = (audio *)calloc(1, sizeof(audio))))
+		return (NULL);
+	if (!(a->ring = (int16_t *)malloc(AUDIO_RING * 2 * sizeof(int16_t))))
+		goto fail;
+	if (!(a->fp = fopen(path, "wb")))
+		goto fail;
+	a->rate = rate;
+	//sizes aren't known yet, a stream never has them
+	if (header(a->fp, rate, 0xFFFFFFFF) < 0 ||
+	    pthread_create(&a->thread, NULL, writer, a) != 0) {
+		fclose(a->fp);
+		goto fail;
+	}
+	return (a);
+
+fail:
+	free(a->ring);
+	free(a);
+	return (NULL);
+}
+
+/**
+ * Write out what's left, fill in the header if the output can seek, and
+ * free a. Waits for the writer to take the backlog.
+ *
+ * Return 0, -1 if anything failed to write.
+ */
+int audio_close(audio *a)
+{
+	struct timespec idle = { 0, AUDIO_IDLE };
+	uint64_t bytes;
+	size_t n;
+	int err;
+
+	while (a->waiting) {
+		n = put(a, a->backlog + a->skip * 2, a->waiting);
+		a->skip += n;
+		a->waiting -= n;
+		if (a->waiting)
+			nanosleep(&idle, NULL);
+	}
+	__atomic_store_n(&a->done, 1, __ATOMIC_RELEASE);
+	pthread_join(a->thread, NULL);
+
+	err = a->err;
+	bytes = a->tail * 4;
+	if (!err && fseek(a->fp, 0, SEEK_SET) == 0)
+		err = header(a->fp, a->rate, bytes < 0xFFFFFFFF ? bytes : 0xFFFFFFFF) < 0;
+	if (fclose(a->fp) != 0)
+		err = 1;
+	free(a->backlog);
+	free(a->ring);
+	free(a);
+	return (err ? -1 : 0);
+}
+
+/**
+ * Hand n stereo frames to the writer, after any still waiting. Never
+ * waits itself: what the ring has no room for is kept for next time.
+ *
+ * Return the frames taken, n unless there was no memory to keep them.
+ */
+size_t audio_push(audio *a, const int16_t *frames, size_t n)
+{
+	size_t took = 0;
+
+	if (a->waiting) {
+		took = put(a, a->backlog + a->skip * 2, a->waiting);
+		a->skip += took;
+		a->waiting -= took;
+		took = 0;
+	}
+	if (!a->waiting)
+		took = put(a, frames, n);
+	if (took < n && keep(a, frames + took * 2, n - took) < 0) {
+		a->dropped += n - took;
+		return (took);
+	}
+	return (n);
+}
+
+/*
+ * Copy as many of n frames as there's room for into the ring.
+ *
+ * Return how many that was.
+ */
+static size_t put(audio *a, const int16_t *frames, size_t n)
+{
+	uint64_t head = a->head, room;
+	size_t at, first;
+
+	room = AUDIO_RING - (head - __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE));
+	if (n > room)
+		n = room;
+	at = head & (AUDIO_RING - 1);
+	first = n < AUDIO_RING - at ? n : AUDIO_RING - at;
+	memcpy(a->ring + at * 2, frames, first * 2 * sizeof(int16_t));
+	memcpy(a->ring, frames + first * 2, (n - first) * 2 * sizeof(int16_t));
+	__atomic_store_n(&a->head, head + n, __ATOMIC_RELEASE);
+	return (n);
+}
+
+/*
+ * Add n frames to the end of the backlog, growing it if moving what's
+ * waiting to its start doesn't make room.
+ *
+ * Return 0, -1 if there's no memory for them.
+ */
+static int keep(audio *a, const int16_t *frames, size_t n)
+{
+	int16_t *grown;
+	size_t cap;
+
+	memmove(a->backlog, a->backlog + a->skip * 2, a->waiting * 2 * sizeof(int16_t));
+	a->skip = 0;
+	if (a->waiting + n > a->cap) {
+		for (cap = a->cap ? a->cap : AUDIO_RING; cap < a->waiting + n; cap *= 2)
+			;
+		if (!(grown = (int16_t *)realloc(a->backlog, cap * 2 * sizeof(int16_t))))
+			return (-1);
+		a->backlog = grown;
+		a->cap = cap;
+	}
+	memcpy(a->backlog + a->waiting * 2, frames, n * 2 * sizeof(int16_t));
+	a->waiting += n;
+	return (0);
+}
+
+/*
+ * The consumer. Done is looked at before head, so once it's set the head
+ * seen is the last one and the ring can be drained for good.
+ */
+static void *writer(void *arg)
+{
+	audio *a = (audio *)arg;
+	struct timespec idle = { 0, AUDIO_IDLE };
+	uint8_t buf[CHUNK * 4], *p;
+	uint64_t head, tail = a->tail;
+	size_t at, n, i;
+	int done;
+
+	for (;;) {
+		done = __atomic_load_n(&a->done, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (done)
+				break;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		at = tail & (AUDIO_RING - 1);
+		n = head - tail;
+		if (n > AUDIO_RING - at)
+			n = AUDIO_RING - at;
+		if (n > CHUNK)
+			n = CHUNK;
+		//WAV is little endian whatever the host is
+		for (i = 0, p = buf; i < n * 2; i++)
+			p = put16(p, a->ring[at * 2 + i]);
+		if (!a->err && fwrite(buf, 4, n, a->fp) != n)
+			a->err = 1;
+		tail += n;
+		__atomic_store_n(&a->tail, tail, __ATOMIC_RELEASE);
+	}
+	if (!a->err && fflush(a->fp) != 0)
+		a->err = 1;
+	return (NULL);
+}
+
+/*
+ * The RIFF header of bytes of 16 bit stereo PCM.
+ */
+static int header(FILE *fp, unsigned rate, uint32_t bytes)
+{
+	uint8_t h[44], *p = h;
+
+	memcpy(p, "RIFF", 4);
+	p = put32(p + 4, bytes < 0xFFFFFFFF - 36 ? bytes + 36 : 0xFFFFFFFF);
+	memcpy(p, "WAVEfmt ", 8);
+	p = put32(p + 8, 16);
+	p = put16(p, 1); //PCM
+	p = put16(p, 2); //channels
+	p = put32(p, rate);
+	p = put32(p, rate * 4); //bytes a second
+	p = put16(p, 4); //per frame
+	p = put16(p, 16); //bits per sample
+	memcpy(p, "data", 4);
+	put32(p + 4, bytes);
+	return (fwrite(h, 1, sizeof(h), fp) == sizeof(h) ? 0 : -1);
+}
+
+static uint8_t *put16(uint8_t *p, uint16_t v)
+{
+	*p++ = v;
+	*p++ = v >> 0x8;
+	return (p);
+}
+
+static uint8_t *put32(uint8_t *p, uint32_t v)
+{
+	p = put16(p, v);
+	return (put16(p, v >> 0x10));
+}
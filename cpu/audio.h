@@ -0,0 +1,48 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Sound output. Samples go through a ring with one producer, the machine's
+ * thread, and one consumer, a thread of its own writing them out as a 16
+ * bit stereo WAV file. Neither side takes a lock: the producer only moves
+ * head and the consumer only tail, each stored with release and loaded
+ * with acquire by the other side, so the machine never waits for the
+ * disk. When the writer falls behind and the ring fills up, what doesn't
+ * fit waits on the machine's side, in a backlog that grows as needed, and
+ * goes in first next time. Frames are only dropped, and counted, if the
+ * backlog can't grow.
+ *
+ * Anything fopen() takes will do, a FIFO too. If the output can't seek,
+ * the sizes in the header are left at their maximum, which players take
+ * for a stream.
+ */
+#define AUDIO_RING	(1 << 18) //stereo frames, a power of two
+#define AUDIO_IDLE	1000000 //ns the writer sleeps when the ring is empty
+
+typedef struct audio {
+	uint64_t	head; //frames pushed, producer only
+	uint8_t		pad0[64]; //head and tail on cache lines of their own
+	uint64_t	tail; //frames written, consumer only
+	uint8_t		pad1[64];
+	uint8_t		done; //no more frames will come
+	uint8_t		err; //writing failed, frames are thrown away since
+	int16_t		*ring; //left and right per frame
+	unsigned	rate; //frames per second
+	int16_t		*backlog; //frames the ring had no room for, producer only
+	size_t		waiting; //in it, from skip on
+	size_t		skip;
+	size_t		cap;
+	uint64_t	dropped; //frames there was no memory for
+	FILE		*fp;
+	pthread_t	thread;
+} audio;
+
+audio		*audio_open(const char *path, unsigned rate);
+int		audio_close(audio *a);
+size_t		audio_push(audio *a, const int16_t *frames, size_t n);
+
+#endif
@@ -0,0 +1,266 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "machine.h"
+#include "movie.h"
+#include "telemetry.h"
+
+typedef struct {
+	pthread_mutex_t	lock;
+	size_t		*slot; //job numbers
+	size_t		head; //oldest, taken by thieves
+	size_t		tail; //past the newest, taken by the owner
+} deque;
+
+typedef struct {
+	batchjob	*jobs;
+	deque		*q; //one per thread
+	int		nq;
+	int		flags; //MACHINE_* for every job
+	int		machines; //workers that got one to run jobs on
+} pool;
+
+typedef struct {
+	pool		*p;
+	int		id;
+	pthread_t	thread;
+} worker;
+
+static void	*work(void *arg);
+static int	take(deque *q, size_t *job, int steal);
+static void	run_job(machine *m, batchjob *job, int flags);
+
+
+/**
+ * Read a job list, one job per line: ROM path, input script or movie or -
+ * for none, and the number of frames. Lines starting with # are skipped.
+ *
+ * Return 0, -1 if the file can't be read or has a bad line.
+ */
+int batch_load(const char *path, batchjob **jobs, size_t *n)
+{
+	FILE *fp;
+	char line[1024], rom[512], script[512];
+	batchjob *list = NULL, *grown;
+	size_t cap = 0, len = 0;
+	unsigned long frames;
+	int fields;
+
+	if (!(fp = fopen(path, "r")))
+		return (-1);
+
+	while (fgets(line, sizeof(line), fp)) {
+		fields = sscanf(line, "%511s %511s %lu", rom, script, &frames);
+		if (fields <= 0 || rom[0] == '#')
+			continue;
+		if (fields != 3)
+			goto bad;
+
+		if (len == cap) {
+			cap = cap ? 2 * cap : 64;
+			if (!(grown = (batchjob *)realloc(list, cap * sizeof(batchjob))))
+				goto bad;
+			list = grown;
+		}
+		memset(&list[len], 0, sizeof(batchjob));
+		list[len].rom = strdup(rom);
+		list[len].script = strcmp(script, "-") != 0 ? strdup(script) : NULL;
+		list[len].frames = frames;
+		len++;
+		if (!list[len - 1].rom)
+			goto bad;
+	}
+
+	fclose(fp);
+	*jobs = list;
+	*n = len;
+	return (0);
+
+bad:
+	fclose(fp);
+	batch_free(list, len);
+	return (-1);
+}
+
+void batch_free(batchjob *jobs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		free(jobs[i].rom);
+		free(jobs[i].script);
+	}
+	free(jobs);
+}
+
+/**
+ * Run every job on threads threads, 0 for one per core. Results go into
+ * the jobs. A job no worker got to, because none had the memory for a
+ * machine, is left with MACHINE_ENOMEM.
+ *
+ * Return -1 if the pool can't be set up or no worker got a machine.
+ */
+int batch_run(batchjob *jobs, size_t n, int threads, int flags)
+{
+	pool p;
+	worker *w;
+	size_t i;
+	int t, started, err = 0;
+
+	if (threads <= 0 && (threads = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+		threads = 1;
+	if ((size_t)threads > n)
+		threads = n ? n : 1;
+
+	p.jobs = jobs;
+	p.nq = threads;
+	p.flags = flags;
+	p.machines = 0;
+	p.q = (deque *)calloc(threads, sizeof(deque));
+	w = (worker *)calloc(threads, sizeof(worker));
+	if (!p.q || !w) {
+		free(p.q);
+		free(w);
+		return (-1);
+	}
+
+	//deal the jobs out in turn so long ones next to each other get split
+	for (t = 0; t < threads; t++) {
+		pthread_mutex_init(&p.q[t].lock, NULL);
+		if (!(p.q[t].slot = (size_t *)malloc((n / threads + 1) * sizeof(size_t))))
+			err = -1;
+	}
+	for (i = 0; i < n; i++)
+		jobs[i].err = MACHINE_ENOMEM;
+	for (i = 0; i < n && !err; i++) {
+		t = i % threads;
+		p.q[t].slot[p.q[t].tail++] = i;
+	}
+
+	//the calling thread is worker 0
+	for (started = 1; started < threads && !err; started++) {
+		w[started].p = &p;
+		w[started].id = started;
+		if (pthread_create(&w[started].thread, NULL, work, &w[started]) != 0)
+			break;
+	}
+	if (!err) {
+		w[0].p = &p;
+		w[0].id = 0;
+		work(&w[0]);
+	}
+	for (t = 1; t < started; t++)
+		pthread_join(w[t].thread, NULL);
+	if (n && !p.machines)
+		err = -1;
+
+	for (t = 0; t < threads; t++) {
+		pthread_mutex_destroy(&p.q[t].lock);
+		free(p.q[t].slot);
+	}
+	free(p.q);
+	free(w);
+	return (err);
+}
+
+const char *batch_strerror(int err)
+{
+	switch (err) {
+	case BATCH_EILLEGAL: return ("illegal opcode");
+	case BATCH_ESCRIPT: return ("can't read input script");
+	default: return (machine_strerror(err));
+	}
+}
+
+/*
+ * Worker loop: newest job off its own deque first, then the oldest off
+ * the others'. Nothing adds jobs once the pool is running, so all deques
+ * empty means done. A worker without a machine leaves its jobs to be
+ * stolen.
+ */
+static void *work(void *arg)
+{
+	worker *w = (worker *)arg;
+	pool *p = w->p;
+	machine *m;
+	size_t job = 0;
+	int i;
+
+	if (!(m = machine_new(p->flags)))
+		return (NULL);
+	__atomic_fetch_add(&p->machines, 1, __ATOMIC_RELAXED);
+
+	for (;;) {
+		if (!take(&p->q[w->id], &job, 0)) {
+			for (i = 1; i < p->nq; i++)
+				if (take(&p->q[(w->id + i) % p->nq], &job, 1))
+					break;
+			if (i == p->nq)
+				break;
+		}
+		run_job(m, &p->jobs[job], p->flags);
+	}
+
+	machine_delete(m);
+	return (NULL);
+}
+
+static int take(deque *q, size_t *job, int steal)
+{
+	int got = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		*job = steal ? q->slot[q->head++] : q->slot[--q->tail];
+		got = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return (got);
+}
+
+/*
+ * The script can be a text input script or a movie, which plays from its
+ * start.
+ */
+static void run_job(machine *m, batchjob *job, int flags)
+{
+	inputstep *script = NULL;
+	size_t nsteps = 0;
+	movie mv;
+	int err = MOVIE_EOPEN;
+	double start = tm_seconds();
+
+	if (job->script && (err = movie_load(&mv, job->script)) < 0 &&
+	    (err != MOVIE_EFORMAT || input_load(job->script, &script, &nsteps) < 0)) {
+		job->err = BATCH_ESCRIPT;
+		return;
+	}
+	if ((job->err = machine_open(m, job->rom, flags)) < 0) {
+		if (err == 0)
+			movie_free(&mv);
+		free(script);
+		return;
+	}
+
+	machine_input(m, script, nsteps);
+	if (err == 0 && movie_seek(&mv, m, mv.start) < 0) {
+		job->err = BATCH_ESCRIPT;
+		movie_free(&mv);
+		machine_close(m);
+		return;
+	}
+	job->insns = machine_run(m, job->frames);
+	job->err = job->insns < 0 ? BATCH_EILLEGAL : 0;
+	job->hash = machine_hash(m);
+	job->cycles = m->mem.sched.now;
+	job->secs = tm_seconds() - start;
+
+	machine_close(m);
+	if (err == 0)
+		movie_free(&mv);
+	free(script);
+}
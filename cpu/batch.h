@@ -0,0 +1,36 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Headless batch runs. Every job is a ROM, an optional input script or
+ * movie and a number of frames, run on its own machine. Jobs are spread
+ * over a pool of threads with a deque each: a thread works through its
+ * own deque and steals from the others once it's empty, so uneven jobs
+ * still keep every core busy.
+ */
+
+//job errors, past the machine_open ones
+#define BATCH_EILLEGAL	-16 //ran into an illegal opcode
+#define BATCH_ESCRIPT	-17 //can't read the input script
+
+typedef struct {
+	char		*rom;
+	char		*script; //input script or movie, NULL for none
+	uint32_t	frames;
+	//filled in by batch_run
+	int		err; //0, a machine_open or BATCH_E* error
+	uint32_t	hash; //machine_hash at the end
+	uint64_t	cycles; //T-cycles run
+	long		insns;
+	double		secs;
+} batchjob;
+
+int		batch_load(const char *path, batchjob **jobs, size_t *n);
+void		batch_free(batchjob *jobs, size_t n);
+int		batch_run(batchjob *jobs, size_t n, int threads, int flags);
+const char	*batch_strerror(int err);
+
+#endif
@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "assembler.h"
+#include "bench.h"
+#include "cpu.h"
+#include "machine.h"
+#include "telemetry.h"
+
+#define ROMSIZE		(2 * ROMBANK)
+#define CODE		0x150 //where programs start, past the header
+#define COPIES		1024 //copies of the opcode in a micro benchmark
+#define STACK		0xDFF0
+#define RETSTACK	0xC800 //return addresses for RET and POP to read
+#define HL_AT		0xD000
+
+/*
+ * Synthetic mixes, assembled into ROMs of their own. Each one loops
+ * forever.
+ */
+static const char mix_alu[] =
+	"	title \"BENCH\"\n"
+	"	org $150\n"
+	"	ld b, 1\n"
+	"	ld c, 3\n"
+	"	ld d, 5\n"
+	"	ld e, 7\n"
+	"loop:	add a, b		; ALU on registers, INC/DEC, rotates, DAA\n"
+	"	adc a, c\n"
+	"	sub d\n"
+	"	xor e\n"
+	"	or h\n"
+	"	and l\n"
+	"	cp b\n"
+	"	inc b\n"
+	"	dec c\n"
+	"	rlca\n"
+	"	swap a\n"
+	"	daa\n"
+	"	cpl\n"
+	"	inc a\n"
+	"	add a, $11\n"
+	"	add hl, hl\n"
+	"	inc de\n"
+	"	jr loop\n";
+
+static const char mix_mem[] =
+	"	title \"BENCH\"\n"
+	"	org $150\n"
+	"	ld hl, $C000\n"
+	"	ld de, $D000\n"
+	"loop:	ld a, [hl+]		; stream through WRAM, HRAM and absolute addresses\n"
+	"	add a, [hl]\n"
+	"	ld [hl], a\n"
+	"	ld [de], a\n"
+	"	inc de\n"
+	"	ldh [$80], a\n"
+	"	ldh a, [$81]\n"
+	"	inc [hl]\n"
+	"	ld [$C800], a\n"
+	"	ld a, [$C801]\n"
+	"	ld a, h\n"
+	"	cp $D0\n"
+	"	jr nz, loop		; until HL reaches D000\n"
+	"	ld hl, $C000\n"
+	"	ld de, $D000\n"
+	"	jr loop\n";
+
+static const char mix_branch[] =
+	"	title \"BENCH\"\n"
+	"	org $150\n"
+	"	ld sp, $DFF0\n"
+	"loop:	ld b, 16\n"
+	".call:	call sub\n"
+	"	push bc\n"
+	"	pop de\n"
+	"	dec b\n"
+	"	jr nz, .call\n"
+	"	jp loop\n"
+	"sub:	inc a\n"
+	"	and 1\n"
+	"	ret z\n"
+	"	ret\n";
+
+static const char mix_bits[] =
+	"	title \"BENCH\"\n"
+	"	org $150\n"
+	"	ld hl, $C000\n"
+	"loop:	bit 0, [hl]		; BIT/SET/RES on (HL) and registers, shifts\n"
+	"	set 0, [hl]\n"
+	"	res 0, [hl]\n"
+	"	bit 7, a\n"
+	"	rl c\n"
+	"	srl d\n"
+	"	sla e\n"
+	"	rrc e\n"
+	"	inc l\n"
+	"	jr loop\n";
+
+static const struct {
+	const char	*name;
+	const char	*src;
+} mixes[] = {
+	{ "alu", mix_alu },
+	{ "mem", mix_mem },
+	{ "branch", mix_branch },
+	{ "bits", mix_bits }
+};
+
+static int	op_rom(uint8_t *rom, bus *mem, uint8_t opc, int cb);
+static int	run_machine(benchlist *bl, const char *kind, const char *name,
+		    const char *path, uint32_t frames, int flags);
+static benchresult	*add(benchlist *bl, const char *kind, const char *name);
+static const benchresult	*find(const benchlist *bl, const benchresult *r);
+static double	ns_insn(const benchresult *r);
+
+
+/**
+ * Time every opcode, base and CB prefixed, BENCH_REPS times for cycles
+ * T-cycles each, keeping the fastest. HALT, STOP and the illegal opcodes
+ * are left out. Each opcode runs with HL,
+ * BC, DE and SP pointing at RAM and with operands that fall through to
+ * the next copy. JP (HL) jumps to itself, and RST is timed with the RET
+ * at its vector.
+ *
+ * Return -1 if there's no memory for it.
+ */
+int bench_ops(benchlist *bl, uint64_t cycles)
+{
+	uint8_t *rom = (uint8_t *)malloc(ROMSIZE);
+	bus *mem = (bus *)malloc(sizeof(bus));
+	registers reg;
+	benchresult *r;
+	char name[64];
+	uint64_t start, insns;
+	size_t first = bl->n, k;
+	long ran;
+	double t;
+	int cb, opc, rep;
+
+	if (!rom || !mem) {
+		free(rom);
+		free(mem);
+		return (-1);
+	}
+
+	//whole rounds over every opcode, so noise on the host hits one
+	//run of an opcode rather than all of them
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		k = first;
+		for (cb = 0; cb < 2; cb++) {
+			for (opc = 0; opc < 256; opc++) {
+				init_bus(mem, 0);
+				if (op_rom(rom, mem, opc, cb) < 0)
+					continue;
+				bus_map_rom(mem, rom, ROMSIZE, MBC_NONE);
+				init_registers(&reg);
+				reg.pc = CODE;
+
+				snprintf(name, sizeof(name), "%02x:%s", opc, opcode_name(opc, cb));
+				if (rep == 0 && !add(bl, cb ? "cb" : "op", name)) {
+					free(rom);
+					free(mem);
+					return (-1);
+				}
+				r = &bl->r[k++];
+
+				//one pass through the copies to warm up
+				execute(mem, &reg, COPIES + 8);
+				start = mem->sched.now;
+				insns = 0;
+				t = tm_seconds();
+				while (mem->sched.now - start < cycles) {
+					if ((ran = execute(mem, &reg, 0x4000)) < 0)
+						break;
+					insns += ran;
+				}
+				t = tm_seconds() - t;
+				if (rep == 0 || t / insns < r->secs / r->insns) {
+					r->secs = t;
+					r->insns = insns;
+					r->cycles = mem->sched.now - start;
+				}
+			}
+		}
+	}
+
+	free(rom);
+	free(mem);
+	return (0);
+}
+
+/**
+ * Run each synthetic mix for frames frames.
+ *
+ * Return -1 if one couldn't be run.
+ */
+int bench_mixes(benchlist *bl, uint32_t frames, int flags)
+{
+	char path[] = "/tmp/gbcbenchXXXXXX";
+	asmerror ae;
+	uint8_t *rom;
+	size_t i, size;
+	int fd, err = 0;
+
+	for (i = 0; i < sizeof(mixes) / sizeof(mixes[0]) && !err; i++) {
+		if (asm_build(mixes[i].src, &rom, &size, &ae) < 0)
+			return (-1);
+		if ((fd = mkstemp(path)) < 0) {
+			free(rom);
+			return (-1);
+		}
+		if (write(fd, rom, size) != (ssize_t)size)
+			err = -1;
+		close(fd);
+		free(rom);
+		if (!err)
+			err = run_machine(bl, "mix", mixes[i].name, path, frames, flags);
+		unlink(path);
+		strcpy(path + strlen(path) - 6, "XXXXXX");
+	}
+	return (err);
+}
+
+/**
+ * Run a ROM for frames frames.
+ *
+ * Return -1 if it couldn't be opened.
+ */
+int bench_rom(benchlist *bl, const char *path, uint32_t frames, int flags)
+{
+	return (run_machine(bl, "rom", path, path, frames, flags));
+}
+
+/**
+ * Print results, a line of column names first.
+ */
+void bench_print(FILE *fp, const benchlist *bl)
+{
+	const benchresult *r;
+	size_t i;
+
+	fprintf(fp, "#kind\tname\tinsns\tcycles\tsecs\tmhz\tips\tns_insn\n");
+	for (i = 0; i < bl->n; i++) {
+		r = &bl->r[i];
+		fprintf(fp, "%s\t%s\t%llu\t%llu\t%.6f\t%.2f\t%.0f\t%.3f\n", r->kind, r->name,
+		    (unsigned long long)r->insns, (unsigned long long)r->cycles, r->secs,
+		    r->secs > 0 ? r->cycles / r->secs / 1e6 : 0.0,
+		    r->secs > 0 ? r->insns / r->secs : 0.0, ns_insn(r));
+	}
+}
+
+/**
+ * Read results printed by bench_print().
+ *
+ * Return 0, -1 if the file can't be read or has a bad line.
+ */
+int bench_load(const char *path, benchlist *bl)
+{
+	FILE *fp;
+	char line[512], kind[8], name[64];
+	unsigned long long insns, cycles;
+	double secs;
+	benchresult *r;
+
+	memset(bl, 0, sizeof(benchlist));
+	if (!(fp = fopen(path, "r")))
+		return (-1);
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%7[^\t]\t%63[^\t]\t%llu\t%llu\t%lf", kind, name, &insns,
+		    &cycles, &secs) != 5 || !(r = add(bl, kind, name))) {
+			fclose(fp);
+			bench_free(bl);
+			return (-1);
+		}
+		r->insns = insns;
+		r->cycles = cycles;
+		r->secs = secs;
+	}
+	fclose(fp);
+	return (0);
+}
+
+/**
+ * Print the results in cur that take more than slack (0.1 for 10%) longer
+ * per instruction than the same ones in old.
+ *
+ * Return how many there are.
+ */
+int bench_compare(FILE *fp, const benchlist *old, const benchlist *cur, double slack)
+{
+	const benchresult *o, *c;
+	size_t i;
+	int slower = 0;
+
+	for (i = 0; i < cur->n; i++) {
+		c = &cur->r[i];
+		if (!(o = find(old, c)) || ns_insn(o) <= 0)
+			continue;
+		if (ns_insn(c) > ns_insn(o) * (1.0 + slack)) {
+			fprintf(fp, "slower\t%s\t%s\t%.3f\t%.3f\t%+.1f%%\n", c->kind, c->name,
+			    ns_insn(o), ns_insn(c), (ns_insn(c) / ns_insn(o) - 1.0) * 100.0);
+			slower++;
+		}
+	}
+	return (slower);
+}
+
+void bench_free(benchlist *bl)
+{
+	free(bl->r);
+	memset(bl, 0, sizeof(benchlist));
+}
+
+/*
+ * Lay out a micro benchmark: point the registers at RAM, then COPIES
+ * copies of the opcode, then jump back. RET at every RST vector, and
+ * return addresses for RET and POP to read.
+ *
+ * Return -1 for opcodes that aren't timed.
+ */
+static int op_rom(uint8_t *rom, bus *mem, uint8_t opc, int cb)
+{
+	const char *name = opcode_name(opc, cb);
+	uint16_t at, sp = STACK, hl = HL_AT, ret;
+	int len = cb ? 2 : opcode_len(opc), copies = COPIES, i;
+
+	if (!cb && (opc == 0xCB || strcmp(name, "illegal") == 0 ||
+	    strcmp(name, "halt") == 0 || strcmp(name, "stop") == 0))
+		return (-1);
+	if (!cb && (strncmp(name, "ret", 3) == 0 || strcmp(name, "pop") == 0))
+		sp = RETSTACK;
+	//code starts after the LD SP, HL, BC and DE below
+	if (!cb && strcmp(name, "jp_hl") == 0) {
+		hl = CODE + 12;
+		copies = 1;
+	}
+
+	memset(rom, 0, ROMSIZE);
+	for (i = 0; i < 8; i++)
+		rom[i * 8] = 0xC9;
+	at = CODE;
+	rom[at++] = 0x31; rom[at++] = sp; rom[at++] = sp >> 0x8;
+	rom[at++] = 0x21; rom[at++] = hl; rom[at++] = hl >> 0x8;
+	rom[at++] = 0x01; rom[at++] = 0x80; rom[at++] = 0xC0; //BC, C for LDH (C)
+	rom[at++] = 0x11; rom[at++] = 0x00; rom[at++] = 0xC1;
+
+	for (i = 0; i < copies; i++, at += len) {
+		if (cb) {
+			rom[at] = 0xCB;
+			rom[at + 1] = opc;
+			continue;
+		}
+		rom[at] = opc;
+		//jumps and calls go to the next copy, relative ones by 0
+		if (len == 2)
+			rom[at + 1] = strncmp(name, "jr", 2) == 0 ? 0x00 : 0x80;
+		if (len == 3) {
+			ret = strncmp(name, "jp", 2) == 0 || strncmp(name, "call", 4) == 0 ?
+			    at + len : 0xC000;
+			rom[at + 1] = ret;
+			rom[at + 2] = ret >> 0x8;
+		}
+		ret = at + len;
+		mem->wram[0][RETSTACK - 0xC000 + 2 * i] = ret;
+		mem->wram[0][RETSTACK - 0xC000 + 2 * i + 1] = ret >> 0x8;
+	}
+	rom[at++] = 0xC3; rom[at++] = CODE & 0xFF; rom[at++] = CODE >> 0x8;
+	return (0);
+}
+
+static int run_machine(benchlist *bl, const char *kind, const char *name,
+    const char *path, uint32_t frames, int flags)
+{
+	machine *m;
+	benchresult *r;
+	long ran;
+	double t;
+
+	if (!(m = machine_new(flags)))
+		return (-1);
+	if (machine_open(m, path, flags) < 0 || !(r = add(bl, kind, name))) {
+		machine_delete(m);
+		return (-1);
+	}
+
+	t = tm_seconds();
+	ran = machine_run(m, frames);
+	r->secs = tm_seconds() - t;
+	r->insns = ran > 0 ? ran : 0;
+	r->cycles = m->mem.sched.now;
+
+	machine_close(m);
+	machine_delete(m);
+	return (0);
+}
+
+static benchresult *add(benchlist *bl, const char *kind, const char *name)
+{
+	benchresult *grown, *r;
+
+	if (bl->n == bl->cap) {
+		bl->cap = bl->cap ? 2 * bl->cap : 64;
+		if (!(grown = (benchresult *)realloc(bl->r, bl->cap * sizeof(benchresult))))
+			return (NULL);
+		bl->r = grown;
+	}
+	r = &bl->r[bl->n++];
+	memset(r, 0, sizeof(benchresult));
+	snprintf(r->kind, sizeof(r->kind), "%s", kind);
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	return (r);
+}
+
+static const benchresult *find(const benchlist *bl, const benchresult *r)
+{
+	size_t i;
+
+	for (i = 0; i < bl->n; i++)
+		if (strcmp(bl->r[i].kind, r->kind) == 0 && strcmp(bl->r[i].name, r->name) == 0)
+			return (&bl->r[i]);
+	return (NULL);
+}
+
+static double ns_insn(const benchresult *r)
+{
+	return (r->insns ? r->secs * 1e9 / r->insns : 0.0);
+}
@@ -0,0 +1,46 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Benchmarks. The micro benchmarks time every opcode, base and CB
+ * prefixed, on its own. Each one gets a ROM with a long run of copies of
+ * the opcode, each falling through to the next, and the interpreter runs
+ * it for a fixed number of T-cycles, keeping the fastest of a few runs
+ * since short runs are noisy. The macro benchmarks run whole
+ * machines, with the caller's MACHINE_* flags, for a fixed number of
+ * frames. They run synthetic instruction mixes and any ROMs given.
+ *
+ * Results print one per line, tab separated, and a file of them can be
+ * read back to compare two versions.
+ */
+#define BENCH_OPCYCLES	2000000 //T-cycles per opcode run, about half a second emulated
+#define BENCH_REPS	5 //runs per opcode
+#define BENCH_FRAMES	600 //frames per mix or ROM, 10 seconds emulated
+
+typedef struct {
+	char		kind[8]; //op, cb, mix or rom
+	char		name[64];
+	uint64_t	insns;
+	uint64_t	cycles; //T-cycles emulated
+	double		secs;
+} benchresult;
+
+typedef struct {
+	benchresult	*r;
+	size_t		n;
+	size_t		cap;
+} benchlist;
+
+int	bench_ops(benchlist *bl, uint64_t cycles);
+int	bench_mixes(benchlist *bl, uint32_t frames, int flags);
+int	bench_rom(benchlist *bl, const char *path, uint32_t frames, int flags);
+void	bench_print(FILE *fp, const benchlist *bl);
+int	bench_load(const char *path, benchlist *bl);
+int	bench_compare(FILE *fp, const benchlist *old, const benchlist *cur, double slack);
+void	bench_free(benchlist *bl);
+
+#endif
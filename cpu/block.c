@@ -0,0 +1,207 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "block.h"
+#include "jit.h"
+
+#define HASH(pc)	(((pc) ^ (pc) >> 0xA) & (BLOCK_HASH - 1))
+
+static block	*block_alloc(blockcache *bc, bus *mem);
+static void	block_unlink(blockcache *bc, block *blk);
+static void	block_drop(blockcache *bc, bus *mem, uint16_t addr);
+static void	block_onwrite(bus *mem, uint16_t addr, uint16_t len, uint8_t watch);
+
+
+/**
+ * Set up an empty cache and hook it into the bus write watch.
+ */
+void init_blockcache(blockcache *bc, bus *mem)
+{
+	memset(bc, 0, offsetof(blockcache, pool));
+	bc->idleskip = 0x1;
+	mem->onwrite = block_onwrite;
+	mem->ctx = bc;
+}
+
+/**
+ * Find the block starting at pc in the currently mapped bank, decoding it
+ * on a miss.
+ *
+ * Return NULL if the code at pc can't be cached, the caller has to
+ * interpret it.
+ */
+block *block_lookup(blockcache *bc, bus *mem, uint16_t pc)
+{
+	const uint8_t *src = mem->rd[pc >> 0x8];
+	block *blk;
+	uint8_t page = pc >> 0x8;
+
+	for (blk = bc->hash[HASH(pc)]; blk; blk = blk->next) {
+		if (blk->pc == pc && blk->src == src) {
+			bc->hits++;
+			return (blk);
+		}
+	}
+
+	//only code straight out of a mapped page is cached, not I/O or HRAM
+	if (!src)
+		return (NULL);
+
+	bc->misses++;
+	blk = block_alloc(bc, mem);
+	if (decode_block(mem, pc, blk) == 0) {
+		blk->next = bc->free;
+		bc->free = blk;
+		return (NULL);
+	}
+
+	if (blk->idle)
+		bc->idleloops++;
+
+	blk->src = src;
+	blk->valid = 0x1;
+	blk->runs = 0;
+	blk->native = NULL;
+	blk->next = bc->hash[HASH(pc)];
+	bc->hash[HASH(pc)] = blk;
+	blk->pagenext = bc->page[page];
+	bc->page[page] = blk;
+	//ROM can't be written, RAM and OAM get watched, RAM with its echo
+	if (page >= 0x80) {
+		bus_watch(mem, page, WATCH_CODE);
+		bus_watch(mem, bus_mirror(page), WATCH_CODE);
+	}
+
+	return (blk);
+}
+
+/**
+ * Drop every block that covers addr, whether it was built from addr or
+ * from the same byte seen through the echo area.
+ */
+void block_invalidate(blockcache *bc, bus *mem, uint16_t addr)
+{
+	uint8_t page = addr >> 0x8;
+	uint8_t mirror = bus_mirror(page);
+
+	block_drop(bc, mem, addr);
+	if (mirror != page)
+		block_drop(bc, mem, mirror << 0x8 | (addr & 0xFF));
+
+	if (!bc->page[page] && !bc->page[mirror]) {
+		bus_unwatch(mem, page, WATCH_CODE);
+		bus_unwatch(mem, mirror, WATCH_CODE);
+	}
+}
+
+/**
+ * Drop every block built from the page of memory at src, whatever page
+ * of the bus it was mapped at, for memory rewritten behind the bus's
+ * back.
+ */
+void block_invalidate_src(blockcache *bc, bus *mem, const uint8_t *src)
+{
+	block **pp, *blk;
+	int page;
+
+	for (page = 0x80; page < 0x100; page++) {
+		pp = &bc->page[page];
+		while ((blk = *pp)) {
+			if (blk->src != src) {
+				pp = &blk->pagenext;
+				continue;
+			}
+			*pp = blk->pagenext;
+			block_unlink(bc, blk);
+			bc->invalidated++;
+			mem->codegen++;
+		}
+	}
+
+	for (page = 0x80; page < 0x100; page++)
+		if (!bc->page[page] && !bc->page[bus_mirror(page)])
+			bus_unwatch(mem, page, WATCH_CODE);
+}
+
+/**
+ * Drop every block.
+ */
+void block_flush(blockcache *bc, bus *mem)
+{
+	int page;
+
+	for (page = 0; page < 256; page++)
+		if (mem->watch[page] & WATCH_CODE)
+			bus_unwatch(mem, page, WATCH_CODE);
+
+	memset(bc->hash, 0, sizeof(bc->hash));
+	memset(bc->page, 0, sizeof(bc->page));
+	bc->free = NULL;
+	bc->used = 0;
+	bc->flushes++;
+	//every compiled block went with it
+	if (bc->jit)
+		jit_flush(bc->jit, bc);
+}
+
+/*
+ * Take a block off the free list or out of the pool, flushing everything
+ * when both are used up.
+ */
+static block *block_alloc(blockcache *bc, bus *mem)
+{
+	block *blk;
+
+	if ((blk = bc->free)) {
+		bc->free = blk->next;
+		return (blk);
+	}
+	if (bc->used == BLOCK_POOL)
+		block_flush(bc, mem);
+	return (&bc->pool[bc->used++]);
+}
+
+/*
+ * Take a block out of its hash chain and put it on the free list. A block
+ * can be dropped while it's running, valid tells the executor to stop.
+ */
+static void block_unlink(blockcache *bc, block *blk)
+{
+	block **pp = &bc->hash[HASH(blk->pc)];
+
+	while (*pp != blk)
+		pp = &(*pp)->next;
+	*pp = blk->next;
+
+	blk->valid = 0x0;
+	blk->next = bc->free;
+	bc->free = blk;
+}
+
+/*
+ * Drop the blocks in the page of addr that cover addr.
+ */
+static void block_drop(blockcache *bc, bus *mem, uint16_t addr)
+{
+	block **pp = &bc->page[addr >> 0x8];
+	block *blk;
+
+	while ((blk = *pp)) {
+		if (addr < blk->pc || addr >= blk->end) {
+			pp = &blk->pagenext;
+			continue;
+		}
+		*pp = blk->pagenext;
+		block_unlink(bc, blk);
+		bc->invalidated++;
+		mem->codegen++;
+	}
+}
+
+static void block_onwrite(bus *mem, uint16_t addr, uint16_t len, uint8_t watch)
+{
+	uint16_t i;
+
+	for (i = 0; i < len && (mem->watch[addr >> 0x8] & WATCH_CODE); i++)
+		block_invalidate((blockcache *)mem->ctx, mem, addr + i);
+}
@@ -0,0 +1,72 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdint.h>
+
+#include "cpu.h"
+
+/*
+ * Pre-decoded basic blocks. The first time a PC is reached the straight
+ * line run of instructions from there is decoded into an array of records
+ * with the immediates already fetched, and later runs execute the array
+ * without touching the opcode bytes again.
+ *
+ * Blocks are keyed by PC and by the page that backed the PC when they were
+ * built, so a ROM or WRAM bank switch simply stops matching and the block
+ * is there again when the bank is switched back. Writes to a RAM page that
+ * holds blocks are watched through the bus and drop the blocks they hit.
+ */
+#define BLOCK_INSNS	32 //longest block
+#define BLOCK_POOL	2048 //blocks per cache, a full cache is flushed
+#define BLOCK_HASH	1024
+
+typedef struct {
+	uint16_t	imm; //immediate operand, or the second byte of a CB op
+	uint8_t		opc; //opcode
+	uint8_t		len; //instruction length
+	uint8_t		cycles; //T-cycles, not counting a taken branch
+} insn;
+
+typedef struct block {
+	struct block	*next; //hash chain, or free list
+	struct block	*pagenext; //blocks starting in the same page
+	const uint8_t	*src; //read pointer of the page when built
+	uint16_t	pc; //first instruction
+	uint16_t	end; //address past the last instruction
+	uint16_t	cycles; //sum of the records' cycles
+	uint8_t		n; //number of records
+	uint8_t		valid; //cleared when a write hits the block
+	uint8_t		idle; //polls I/O in a loop, see execute_blocks
+	uint16_t	runs; //times run before being compiled, see jit.h
+	void		*native; //compiled code, NULL if not compiled
+	insn		code[BLOCK_INSNS];
+} block;
+
+struct jitcache;
+
+typedef struct {
+	block		*hash[BLOCK_HASH];
+	block		*page[256]; //blocks per page, for invalidation
+	block		*free;
+	int		used; //blocks handed out of the pool
+	unsigned long	hits;
+	unsigned long	misses;
+	unsigned long	invalidated;
+	unsigned long	flushes;
+	unsigned long	idleloops; //polling loops decoded
+	unsigned long	idleskips; //times one was skipped ahead
+	uint64_t	idlecycles; //T-cycles skipped in them
+	uint8_t		idleskip; //skip polling loops, on by default
+	struct jitcache	*jit; //recompiler, NULL to only interpret
+	block		pool[BLOCK_POOL];
+} blockcache;
+
+void	init_blockcache(blockcache *bc, bus *mem);
+block	*block_lookup(blockcache *bc, bus *mem, uint16_t pc);
+void	block_invalidate(blockcache *bc, bus *mem, uint16_t addr);
+void	block_invalidate_src(blockcache *bc, bus *mem, const uint8_t *src);
+void	block_flush(blockcache *bc, bus *mem);
+int	decode_block(bus *mem, uint16_t pc, block *blk);
+long	execute_blocks(bus *mem, registers *reg, blockcache *bc, long count);
+
+#endif
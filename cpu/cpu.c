@@ -1,808 +1,1607 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
 
-typedef struct {
-	uint8_t		a;
-	uint8_t		b;
-	uint8_t		c;
-	uint8_t 	d;
-	uint8_t		e;
-	uint8_t		f; //flag register
-	uint8_t		h;
-	uint8_t		l;
-	uint16_t	sp; //stack pointer
-	uint16_t	pc; //program counter
-} registers;
-
-typedef struct {
-	char	mem[]; //start of RAM space
-} RAM;
-
-#define RAMBYTES	8000
-
-//zero flag set
-#define zflagisset(f)	((f & 0x80) >> 0x7)
-
-//subtract flag set
-#define sflagisset(f)	((f & 0x40) >> 0x6)
-
-//half carry flag set
-#define hflagisset(f)	((f & 0x20) >> 0x5)
-
-//carry flag set
-#define cflagisset(f)	((f & 0x10) >> 0x4)
-
-#define setz(f)		(f | 0x80)
-#define sets(f)		(f | 0x40)
-#define seth(f)		(f | 0x20)
-#define setc(f)		(f | 0x10)
-#define clear(f)	(f & 0x0)
-
-#define CBOP(p)		(p & 0xCB00)
-
-void	init_registers(registers *reg);
-void	init_ram(RAM *ram);
-void	nop();
-void	stop();
-void	halt();
-void	add(uint8_t *dest, uint8_t *src, uint8_t *flag);
-void	sub(uint8_t *dest, uint8_t *src, uint8_t *flag);
-void	ld_mem(RAM *ram, uint8_t *mem_offset, uint8_t *reg);
-void	ld_reg(RAM *ram, uint8_t *reg, uint8_t *mem_offset);
-void 	inc(uint8_t *reg, uint8_t *f);
-void 	inc(uint8_t *reg_hi, uint8_t *reg_lo, uint8_t *f);
-void 	dec(uint8_t *reg, uint8_t *f);
-void	lxor(uint8_t *dest, uint8_t *src, uint8_t *f);
-void	lor(uint8_t *dest, uint8_t *src, uint8_t *f);
-void	land(uint8_t *dest, uint8_t *src, uint8_t *f);
-void	ld(uint8_t *dest, uint8_t *src);
-void	cp(uint8_t *reg, uint8_t *n, uint8_t *f);
-void	swap(uint8_t *reg, uint8_t *f);
-void	ret(uint16_t *sp, uint16_t *pc);
-void	set(uint8_t *reg, uint8_t b);
-void	res(uint8_t *reg, uint8_t b);
-void	bit(uint8_t *reg, uint8_t b, uint8_t *f);
-void	rlc(uint8_t *reg, uint8_t *f);
-void	rrc(uint8_t *reg, uint8_t *f);
-int	fetch_decode(RAM *ram, registers *reg);
-int	decode1B(RAM *ram, registers *reg, uint8_t opc);
-int	decode2B(RAM *ram, registers *reg);
-
+#include "cpu.h"
+#include "rom.h"
+#include "block.h"
+#include "jit.h"
+#include "io.h"
+#include "machine.h"
+#include "batch.h"
+#include "rewind.h"
+#include "movie.h"
+#include "bench.h"
+#include "assembler.h"
+#include "profile.h"
+#include "trace.h"
+#include "telemetry.h"
+#include "ppu.h"
+#include "apu.h"
+#include "audio.h"
 
 /**
  * Set the registers to their initial states.
  */
-void init_registers(registers *reg) 
-{
-	reg = (registers *) malloc(sizeof(registers));
-	
-	reg->a = 0x0;
-	reg->b = 0x0;
-	reg->c = 0x0;
-	reg->d = 0x0;
-	reg->e = 0x0;
-	reg->f = 0x0;
-	reg->h = 0x0;
-	reg->l = 0x0;
+void init_registers(registers *reg)
+{
+	reg->af = 0x0;
+	reg->bc = 0x0;
+	reg->de = 0x0;
+	reg->hl = 0x0;
 	reg->sp = 0xFFFE;
 	reg->pc = 0x100;
+	reg->ime = IME_OFF;
+	reg->halt = CPU_RUN;
+	reg->lf.op = LF_NONE;
 }
 
 /**
- * Set up the RAM space. Later needs to be the actual cartridge loading into memory.
+ * No-op.
  */
-void init_ram(RAM *ram)
+void nop()
 {
-	ram = (RAM *) malloc(RAMBYTES);
 }
 
 /**
- * Determine if the instruction is 1 or 2 bytes and branch as necessary.
+ * Stop the processor and the clock until a button is pressed. DIV is
+ * reset on the way in.
  */
-int fetch_decode(RAM *ram, registers *reg)
+void stop(bus *mem, registers *reg)
 {
-	uint8_t opc;
-	
-	opc = ram->mem[reg->pc++];
-	
-	//check to see if it's a CB prefix, if so then it's just a prefix
-	if (CBOP(opc))
-		return decode2B(ram, reg);
-	else
-		return decode1B(ram, reg, opc);
+	io_write(mem, IO_DIV, 0x0);
+	reg->halt = CPU_STOP;
+	sched_poke(&mem->sched);
 }
 
 /**
- * Decode a 1 byte instruction.
- *
- * Return -1 on failure, 0 on success.
- */
-int decode1B(RAM *ram, registers *reg, uint8_t opc)
-{
-	//note: keep opcodes in order so compiler will optimize to jump tables over if-else chains
-	switch (opc) {
-		
-	case 0x00: nop(); break;
-	
-	case 0x06: ld(&reg->b, (uint8_t *)&ram->mem[reg->pc++]); break;
-	
-	case 0x10: stop(); break;
-	
-	case 0x04: inc(&reg->b, &reg->f); break;
-	
-	case 0x0C: inc(&reg->c, &reg->f); break;
-	
-	case 0x0E: ld(&reg->c, (uint8_t *)&ram->mem[reg->pc++]); break;
-	
-	case 0x14: inc(&reg->d, &reg->f); break;
-	
-	case 0x16: ld(&reg->d, (uint8_t *)&ram->mem[reg->pc++]); break;
-	
-	case 0x1C: inc(&reg->e, &reg->f); break;
-	
-	case 0x1E: ld(&reg->e, (uint8_t *)&ram->mem[reg->pc++]); break;
-	
-	case 0x24: inc(&reg->h, &reg->f); break;
-	
-	case 0x26: ld(&reg->h, (uint8_t *)&ram->mem[reg->pc++]); break;
-	
-	case 0x2C: inc(&reg->l, &reg->f); break;
-	
-	case 0x2E: ld(&reg->l, (uint8_t *)&ram->mem[reg->pc++]); break;
-	
-	//....
-	case 0x3C: inc(&reg->a, &reg->f); break;
-	
-	case 0x40: ld(&reg->b, &reg->b); break;
-	case 0x41: ld(&reg->b, &reg->c); break;
-	case 0x42: ld(&reg->b, &reg->d); break;
-	case 0x43: ld(&reg->b, &reg->e); break;
-	case 0x44: ld(&reg->b, &reg->h); break;
-	case 0x45: ld(&reg->b, &reg->l); break;
-	case 0x46: nop(); break; //TODO
-	case 0x47: ld(&reg->b, &reg->a); break;
-	case 0x48: ld(&reg->c, &reg->b); break;
-	case 0x49: ld(&reg->c, &reg->c); break;
-	case 0x4A: ld(&reg->c, &reg->d); break;
-	case 0x4B: ld(&reg->c, &reg->e); break;
-	case 0x4C: ld(&reg->c, &reg->h); break;
-	case 0x4D: ld(&reg->c, &reg->l); break;
-	case 0x4E: nop(); break; //TODO
-	case 0x4F: ld(&reg->c, &reg->a); break;
-	
-	case 0x50: ld(&reg->d, &reg->b); break;
-	case 0x51: ld(&reg->d, &reg->c); break;
-	case 0x52: ld(&reg->d, &reg->d); break;
-	case 0x53: ld(&reg->d, &reg->e); break;
-	case 0x54: ld(&reg->d, &reg->h); break;
-	case 0x55: ld(&reg->d, &reg->l); break;
-	case 0x56: nop(); break; //TODO
-	case 0x57: ld(&reg->d, &reg->a); break;
-	case 0x58: ld(&reg->e, &reg->b); break;
-	case 0x59: ld(&reg->e, &reg->c); break;
-	case 0x5A: ld(&reg->e, &reg->d); break;
-	case 0x5B: ld(&reg->e, &reg->e); break;
-	case 0x5C: ld(&reg->e, &reg->h); break;
-	case 0x5D: ld(&reg->e, &reg->l); break;
-	case 0x5E: nop(); break; //TODO
-	case 0x5F: ld(&reg->e, &reg->a); break;
-	
-	case 0x60: ld(&reg->h, &reg->b); break;
-	case 0x61: ld(&reg->h, &reg->c); break;
-	case 0x62: ld(&reg->h, &reg->d); break;
-	case 0x63: ld(&reg->h, &reg->e); break;
-	case 0x64: ld(&reg->h, &reg->h); break;
-	case 0x65: ld(&reg->h, &reg->l); break;
-	case 0x66: nop(); break; //TODO
-	case 0x67: ld(&reg->h, &reg->a); break;
-	case 0x68: ld(&reg->l, &reg->b); break;
-	case 0x69: ld(&reg->l, &reg->c); break;
-	case 0x6A: ld(&reg->l, &reg->d); break;
-	case 0x6B: ld(&reg->l, &reg->e); break;
-	case 0x6C: ld(&reg->l, &reg->h); break;
-	case 0x6D: ld(&reg->l, &reg->l); break;
-	case 0x6E: nop(); break; //TODO
-	case 0x6F: ld(&reg->l, &reg->a); break;
-	
-	case 0x76: halt(); break; //TODO
-	
-	case 0x77: nop(); break; //TODO
-	case 0x78: ld(&reg->a, &reg->b); break;
-	case 0x79: ld(&reg->a, &reg->c); break;
-	case 0x7A: ld(&reg->a, &reg->d); break;
-	case 0x7B: ld(&reg->a, &reg->e); break;
-	case 0x7C: ld(&reg->a, &reg->h); break;
-	case 0x7D: ld(&reg->a, &reg->l); break;
-	case 0x7E: nop(); break; //TODO
-	case 0x7F: ld(&reg->a, &reg->a); break;
-
-	case 0x80: add(&reg->a, &reg->b, &reg->f); break;
-	case 0x81: add(&reg->a, &reg->c, &reg->f); break;
-	case 0x82: add(&reg->a, &reg->d, &reg->f); break;
-	case 0x83: add(&reg->a, &reg->e, &reg->f); break;
-	case 0x84: add(&reg->a, &reg->h, &reg->f); break;
-	case 0x85: add(&reg->a, &reg->l, &reg->f); break;
-	case 0x86: nop(); break; //TODO
-	case 0x87: add(&reg->a, &reg->a, &reg->f); break;
-	
-	case 0x90: sub(&reg->a, &reg->b, &reg->f); break;
-	case 0x91: sub(&reg->a, &reg->c, &reg->f); break;
-	case 0x92: sub(&reg->a, &reg->d, &reg->f); break;
-	case 0x93: sub(&reg->a, &reg->e, &reg->f); break;
-	case 0x94: sub(&reg->a, &reg->h, &reg->f); break;
-	case 0x95: sub(&reg->a, &reg->l, &reg->f); break;
-	case 0x96: nop(); break; //TODO
-	case 0x97: sub(&reg->a, &reg->a, &reg->f); break;
-	
-	case 0xA0: land(&reg->a, &reg->b, &reg->f); break;
-	case 0xA1: land(&reg->a, &reg->c, &reg->f); break;
-	case 0xA2: land(&reg->a, &reg->d, &reg->f); break;
-	case 0xA3: land(&reg->a, &reg->e, &reg->f); break;
-	case 0xA4: land(&reg->a, &reg->h, &reg->f); break;
-	case 0xA5: land(&reg->a, &reg->l, &reg->f); break;
-	case 0xA6: nop(); break; //TODO
-	case 0xA7: land(&reg->a, &reg->a, &reg->f); break;
-	
-	case 0xA8: lxor(&reg->a, &reg->b, &reg->f); break;
-	case 0xA9: lxor(&reg->a, &reg->c, &reg->f); break;
-	case 0xAA: lxor(&reg->a, &reg->d, &reg->f); break;
-	case 0xAB: lxor(&reg->a, &reg->e, &reg->f); break;
-	case 0xAC: lxor(&reg->a, &reg->h, &reg->f); break;
-	case 0xAD: lxor(&reg->a, &reg->l, &reg->f); break;
-	case 0xAE: nop(); break; //TODO
-	case 0xAF: lxor(&reg->a, &reg->a, &reg->f); break;
-	
-	case 0xB0: lor(&reg->a, &reg->b, &reg->f); break;
-	case 0xB1: lor(&reg->a, &reg->c, &reg->f); break;
-	case 0xB2: lor(&reg->a, &reg->d, &reg->f); break;
-	case 0xB3: lor(&reg->a, &reg->e, &reg->f); break;
-	case 0xB4: lor(&reg->a, &reg->h, &reg->f); break;
-	case 0xB5: lor(&reg->a, &reg->l, &reg->f); break;
-	case 0xB6: nop(); break; //TODO
-	case 0xB7: lor(&reg->a, &reg->a, &reg->f); break;
-	
-	case 0xB8: cp(&reg->a, &reg->b, &reg->f); break; //cp needs to be implemented
-	case 0xB9: cp(&reg->a, &reg->c, &reg->f); break;
-	case 0xBA: cp(&reg->a, &reg->d, &reg->f); break;
-	case 0xBB: cp(&reg->a, &reg->e, &reg->f); break;
-	case 0xBC: cp(&reg->a, &reg->h, &reg->f); break;
-	case 0xBD: cp(&reg->a, &reg->l, &reg->f); break;
-	case 0xBE: nop(); break; //TODO
-	case 0xBF: cp(&reg->a, &reg->a, &reg->f); break;
-	
-	case 0xC6: add(&reg->a, (uint8_t *)&ram->mem[reg->pc++], &reg->f); break;
-	
-	case 0xC9: ret(&reg->sp, &reg->pc); break;
-	
-	default: return (-1);
-	
-	}
-	
-	return (0);
+ * Stop the processor until there's an interrupt. The clock skips ahead
+ * from one event to the next in the meantime, see service().
+ */
+void halt(bus *mem, registers *reg)
+{
+	reg->halt = CPU_HALT;
+	sched_poke(&mem->sched);
 }
 
-/**
- * Decode a 2 byte instruction.
- *
- * Return -1 on failure, 0 on success.
+static inline void push(bus *mem, registers *reg, uint16_t val)
+{
+	wr8(mem, --reg->sp, val >> 0x8);
+	wr8(mem, --reg->sp, val & 0xFF);
+}
+
+static inline uint16_t pop(bus *mem, registers *reg)
+{
+	uint16_t val;
+
+	val = rd8(mem, reg->sp++);
+	val |= rd8(mem, reg->sp++) << 0x8;
+	return (val);
+}
+
+/*
+ * Register operands by opcode index. Index 6 is (HL) and never reaches here,
+ * the handlers for memory operands are separate table entries.
  */
-int decode2B(RAM *ram, registers *reg)
+static const uint8_t r8off[8] = {
+	offsetof(registers, b), offsetof(registers, c),
+	offsetof(registers, d), offsetof(registers, e),
+	offsetof(registers, h), offsetof(registers, l),
+	offsetof(registers, f), offsetof(registers, a)
+};
+
+static inline uint8_t *r8(registers *reg, uint8_t i)
 {
-	uint8_t opc;
-	
-	opc = ram->mem[reg->pc++];
-	
-	switch (opc) {
-		
-	case 0x00: nop(); break; //rlc opc
-	case 0x01: nop(); break;
-	case 0x02: nop(); break;
-	case 0x03: nop(); break;
-	case 0x04: nop(); break;
-	case 0x05: nop(); break;
-	case 0x06: nop(); break;
-	case 0x07: nop(); break;
-	case 0x08: nop(); break; //rrc opc
-	case 0x09: nop(); break;
-	case 0x0A: nop(); break;
-	case 0x0B: nop(); break;
-	case 0x0C: nop(); break;
-	case 0x0D: nop(); break;
-	case 0x0E: nop(); break;
-	case 0x0F: nop(); break;
-	case 0x10: nop(); break; //rl opc
-	case 0x11: nop(); break;
-	case 0x12: nop(); break;
-	case 0x13: nop(); break;
-	case 0x14: nop(); break;
-	case 0x15: nop(); break;
-	case 0x16: nop(); break;
-	case 0x17: nop(); break;
-	case 0x18: nop(); break; //rr opc
-	case 0x19: nop(); break;
-	case 0x1A: nop(); break;
-	case 0x1B: nop(); break;
-	case 0x1C: nop(); break;
-	case 0x1D: nop(); break;
-	case 0x1E: nop(); break;
-	case 0x1F: nop(); break;
-	case 0x20: nop(); break; //sla opc
-	case 0x21: nop(); break;
-	case 0x22: nop(); break;
-	case 0x23: nop(); break;
-	case 0x24: nop(); break;
-	case 0x25: nop(); break;
-	case 0x26: nop(); break;
-	case 0x27: nop(); break;
-	case 0x28: nop(); break; //sra opc
-	case 0x29: nop(); break;
-	case 0x2A: nop(); break;
-	case 0x2B: nop(); break;
-	case 0x2C: nop(); break;
-	case 0x2D: nop(); break;
-	case 0x2E: nop(); break;
-	case 0x2F: nop(); break;
-	case 0x30: swap(&reg->b, &reg->f); break; //swap opc
-	case 0x31: swap(&reg->c, &reg->f); break;
-	case 0x32: swap(&reg->d, &reg->f); break;
-	case 0x33: swap(&reg->e, &reg->f); break;
-	case 0x34: swap(&reg->h, &reg->f); break;
-	case 0x35: swap(&reg->l, &reg->f); break;
-	case 0x36: nop(); break; //TODO
-	case 0x37: swap(&reg->a, &reg->f); break;
-	case 0x38: nop(); break; //srl opc
-	case 0x39: nop(); break;
-	case 0x3A: nop(); break;
-	case 0x3B: nop(); break;
-	case 0x3C: nop(); break;
-	case 0x3D: nop(); break;
-	case 0x3E: nop(); break;
-	case 0x3F: nop(); break;
-	case 0x40: bit(&reg->b, 0x0, &reg->f); break;	
-	case 0x41: bit(&reg->c, 0x0, &reg->f); break;
-	case 0x42: bit(&reg->d, 0x0, &reg->f); break;
-	case 0x43: bit(&reg->e, 0x0, &reg->f); break;
-	case 0x44: bit(&reg->h, 0x0, &reg->f); break;
-	case 0x45: bit(&reg->l, 0x0, &reg->f); break;
-	case 0x46: nop(); break; //TODO
-	case 0x47: bit(&reg->a, 0x0, &reg->f); break;
-	case 0x48: bit(&reg->b, 0x1, &reg->f); break;	
-	case 0x49: bit(&reg->c, 0x1, &reg->f); break;
-	case 0x4A: bit(&reg->d, 0x1, &reg->f); break;
-	case 0x4B: bit(&reg->e, 0x1, &reg->f); break;
-	case 0x4C: bit(&reg->h, 0x1, &reg->f); break;
-	case 0x4D: bit(&reg->l, 0x1, &reg->f); break;
-	case 0x4E: nop(); break; //TODO
-	case 0x4F: bit(&reg->a, 0x1, &reg->f); break;
-	case 0x50: bit(&reg->b, 0x2, &reg->f); break;	
-	case 0x51: bit(&reg->c, 0x2, &reg->f); break;
-	case 0x52: bit(&reg->d, 0x2, &reg->f); break;
-	case 0x53: bit(&reg->e, 0x2, &reg->f); break;
-	case 0x54: bit(&reg->h, 0x2, &reg->f); break;
-	case 0x55: bit(&reg->l, 0x2, &reg->f); break;
-	case 0x56: nop(); break; //TODO
-	case 0x57: bit(&reg->a, 0x2, &reg->f); break;
-	case 0x58: bit(&reg->b, 0x3, &reg->f); break;	
-	case 0x59: bit(&reg->c, 0x3, &reg->f); break;
-	case 0x5A: bit(&reg->d, 0x3, &reg->f); break;
-	case 0x5B: bit(&reg->e, 0x3, &reg->f); break;
-	case 0x5C: bit(&reg->h, 0x3, &reg->f); break;
-	case 0x5D: bit(&reg->l, 0x3, &reg->f); break;
-	case 0x5E: nop(); break; //TODO
-	case 0x5F: bit(&reg->a, 0x3, &reg->f); break;
-	case 0x60: bit(&reg->b, 0x4, &reg->f); break;	
-	case 0x61: bit(&reg->c, 0x4, &reg->f); break;
-	case 0x62: bit(&reg->d, 0x4, &reg->f); break;
-	case 0x63: bit(&reg->e, 0x4, &reg->f); break;
-	case 0x64: bit(&reg->h, 0x4, &reg->f); break;
-	case 0x65: bit(&reg->l, 0x4, &reg->f); break;
-	case 0x66: nop(); break; //TODO
-	case 0x67: bit(&reg->a, 0x4, &reg->f); break;
-	case 0x68: bit(&reg->b, 0x5, &reg->f); break;	
-	case 0x69: bit(&reg->c, 0x5, &reg->f); break;
-	case 0x6A: bit(&reg->d, 0x5, &reg->f); break;
-	case 0x6B: bit(&reg->e, 0x5, &reg->f); break;
-	case 0x6C: bit(&reg->h, 0x5, &reg->f); break;
-	case 0x6D: bit(&reg->l, 0x5, &reg->f); break;
-	case 0x6E: nop(); break; //TODO
-	case 0x6F: bit(&reg->a, 0x5, &reg->f); break;
-	case 0x70: bit(&reg->b, 0x6, &reg->f); break;	
-	case 0x71: bit(&reg->c, 0x6, &reg->f); break;
-	case 0x72: bit(&reg->d, 0x6, &reg->f); break;
-	case 0x73: bit(&reg->e, 0x6, &reg->f); break;
-	case 0x74: bit(&reg->h, 0x6, &reg->f); break;
-	case 0x75: bit(&reg->l, 0x6, &reg->f); break;
-	case 0x76: nop(); break; //TODO
-	case 0x77: bit(&reg->a, 0x6, &reg->f); break;
-	case 0x78: bit(&reg->b, 0x7, &reg->f); break;	
-	case 0x79: bit(&reg->c, 0x7, &reg->f); break;
-	case 0x7A: bit(&reg->d, 0x7, &reg->f); break;
-	case 0x7B: bit(&reg->e, 0x7, &reg->f); break;
-	case 0x7C: bit(&reg->h, 0x7, &reg->f); break;
-	case 0x7D: bit(&reg->l, 0x7, &reg->f); break;
-	case 0x7E: nop(); break; //TODO
-	case 0x7F: bit(&reg->a, 0x7, &reg->f); break;
-	case 0x80: res(&reg->b, 0x0); break;	
-	case 0x81: res(&reg->c, 0x0); break;
-	case 0x82: res(&reg->d, 0x0); break;
-	case 0x83: res(&reg->e, 0x0); break;
-	case 0x84: res(&reg->h, 0x0); break;
-	case 0x85: res(&reg->l, 0x0); break;
-	case 0x86: nop(); break; //TODO
-	case 0x87: res(&reg->a, 0x0); break;
-	case 0x88: res(&reg->b, 0x1); break;	
-	case 0x89: res(&reg->c, 0x1); break;
-	case 0x8A: res(&reg->d, 0x1); break;
-	case 0x8B: res(&reg->e, 0x1); break;
-	case 0x8C: res(&reg->h, 0x1); break;
-	case 0x8D: res(&reg->l, 0x1); break;
-	case 0x8E: nop(); break; //TODO
-	case 0x8F: res(&reg->a, 0x1); break;
-	case 0x90: res(&reg->b, 0x2); break;	
-	case 0x91: res(&reg->c, 0x2); break;
-	case 0x92: res(&reg->d, 0x2); break;
-	case 0x93: res(&reg->e, 0x2); break;
-	case 0x94: res(&reg->h, 0x2); break;
-	case 0x95: res(&reg->l, 0x2); break;
-	case 0x96: nop(); break; //TODO
-	case 0x97: res(&reg->a, 0x2); break;
-	case 0x98: res(&reg->b, 0x3); break;	
-	case 0x99: res(&reg->c, 0x3); break;
-	case 0x9A: res(&reg->d, 0x3); break;
-	case 0x9B: res(&reg->e, 0x3); break;
-	case 0x9C: res(&reg->h, 0x3); break;
-	case 0x9D: res(&reg->l, 0x3); break;
-	case 0x9E: nop(); break; //TODO
-	case 0x9F: res(&reg->a, 0x3); break;
-	case 0xA0: res(&reg->b, 0x4); break;	
-	case 0xA1: res(&reg->c, 0x4); break;
-	case 0xA2: res(&reg->d, 0x4); break;
-	case 0xA3: res(&reg->e, 0x4); break;
-	case 0xA4: res(&reg->h, 0x4); break;
-	case 0xA5: res(&reg->l, 0x4); break;
-	case 0xA6: nop(); break; //TODO
-	case 0xA7: res(&reg->a, 0x4); break;
-	case 0xA8: res(&reg->b, 0x5); break;	
-	case 0xA9: res(&reg->c, 0x5); break;
-	case 0xAA: res(&reg->d, 0x5); break;
-	case 0xAB: res(&reg->e, 0x5); break;
-	case 0xAC: res(&reg->h, 0x5); break;
-	case 0xAD: res(&reg->l, 0x5); break;
-	case 0xAE: nop(); break; //TODO
-	case 0xAF: res(&reg->a, 0x5); break;
-	case 0xB0: res(&reg->b, 0x6); break;	
-	case 0xB1: res(&reg->c, 0x6); break;
-	case 0xB2: res(&reg->d, 0x6); break;
-	case 0xB3: res(&reg->e, 0x6); break;
-	case 0xB4: res(&reg->h, 0x6); break;
-	case 0xB5: res(&reg->l, 0x6); break;
-	case 0xB6: nop(); break; //TODO
-	case 0xB7: res(&reg->a, 0x6); break;
-	case 0xB8: res(&reg->b, 0x7); break;	
-	case 0xB9: res(&reg->c, 0x7); break;
-	case 0xBA: res(&reg->d, 0x7); break;
-	case 0xBB: res(&reg->e, 0x7); break;
-	case 0xBC: res(&reg->h, 0x7); break;
-	case 0xBD: res(&reg->l, 0x7); break;
-	case 0xBE: nop(); break; //TODO
-	case 0xBF: res(&reg->a, 0x7); break;
-	case 0xC0: set(&reg->b, 0x0); break;	
-	case 0xC1: set(&reg->c, 0x0); break;
-	case 0xC2: set(&reg->d, 0x0); break;
-	case 0xC3: set(&reg->e, 0x0); break;
-	case 0xC4: set(&reg->h, 0x0); break;
-	case 0xC5: set(&reg->l, 0x0); break;
-	case 0xC6: nop(); break; //TODO
-	case 0xC7: set(&reg->a, 0x0); break;
-	case 0xC8: set(&reg->b, 0x1); break;	
-	case 0xC9: set(&reg->c, 0x1); break;
-	case 0xCA: set(&reg->d, 0x1); break;
-	case 0xCB: set(&reg->e, 0x1); break;
-	case 0xCC: set(&reg->h, 0x1); break;
-	case 0xCD: set(&reg->l, 0x1); break;
-	case 0xCE: nop(); break; //TODO
-	case 0xCF: set(&reg->a, 0x1); break;
-	case 0xD0: set(&reg->b, 0x2); break;	
-	case 0xD1: set(&reg->c, 0x2); break;
-	case 0xD2: set(&reg->d, 0x2); break;
-	case 0xD3: set(&reg->e, 0x2); break;
-	case 0xD4: set(&reg->h, 0x2); break;
-	case 0xD5: set(&reg->l, 0x2); break;
-	case 0xD6: nop(); break; //TODO
-	case 0xD7: set(&reg->a, 0x2); break;
-	case 0xD8: set(&reg->b, 0x3); break;	
-	case 0xD9: set(&reg->c, 0x3); break;
-	case 0xDA: set(&reg->d, 0x3); break;
-	case 0xDB: set(&reg->e, 0x3); break;
-	case 0xDC: set(&reg->h, 0x3); break;
-	case 0xDD: set(&reg->l, 0x3); break;
-	case 0xDE: nop(); break; //TODO
-	case 0xDF: set(&reg->a, 0x3); break;
-	case 0xE0: set(&reg->b, 0x4); break;	
-	case 0xE1: set(&reg->c, 0x4); break;
-	case 0xE2: set(&reg->d, 0x4); break;
-	case 0xE3: set(&reg->e, 0x4); break;
-	case 0xE4: set(&reg->h, 0x4); break;
-	case 0xE5: set(&reg->l, 0x4); break;
-	case 0xE6: nop(); break; //TODO
-	case 0xE7: set(&reg->a, 0x4); break;
-	case 0xE8: set(&reg->b, 0x5); break;	
-	case 0xE9: set(&reg->c, 0x5); break;
-	case 0xEA: set(&reg->d, 0x5); break;
-	case 0xEB: set(&reg->e, 0x5); break;
-	case 0xEC: set(&reg->h, 0x5); break;
-	case 0xED: set(&reg->l, 0x5); break;
-	case 0xEE: nop(); break; //TODO
-	case 0xEF: set(&reg->a, 0x5); break;
-	case 0xF0: set(&reg->b, 0x6); break;	
-	case 0xF1: set(&reg->c, 0x6); break;
-	case 0xF2: set(&reg->d, 0x6); break;
-	case 0xF3: set(&reg->e, 0x6); break;
-	case 0xF4: set(&reg->h, 0x6); break;
-	case 0xF5: set(&reg->l, 0x6); break;
-	case 0xF6: nop(); break; //TODO
-	case 0xF7: set(&reg->a, 0x6); break;
-	case 0xF8: set(&reg->b, 0x7); break;	
-	case 0xF9: set(&reg->c, 0x7); break;
-	case 0xFA: set(&reg->d, 0x7); break;
-	case 0xFB: set(&reg->e, 0x7); break;
-	case 0xFC: set(&reg->h, 0x7); break;
-	case 0xFD: set(&reg->l, 0x7); break;
-	case 0xFE: nop(); break; //TODO
-	case 0xFF: set(&reg->a, 0x7); break;
-		
-	default: return (-1);
-		
+	return ((uint8_t *)reg + r8off[i]);
+}
+
+/*
+ * Register pairs by opcode index, as encoded in bits 4-5: BC DE HL SP.
+ */
+static const uint8_t r16off[4] = {
+	offsetof(registers, bc), offsetof(registers, de),
+	offsetof(registers, hl), offsetof(registers, sp)
+};
+
+static inline uint16_t *r16(registers *reg, uint8_t p)
+{
+	return ((uint16_t *)((uint8_t *)reg + r16off[p]));
+}
+
+/*
+ * Condition cc as encoded in bits 3-4: NZ Z NC C.
+ */
+static inline int cond(registers *reg, uint8_t opc)
+{
+	switch (OPY(opc) & 0x3) {
+	case 0: return (!flagz(reg));
+	case 1: return (flagz(reg));
+	case 2: return (!flagc(reg));
+	default: return (flagc(reg));
 	}
-	
-	
-	
-	return (0);
 }
 
-/**
- * No-op.
+/*
+ * Adds n to A. Z 0 H C
  */
-void nop() 
-{ 
+static inline void add(registers *reg, uint8_t n)
+{
+	reg->a = setlf(reg, LF_ADD, reg->a, n, reg->a + n, 0);
 }
 
-/**
- * Stop the processor until a button is pressed.
- * Further implementation necessary.
+/*
+ * Adds n and the carry flag to A. Z 0 H C
  */
-void stop() 
+static inline void adc(registers *reg, uint8_t n)
 {
-	//stop display
-	for (;;);
+	uint8_t c = flagc(reg);
+
+	reg->a = setlf(reg, LF_ADC, reg->a, n, reg->a + n + c, c);
 }
 
-/**
- * Stop the system clock until there's an interrupt.
- * Further implementation necessary.
+/*
+ * Compare A with n. Z 1 H C
  */
-void halt()
+static inline void cp(registers *reg, uint8_t n)
 {
-	
+	setlf(reg, LF_SUB, reg->a, n, reg->a - n, 0);
 }
-	
-/**
- * Adds src register to dest register. Z 0 H C
- * TODO set flag
- */
-void add(uint8_t *dest, uint8_t *src, uint8_t *flag)
-{
-	int prev = *dest;
-	
-	*flag = clear(*flag);
-	
-	*dest += *src;
-	
-	if (*dest == 0) {
-		*flag = setz(*flag);
-	}
-	//todo set H, C
+
+/*
+ * Subtracts n from A. Z 1 H C
+ */
+static inline void sub(registers *reg, uint8_t n)
+{
+	reg->a = setlf(reg, LF_SUB, reg->a, n, reg->a - n, 0);
 }
 
-/**
- * Adds src register to dest register. Z 0 H C
- * TODO set flag
- */
-void sub(uint8_t *dest, uint8_t *src, uint8_t *flag)
-{
-	int prev = *dest;
-	
-	*flag = clear(*flag);
-	
-	*dest -= *src;
-	
-	if (*dest == 0) {
-		*flag = setz(*flag);
-	}
+/*
+ * Subtracts n and the carry flag from A. Z 1 H C
+ */
+static inline void sbc(registers *reg, uint8_t n)
+{
+	uint8_t c = flagc(reg);
+
+	reg->a = setlf(reg, LF_SBC, reg->a, n, reg->a - n - c, c);
+}
+
+/*
+ * Logical and of A and n. Result in A. Z 0 1 0
+ */
+static inline void land(registers *reg, uint8_t n)
+{
+	reg->a = setlf(reg, LF_AND, reg->a, n, reg->a & n, 0);
+}
+
+/*
+ * Logical xor of A and n. Result in A. Z 0 0 0
+ */
+static inline void lxor(registers *reg, uint8_t n)
+{
+	reg->a = setlf(reg, LF_OR, reg->a, n, reg->a ^ n, 0);
+}
+
+/*
+ * Logical or of A and n. Result in A. Z 0 0 0
+ */
+static inline void lor(registers *reg, uint8_t n)
+{
+	reg->a = setlf(reg, LF_OR, reg->a, n, reg->a | n, 0);
+}
+
+/*
+ * Increment n. Z 0 H (U)
+ */
+static inline uint8_t inc(registers *reg, uint8_t n)
+{
+	return (setlf(reg, LF_INC, n, 1, n + 1, flagc(reg)));
+}
+
+/*
+ * Decrement n. Z 1 H (U)
+ */
+static inline uint8_t dec(registers *reg, uint8_t n)
+{
+	return (setlf(reg, LF_DEC, n, 1, n - 1, flagc(reg)));
+}
+
+/*
+ * Record a rotate or shift. Z 0 0 C
+ */
+static inline uint8_t shiftflags(registers *reg, uint8_t n, uint8_t res, uint8_t carry)
+{
+	return (setlf(reg, LF_SHIFT, n, 0, res, carry != 0));
 }
 
+/*
+ * Rotate left. Set old bit 7 to carry. Z 0 0 C
+ */
+static inline uint8_t rlc(registers *reg, uint8_t n)
+{
+	return (shiftflags(reg, n, n << 0x1 | n >> 0x7, n & 0x80));
+}
+
+/*
+ * Rotate right. Set old bit 0 to carry. Z 0 0 C
+ */
+static inline uint8_t rrc(registers *reg, uint8_t n)
+{
+	return (shiftflags(reg, n, n >> 0x1 | n << 0x7, n & 0x1));
+}
+
+/*
+ * Rotate left through carry. Z 0 0 C
+ */
+static inline uint8_t rl(registers *reg, uint8_t n)
+{
+	return (shiftflags(reg, n, n << 0x1 | flagc(reg), n & 0x80));
+}
 
 /*
- * Increment the parameter register. Z 0 H (U)
- * TODO set flag
+ * Rotate right through carry. Z 0 0 C
  */
-void inc(uint8_t *reg, uint8_t *f)
+static inline uint8_t rr(registers *reg, uint8_t n)
 {
-	*reg++;
+	return (shiftflags(reg, n, n >> 0x1 | flagc(reg) << 0x7, n & 0x1));
 }
 
 /*
- * Increment the parameter 2 byte register. Z 0 H (U)
- * TODO set flag
- * There are endian-related problems to be fixed here
+ * Shift left into carry, bit 0 reset. Z 0 0 C
  */
-void inc(uint8_t *reg_hi, uint8_t *reg_lo, uint8_t *f)
+static inline uint8_t sla(registers *reg, uint8_t n)
 {
-	uint16_t *reg;
-	
-	*reg = *reg_hi + (*reg_lo << 0x8);
-	printf("%04x\n", *reg);
-	*reg_hi = *reg >> 0x8;
-	*reg_lo = (*reg << 0x8) >> 0x8;
+	return (shiftflags(reg, n, n << 0x1, n & 0x80));
 }
 
 /*
- * Decrement the parameter register. Z 1 H (U)
- * TODO set flag
+ * Shift right into carry, bit 7 kept. Z 0 0 C
  */
-void dec(uint8_t *reg, uint8_t *f)
+static inline uint8_t sra(registers *reg, uint8_t n)
 {
-	*reg--;
+	return (shiftflags(reg, n, n >> 0x1 | (n & 0x80), n & 0x1));
 }
 
 /*
- * Logical or of *dest and *src. Result in dest. Z 0 0 0
- * TODO set flag
+ * Swap the high and low nibbles of n. Z 0 0 0
  */
-void lor(uint8_t *dest, uint8_t *src, uint8_t *f)
+static inline uint8_t swap(registers *reg, uint8_t n)
 {
-	*dest |= *src;
+	return (shiftflags(reg, n, n >> 0x4 | n << 0x4, 0));
 }
 
 /*
- * Logical and of *dest and *src. Result in dest. Z 0 1 0
- * TODO set flag
+ * Shift right into carry, bit 7 reset. Z 0 0 C
  */
-void land(uint8_t *dest, uint8_t *src, uint8_t *f)
+static inline uint8_t srl(registers *reg, uint8_t n)
 {
-	*dest &= *src;
+	return (shiftflags(reg, n, n >> 0x1, n & 0x1));
 }
 
 /*
- * Logical xor of *dest and *src. Result in dest. Z 0 0 0
- * TODO set flag
+ * Test bit b of n. Z 0 1 (U)
  */
-void lxor(uint8_t *dest, uint8_t *src, uint8_t *f)
+static inline void bit(registers *reg, uint8_t n, uint8_t b)
 {
-	*dest ^= *src;
+	uint8_t f = flagc(reg) ? 0x30 : 0x20;
+
+	if (!(n & (0x1 << b)))
+		f = setz(f);
+	putf(reg, f);
 }
 
 /*
- * Load src into destination register.
+ * Reset bit b of n.
  */
-void ld(uint8_t *dest, uint8_t *src)
+static inline uint8_t res(registers *reg, uint8_t n, uint8_t b)
 {
-	*dest = *src;
+	return (n & ~(0x1 << b));
 }
 
 /*
- * Compare reg with n. Z 1 H C
+ * Set bit b of n.
  */
-void cp(uint8_t *reg, uint8_t *n, uint8_t *f)
+static inline uint8_t set(registers *reg, uint8_t n, uint8_t b)
 {
-	uint8_t res;
-	
-	res = *reg - *n;
-	
-	//set flags..
+	return (n | (0x1 << b));
 }
 
 /*
- * Pop two bytes from stack and jump to the resulting address.
+ * Add a signed offset to SP, flags come from the low byte. 0 0 H C
  */
-void ret(uint16_t *sp, uint16_t *pc)
+static inline uint16_t spoffset(registers *reg, uint8_t e)
+{
+	uint8_t f = 0x0;
+
+	if ((reg->sp & 0xF) + (e & 0xF) > 0xF)
+		f = seth(f);
+	if ((reg->sp & 0xFF) + e > 0xFF)
+		f = setc(f);
+	putf(reg, f);
+	return (reg->sp + (int8_t)e);
+}
+
+/*
+ * Instruction handlers, one per opcode class. Each handler serves every
+ * opcode of its class and pulls its operands out of the opcode fields,
+ * immediates are fetched by the dispatcher and passed in imm.
+ */
+#define OPHANDLER(name) \
+	static inline void op_##name(bus *mem, registers *reg, uint8_t opc, uint16_t imm)
+
+OPHANDLER(nop) { nop(); }
+OPHANDLER(stop) { stop(mem, reg); }
+OPHANDLER(halt) { halt(mem, reg); }
+OPHANDLER(di) { reg->ime = IME_OFF; }
+OPHANDLER(ei)
 {
-	*pc = *sp++;
+	if (reg->ime == IME_OFF) {
+		reg->ime = IME_EI;
+		sched_poke(&mem->sched);
+	}
+}
+
+OPHANDLER(ld_r_r) { *r8(reg, OPY(opc)) = *r8(reg, OPZ(opc)); }
+OPHANDLER(ld_r_mhl) { *r8(reg, OPY(opc)) = rd8(mem, reg->hl); }
+OPHANDLER(ld_mhl_r) { wr8(mem, reg->hl, *r8(reg, OPZ(opc))); }
+OPHANDLER(ld_r_n) { *r8(reg, OPY(opc)) = imm; }
+OPHANDLER(ld_mhl_n) { wr8(mem, reg->hl, imm); }
+OPHANDLER(ld_rr_nn) { *r16(reg, OPP(opc)) = imm; }
+OPHANDLER(ld_nn_sp) { wr16(mem, imm, reg->sp); }
+OPHANDLER(ld_sp_hl) { reg->sp = reg->hl; }
+OPHANDLER(ld_hl_spe) { reg->hl = spoffset(reg, imm); }
+OPHANDLER(ld_nn_a) { wr8(mem, imm, reg->a); }
+OPHANDLER(ld_a_nn) { reg->a = rd8(mem, imm); }
+OPHANDLER(ldh_n_a) { wr8(mem, 0xFF00 | imm, reg->a); }
+OPHANDLER(ldh_a_n) { reg->a = rd8(mem, 0xFF00 | imm); }
+OPHANDLER(ld_mc_a) { wr8(mem, 0xFF00 | reg->c, reg->a); }
+OPHANDLER(ld_a_mc) { reg->a = rd8(mem, 0xFF00 | reg->c); }
+
+/*
+ * LD (BC),A  LD (DE),A  LD (HL+),A  LD (HL-),A
+ */
+OPHANDLER(ld_mrr_a)
+{
+	uint8_t p = OPP(opc);
+	uint16_t addr = *r16(reg, p & 0x2 ? 2 : p);
+
+	wr8(mem, addr, reg->a);
+	if (p == 2)
+		reg->hl = addr + 1;
+	else if (p == 3)
+		reg->hl = addr - 1;
+}
+
+/*
+ * LD A,(BC)  LD A,(DE)  LD A,(HL+)  LD A,(HL-)
+ */
+OPHANDLER(ld_a_mrr)
+{
+	uint8_t p = OPP(opc);
+	uint16_t addr = *r16(reg, p & 0x2 ? 2 : p);
+
+	reg->a = rd8(mem, addr);
+	if (p == 2)
+		reg->hl = addr + 1;
+	else if (p == 3)
+		reg->hl = addr - 1;
+}
+
+OPHANDLER(inc_r) { *r8(reg, OPY(opc)) = inc(reg, *r8(reg, OPY(opc))); }
+OPHANDLER(dec_r) { *r8(reg, OPY(opc)) = dec(reg, *r8(reg, OPY(opc))); }
+OPHANDLER(inc_mhl) { wr8(mem, reg->hl, inc(reg, rd8(mem, reg->hl))); }
+OPHANDLER(dec_mhl) { wr8(mem, reg->hl, dec(reg, rd8(mem, reg->hl))); }
+OPHANDLER(inc_rr) { (*r16(reg, OPP(opc)))++; }
+OPHANDLER(dec_rr) { (*r16(reg, OPP(opc)))--; }
+
+/*
+ * ADD HL,rr. (U) 0 H C
+ */
+OPHANDLER(add_hl_rr)
+{
+	uint16_t a = reg->hl;
+	uint16_t n = *r16(reg, OPP(opc));
+	uint8_t f = flagz(reg) ? 0x80 : 0x0;
+
+	if ((a & 0xFFF) + (n & 0xFFF) > 0xFFF)
+		f = seth(f);
+	if (a + n > 0xFFFF)
+		f = setc(f);
+	putf(reg, f);
+	reg->hl = a + n;
 }
 
+OPHANDLER(add_sp_e) { reg->sp = spoffset(reg, imm); }
+
+//the accumulator rotates always clear Z
+OPHANDLER(rlca) { reg->a = rlc(reg, reg->a); putf(reg, flagc(reg) << 0x4); }
+OPHANDLER(rrca) { reg->a = rrc(reg, reg->a); putf(reg, flagc(reg) << 0x4); }
+OPHANDLER(rla) { reg->a = rl(reg, reg->a); putf(reg, flagc(reg) << 0x4); }
+OPHANDLER(rra) { reg->a = rr(reg, reg->a); putf(reg, flagc(reg) << 0x4); }
+
+/*
+ * Decimal adjust A after a BCD add or subtract. Z (U) 0 C
+ */
+OPHANDLER(daa)
+{
+	uint8_t old = getf(reg);
+	uint8_t corr = 0x0;
+	uint8_t f = old & 0x50;
+
+	if (hflagisset(old) || (!sflagisset(old) && (reg->a & 0xF) > 0x9))
+		corr |= 0x06;
+	if (cflagisset(old) || (!sflagisset(old) && reg->a > 0x99)) {
+		corr |= 0x60;
+		f = setc(f);
+	}
+	reg->a = sflagisset(old) ? reg->a - corr : reg->a + corr;
+	if (reg->a == 0)
+		f = setz(f);
+	putf(reg, f);
+}
+
+OPHANDLER(cpl) { reg->a = ~reg->a; putf(reg, getf(reg) | 0x60); }
+OPHANDLER(scf) { putf(reg, flagz(reg) << 0x7 | 0x10); }
+OPHANDLER(ccf) { putf(reg, flagz(reg) << 0x7 | !flagc(reg) << 0x4); }
+
+/*
+ * The cycle tables have conditional jumps not taken, taking one costs the
+ * difference here.
+ */
+#define TAKEN(t)	(mem->sched.now += (t))
+
+OPHANDLER(jr) { reg->pc += (int8_t)imm; }
+OPHANDLER(jr_cc) { if (cond(reg, opc)) { reg->pc += (int8_t)imm; TAKEN(4); } }
+OPHANDLER(jp) { reg->pc = imm; }
+OPHANDLER(jp_cc) { if (cond(reg, opc)) { reg->pc = imm; TAKEN(4); } }
+OPHANDLER(jp_hl) { reg->pc = reg->hl; }
+OPHANDLER(call) { push(mem, reg, reg->pc); reg->pc = imm; }
+OPHANDLER(call_cc) { if (cond(reg, opc)) { push(mem, reg, reg->pc); reg->pc = imm; TAKEN(12); } }
+OPHANDLER(rst) { push(mem, reg, reg->pc); reg->pc = opc & 0x38; }
+OPHANDLER(ret) { reg->pc = pop(mem, reg); }
+OPHANDLER(ret_cc) { if (cond(reg, opc)) { reg->pc = pop(mem, reg); TAKEN(12); } }
+OPHANDLER(reti) { reg->pc = pop(mem, reg); reg->ime = IME_ON; sched_poke(&mem->sched); }
+
+/*
+ * PUSH/POP use AF instead of SP for p == 3.
+ */
+OPHANDLER(push)
+{
+	if (OPP(opc) == 3) {
+		getf(reg);
+		push(mem, reg, reg->af);
+	} else {
+		push(mem, reg, *r16(reg, OPP(opc)));
+	}
+}
+
+OPHANDLER(pop)
+{
+	uint16_t val = pop(mem, reg);
+
+	if (OPP(opc) == 3) {
+		reg->af = val;
+		putf(reg, val);
+	} else {
+		*r16(reg, OPP(opc)) = val;
+	}
+}
+
+/*
+ * ALU A,r  ALU A,(HL)  ALU A,n for each of the eight ALU operations.
+ */
+#define ALU_OPS(X)	X(add) X(adc) X(sub) X(sbc) X(land) X(lxor) X(lor) X(cp)
+
+#define ALU_HANDLERS(name) \
+	OPHANDLER(name##_r) { name(reg, *r8(reg, OPZ(opc))); } \
+	OPHANDLER(name##_mhl) { name(reg, rd8(mem, reg->hl)); } \
+	OPHANDLER(name##_n) { name(reg, imm); }
+ALU_OPS(ALU_HANDLERS)
+
+/*
+ * CB prefixed rotates, shifts and bit operations on r and (HL).
+ */
+#define CB_SHIFTS(X)	X(rlc) X(rrc) X(rl) X(rr) X(sla) X(sra) X(swap) X(srl)
+#define CB_BITOPS(X)	X(res) X(set)
+
+#define CB_SHIFT_HANDLERS(name) \
+	OPHANDLER(name##_r) { *r8(reg, OPZ(opc)) = name(reg, *r8(reg, OPZ(opc))); } \
+	OPHANDLER(name##_mhl) { wr8(mem, reg->hl, name(reg, rd8(mem, reg->hl))); }
+CB_SHIFTS(CB_SHIFT_HANDLERS)
+
+#define CB_BITOP_HANDLERS(name) \
+	OPHANDLER(name##_r) { *r8(reg, OPZ(opc)) = name(reg, *r8(reg, OPZ(opc)), OPY(opc)); } \
+	OPHANDLER(name##_mhl) { wr8(mem, reg->hl, name(reg, rd8(mem, reg->hl), OPY(opc))); }
+CB_BITOPS(CB_BITOP_HANDLERS)
+
+//BIT only reads its operand, nothing is written back
+OPHANDLER(bit_r) { bit(reg, *r8(reg, OPZ(opc)), OPY(opc)); }
+OPHANDLER(bit_mhl) { bit(reg, rd8(mem, reg->hl), OPY(opc)); }
+
+OPHANDLER(illegal) { }
+
+/*
+ * Handler classes and the size of their immediate operand. The dispatcher
+ * fetches the immediate so the handlers never touch the PC for operands.
+ * cb and illegal are special cased by the threaded loop.
+ */
+#define OP_CLASSES(X) \
+	X(nop, 0) X(stop, 1) X(halt, 0) X(di, 0) X(ei, 0) \
+	X(ld_r_r, 0) X(ld_r_mhl, 0) X(ld_mhl_r, 0) X(ld_r_n, 1) X(ld_mhl_n, 1) \
+	X(ld_rr_nn, 2) X(ld_nn_sp, 2) X(ld_sp_hl, 0) X(ld_hl_spe, 1) \
+	X(ld_nn_a, 2) X(ld_a_nn, 2) X(ldh_n_a, 1) X(ldh_a_n, 1) \
+	X(ld_mc_a, 0) X(ld_a_mc, 0) X(ld_mrr_a, 0) X(ld_a_mrr, 0) \
+	X(inc_r, 0) X(dec_r, 0) X(inc_mhl, 0) X(dec_mhl, 0) \
+	X(inc_rr, 0) X(dec_rr, 0) X(add_hl_rr, 0) X(add_sp_e, 1) \
+	X(rlca, 0) X(rrca, 0) X(rla, 0) X(rra, 0) \
+	X(daa, 0) X(cpl, 0) X(scf, 0) X(ccf, 0) \
+	X(jr, 1) X(jr_cc, 1) X(jp, 2) X(jp_cc, 2) X(jp_hl, 0) \
+	X(call, 2) X(call_cc, 2) X(rst, 0) X(ret, 0) X(ret_cc, 0) X(reti, 0) \
+	X(push, 0) X(pop, 0) \
+	X(add_r, 0) X(add_mhl, 0) X(add_n, 1) \
+	X(adc_r, 0) X(adc_mhl, 0) X(adc_n, 1) \
+	X(sub_r, 0) X(sub_mhl, 0) X(sub_n, 1) \
+	X(sbc_r, 0) X(sbc_mhl, 0) X(sbc_n, 1) \
+	X(land_r, 0) X(land_mhl, 0) X(land_n, 1) \
+	X(lxor_r, 0) X(lxor_mhl, 0) X(lxor_n, 1) \
+	X(lor_r, 0) X(lor_mhl, 0) X(lor_n, 1) \
+	X(cp_r, 0) X(cp_mhl, 0) X(cp_n, 1)
+
+#define CBOP_CLASSES(X) \
+	X(rlc_r) X(rlc_mhl) X(rrc_r) X(rrc_mhl) X(rl_r) X(rl_mhl) X(rr_r) X(rr_mhl) \
+	X(sla_r) X(sla_mhl) X(sra_r) X(sra_mhl) X(swap_r) X(swap_mhl) X(srl_r) X(srl_mhl) \
+	X(bit_r) X(bit_mhl) X(res_r) X(res_mhl) X(set_r) X(set_mhl)
+
+/*
+ * Opcode map. A row of eight entries shares x and y, the z field picks the
+ * operand, so rows with a register operand use the r/(HL) helpers below.
+ */
+#define ROW8(X, name)	X(name##_r) X(name##_r) X(name##_r) X(name##_r) \
+			X(name##_r) X(name##_r) X(name##_mhl) X(name##_r)
+#define ROWLD(X)	X(ld_r_r) X(ld_r_r) X(ld_r_r) X(ld_r_r) \
+			X(ld_r_r) X(ld_r_r) X(ld_r_mhl) X(ld_r_r)
+
+#define BASE_OPS(X) \
+	/* 0x00 */ X(nop) X(ld_rr_nn) X(ld_mrr_a) X(inc_rr) X(inc_r) X(dec_r) X(ld_r_n) X(rlca) \
+	/* 0x08 */ X(ld_nn_sp) X(add_hl_rr) X(ld_a_mrr) X(dec_rr) X(inc_r) X(dec_r) X(ld_r_n) X(rrca) \
+	/* 0x10 */ X(stop) X(ld_rr_nn) X(ld_mrr_a) X(inc_rr) X(inc_r) X(dec_r) X(ld_r_n) X(rla) \
+	/* 0x18 */ X(jr) X(add_hl_rr) X(ld_a_mrr) X(dec_rr) X(inc_r) X(dec_r) X(ld_r_n) X(rra) \
+	/* 0x20 */ X(jr_cc) X(ld_rr_nn) X(ld_mrr_a) X(inc_rr) X(inc_r) X(dec_r) X(ld_r_n) X(daa) \
+	/* 0x28 */ X(jr_cc) X(add_hl_rr) X(ld_a_mrr) X(dec_rr) X(inc_r) X(dec_r) X(ld_r_n) X(cpl) \
+	/* 0x30 */ X(jr_cc) X(ld_rr_nn) X(ld_mrr_a) X(inc_rr) X(inc_mhl) X(dec_mhl) X(ld_mhl_n) X(scf) \
+	/* 0x38 */ X(jr_cc) X(add_hl_rr) X(ld_a_mrr) X(dec_rr) X(inc_r) X(dec_r) X(ld_r_n) X(ccf) \
+	/* 0x40 */ ROWLD(X) ROWLD(X) ROWLD(X) ROWLD(X) ROWLD(X) ROWLD(X) \
+	/* 0x70 */ X(ld_mhl_r) X(ld_mhl_r) X(ld_mhl_r) X(ld_mhl_r) \
+		   X(ld_mhl_r) X(ld_mhl_r) X(halt) X(ld_mhl_r) \
+	/* 0x78 */ ROWLD(X) \
+	/* 0x80 */ ROW8(X, add) ROW8(X, adc) ROW8(X, sub) ROW8(X, sbc) \
+	/* 0xA0 */ ROW8(X, land) ROW8(X, lxor) ROW8(X, lor) ROW8(X, cp) \
+	/* 0xC0 */ X(ret_cc) X(pop) X(jp_cc) X(jp) X(call_cc) X(push) X(add_n) X(rst) \
+	/* 0xC8 */ X(ret_cc) X(ret) X(jp_cc) X(cb) X(call_cc) X(call) X(adc_n) X(rst) \
+	/* 0xD0 */ X(ret_cc) X(pop) X(jp_cc) X(illegal) X(call_cc) X(push) X(sub_n) X(rst) \
+	/* 0xD8 */ X(ret_cc) X(reti) X(jp_cc) X(illegal) X(call_cc) X(illegal) X(sbc_n) X(rst) \
+	/* 0xE0 */ X(ldh_n_a) X(pop) X(ld_mc_a) X(illegal) X(illegal) X(push) X(land_n) X(rst) \
+	/* 0xE8 */ X(add_sp_e) X(jp_hl) X(ld_nn_a) X(illegal) X(illegal) X(illegal) X(lxor_n) X(rst) \
+	/* 0xF0 */ X(ldh_a_n) X(pop) X(ld_a_mc) X(di) X(illegal) X(push) X(lor_n) X(rst) \
+	/* 0xF8 */ X(ld_hl_spe) X(ld_sp_hl) X(ld_a_nn) X(ei) X(illegal) X(illegal) X(cp_n) X(rst)
+
+#define CB_OPS(X) \
+	ROW8(X, rlc) ROW8(X, rrc) ROW8(X, rl) ROW8(X, rr) \
+	ROW8(X, sla) ROW8(X, sra) ROW8(X, swap) ROW8(X, srl) \
+	ROW8(X, bit) ROW8(X, bit) ROW8(X, bit) ROW8(X, bit) \
+	ROW8(X, bit) ROW8(X, bit) ROW8(X, bit) ROW8(X, bit) \
+	ROW8(X, res) ROW8(X, res) ROW8(X, res) ROW8(X, res) \
+	ROW8(X, res) ROW8(X, res) ROW8(X, res) ROW8(X, res) \
+	ROW8(X, set) ROW8(X, set) ROW8(X, set) ROW8(X, set) \
+	ROW8(X, set) ROW8(X, set) ROW8(X, set) ROW8(X, set)
+
+#define OPLEN_ENUM(name, len)	OPLEN_##name = len,
+#define OPLEN_ENTRY(name)	OPLEN_##name,
+#define HANDLER_ENTRY(name)	op_##name,
+#define NAME_ENTRY(name)	#name,
+
+enum { OP_CLASSES(OPLEN_ENUM) OPLEN_cb = 1, OPLEN_illegal = 0 };
+
+static const ophandler cbtable[256] = { CB_OPS(HANDLER_ENTRY) };
+
+OPHANDLER(cb) { cbtable[imm](mem, reg, imm, 0); }
+
+static const uint8_t oplen[256] = { BASE_OPS(OPLEN_ENTRY) };
+static const ophandler optable[256] = { BASE_OPS(HANDLER_ENTRY) };
+static const char *const opname[256] = { BASE_OPS(NAME_ENTRY) };
+static const char *const cbname[256] = { CB_OPS(NAME_ENTRY) };
+
+/*
+ * T-cycles per opcode. Conditional jumps, calls and returns are listed
+ * with their not taken time.
+ */
+static const uint8_t opcycles[256] = {
+	 4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4,
+	 4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4,
+	 8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+	 8, 12,  8,  8, 12, 12, 12,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 8,  8,  8,  8,  8,  8,  4,  8,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+	 8, 12, 12, 16, 12, 16,  8, 16,  8, 16, 12,  4, 12, 24,  8, 16,
+	 8, 12, 12,  0, 12, 16,  8, 16,  8, 16, 12,  0, 12,  0,  8, 16,
+	12, 12,  8,  0,  0, 16,  8, 16, 16,  4, 16,  0,  0,  0,  8, 16,
+	12, 12,  8,  4,  0, 16,  8, 16, 12,  8, 16,  4,  0,  0,  8, 16
+};
+
 /*
- * Set bit b in register reg.
+ * T-cycles per CB opcode, including the prefix. (HL) operands take two
+ * extra memory accesses, one for BIT which doesn't write back.
  */
-void set(uint8_t *reg, uint8_t b)
+#define CB8(r, m)	r, r, r, r, r, r, m, r
+
+static const uint8_t cbcycles[256] = {
+	CB8(8, 16), CB8(8, 16), CB8(8, 16), CB8(8, 16),
+	CB8(8, 16), CB8(8, 16), CB8(8, 16), CB8(8, 16),
+	CB8(8, 12), CB8(8, 12), CB8(8, 12), CB8(8, 12),
+	CB8(8, 12), CB8(8, 12), CB8(8, 12), CB8(8, 12),
+	CB8(8, 16), CB8(8, 16), CB8(8, 16), CB8(8, 16),
+	CB8(8, 16), CB8(8, 16), CB8(8, 16), CB8(8, 16),
+	CB8(8, 16), CB8(8, 16), CB8(8, 16), CB8(8, 16),
+	CB8(8, 16), CB8(8, 16), CB8(8, 16), CB8(8, 16)
+};
+
+static inline uint16_t fetch8(bus *mem, registers *reg)
+{
+	return (rd8(mem, reg->pc++));
+}
+
+static inline uint16_t fetch16(bus *mem, registers *reg)
 {
-	*reg |= (0x1 << b);
+	reg->pc += 2;
+	return (rd16(mem, reg->pc - 2));
 }
 
+#define DUE(mem)	unlikely((mem)->sched.now >= (mem)->sched.next)
+
 /*
- * Reset bit b in register reg.
+ * Take the highest priority interrupt that is both requested and enabled:
+ * push PC and jump to its vector, 20 T-cycles.
  */
-void res(uint8_t *reg, uint8_t b)
+static inline void irq(bus *mem, registers *reg)
 {
-	*reg &= ~(0x1 << b);
+	uint8_t pending = mem->io[IO_IF] & mem->hram[IO_IE - 0x80] & 0x1F;
+	uint8_t bit;
 
+	if (reg->ime != IME_ON || !pending)
+		return;
+
+	for (bit = 0; !(pending & (0x1 << bit)); bit++)
+		;
+	mem->io[IO_IF] &= ~(0x1 << bit);
+	reg->ime = IME_OFF;
+	PROF_IRQ(mem, reg->pc, 0x40 + bit * 0x8);
+	TRACE_IRQ(mem, reg, 0x40 + bit * 0x8);
+	push(mem, reg, reg->pc);
+	reg->pc = 0x40 + bit * 0x8;
+	mem->sched.now += 20;
 }
 
 /*
- * Test bit b in register reg. Z 0 1 (U)
- * TODO set flag
+ * Leave HALT once an interrupt is both requested and enabled, whether or
+ * not IME lets it be taken, and STOP once a selected button is held.
  */
-void bit(uint8_t *reg, uint8_t b, uint8_t *f)
+static inline int wake(bus *mem, registers *reg)
 {
-	uint8_t res;
-	
-	res = *reg & (0x1 << b);
+	if (reg->halt == CPU_HALT && !(mem->io[IO_IF] & mem->hram[IO_IE - 0x80] & 0x1F))
+		return (0);
+	if (reg->halt == CPU_STOP && (io_read(mem, IO_JOYP) & 0xF) == 0xF)
+		return (0);
+	reg->halt = CPU_RUN;
+	return (1);
+}
 
+/*
+ * The clock reached the next deadline. Fire the events that are due, then
+ * look for an interrupt, between two instructions.
+ *
+ * A halted CPU that doesn't wake up jumps the clock to the next deadline
+ * instead of running anything, and the executors come back here once
+ * they see it's due. The time skipped is kept in sched.slept.
+ *
+ * Return 1 to go on running, 0 if the CPU slept up to the next deadline,
+ * -1 if it's asleep with nothing scheduled that could wake it.
+ */
+static int service(bus *mem, registers *reg)
+{
+	uint64_t when;
+	int ev;
+
+	while ((ev = sched_due(&mem->sched, &when)) >= 0)
+		io_event(mem, ev, when);
+
+	if (reg->halt && !wake(mem, reg)) {
+		if (reg->halt == CPU_STOP || mem->sched.next == SCHED_NEVER) {
+			//look again next time, input may have come in by then
+			sched_poke(&mem->sched);
+			return (-1);
+		}
+		mem->sched.slept += mem->sched.next - mem->sched.now;
+		mem->sched.now = mem->sched.next;
+		return (0);
+	}
+
+	//EI poked the scheduler to get here right after it, have it come
+	//back after the next instruction too
+	if (reg->ime == IME_EI) {
+		reg->ime = IME_NEXT;
+		sched_step(&mem->sched);
+		return (1);
+	}
+	if (reg->ime == IME_NEXT)
+		reg->ime = IME_ON;
+	irq(mem, reg);
+	return (1);
+}
+
+/**
+ * Execute a single instruction through the handler tables and add its
+ * time to the clock. Events that come due are left to the caller.
+ *
+ * Return -1 on an illegal opcode, the T-cycles taken otherwise.
+ */
+int fetch_decode(bus *mem, registers *reg)
+{
+	uint64_t start = mem->sched.now;
+	uint8_t opc;
+	uint16_t imm;
+	ophandler h;
+
+	opc = fetch8(mem, reg);
+	h = optable[opc];
+	if (h == op_illegal)
+		return (-1);
+
+	switch (oplen[opc]) {
+	case 0: imm = 0; break;
+	case 1: imm = fetch8(mem, reg); break;
+	default: imm = fetch16(mem, reg); break;
+	}
+	PROF_OP(mem, reg->pc - 1 - oplen[opc], opc, imm);
+	TRACE_OP(mem, reg, reg->pc - 1 - oplen[opc], opc, imm);
+
+	mem->sched.now += opc == 0xCB ? cbcycles[imm] : opcycles[opc];
+	h(mem, reg, opc, imm);
+	return (mem->sched.now - start);
+}
+
+/**
+ * Run one instruction that was already decoded. The PC has to point past
+ * it, the way the dispatcher leaves it after fetching the operands.
+ */
+void execute_insn(bus *mem, registers *reg, uint8_t opc, uint16_t imm)
+{
+	if (opc == 0xCB)
+		cbtable[imm](mem, reg, imm, 0);
+	else
+		optable[opc](mem, reg, opc, imm);
+}
+
+/**
+ * Handler class of an opcode, or of a CB prefixed one with cb set, for
+ * reports.
+ */
+const char *opcode_name(uint8_t opc, int cb)
+{
+	return (cb ? cbname[opc] : opname[opc]);
+}
+
+/**
+ * Bytes an instruction takes, its opcode included.
+ */
+int opcode_len(uint8_t opc)
+{
+	return (oplen[opc] + 1);
+}
+
+/**
+ * Execute up to count instructions, firing events and taking interrupts
+ * as the clock reaches them. While halted, sleeping up to the next event
+ * counts as an instruction, and the run ends early if there's no event
+ * left to wake up for.
+ *
+ * With GCC and clang the loop is threaded through computed gotos: every
+ * opcode class gets its own copy of the dispatch jump so the branch
+ * predictor sees one indirect jump per handler instead of a single shared
+ * one, and the handlers are inlined into their labels. Other compilers
+ * fall back to fetch_decode and the handler tables.
+ *
+ * Return the number of instructions executed or -1 on an illegal opcode.
+ */
+#if defined(__GNUC__)
+#define LABEL_ENTRY(name)	&&l_##name,
+#endif
+
+long execute(bus *mem, registers *reg, long count)
+{
+	long n = count;
+	int awake;
+
+#if defined(__GNUC__)
+#define IMM_0			0
+#define IMM_1			fetch8(mem, reg)
+#define IMM_2			fetch16(mem, reg)
+#define DISPATCH() \
+	do { \
+		if (n-- == 0) \
+			return (count); \
+		if (DUE(mem) && (awake = service(mem, reg)) <= 0) { \
+			if (awake < 0) \
+				return (count - n - 1); \
+			goto l_asleep; \
+		} \
+		opc = fetch8(mem, reg); \
+		PROF_INSN(mem, reg->pc - 1, opc); \
+		TRACE_INSN(mem, reg, reg->pc - 1, opc); \
+		mem->sched.now += opcycles[opc]; \
+		goto *optarget[opc]; \
+	} while (0)
+#define OP_LABEL(name, len) \
+	l_##name: op_##name(mem, reg, opc, IMM_##len); DISPATCH();
+#define CBOP_LABEL(name) \
+	l_##name: op_##name(mem, reg, opc, 0); DISPATCH();
+
+	static const void *const optarget[256] = { BASE_OPS(LABEL_ENTRY) };
+	static const void *const cbtarget[256] = { CB_OPS(LABEL_ENTRY) };
+	uint8_t opc;
+
+	DISPATCH();
+
+	OP_CLASSES(OP_LABEL)
+	CBOP_CLASSES(CBOP_LABEL)
+
+l_cb:
+	opc = fetch8(mem, reg);
+	PROF_CB(mem, opc);
+	TRACE_CB(mem, opc);
+	//the prefix was already counted
+	mem->sched.now += cbcycles[opc] - opcycles[0xCB];
+	goto *cbtarget[opc];
+l_asleep:
+	DISPATCH();
+l_illegal:
+	return (-1);
+
+#undef IMM_0
+#undef IMM_1
+#undef IMM_2
+#undef DISPATCH
+#undef OP_LABEL
+#undef CBOP_LABEL
+#else
+	while (n-- > 0) {
+		if (DUE(mem) && (awake = service(mem, reg)) <= 0) {
+			if (awake < 0)
+				return (count - n - 1);
+			continue;
+		}
+		if (fetch_decode(mem, reg) < 0)
+			return (-1);
+	}
+	return (count);
+#endif
 }
 
 /*
- * Rotate the parameter register left. Set old bit 7 to carry. Z 0 0 C
- * TODO set flag
+ * Instructions that leave straight line code, or that change whether
+ * interrupts can come in, end a block.
  */
-void rlc(uint8_t *reg, uint8_t *f)
+static inline int endsblock(ophandler h)
 {
-	*reg << 0x1;
+	return (h == op_jr || h == op_jr_cc || h == op_jp || h == op_jp_cc ||
+	    h == op_jp_hl || h == op_call || h == op_call_cc || h == op_rst ||
+	    h == op_ret || h == op_ret_cc || h == op_reti || h == op_halt ||
+	    h == op_stop || h == op_di || h == op_ei);
 }
 
 /*
- * Rotate the parameter register right. Set old bit 7 to carry. Z 0 0 C
- * TODO set flag
+ * I/O registers that only change when an event fires.
+ */
+static inline int polled(uint16_t addr)
+{
+	return (addr == (0xFF00 | IO_LY) || addr == (0xFF00 | IO_STAT) ||
+	    addr == (0xFF00 | IO_IF));
+}
+
+/*
+ * A polling loop: a block that loads LY, STAT or IF into A, tests it and
+ * branches back to its own start. Nothing is written and A is loaded
+ * before it's used, so every run up to the next event leaves the same
+ * state behind.
+ */
+static int idle_loop(const block *blk)
+{
+	const insn *in, *last = &blk->code[blk->n - 1];
+	uint16_t target;
+
+	if (blk->n < 2 || (blk->code[0].opc != 0xF0 && blk->code[0].opc != 0xFA))
+		return (0);
+
+	for (in = blk->code; in < last; in++) {
+		switch (in->opc) {
+		case 0xF0: //LDH A,(n)
+			if (!polled(0xFF00 | in->imm))
+				return (0);
+			break;
+		case 0xFA: //LD A,(nn)
+			if (!polled(in->imm))
+				return (0);
+			break;
+		case 0xE6: //AND n
+		case 0xFE: //CP n
+			break;
+		case 0xCB: //BIT b,A
+			if ((in->imm & 0xC7) != 0x47)
+				return (0);
+			break;
+		default:
+			return (0);
+		}
+	}
+
+	switch (last->opc) {
+	case 0x20: case 0x28: case 0x30: case 0x38: //JR cc
+		target = blk->end + (int8_t)last->imm;
+		break;
+	case 0xC2: case 0xCA: case 0xD2: case 0xDA: //JP cc
+		target = last->imm;
+		break;
+	default:
+		return (0);
+	}
+	return (target == blk->pc);
+}
+
+/**
+ * Decode the straight line run of instructions at pc into blk. A block
+ * never reaches into the next page so a write or a bank switch can be
+ * matched against the one page it was read from.
+ *
+ * Return the number of instructions decoded, 0 if the first one can't be
+ * put in a block.
  */
-void rrc(uint8_t *reg, uint8_t *f)
+int decode_block(bus *mem, uint16_t pc, block *blk)
 {
-	*reg >> 0x1;
+	unsigned addr = pc;
+	uint8_t opc, len;
+	ophandler h;
+	insn *in;
+
+	blk->pc = pc;
+	blk->n = 0;
+	blk->cycles = 0;
+
+	while (blk->n < BLOCK_INSNS) {
+		opc = rd8(mem, addr);
+		h = optable[opc];
+		len = oplen[opc] + 1;
+		if (h == op_illegal || (addr + len - 1) >> 0x8 != (unsigned)pc >> 0x8)
+			break;
+
+		in = &blk->code[blk->n++];
+		in->opc = opc;
+		in->len = len;
+		in->imm = len == 3 ? rd16(mem, addr + 1) : len == 2 ? rd8(mem, addr + 1) : 0;
+		in->cycles = opc == 0xCB ? cbcycles[in->imm] : opcycles[opc];
+		blk->cycles += in->cycles;
+		addr += len;
+
+		if (endsblock(h))
+			break;
+	}
+
+	blk->end = addr;
+	blk->idle = blk->n && idle_loop(blk);
+	return (blk->n);
 }
 
 /*
- * Swap the high and low bits of the parameter register. Z 0 0 0
- * TODO set flag
+ * Skip the runs of a polling loop that would end by the next deadline.
+ * blk just ran and branched back to its start, so each of them would
+ * read the same value and leave the same state. Skipped instructions
+ * count against the budget in left.
+ *
+ * Return the number of instructions skipped.
  */
-void swap(uint8_t *reg, uint8_t *f)
+static long idle_skip(bus *mem, blockcache *bc, const block *blk, long left)
 {
-	uint8_t res;
-	
-	res = (*reg >> 0x4) + (*reg << 0x4);
-	*reg = res;
+	//the branch back costs 4 more than the table's not taken time
+	uint64_t run = blk->cycles + 4;
+	uint64_t k = left / blk->n;
+
+	if (mem->sched.now >= mem->sched.next)
+		return (0);
+	if (mem->sched.next != SCHED_NEVER && (mem->sched.next - mem->sched.now) / run < k)
+		k = (mem->sched.next - mem->sched.now) / run;
+	if (k == 0)
+		return (0);
+
+	mem->sched.now += k * run;
+	bc->idleskips++;
+	bc->idlecycles += k * run;
+	return (k * blk->n);
+}
+
+/**
+ * Execute up to count instructions out of the block cache. Code that can't
+ * be cached is interpreted one instruction at a time, and with a
+ * recompiler attached and enabled hot blocks run as host code.
+ *
+ * A block stops early when the bus reports that mapped code may have
+ * changed under it, a bank switch or a write hitting a cached block, and
+ * when the clock reaches a deadline. HALT and STOP are handled as in
+ * execute().
+ *
+ * Loops that poll LY, STAT or IF are skipped up to the next deadline
+ * unless bc->idleskip is cleared, the skipped instructions are counted
+ * as executed.
+ *
+ * Return the number of instructions executed or -1 on an illegal opcode.
+ */
+long execute_blocks(bus *mem, registers *reg, blockcache *bc, long count)
+{
+	const insn *ip, *end;
+	block *blk;
+	uint32_t gen;
+	long n = 0, ran;
+	int awake;
+
+#if defined(__GNUC__)
+#define NEXT_INSN() \
+	do { \
+		if (++ip < end && mem->codegen == gen && !DUE(mem)) \
+			goto *optarget[ip->opc]; \
+		goto done; \
+	} while (0)
+#define BLOCK_LABEL(name, size) \
+	l_##name: PROF_INSN(mem, reg->pc, ip->opc); \
+	TRACE_INSN(mem, reg, reg->pc, ip->opc); \
+	reg->pc += ip->len; mem->sched.now += ip->cycles; \
+	op_##name(mem, reg, ip->opc, ip->imm); NEXT_INSN();
+#define CBBLOCK_LABEL(name) \
+	l_##name: PROF_CB(mem, ip->imm); TRACE_CB(mem, ip->imm); \
+	reg->pc += ip->len; mem->sched.now += ip->cycles; \
+	op_##name(mem, reg, ip->imm, 0); NEXT_INSN();
+
+	static const void *const optarget[256] = { BASE_OPS(LABEL_ENTRY) };
+	static const void *const cbtarget[256] = { CB_OPS(LABEL_ENTRY) };
+#endif
+
+	while (n < count) {
+		if (DUE(mem) && (awake = service(mem, reg)) <= 0) {
+			if (awake < 0)
+				break;
+			n++;
+			continue;
+		}
+		if (!(blk = block_lookup(bc, mem, reg->pc))) {
+			if (fetch_decode(mem, reg) < 0)
+				return (-1);
+			n++;
+			continue;
+		}
+
+		//hot blocks run compiled when the recompiler is on, and when
+		//no deadline falls inside them and nothing profiles them
+		if (bc->jit && !PROF_ACTIVE(mem) && blk->n <= count - n &&
+		    mem->sched.now + blk->cycles < mem->sched.next &&
+		    (ran = jit_run(bc->jit, bc, blk, mem, reg)) >= 0) {
+			n += ran;
+			if (blk->idle && bc->idleskip && reg->pc == blk->pc)
+				n += idle_skip(mem, bc, blk, count - n);
+			continue;
+		}
+
+		ip = blk->code;
+		end = ip + (blk->n < count - n ? blk->n : count - n);
+		gen = mem->codegen;
+
+#if defined(__GNUC__)
+		goto *optarget[ip->opc];
+
+		OP_CLASSES(BLOCK_LABEL)
+		CBOP_CLASSES(CBBLOCK_LABEL)
+
+	l_cb:
+		PROF_INSN(mem, reg->pc, 0xCB);
+		TRACE_INSN(mem, reg, reg->pc, 0xCB);
+		goto *cbtarget[ip->imm];
+	l_illegal:
+		//never decoded into a block
+		return (-1);
+	done:
+#else
+		while (ip < end) {
+			PROF_OP(mem, reg->pc, ip->opc, ip->imm);
+			TRACE_OP(mem, reg, reg->pc, ip->opc, ip->imm);
+			reg->pc += ip->len;
+			mem->sched.now += ip->cycles;
+			execute_insn(mem, reg, ip->opc, ip->imm);
+			ip++;
+			if (mem->codegen != gen || DUE(mem))
+				break;
+		}
+#endif
+		n += ip - blk->code;
+		if (blk->idle && bc->idleskip && reg->pc == blk->pc)
+			n += idle_skip(mem, bc, blk, count - n);
+	}
+
+	return (n);
+
+#undef NEXT_INSN
+#undef BLOCK_LABEL
+#undef CBBLOCK_LABEL
 }
 
 //note: might need to take endianess into account
 
-int main() 
+/*
+ * Diff two traces to stdout.
+ *
+ * Return 0 if they agree, 1 if not, -1 if they can't be read.
+ */
+static int diff_traces(const char *a, const char *b)
 {
-	RAM ram;
+	tracefile ta, tb;
+	int err;
+
+	if ((err = trace_load(&ta, a)) < 0) {
+		fprintf(stderr, "%s: %s\n", a, trace_strerror(err));
+		return (-1);
+	}
+	if ((err = trace_load(&tb, b)) < 0) {
+		fprintf(stderr, "%s: %s\n", b, trace_strerror(err));
+		trace_unload(&ta);
+		return (-1);
+	}
+	if ((err = trace_diff(&ta, &tb, stdout)) < 0)
+		fprintf(stderr, "%s\n", trace_strerror(err));
+	trace_unload(&ta);
+	trace_unload(&tb);
+	return (err < 0 ? -1 : err);
+}
+
+/*
+ * Print another instance's counters to stdout.
+ *
+ * Return 0, -1 if there's no such instance.
+ */
+static int sample(const char *name)
+{
+	const telemetry *t;
+	int err;
+
+	if (!(t = tm_attach(name))) {
+		fprintf(stderr, "%s: no telemetry there\n", name);
+		return (-1);
+	}
+	err = tm_prometheus(t, stdout);
+	tm_detach(t);
+	return (err);
+}
+
+//-P only exists with the profiler built in
+#ifdef PROFILE
+#define PROF_OPT	"P:"
+#define PROF_USAGE	"[-P report] "
+#else
+#define PROF_OPT	""
+#define PROF_USAGE	""
+#endif
+
+//and -T with the trace writer
+#ifdef TRACE
+#define TRACE_OPT	"T:"
+#define TRACE_USAGE	"[-T trace] "
+#else
+#define TRACE_OPT	""
+#define TRACE_USAGE	""
+#endif
+
+int main(int argc, char **argv)
+{
+	static uint8_t rom[2 * ROMBANK];
+	static bus mem;
 	registers reg;
-	
-	init_ram(&ram);
+	machine *m;
+	ppu *p;
+	apu *snd;
+	audio *au = NULL;
+	rewinder rw;
+	rewindstats rs;
+	movie mv;
+	benchlist bl, base;
+	asmerror ae;
+	inputstep *steps = NULL;
+	batchjob *jobs;
+	size_t njobs, i, nsteps = 0;
+	uint64_t cycles = 0, rows, hits;
+	double start, secs, dumped = 0.0;
+	int err, ch;
+	int flags = 0, threads = 0, bench = 0, publish = 0, check = 0, stepwise;
+	unsigned long frames = 60, f, history = 0, seek = 0, benchframes = BENCH_FRAMES;
+	uint8_t held = 0x0;
+	const char *batch = NULL, *script = NULL, *record = NULL, *play = NULL;
+	const char *baseline = NULL, *assemble = NULL, *diff = NULL;
+	const char *tmdump = NULL, *tmname = NULL, *video = NULL, *sound = NULL;
+	FILE *vfp = NULL;
+	char segment[32];
+#ifdef PROFILE
+	const char *profpath = NULL;
+#endif
+#ifdef TRACE
+	const char *tracepath = NULL;
+#endif
+
+	while ((ch = getopt(argc, argv, "a:b:Bc:D:ef:Hi:IjJmM:o:p:" PROF_OPT "r:s:S:t:" TRACE_OPT "v:Vw:")) != -1) {
+		switch (ch) {
+		case 'a': assemble = optarg; break; //ROM to assemble the source into
+		case 'b': batch = optarg; break; //run a job list
+		case 'B': bench = 1; break; //run the benchmarks
+		case 'c': baseline = optarg; break; //benchmark results to compare with
+		case 'D': diff = optarg; break; //trace to compare with another
+		case 'e': flags |= MACHINE_EXACT; break; //run polling loops instead of skipping
+		case 'f': frames = benchframes = strtoul(optarg, NULL, 10); break;
+		case 'H': flags |= MACHINE_HUGE; break; //machines on huge pages
+		case 'i': script = optarg; break; //input script
+		case 'I': flags |= MACHINE_INTERP; break; //no block cache
+		case 'j': flags |= MACHINE_JIT; break; //recompile hot blocks
+		case 'J': flags |= MACHINE_JIT | MACHINE_LOCKSTEP; break; //and check them
+		case 'm': publish = 1; break; //publish telemetry
+		case 'M': tmdump = optarg; publish = 1; break; //and dump it every second
+		case 'o': sound = optarg; break; //write the sound out
+		case 'p': play = optarg; break; //play a movie to its end
+#ifdef PROFILE
+		case 'P': profpath = optarg; break; //profile report
+#endif
+		case 'r': history = strtoul(optarg, NULL, 10) << 20; break; //rewind MB
+		case 's': seek = strtoul(optarg, NULL, 10); break; //movie frame to start at
+		case 'S': tmname = optarg; break; //print a running instance's telemetry
+		case 't': threads = atoi(optarg); break; //batch threads, 0 for all cores
+#ifdef TRACE
+		case 'T': tracepath = optarg; break; //execution trace
+#endif
+		case 'v': video = optarg; break; //write every frame out
+		case 'V': check = 1; break; //and draw it both ways to compare
+		case 'w': record = optarg; break; //record the run as a movie
+		default:
+			fprintf(stderr, "usage: %s [-eHIjJmV] [-f frames] [-i script] [-M metrics] "
+			    "[-o audio] [-r MB] [-v video] [-w movie] " PROF_USAGE TRACE_USAGE "[rom]\n"
+			    "       %s [-eHIjJ] [-r MB] [-s frame] -p movie rom\n"
+			    "       %s [-eHIjJ] [-t threads] -b jobs\n"
+			    "       %s [-eHIjJ] [-f frames] [-c baseline] -B [rom ...]\n"
+			    "       %s -a rom source\n"
+			    "       %s -D trace trace\n"
+			    "       %s -S instance\n",
+			    argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+			return (-1);
+		}
+	}
+
+	if (assemble) {
+		if (optind >= argc) {
+			fprintf(stderr, "no source to assemble\n");
+			return (-1);
+		}
+		if (asm_file(argv[optind], assemble, &ae) < 0) {
+			if (ae.line)
+				fprintf(stderr, "%s:%d: %s\n", argv[optind], ae.line, ae.msg);
+			else
+				fprintf(stderr, "%s: %s\n", argv[optind], ae.msg);
+			return (-1);
+		}
+		return (0);
+	}
+
+	//0 if the traces agree, 1 at the first step they don't
+	if (diff) {
+		if (optind >= argc) {
+			fprintf(stderr, "no trace to compare with\n");
+			return (-1);
+		}
+		return (diff_traces(diff, argv[optind]));
+	}
+
+	if (tmname)
+		return (sample(tmname));
+
+	//results go to stdout, anything slower than the baseline to stderr
+	if (bench) {
+		memset(&base, 0, sizeof(base));
+		if (baseline && bench_load(baseline, &base) < 0) {
+			fprintf(stderr, "%s: can't read benchmark results\n", baseline);
+			return (-1);
+		}
+		memset(&bl, 0, sizeof(bl));
+		err = bench_ops(&bl, BENCH_OPCYCLES);
+		if (err == 0)
+			err = bench_mixes(&bl, benchframes, flags);
+		for (; err == 0 && optind < argc; optind++)
+			if ((err = bench_rom(&bl, argv[optind], benchframes, flags)) < 0)
+				fprintf(stderr, "%s: can't run\n", argv[optind]);
+		bench_print(stdout, &bl);
+		if (err == 0 && baseline && bench_compare(stderr, &base, &bl, 0.1) > 0)
+			err = 1;
+		bench_free(&bl);
+		bench_free(&base);
+		return (err);
+	}
+
 	init_registers(&reg);
+
+	if (batch) {
+		if (batch_load(batch, &jobs, &njobs) < 0) {
+			fprintf(stderr, "%s: can't read job list\n", batch);
+			return (-1);
+		}
+		start = tm_seconds();
+		if (batch_run(jobs, njobs, threads, flags) < 0) {
+			fprintf(stderr, "can't start the workers\n");
+			batch_free(jobs, njobs);
+			return (-1);
+		}
+		secs = tm_seconds() - start;
+
+		for (i = 0; i < njobs; i++) {
+			if (jobs[i].err < 0) {
+				printf("%s: %s\n", jobs[i].rom, batch_strerror(jobs[i].err));
+				continue;
+			}
+			printf("%s: %u frames, hash %08x, %ld insns, %.3fs\n", jobs[i].rom,
+			    jobs[i].frames, jobs[i].hash, jobs[i].insns, jobs[i].secs);
+			cycles += jobs[i].cycles;
+		}
+		printf("%lu jobs in %.3fs, %.1f emulated MHz\n", (unsigned long)njobs,
+		    secs, cycles / secs / 1e6);
+		batch_free(jobs, njobs);
+		return (0);
+	}
+
+	//with a ROM given, run it for a while and dump the registers
+	if (optind < argc) {
+		if (!(m = machine_new(flags)))
+			return (-1);
+		if ((err = machine_open(m, argv[optind], flags)) < 0) {
+			fprintf(stderr, "%s: %s\n", argv[optind], machine_strerror(err));
+			machine_delete(m);
+			return (-1);
+		}
+		printf("%s: type %02x, %u banks, %u bytes RAM%s\n", m->cart.title,
+		    m->cart.type, m->cart.nbanks, m->cart.ramsize, m->cart.cgb ? ", CGB" : "");
+		if (flags & MACHINE_JIT && !m->jc.enabled)
+			fprintf(stderr, "recompiler not available, interpreting\n");
+#ifdef PROFILE
+		if (profpath && !(m->mem.prof = prof_new(m->cart.romsize))) {
+			fprintf(stderr, "no memory for a profile\n");
+			profpath = NULL;
+		}
+#endif
+#ifdef TRACE
+		if (tracepath && !(m->mem.trace = trace_open(tracepath))) {
+			fprintf(stderr, "%s: %s\n", tracepath, trace_strerror(TRACE_EOPEN));
+			tracepath = NULL;
+		}
+#endif
+		if (script && input_load(script, &steps, &nsteps) < 0) {
+			fprintf(stderr, "%s: can't read input script\n", script);
+			machine_close(m);
+			machine_delete(m);
+			return (-1);
+		}
+		machine_input(m, steps, nsteps);
+		//the segment is named after the process, -S takes the name
+		if (publish) {
+			snprintf(segment, sizeof(segment), "gbcemu.%ld", (long)getpid());
+			if (!(m->mem.tm = tm_open(segment))) {
+				fprintf(stderr, "%s: can't publish telemetry\n", segment);
+				tmdump = NULL;
+			} else {
+				fprintf(stderr, "telemetry: %s\n", segment);
+			}
+		}
+		//frames go out as a stream of PPM images
+		if (video || check) {
+			if (!(p = ppu_new())) {
+				fprintf(stderr, "no memory for a screen\n");
+				video = NULL;
+			} else {
+				p->check = check;
+				machine_screen(m, p);
+			}
+		}
+		if (video && !(vfp = fopen(video, "wb"))) {
+			fprintf(stderr, "%s: can't write video\n", video);
+			video = NULL;
+		}
+		//sound goes out as a WAV file, written on a thread of its own
+		if (sound && !(au = audio_open(sound, APU_RATE))) {
+			fprintf(stderr, "%s: can't write sound\n", sound);
+		} else if (au && !(snd = apu_new(APU_RATE, au))) {
+			fprintf(stderr, "no memory for sound\n");
+			audio_close(au);
+			au = NULL;
+		} else if (au) {
+			machine_sound(m, snd);
+		}
+		//a movie plays from its start or the frame asked for to its end
+		if (play) {
+			if ((err = movie_load(&mv, play)) == 0 &&
+			    (err = movie_seek(&mv, m, seek > mv.start ? seek : mv.start)) == 0)
+				frames = mv.end - m->frame;
+			if (err < 0) {
+				fprintf(stderr, "%s: %s\n", play, movie_strerror(err));
+				movie_free(&mv);
+				play = NULL;
+				frames = 0;
+			}
+			record = NULL;
+		}
+		if (record && movie_record(&mv, m, 0) < 0) {
+			fprintf(stderr, "no memory for a movie\n");
+			record = NULL;
+		}
+		if (history && rewind_init(&rw, m, history, 0) < 0) {
+			fprintf(stderr, "no memory for %lu bytes of history\n", history);
+			history = 0;
+		}
+		//with a history, a recording, a metrics file or video, one frame at a time
+		stepwise = history || record || tmdump || video;
+		for (f = 0, i = 0; f < (stepwise ? frames : 1); f++) {
+			while (i < nsteps && steps[i].frame <= m->frame)
+				held = steps[i++].held;
+			if (record)
+				err = movie_frame(&mv, m, held) < 0 ? -1 : 0;
+			else
+				err = machine_run(m, stepwise ? 1 : frames) < 0 ? -1 : 0;
+			if (err < 0) {
+				printf("illegal opcode at %04x\n", m->reg.pc - 1);
+				break;
+			}
+			if (history)
+				rewind_push(&rw, m);
+			if (video && ppu_ppm(m->mem.ppu, vfp) < 0) {
+				fprintf(stderr, "%s: can't write video\n", video);
+				break;
+			}
+			if (tmdump && tm_seconds() - dumped >= 1.0) {
+				if (tm_dump(m->mem.tm, tmdump) < 0)
+					fprintf(stderr, "%s: can't write metrics\n", tmdump);
+				dumped = tm_seconds();
+			}
+		}
+		printf("pc %04x sp %04x a %02x f %02x\n", m->reg.pc, m->reg.sp, m->reg.a,
+		    getf(&m->reg));
+		printf("%u frames, %lu T-cycles, %lu halted\n", m->frame,
+		    (unsigned long)m->mem.sched.now, (unsigned long)m->mem.sched.slept);
+		printf("idle: %lu polling loops, %lu skips, %lu T-cycles skipped\n",
+		    m->bc.idleloops, m->bc.idleskips, (unsigned long)m->bc.idlecycles);
+		if (m->jc.enabled)
+			printf("jit: %lu blocks compiled, %lu runs, %lu mismatches\n",
+			    m->jc.compiled, m->jc.runs, m->jc.mismatches);
+		if (m->mem.ppu) {
+			printf("ppu: %lu frames, %lu lines, %s kernels", (unsigned long)m->mem.ppu->frames,
+			    (unsigned long)m->mem.ppu->lines, m->mem.ppu->simd == PPU_SSSE3 ? "SSSE3" :
+			    m->mem.ppu->simd == PPU_SSE2 ? "SSE2" : "scalar");
+			if (check)
+				printf(", %lu lines differ", (unsigned long)m->mem.ppu->mismatches);
+			rows = m->mem.ppu->tilerows;
+			hits = rows - m->mem.ppu->tilemisses;
+			printf("\ntiles: %lu decoded, %lu of %lu rows cached (%.1f%%)\n",
+			    (unsigned long)m->mem.ppu->tilemisses, (unsigned long)hits, (unsigned long)rows,
+			    rows ? 100.0 * hits / rows : 0.0);
+			printf("sprites: %lu line lists made for %lu lines\n",
+			    (unsigned long)m->mem.ppu->objlists, (unsigned long)m->mem.ppu->lines);
+			p = m->mem.ppu;
+			machine_screen(m, NULL);
+			ppu_free(p);
+		}
+		if (vfp && fclose(vfp) != 0)
+			fprintf(stderr, "%s: can't write video\n", video);
+		if (m->mem.apu) {
+			snd = m->mem.apu;
+			apu_flush(snd, &m->mem);
+			machine_sound(m, NULL);
+			printf("apu: %lu samples at %u Hz, %lu steps, %lu dropped\n",
+			    (unsigned long)snd->samples, snd->rate, (unsigned long)snd->steps,
+			    (unsigned long)au->dropped);
+			apu_free(snd);
+		}
+		if (au && audio_close(au) < 0)
+			fprintf(stderr, "%s: can't write sound\n", sound);
+		if (history) {
+			rewind_stats(&rw, &rs);
+			printf("rewind: %lu frames, %lu keyframes, %lu bytes for %lu (%.1fx), "
+			    "%lu bytes allocated\n", (unsigned long)rs.frames,
+			    (unsigned long)rs.keyframes, (unsigned long)rs.bytes,
+			    (unsigned long)rs.raw, rs.ratio, (unsigned long)rs.memory);
+			rewind_free(&rw);
+		}
+		if (play) {
+			printf("movie: frames %u-%u, %lu keyframes, hash %08x, %s\n", mv.start,
+			    mv.end, (unsigned long)mv.nkeys, machine_hash(m),
+			    machine_hash(m) == mv.hash ? "same as recorded" : "DIFFERENT");
+			movie_free(&mv);
+		}
+		if (record) {
+			movie_stop(&mv, m);
+			if ((err = movie_save(&mv, record)) < 0)
+				fprintf(stderr, "%s: %s\n", record, movie_strerror(err));
+			else
+				printf("movie: frames %u-%u, %lu keyframes, %lu bytes, hash %08x\n",
+				    mv.start, mv.end, (unsigned long)mv.nkeys,
+				    (unsigned long)mv.used, mv.hash);
+			movie_free(&mv);
+		}
+#ifdef PROFILE
+		//the report, and the folded stacks next to it
+		if (profpath) {
+			char path[4096];
+			FILE *fp;
+
+			snprintf(path, sizeof(path), "%s.folded", profpath);
+			if (!(fp = fopen(profpath, "w")) || prof_report(m->mem.prof, fp) < 0)
+				fprintf(stderr, "%s: can't write profile\n", profpath);
+			if (fp)
+				fclose(fp);
+			if (!(fp = fopen(path, "w")) || prof_folded(m->mem.prof, fp) < 0)
+				fprintf(stderr, "%s: can't write profile\n", path);
+			if (fp)
+				fclose(fp);
+			prof_free(m->mem.prof);
+			m->mem.prof = NULL;
+		}
+#endif
+#ifdef TRACE
+		if (tracepath) {
+			if (m->mem.trace->dropped)
+				fprintf(stderr, "%s: %lu stores past %d in a step left out\n", tracepath,
+				    (unsigned long)m->mem.trace->dropped, TRACE_WRITES);
+			if (trace_close(m->mem.trace, &m->reg) < 0)
+				fprintf(stderr, "%s: can't write trace\n", tracepath);
+			m->mem.trace = NULL;
+		}
+#endif
+		if (m->mem.tm) {
+			if (tmdump && tm_dump(m->mem.tm, tmdump) < 0)
+				fprintf(stderr, "%s: can't write metrics\n", tmdump);
+			tm_close(m->mem.tm);
+			m->mem.tm = NULL;
+		}
+
+		machine_close(m);
+		free(steps);
+		machine_delete(m);
+		return (0);
+	}
+
+	init_bus(&mem, 0);
 	reg.a = 0x1;
 	reg.b = 0x2;
-	ram.mem[reg.pc] = 0x04;
-	ram.mem[reg.pc + 1] = 0x90;
+	rom[reg.pc] = 0x04;
+	rom[reg.pc + 1] = 0x90;
+	bus_map_rom(&mem, rom, sizeof(rom), MBC_NONE);
 	/*for (;;) {
-		if (fetch_decode(&ram, &reg) < 0)
+		if (fetch_decode(&mem, &reg) < 0)
 			return (-1);
 	}*/
-	
-	fetch_decode(&ram, &reg);
-	fetch_decode(&ram, &reg);
-		
+
+	execute(&mem, &reg, 2);
+
 	printf("%d\n", reg.a);
-	
-	uint8_t hi = 0xAB;
-	uint8_t lo = 0xCD;
-	inc(&lo, &hi, NULL);
-	
-	printf("%02x \t %02x\n", hi, lo);
-	
-	swap(&hi, NULL);
-	swap(&lo, NULL);
-	
-	printf("%02x \t %02x\n", hi, lo);
-		
-	return (0); 
-}
\ No newline at end of file
+	printf("%02x \t %02x\n", reg.b, getf(&reg));
+
+	return (0);
+}
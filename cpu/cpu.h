@@ -0,0 +1,207 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+#include "mem.h"
+
+/*
+ * Flags are evaluated lazily. ALU ops only record what they did here and
+ * Z N H C are worked out when something reads them. With op LF_NONE the f
+ * register holds the flags as they are.
+ */
+typedef struct {
+	uint8_t		op; //LF_* operation that last set the flags
+	uint8_t		a; //first operand
+	uint8_t		b; //second operand
+	uint8_t		res; //result
+	uint8_t		c; //carry in, or the carry the op leaves alone
+} lazyflags;
+
+#define LF_NONE		0x0
+#define LF_ADD		0x1
+#define LF_ADC		0x2
+#define LF_SUB		0x3 //also cp
+#define LF_SBC		0x4
+#define LF_AND		0x5
+#define LF_OR		0x6 //also xor
+#define LF_INC		0x7
+#define LF_DEC		0x8
+#define LF_SHIFT	0x9 //cb rotates and shifts
+
+/*
+ * An 8 bit register pair that can also be used as one 16 bit register,
+ * hi in the upper byte whatever the host's byte order.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REGPAIR(hi, lo) \
+	union { struct { uint8_t hi; uint8_t lo; }; uint16_t hi##lo; }
+#else
+#define REGPAIR(hi, lo) \
+	union { struct { uint8_t lo; uint8_t hi; }; uint16_t hi##lo; }
+#endif
+
+typedef struct {
+	REGPAIR(a, f); //f is only up to date once getf() ran, so is af
+	REGPAIR(b, c);
+	REGPAIR(d, e);
+	REGPAIR(h, l);
+	uint16_t	sp; //stack pointer
+	uint16_t	pc; //program counter
+	uint8_t		ime; //interrupt master enable, IME_*
+	uint8_t		halt; //CPU_* low power state
+	lazyflags	lf; //pending flag computation, see getf()
+} registers;
+
+//interrupt master enable. EI only enables interrupts once the instruction
+//after it ran, so a handler can't come in between EI and a HALT or RET
+#define IME_OFF		0x0
+#define IME_ON		0x1
+#define IME_EI		0x2 //EI just ran
+#define IME_NEXT	0x3 //on once the instruction running now is done
+
+//low power states
+#define CPU_RUN		0x0
+#define CPU_HALT	0x1 //until an interrupt is requested
+#define CPU_STOP	0x2 //clock stopped too, until a button is pressed
+
+//zero flag set
+#define zflagisset(f)	((f & 0x80) >> 0x7)
+
+//subtract flag set
+#define sflagisset(f)	((f & 0x40) >> 0x6)
+
+//half carry flag set
+#define hflagisset(f)	((f & 0x20) >> 0x5)
+
+//carry flag set
+#define cflagisset(f)	((f & 0x10) >> 0x4)
+
+#define setz(f)		((f) | 0x80)
+#define sets(f)		((f) | 0x40)
+#define seth(f)		((f) | 0x20)
+#define setc(f)		((f) | 0x10)
+#define clear(f)	((f) & 0x0)
+
+/*
+ * Record an ALU op for later flag evaluation.
+ */
+static inline uint8_t setlf(registers *reg, uint8_t op, uint8_t a, uint8_t b, uint8_t res, uint8_t c)
+{
+	reg->lf.op = op;
+	reg->lf.a = a;
+	reg->lf.b = b;
+	reg->lf.res = res;
+	reg->lf.c = c;
+	return (res);
+}
+
+/*
+ * Zero flag. Every recorded op sets Z from its result.
+ */
+static inline uint8_t flagz(registers *reg)
+{
+	if (reg->lf.op == LF_NONE)
+		return (zflagisset(reg->f));
+	return (reg->lf.res == 0);
+}
+
+/*
+ * Carry flag, without materializing the rest of F.
+ */
+static inline uint8_t flagc(registers *reg)
+{
+	lazyflags *lf = &reg->lf;
+
+	switch (lf->op) {
+	case LF_NONE: return (cflagisset(reg->f));
+	case LF_ADD: return (lf->res < lf->a);
+	case LF_ADC: return (lf->a + lf->b + lf->c > 0xFF);
+	case LF_SUB: return (lf->a < lf->b);
+	case LF_SBC: return (lf->a < lf->b + lf->c);
+	case LF_AND:
+	case LF_OR: return (0);
+	default: return (lf->c);
+	}
+}
+
+/*
+ * Work out the pending flags into the f register and return it. Z N H C
+ */
+static inline uint8_t getf(registers *reg)
+{
+	lazyflags *lf = &reg->lf;
+	uint8_t f = 0x0;
+
+	switch (lf->op) {
+	case LF_NONE:
+		return (reg->f);
+	case LF_ADD:
+	case LF_ADC:
+		if ((lf->a & 0xF) + (lf->b & 0xF) + lf->c > 0xF)
+			f = seth(f);
+		break;
+	case LF_SUB:
+	case LF_SBC:
+		f = sets(f);
+		if ((lf->a & 0xF) < (lf->b & 0xF) + lf->c)
+			f = seth(f);
+		break;
+	case LF_AND:
+		f = seth(f);
+		break;
+	case LF_INC:
+		if ((lf->res & 0xF) == 0)
+			f = seth(f);
+		break;
+	case LF_DEC:
+		f = sets(f);
+		if ((lf->res & 0xF) == 0xF)
+			f = seth(f);
+		break;
+	}
+	if (lf->res == 0)
+		f = setz(f);
+	if (flagc(reg))
+		f = setc(f);
+
+	lf->op = LF_NONE;
+	reg->f = f;
+	return (f);
+}
+
+/*
+ * Overwrite all of F, dropping whatever was pending.
+ */
+static inline void putf(registers *reg, uint8_t f)
+{
+	reg->lf.op = LF_NONE;
+	reg->f = f & 0xF0;
+}
+
+#define CBOP(p)		((p) == 0xCB)
+
+/*
+ * Opcode fields. An opcode byte is laid out as xxyyyzzz, with y further
+ * split into ppq. Register operands are encoded in y and z as
+ * B C D E H L (HL) A, register pairs in p as BC DE HL SP.
+ */
+#define OPX(o)		((o) >> 6)
+#define OPY(o)		(((o) >> 3) & 0x7)
+#define OPZ(o)		((o) & 0x7)
+#define OPP(o)		(((o) >> 4) & 0x3)
+#define OPQ(o)		(((o) >> 3) & 0x1)
+
+typedef void (*ophandler)(bus *mem, registers *reg, uint8_t opc, uint16_t imm);
+
+void	init_registers(registers *reg);
+void	nop();
+void	stop(bus *mem, registers *reg);
+void	halt(bus *mem, registers *reg);
+int	fetch_decode(bus *mem, registers *reg);
+void	execute_insn(bus *mem, registers *reg, uint8_t opc, uint16_t imm);
+long	execute(bus *mem, registers *reg, long count);
+const char	*opcode_name(uint8_t opc, int cb);
+int	opcode_len(uint8_t opc);
+
+#endif
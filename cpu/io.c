@@ -0,0 +1,485 @@
+#include <string.h>
+
+#include "io.h"
+#include "apu.h"
+#include "ppu.h"
+#include "telemetry.h"
+
+static uint8_t	joyp(bus *mem);
+static void	timer_sync(bus *mem);
+static void	timer_schedule(bus *mem);
+static void	lcd_event(bus *mem, uint64_t when);
+static void	lcd_mode(bus *mem, uint8_t mode);
+static void	lcd_line(bus *mem, uint8_t ly);
+static void	lcd_power(bus *mem, uint8_t lcdc);
+static void	dma_start(bus *mem, uint8_t src);
+static void	hdma_start(bus *mem, uint8_t val);
+static void	hdma_block(bus *mem);
+static void	hdma_copy(bus *mem, uint8_t blocks);
+static void	pal_write(bus *mem, uint8_t reg, uint8_t val);
+
+//TIMA input clock by TAC bits 0-1, in T-cycles
+static const uint16_t timerperiod[4] = { 1024, 16, 64, 256 };
+
+//STAT interrupt enable bit for entering each mode
+static const uint8_t statirq[4] = { 0x08, 0x10, 0x20, 0x00 };
+
+
+/**
+ * Reset the clock and put the peripherals in their state after the boot
+ * ROM: LCD on and starting a frame, timer stopped, sound on.
+ */
+void init_io(bus *mem)
+{
+	init_sched(&mem->sched);
+	mem->divbase = 0;
+	mem->timabase = 0;
+	mem->dma = 0x0;
+	mem->hdma = 0x0;
+	mem->joypad = 0x0;
+
+	mem->io[IO_LCDC] = 0x91;
+	mem->io[IO_STAT] = 0x2;
+	mem->io[IO_LY] = 0x0;
+	mem->io[IO_BGP] = 0xFC;
+	mem->io[IO_OBP0] = 0xFF;
+	mem->io[IO_OBP1] = 0xFF;
+	mem->io[IO_HDMA5] = 0xFF;
+	//the boot ROM leaves the sound on at full volume, with square 1
+	//still on after its chime faded out
+	mem->io[IO_NR50] = 0x77;
+	mem->io[IO_NR51] = 0xF3;
+	mem->io[IO_NR52] = 0x80;
+	memset(&mem->snd, 0x0, sizeof(sndstate));
+	mem->snd.ch[0].on = 0x1;
+	//the CGB boot ROM leaves the background white
+	memset(mem->bgpal, 0xFF, sizeof(mem->bgpal));
+	memset(mem->objpal, 0x0, sizeof(mem->objpal));
+	sched_at(&mem->sched, EV_LCD, LCD_OAM);
+}
+
+uint8_t io_read(bus *mem, uint8_t reg)
+{
+	uint8_t *io = mem->io;
+	uint64_t start;
+	uint8_t val;
+
+	if (reg >= IO_NR10 && reg <= IO_WAVE + 0xF) {
+		start = TM_BEGIN(mem);
+		val = apu_read(mem, reg);
+		TM_CHARGE(mem, TM_APU, start);
+		return (val);
+	}
+
+	switch (reg) {
+	case IO_JOYP: return (joyp(mem));
+	case IO_SC: return (io[IO_SC] | 0x7E);
+	case IO_DIV: return ((mem->sched.now - mem->divbase) >> 0x8);
+	case IO_TIMA: timer_sync(mem); return (io[IO_TIMA]);
+	case IO_TAC: return (io[IO_TAC] | 0xF8);
+	case IO_IF: return (io[IO_IF] | 0xE0);
+	case IO_STAT: return (io[IO_STAT] | 0x80);
+	case IO_BCPS:
+	case IO_OCPS: return (mem->cgb ? io[reg] | 0x40 : 0xFF);
+	case IO_BCPD: return (mem->cgb ? mem->bgpal[io[IO_BCPS] & 0x3F] : 0xFF);
+	case IO_OCPD: return (mem->cgb ? mem->objpal[io[IO_OCPS] & 0x3F] : 0xFF);
+	case IO_HDMA1:
+	case IO_HDMA2:
+	case IO_HDMA3:
+	case IO_HDMA4: return (0xFF);
+	case IO_HDMA5: return (mem->cgb ? io[IO_HDMA5] : 0xFF);
+	default: return (io[reg]);
+	}
+}
+
+void io_write(bus *mem, uint8_t reg, uint8_t val)
+{
+	uint8_t *io = mem->io;
+	uint64_t start;
+
+	if (reg >= IO_NR10 && reg <= IO_WAVE + 0xF) {
+		start = TM_BEGIN(mem);
+		apu_write(mem, reg, val);
+		TM_CHARGE(mem, TM_APU, start);
+		return;
+	}
+
+	switch (reg) {
+	case IO_JOYP:
+		io[IO_JOYP] = val & 0x30;
+		break;
+	case IO_SC:
+		io[IO_SC] = val;
+		//only the internal clock runs, nothing is on the other end
+		if ((val & 0x81) == 0x81)
+			sched_at(&mem->sched, EV_SERIAL, mem->sched.now +
+			    (mem->cgb && (val & 0x2) ? 8 * 16 : 8 * 512));
+		else
+			sched_cancel(&mem->sched, EV_SERIAL);
+		break;
+	case IO_DIV:
+		timer_sync(mem);
+		mem->divbase = mem->sched.now;
+		timer_schedule(mem);
+		break;
+	case IO_TIMA:
+	case IO_TMA:
+	case IO_TAC:
+		timer_sync(mem);
+		io[reg] = reg == IO_TAC ? val & 0x7 : val;
+		timer_schedule(mem);
+		break;
+	case IO_IF:
+		io[IO_IF] = val & 0x1F;
+		sched_poke(&mem->sched);
+		break;
+	case IO_LCDC:
+		lcd_power(mem, val);
+		break;
+	case IO_STAT:
+		io[IO_STAT] = (io[IO_STAT] & 0x87) | (val & 0x78);
+		break;
+	case IO_LY:
+		break;
+	case IO_LYC:
+		io[IO_LYC] = val;
+		if (io[IO_LCDC] & 0x80)
+			lcd_line(mem, io[IO_LY]);
+		break;
+	case IO_DMA:
+		dma_start(mem, val);
+		break;
+	case IO_BCPS:
+	case IO_OCPS:
+		io[reg] = val & 0xBF;
+		break;
+	case IO_BCPD:
+	case IO_OCPD:
+		if (mem->cgb)
+			pal_write(mem, reg, val);
+		break;
+	case IO_HDMA5:
+		if (mem->cgb)
+			hdma_start(mem, val);
+		break;
+	default:
+		io[reg] = val;
+		break;
+	}
+}
+
+/**
+ * Handle an event that came due. when is its deadline, the clock may be a
+ * few cycles past it.
+ */
+void io_event(bus *mem, uint8_t ev, uint64_t when)
+{
+	switch (ev) {
+	case EV_TIMER:
+		timer_sync(mem);
+		timer_schedule(mem);
+		break;
+	case EV_LCD:
+		lcd_event(mem, when);
+		break;
+	case EV_SERIAL:
+		mem->io[IO_SB] = 0xFF;
+		mem->io[IO_SC] &= 0x7F;
+		io_irq(mem, INT_SERIAL);
+		break;
+	case EV_DMA:
+		mem->dma = 0x0;
+		mem->rd[0xFE] = mem->oam;
+		break;
+	case EV_HDMA:
+		hdma_block(mem);
+		break;
+	}
+}
+
+/**
+ * Request interrupts. The CPU looks at them at the next instruction.
+ */
+void io_irq(bus *mem, uint8_t bits)
+{
+	mem->io[IO_IF] |= bits;
+	sched_poke(&mem->sched);
+}
+
+/**
+ * Set the buttons held, JOY_* bits. A selected button going down requests
+ * the joypad interrupt and wakes the CPU from STOP.
+ */
+void io_joypad(bus *mem, uint8_t held)
+{
+	uint8_t before = joyp(mem);
+
+	mem->joypad = held;
+	if (before & ~joyp(mem) & 0xF)
+		io_irq(mem, INT_JOYPAD);
+}
+
+/*
+ * P14 and P15 select the button groups with a 0, pressed buttons in a
+ * selected group read as 0.
+ */
+static uint8_t joyp(bus *mem)
+{
+	uint8_t sel = mem->io[IO_JOYP] & 0x30;
+	uint8_t held = 0x0;
+
+	if (!(sel & 0x10))
+		held |= mem->joypad >> 0x4;
+	if (!(sel & 0x20))
+		held |= mem->joypad & 0xF;
+	return (0xC0 | sel | (~held & 0xF));
+}
+
+/*
+ * Bring TIMA up to the clock. TIMA counts falling edges of a DIV counter
+ * bit, so ticks are counted on multiples of the period since DIV was
+ * reset, and overflows reload TMA and request the timer interrupt.
+ */
+static void timer_sync(bus *mem)
+{
+	uint8_t *io = mem->io;
+	uint64_t now = mem->sched.now;
+	uint64_t period, ticks;
+	unsigned room;
+
+	if (io[IO_TAC] & 0x4) {
+		period = timerperiod[io[IO_TAC] & 0x3];
+		ticks = (now - mem->divbase) / period - (mem->timabase - mem->divbase) / period;
+		while (ticks > 0) {
+			room = 0x100 - io[IO_TIMA];
+			if (ticks < room) {
+				io[IO_TIMA] += ticks;
+				break;
+			}
+			ticks -= room;
+			io[IO_TIMA] = io[IO_TMA];
+			io_irq(mem, INT_TIMER);
+		}
+	}
+	mem->timabase = now;
+}
+
+/*
+ * Schedule the next TIMA overflow, after timer_sync.
+ */
+static void timer_schedule(bus *mem)
+{
+	uint8_t *io = mem->io;
+	uint64_t period, tick;
+
+	if (!(io[IO_TAC] & 0x4)) {
+		sched_cancel(&mem->sched, EV_TIMER);
+		return;
+	}
+
+	period = timerperiod[io[IO_TAC] & 0x3];
+	tick = (mem->sched.now - mem->divbase) / period + (0x100 - io[IO_TIMA]);
+	sched_at(&mem->sched, EV_TIMER, mem->divbase + tick * period);
+}
+
+/*
+ * Step the LCD to its next mode. Every line is OAM scan, transfer and
+ * HBlank, then ten lines of VBlank. Deadlines are taken from the last
+ * one, not the clock, so a late look doesn't make the frame drift.
+ */
+static void lcd_event(bus *mem, uint64_t when)
+{
+	uint64_t start = TM_BEGIN(mem);
+	uint8_t ly = mem->io[IO_LY];
+
+	switch (mem->io[IO_STAT] & 0x3) {
+	case 2:
+		lcd_mode(mem, 3);
+		sched_at(&mem->sched, EV_LCD, when + LCD_XFER);
+		break;
+	case 3:
+		if (mem->ppu)
+			ppu_line(mem->ppu, mem, ly);
+		lcd_mode(mem, 0);
+		if (mem->hdma)
+			sched_at(&mem->sched, EV_HDMA, when);
+		sched_at(&mem->sched, EV_LCD, when + LCD_HBLANK);
+		break;
+	case 0:
+		lcd_line(mem, ly + 1);
+		if (ly + 1 == LCD_VISIBLE) {
+			if (mem->ppu)
+				ppu_vblank(mem->ppu);
+			lcd_mode(mem, 1);
+			io_irq(mem, INT_VBLANK);
+			sched_at(&mem->sched, EV_LCD, when + LCD_LINE);
+		} else {
+			lcd_mode(mem, 2);
+			sched_at(&mem->sched, EV_LCD, when + LCD_OAM);
+		}
+		break;
+	case 1:
+		if (ly + 1 == LCD_LINES) {
+			lcd_line(mem, 0);
+			lcd_mode(mem, 2);
+			sched_at(&mem->sched, EV_LCD, when + LCD_OAM);
+		} else {
+			lcd_line(mem, ly + 1);
+			sched_at(&mem->sched, EV_LCD, when + LCD_LINE);
+		}
+		break;
+	}
+	TM_CHARGE(mem, TM_PPU, start);
+}
+
+static void lcd_mode(bus *mem, uint8_t mode)
+{
+	mem->io[IO_STAT] = (mem->io[IO_STAT] & ~0x3) | mode;
+	if (mem->io[IO_STAT] & statirq[mode])
+		io_irq(mem, INT_STAT);
+}
+
+/*
+ * Move to line ly and compare it with LYC.
+ */
+static void lcd_line(bus *mem, uint8_t ly)
+{
+	uint8_t *io = mem->io;
+
+	io[IO_LY] = ly;
+	if (ly == io[IO_LYC]) {
+		io[IO_STAT] |= 0x4;
+		if (io[IO_STAT] & 0x40)
+			io_irq(mem, INT_STAT);
+	} else {
+		io[IO_STAT] &= ~0x4;
+	}
+}
+
+/*
+ * LCDC write. Switching the LCD off parks it at line 0 in HBlank,
+ * switching it on starts a frame.
+ */
+static void lcd_power(bus *mem, uint8_t lcdc)
+{
+	uint8_t was = mem->io[IO_LCDC] & 0x80;
+
+	mem->io[IO_LCDC] = lcdc;
+	if (was && !(lcdc & 0x80)) {
+		if (mem->ppu)
+			ppu_blank(mem->ppu);
+		mem->io[IO_LY] = 0x0;
+		mem->io[IO_STAT] &= ~0x3;
+		sched_cancel(&mem->sched, EV_LCD);
+	} else if (!was && (lcdc & 0x80)) {
+		lcd_line(mem, 0);
+		mem->io[IO_STAT] = (mem->io[IO_STAT] & ~0x3) | 0x2;
+		sched_at(&mem->sched, EV_LCD, mem->sched.now + LCD_OAM);
+	}
+}
+
+/*
+ * OAM DMA. The copy is done up front in one go, and whoever watches OAM
+ * hears about all of it at once. OAM then reads 0xFF and ignores writes
+ * until the event marks the end of the transfer.
+ */
+static void dma_start(bus *mem, uint8_t src)
+{
+	uint64_t start = TM_BEGIN(mem);
+
+	mem->io[IO_DMA] = src;
+	//sources past WRAM read the echo of it
+	if (src >= 0xE0)
+		src -= 0x20;
+	bus_read(mem, src << 0x8, mem->oam, 0xA0);
+	bus_written(mem, 0xFE00, 0xA0);
+
+	mem->dma = 0x1;
+	mem->rd[0xFE] = 0;
+	sched_at(&mem->sched, EV_DMA, mem->sched.now + DMA_CYCLES);
+	TM_CHARGE(mem, TM_DMA, start);
+}
+
+/*
+ * HDMA5 write. Bit 7 starts an HBlank DMA, or clearing it stops the one
+ * running, which then reads as stopped with the blocks it had left.
+ * Otherwise it's a general DMA, all blocks now with the CPU waiting.
+ */
+static void hdma_start(bus *mem, uint8_t val)
+{
+	uint64_t start;
+
+	if (mem->hdma && !(val & 0x80)) {
+		mem->hdma = 0x0;
+		mem->io[IO_HDMA5] |= 0x80;
+		sched_cancel(&mem->sched, EV_HDMA);
+		return;
+	}
+	mem->io[IO_HDMA5] = val & 0x7F;
+	if (val & 0x80) {
+		mem->hdma = 0x1;
+		return;
+	}
+
+	start = TM_BEGIN(mem);
+	hdma_copy(mem, (val & 0x7F) + 1);
+	mem->io[IO_HDMA5] = 0xFF;
+	mem->sched.now += ((val & 0x7F) + 1) * HDMA_STALL;
+	TM_CHARGE(mem, TM_DMA, start);
+}
+
+/*
+ * One HBlank's block.
+ */
+static void hdma_block(bus *mem)
+{
+	uint64_t start = TM_BEGIN(mem);
+
+	hdma_copy(mem, 1);
+	mem->sched.now += HDMA_STALL;
+	if (mem->io[IO_HDMA5] == 0x0) {
+		mem->io[IO_HDMA5] = 0xFF;
+		mem->hdma = 0x0;
+	} else {
+		mem->io[IO_HDMA5]--;
+	}
+	TM_CHARGE(mem, TM_DMA, start);
+}
+
+/*
+ * Copy blocks from the source to the destination in the current VRAM
+ * bank and move both past them, as the registers do.
+ */
+static void hdma_copy(bus *mem, uint8_t blocks)
+{
+	uint8_t *io = mem->io, buf[0x80 * HDMA_BLOCK];
+	uint16_t src = io[IO_HDMA1] << 0x8 | (io[IO_HDMA2] & 0xF0);
+	uint16_t dst = (io[IO_HDMA3] & 0x1F) << 0x8 | (io[IO_HDMA4] & 0xF0);
+	uint16_t len = blocks * HDMA_BLOCK, first;
+
+	bus_read(mem, src, buf, len);
+	//the destination wraps around at the end of VRAM
+	first = len < VRAMBANK - dst ? len : VRAMBANK - dst;
+	bus_write(mem, 0x8000 | dst, buf, first);
+	bus_write(mem, 0x8000, buf + first, len - first);
+
+	src += len;
+	dst = (dst + len) & (VRAMBANK - 1);
+	io[IO_HDMA1] = src >> 0x8;
+	io[IO_HDMA2] = src & 0xFF;
+	io[IO_HDMA3] = dst >> 0x8;
+	io[IO_HDMA4] = dst & 0xFF;
+}
+
+/*
+ * CGB palette data write, at the index in the register before it, which
+ * counts up after the write if its top bit is set.
+ */
+static void pal_write(bus *mem, uint8_t reg, uint8_t val)
+{
+	uint8_t *index = &mem->io[reg - 1];
+
+	(reg == IO_BCPD ? mem->bgpal : mem->objpal)[*index & 0x3F] = val;
+	if (*index & 0x80)
+		*index = 0x80 | ((*index + 1) & 0x3F);
+}
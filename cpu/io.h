@@ -0,0 +1,105 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdint.h>
+
+#include "mem.h"
+
+/*
+ * Timer, LCD timing, serial port, OAM and CGB VRAM DMA and interrupt
+ * flags. Each of them runs off the bus scheduler: state changes that
+ * raise interrupts are events, counters in between are worked out from
+ * the clock when their register is read. A ppu on the bus draws each line
+ * as the LCD timing gets through it. The sound registers go to apu.c on
+ * every machine, which only makes samples with an apu on the bus.
+ *
+ * DMA copies whole runs through the page table instead of a byte per bus
+ * cycle. OAM DMA is done up front and keeps OAM off the CPU's bus until
+ * its cycles are up. A general VRAM DMA is done at once and stalls the
+ * CPU for its length. HBlank DMA copies a block at the start of every
+ * visible HBlank, as an event, and stalls the CPU for that block.
+ */
+
+//I/O registers, offsets into the 0xFF00 page
+#define IO_JOYP		0x00
+#define IO_SB		0x01 //serial data
+#define IO_SC		0x02 //serial control
+#define IO_DIV		0x04
+#define IO_TIMA		0x05
+#define IO_TMA		0x06
+#define IO_TAC		0x07
+#define IO_IF		0x0F //interrupts requested
+#define IO_NR10		0x10 //sound, square 1 sweep
+#define IO_NR11		0x11 //duty and length, every channel's NRx1 is 5 on
+#define IO_NR12		0x12 //envelope
+#define IO_NR13		0x13 //period, low byte
+#define IO_NR14		0x14 //and high bits, length enable and trigger
+#define IO_NR21		0x16 //square 2
+#define IO_NR30		0x1A //wave, DAC power
+#define IO_NR32		0x1C //output level
+#define IO_NR41		0x20 //noise
+#define IO_NR43		0x22 //LFSR clock and width
+#define IO_NR50		0x24 //master volume, left and right
+#define IO_NR51		0x25 //channels to the left and right
+#define IO_NR52		0x26 //sound on, and the channels playing
+#define IO_WAVE		0x30 //wave RAM, 32 4 bit samples, high nibble first
+#define IO_LCDC		0x40
+#define IO_STAT		0x41
+#define IO_SCY		0x42
+#define IO_SCX		0x43
+#define IO_LY		0x44
+#define IO_LYC		0x45
+#define IO_DMA		0x46
+#define IO_BGP		0x47 //DMG palettes
+#define IO_OBP0		0x48
+#define IO_OBP1		0x49
+#define IO_WY		0x4A
+#define IO_WX		0x4B
+#define IO_HDMA1	0x51 //CGB VRAM DMA source, high byte
+#define IO_HDMA2	0x52 //and low
+#define IO_HDMA3	0x53 //destination in VRAM, high byte
+#define IO_HDMA4	0x54 //and low
+#define IO_HDMA5	0x55 //blocks left - 1, bit 7 clear while HBlank DMA runs
+#define IO_BCPS		0x68 //CGB background palette index
+#define IO_BCPD		0x69 //and data
+#define IO_OCPS		0x6A //CGB sprite palette index
+#define IO_OCPD		0x6B
+#define IO_IE		0xFF //interrupts enabled, lives in HRAM
+
+//interrupt bits in IF and IE, by priority
+#define INT_VBLANK	0x01
+#define INT_STAT	0x02
+#define INT_TIMER	0x04
+#define INT_SERIAL	0x08
+#define INT_JOYPAD	0x10
+
+//joypad buttons, high nibble read through P14, low nibble through P15
+#define JOY_RIGHT	0x80
+#define JOY_LEFT	0x40
+#define JOY_UP		0x20
+#define JOY_DOWN	0x10
+#define JOY_START	0x08
+#define JOY_SELECT	0x04
+#define JOY_B		0x02
+#define JOY_A		0x01
+
+//LCD timing in T-cycles
+#define LCD_OAM		80 //mode 2
+#define LCD_XFER	172 //mode 3
+#define LCD_HBLANK	204 //mode 0
+#define LCD_LINE	456
+#define LCD_VISIBLE	144 //lines before VBlank
+#define LCD_LINES	154
+
+#define DMA_CYCLES	640 //OAM DMA, OAM is off the bus meanwhile
+#define HDMA_BLOCK	0x10 //bytes per HBlank, and per block of a general DMA
+#define HDMA_STALL	32 //T-cycles the CPU waits per block
+
+void	init_io(bus *mem);
+uint8_t	io_read(bus *mem, uint8_t reg);
+void	io_write(bus *mem, uint8_t reg, uint8_t val);
+void	io_event(bus *mem, uint8_t ev, uint64_t when);
+void	io_irq(bus *mem, uint8_t bits);
+void	io_joypad(bus *mem, uint8_t held);
+
+#endif
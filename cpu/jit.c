@@ -0,0 +1,1178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "trace.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+//host registers
+#define RAX	0
+#define RCX	1
+#define RDX	2
+#define RBX	3 //registers *
+#define RSP	4
+#define RBP	5 //bus *
+#define RSI	6
+#define RDI	7
+#define R12	12 //R12-R15 hold guest registers
+#define R13	13
+#define R14	14
+#define R15	15
+
+//x86 condition codes for jb, je/jz and jne/jnz
+#define CC_B	0x2
+#define CC_E	0x4
+#define CC_NE	0x5
+
+//stack frame: codegen at entry, then the guest carry flag
+#define SLOT_GEN	0
+#define SLOT_CARRY	4
+
+#define GUEST_A		7
+
+/*
+ * Instruction classes that are translated inline. Everything else goes
+ * through execute_insn.
+ */
+enum {
+	J_NONE, J_NOP, J_LD_R_R, J_LD_R_N, J_LD_R_MHL, J_LD_MHL_R, J_LD_MHL_N,
+	J_LD_RR_NN, J_LD_MRR_A, J_LD_A_MRR, J_INC_RR, J_DEC_RR, J_INC_R, J_DEC_R,
+	J_ALU_R, J_ALU_MHL, J_ALU_N, J_LD_NN_A, J_LD_A_NN, J_LDH_N_A, J_LDH_A_N,
+	J_LD_MC_A, J_LD_A_MC, J_JR, J_JR_CC, J_JP, J_JP_CC
+};
+
+typedef struct {
+	uint8_t		*p; //next byte, may run past lim, nothing is written there
+	uint8_t		*lim;
+	int8_t		host[8]; //host register of guest register i, -1 in memory
+	uint8_t		zknown; //lf holds a recorded op, so Z is lf.res == 0
+	uint8_t		cknown; //the carry slot holds C
+	uint8_t		wrote; //the instruction stored to memory
+	uint16_t	next; //address of the next instruction
+	unsigned	n; //instructions run up to and including this one
+	unsigned	cycles; //T-cycles of those, not counting taken branches
+} emitter;
+
+//guest registers in the B C D E H L (HL) A order of the opcode fields
+static const uint8_t regoff[8] = {
+	offsetof(registers, b), offsetof(registers, c),
+	offsetof(registers, d), offsetof(registers, e),
+	offsetof(registers, h), offsetof(registers, l),
+	offsetof(registers, f), offsetof(registers, a)
+};
+
+//register pairs BC DE HL SP, x86 is little endian like the pair views
+static const uint8_t pairoff[4] = {
+	offsetof(registers, bc), offsetof(registers, de),
+	offsetof(registers, hl), offsetof(registers, sp)
+};
+
+static const uint8_t hostregs[4] = { R12, R13, R14, R15 };
+
+static jitcode	compile(jitcache *jc, blockcache *bc, const block *blk);
+static int	protect(jitcache *jc, uint8_t *from, int prot);
+static uint64_t	run_native(block *blk, bus *mem, registers *reg);
+static uint64_t	lockstep(jitcache *jc, block *blk, bus *mem, registers *reg);
+
+
+/**
+ * Map the code buffer and hook the recompiler into a block cache. It
+ * starts out disabled. The buffer is never writable and executable at
+ * once: compile() opens up the pages it emits into and seals them again.
+ *
+ * Return -1 if the host won't hand out the memory.
+ */
+int init_jit(jitcache *jc, blockcache *bc)
+{
+	void *code;
+
+	memset(jc, 0, sizeof(jitcache));
+
+	code = mmap(NULL, JIT_CODESIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED)
+		return (-1);
+
+	jc->code = (uint8_t *)code;
+	jc->size = JIT_CODESIZE;
+	bc->jit = jc;
+	jit_flush(jc, bc);
+	jc->flushes = 0;
+	return (0);
+}
+
+void free_jit(jitcache *jc, blockcache *bc)
+{
+	if (bc->jit == jc) {
+		jit_flush(jc, bc);
+		bc->jit = NULL;
+	}
+	if (jc->code)
+		munmap(jc->code, jc->size);
+	free(jc->snap);
+	free(jc->sramsnap);
+	memset(jc, 0, sizeof(jitcache));
+}
+
+#else
+
+int init_jit(jitcache *jc, blockcache *bc)
+{
+	memset(jc, 0, sizeof(jitcache));
+	return (-1);
+}
+
+void free_jit(jitcache *jc, blockcache *bc)
+{
+	if (bc->jit == jc)
+		bc->jit = NULL;
+}
+
+#endif
+
+/**
+ * Switch between compiled and interpreted blocks. Compiled code is kept
+ * while switched off.
+ */
+void jit_enable(jitcache *jc, int on)
+{
+	jc->enabled = jc->code && on;
+}
+
+/**
+ * Run the interpreter side by side with every compiled block and compare
+ * register and memory state afterwards. Slow, this copies the bus twice
+ * per block.
+ *
+ * Return -1 if the snapshots can't be allocated.
+ */
+int jit_lockstep(jitcache *jc, int on)
+{
+	if (on && !jc->snap && !(jc->snap = (bus *)malloc(2 * sizeof(bus))))
+		return (-1);
+	jc->lockstep = on != 0;
+	return (0);
+}
+
+/**
+ * Drop all compiled code. Blocks go back to being interpreted and have to
+ * get hot again.
+ */
+void jit_flush(jitcache *jc, blockcache *bc)
+{
+	int i;
+
+	for (i = 0; i < bc->used; i++) {
+		bc->pool[i].native = NULL;
+		bc->pool[i].runs = 0;
+	}
+	jc->used = 0;
+	jc->flushes++;
+}
+
+/**
+ * Run blk as compiled code, compiling it once it's hot. The whole block is
+ * run, so the caller has to leave room for blk->n instructions.
+ *
+ * Return the number of instructions run, -1 if the block wasn't run and
+ * has to be interpreted.
+ */
+long jit_run(jitcache *jc, blockcache *bc, block *blk, bus *mem, registers *reg)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	uint64_t ret;
+
+	if (!jc->enabled)
+		return (-1);
+
+	if (!blk->native) {
+		if (blk->runs == JIT_NEVER || ++blk->runs < JIT_HOT)
+			return (-1);
+		if (!(blk->native = (void *)compile(jc, bc, blk))) {
+			blk->runs = JIT_NEVER;
+			jc->failed++;
+			return (-1);
+		}
+		jc->compiled++;
+	}
+
+	TRACE_END(mem, reg);
+	if (jc->lockstep)
+		ret = lockstep(jc, blk, mem, reg);
+	else
+		ret = run_native(blk, mem, reg);
+	TRACE_BLOCK(mem, blk, (uint32_t)(ret & 0xFFFFFFFF));
+
+	jc->runs++;
+	jc->cycles += ret >> 0x20;
+	return ((long)(ret & 0xFFFFFFFF));
+#else
+	return (-1);
+#endif
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+/*
+ * Compiled code keeps its cycles in the return value, the clock is only
+ * brought up to date around calls out of it.
+ */
+static uint64_t run_native(block *blk, bus *mem, registers *reg)
+{
+	uint64_t ret = ((jitcode)blk->native)(reg, mem);
+
+	mem->sched.now += ret >> 0x20;
+	return (ret);
+}
+
+/*
+ * Calls out of compiled code. The handlers' helpers are inline, these give
+ * them an address and a return value with the upper bits defined.
+ */
+static unsigned jit_rd8(bus *mem, uint16_t addr)
+{
+	return (rd8(mem, addr));
+}
+
+static void jit_wr8(bus *mem, uint16_t addr, uint8_t val)
+{
+	wr8(mem, addr, val);
+}
+
+static unsigned jit_flagz(registers *reg)
+{
+	return (flagz(reg));
+}
+
+static unsigned jit_flagc(registers *reg)
+{
+	return (flagc(reg));
+}
+
+/*
+ * Instruction encoding. Guest values are kept zero extended in 32 bit
+ * host registers, byte ops only show up where the flags need them.
+ */
+static void emit8(emitter *e, uint8_t b)
+{
+	if (e->p < e->lim)
+		*e->p = b;
+	e->p++;
+}
+
+static void emit16(emitter *e, uint16_t v)
+{
+	emit8(e, v & 0xFF);
+	emit8(e, v >> 0x8);
+}
+
+static void emit32(emitter *e, uint32_t v)
+{
+	emit16(e, v & 0xFFFF);
+	emit16(e, v >> 0x10);
+}
+
+static void emit64(emitter *e, uint64_t v)
+{
+	emit32(e, v & 0xFFFFFFFF);
+	emit32(e, v >> 0x20);
+}
+
+/*
+ * REX prefix, left out when it would be empty. Byte ops force it so the
+ * low byte of RSI/RDI/RSP/RBP isn't read as AH-BH.
+ */
+static void rex(emitter *e, int w, int r, int x, int b, int b8)
+{
+	uint8_t v = 0x40 | w << 0x3 | (r & 0x8) >> 0x1 | (x & 0x8) >> 0x2 | (b & 0x8) >> 0x3;
+
+	if (v != 0x40 || b8)
+		emit8(e, v);
+}
+
+static void opcode(emitter *e, int op)
+{
+	if (op > 0xFF)
+		emit8(e, op >> 0x8);
+	emit8(e, op & 0xFF);
+}
+
+/*
+ * op reg, rm with both operands registers. For group opcodes reg is the
+ * /digit.
+ */
+static void x_rr(emitter *e, int w, int b8, int op, int reg, int rm)
+{
+	rex(e, w, reg, 0, rm, b8);
+	opcode(e, op);
+	emit8(e, 0xC0 | (reg & 0x7) << 0x3 | (rm & 0x7));
+}
+
+/*
+ * op reg, [base + disp].
+ */
+static void x_mem(emitter *e, int w, int b8, int op, int reg, int base, int32_t disp)
+{
+	int short_disp = disp >= -128 && disp < 128;
+
+	rex(e, w, reg, 0, base, b8);
+	opcode(e, op);
+	emit8(e, (short_disp ? 0x40 : 0x80) | (reg & 0x7) << 0x3 | (base & 0x7));
+	if ((base & 0x7) == RSP)
+		emit8(e, 0x24);
+	if (short_disp)
+		emit8(e, disp);
+	else
+		emit32(e, disp);
+}
+
+/*
+ * op reg, [base + index << scale + disp].
+ */
+static void x_sib(emitter *e, int w, int b8, int op, int reg, int base, int index,
+    int scale, int32_t disp)
+{
+	int nodisp = disp == 0 && (base & 0x7) != RBP;
+
+	rex(e, w, reg, index, base, b8);
+	opcode(e, op);
+	emit8(e, (nodisp ? 0x04 : 0x84) | (reg & 0x7) << 0x3);
+	emit8(e, scale << 0x6 | (index & 0x7) << 0x3 | (base & 0x7));
+	if (!nodisp)
+		emit32(e, disp);
+}
+
+//ALU op /digit on a 32 bit register: ADD 0, OR 1, AND 4, SUB 5, XOR 6, CMP 7
+static void x_ri(emitter *e, int ext, int rm, int32_t imm)
+{
+	if (imm >= -128 && imm < 128) {
+		x_rr(e, 0, 0, 0x83, ext, rm);
+		emit8(e, imm);
+	} else {
+		x_rr(e, 0, 0, 0x81, ext, rm);
+		emit32(e, imm);
+	}
+}
+
+//SHL 4, SHR 5
+static void x_shift(emitter *e, int ext, int rm, uint8_t n)
+{
+	x_rr(e, 0, 0, 0xC1, ext, rm);
+	emit8(e, n);
+}
+
+static void x_movi(emitter *e, int r, uint32_t imm)
+{
+	rex(e, 0, 0, 0, r, 0);
+	emit8(e, 0xB8 + (r & 0x7));
+	emit32(e, imm);
+}
+
+static void x_movi64(emitter *e, int r, uint64_t imm)
+{
+	rex(e, 1, 0, 0, r, 0);
+	emit8(e, 0xB8 + (r & 0x7));
+	emit64(e, imm);
+}
+
+static void x_call(emitter *e, uintptr_t fn)
+{
+	x_movi64(e, RAX, fn);
+	x_rr(e, 0, 0, 0xFF, 2, RAX);
+}
+
+static void x_push(emitter *e, int r)
+{
+	rex(e, 0, 0, 0, r, 0);
+	emit8(e, 0x50 + (r & 0x7));
+}
+
+static void x_pop(emitter *e, int r)
+{
+	rex(e, 0, 0, 0, r, 0);
+	emit8(e, 0x58 + (r & 0x7));
+}
+
+/*
+ * Forward jumps. The rel32 is filled in by x_here once the target is
+ * emitted.
+ */
+static uint8_t *x_jcc(emitter *e, int cc)
+{
+	emit8(e, 0x0F);
+	emit8(e, 0x80 | cc);
+	emit32(e, 0);
+	return (e->p - 4);
+}
+
+static uint8_t *x_jmp(emitter *e)
+{
+	emit8(e, 0xE9);
+	emit32(e, 0);
+	return (e->p - 4);
+}
+
+static void x_here(emitter *e, uint8_t *rel)
+{
+	int32_t d = (int32_t)(e->p - (rel + 4));
+
+	if (rel + 4 <= e->lim)
+		memcpy(rel, &d, 4);
+}
+
+/*
+ * Guest register r into scratch register dst.
+ */
+static void get8(emitter *e, int dst, int r)
+{
+	if (e->host[r] >= 0)
+		x_rr(e, 0, 0, 0x89, e->host[r], dst);
+	else
+		x_mem(e, 0, 0, 0x0FB6, dst, RBX, regoff[r]);
+}
+
+/*
+ * Low byte of scratch register src into guest register r.
+ */
+static void put8(emitter *e, int r, int src)
+{
+	if (e->host[r] >= 0)
+		x_rr(e, 0, 1, 0x0FB6, e->host[r], src);
+	else
+		x_mem(e, 0, 1, 0x88, src, RBX, regoff[r]);
+}
+
+/*
+ * Register pair p (BC DE HL SP) into dst, tmp is clobbered.
+ */
+static void get16(emitter *e, int dst, int tmp, uint8_t p)
+{
+	if (p == 3 || (e->host[2 * p] < 0 && e->host[2 * p + 1] < 0)) {
+		x_mem(e, 0, 0, 0x0FB7, dst, RBX, pairoff[p]);
+		return;
+	}
+	get8(e, dst, 2 * p);
+	x_shift(e, 4, dst, 0x8);
+	get8(e, tmp, 2 * p + 1);
+	x_rr(e, 0, 0, 0x09, tmp, dst);
+}
+
+/*
+ * Low 16 bits of src into register pair p, src is clobbered.
+ */
+static void put16(emitter *e, uint8_t p, int src)
+{
+	if (p == 3 || (e->host[2 * p] < 0 && e->host[2 * p + 1] < 0)) {
+		emit8(e, 0x66);
+		x_mem(e, 0, 0, 0x89, src, RBX, pairoff[p]);
+		return;
+	}
+	put8(e, 2 * p + 1, src);
+	x_shift(e, 5, src, 0x8);
+	put8(e, 2 * p, src);
+}
+
+static void spill(emitter *e)
+{
+	int r;
+
+	for (r = 0; r < 8; r++)
+		if (e->host[r] >= 0)
+			x_mem(e, 0, 1, 0x88, e->host[r], RBX, regoff[r]);
+}
+
+static void reload(emitter *e)
+{
+	int r;
+
+	for (r = 0; r < 8; r++)
+		if (e->host[r] >= 0)
+			x_mem(e, 0, 0, 0x0FB6, e->host[r], RBX, regoff[r]);
+}
+
+/*
+ * Add (ext 0) or subtract (ext 5) the cycles so far to the bus clock, so
+ * a call out sees the time the interpreter would have.
+ */
+static void emit_clock(emitter *e, int ext)
+{
+	x_mem(e, 1, 0, 0x81, ext, RBP, offsetof(bus, sched.now));
+	emit32(e, e->cycles);
+}
+
+/*
+ * Read the byte at the address in ECX into EAX. Mapped pages are read
+ * inline through the page table, callbacks are called.
+ */
+static void emit_rd(emitter *e)
+{
+	uint8_t *slow, *done;
+
+	x_rr(e, 0, 0, 0x89, RCX, RAX);
+	x_shift(e, 5, RAX, 0x8);
+	x_sib(e, 1, 0, 0x8B, RDX, RBP, RAX, 3, offsetof(bus, rd));
+	x_rr(e, 1, 0, 0x85, RDX, RDX);
+	slow = x_jcc(e, CC_E);
+	x_rr(e, 0, 1, 0x0FB6, RSI, RCX);
+	x_sib(e, 0, 0, 0x0FB6, RAX, RDX, RSI, 0, 0);
+	done = x_jmp(e);
+
+	x_here(e, slow);
+	emit_clock(e, 0);
+	x_rr(e, 1, 0, 0x89, RBP, RDI);
+	x_rr(e, 0, 0, 0x89, RCX, RSI);
+	x_call(e, (uintptr_t)jit_rd8);
+	emit_clock(e, 5);
+	x_here(e, done);
+}
+
+/*
+ * Write AL to the address in ECX. Watched pages have no write pointer, so
+ * stores that can hit cached code always take the call. Traced builds
+ * always call, for the tracer to see every store.
+ */
+static void emit_wr(emitter *e)
+{
+#ifndef TRACE
+	uint8_t *slow, *done;
+
+	x_rr(e, 0, 0, 0x89, RCX, RSI);
+	x_shift(e, 5, RSI, 0x8);
+	x_sib(e, 1, 0, 0x8B, RDX, RBP, RSI, 3, offsetof(bus, wr));
+	x_rr(e, 1, 0, 0x85, RDX, RDX);
+	slow = x_jcc(e, CC_E);
+	x_rr(e, 0, 1, 0x0FB6, RSI, RCX);
+	x_sib(e, 0, 1, 0x88, RAX, RDX, RSI, 0, 0);
+	done = x_jmp(e);
+
+	x_here(e, slow);
+#endif
+	emit_clock(e, 0);
+	x_rr(e, 0, 0, 0x89, RAX, RDX);
+	x_rr(e, 0, 0, 0x89, RCX, RSI);
+	x_rr(e, 1, 0, 0x89, RBP, RDI);
+	x_call(e, (uintptr_t)jit_wr8);
+	emit_clock(e, 5);
+#ifndef TRACE
+	x_here(e, done);
+#endif
+
+	e->wrote = 0x1;
+}
+
+/*
+ * Leave the block: registers back to memory, the guest PC, and the count
+ * of what ran. pc -1 keeps the PC an interpreted instruction left.
+ */
+static void emit_exit(emitter *e, int pc, unsigned n, unsigned cycles)
+{
+	spill(e);
+	if (pc >= 0) {
+		emit8(e, 0x66);
+		x_mem(e, 0, 0, 0xC7, 0, RBX, offsetof(registers, pc));
+		emit16(e, pc);
+	}
+	x_movi64(e, RAX, (uint64_t)cycles << 0x20 | n);
+	x_rr(e, 1, 0, 0x83, 0, RSP);
+	emit8(e, 0x8);
+	x_pop(e, R15);
+	x_pop(e, R14);
+	x_pop(e, R13);
+	x_pop(e, R12);
+	x_pop(e, RBP);
+	x_pop(e, RBX);
+	emit8(e, 0xC3);
+}
+
+/*
+ * Stop after this instruction if the bus bumped codegen or the write
+ * moved the next deadline up, the way the block executor does.
+ */
+static void emit_gencheck(emitter *e)
+{
+	uint8_t *changed, *early;
+
+	x_mem(e, 0, 0, 0x8B, RAX, RBP, offsetof(bus, codegen));
+	x_mem(e, 0, 0, 0x3B, RAX, RSP, SLOT_GEN);
+	changed = x_jcc(e, CC_NE);
+	x_mem(e, 1, 0, 0x8B, RAX, RBP, offsetof(bus, sched.now));
+	x_rr(e, 1, 0, 0x81, 0, RAX);
+	emit32(e, e->cycles);
+	x_mem(e, 1, 0, 0x3B, RAX, RBP, offsetof(bus, sched.next));
+	early = x_jcc(e, CC_B);
+	x_here(e, changed);
+	emit_exit(e, e->next, e->n, e->cycles);
+	x_here(e, early);
+}
+
+/*
+ * Make the carry slot valid. Ops translated in this block put their carry
+ * there, before the first one it comes from the lazy flags.
+ */
+static void emit_carry(emitter *e)
+{
+	if (e->cknown)
+		return;
+	x_rr(e, 1, 0, 0x89, RBX, RDI);
+	x_call(e, (uintptr_t)jit_flagc);
+	x_mem(e, 0, 1, 0x88, RAX, RSP, SLOT_CARRY);
+	e->cknown = 0x1;
+}
+
+/*
+ * Condition cc (NZ Z NC C) into EAX as 0 or 1.
+ */
+static void emit_cond(emitter *e, uint8_t opc)
+{
+	uint8_t cc = OPY(opc) & 0x3;
+
+	if (cc < 2) {
+		if (e->zknown) {
+			x_mem(e, 0, 0, 0x80, 7, RBX, offsetof(registers, lf.res));
+			emit8(e, 0);
+			x_rr(e, 0, 1, 0x0F94, 0, RAX);
+			x_rr(e, 0, 1, 0x0FB6, RAX, RAX);
+		} else {
+			x_rr(e, 1, 0, 0x89, RBX, RDI);
+			x_call(e, (uintptr_t)jit_flagz);
+		}
+	} else {
+		emit_carry(e);
+		x_mem(e, 0, 0, 0x0FB6, RAX, RSP, SLOT_CARRY);
+	}
+	if (!(cc & 0x1))
+		x_ri(e, 6, RAX, 1);
+}
+
+/*
+ * Record a lazy flag op: operands in AL and CL, result in DL.
+ */
+static void emit_lf(emitter *e, uint8_t op, int res, uint8_t c)
+{
+	x_mem(e, 0, 1, 0x88, RAX, RBX, offsetof(registers, lf.a));
+	x_mem(e, 0, 1, 0x88, RCX, RBX, offsetof(registers, lf.b));
+	x_mem(e, 0, 1, 0x88, res, RBX, offsetof(registers, lf.res));
+	x_mem(e, 0, 0, 0xC6, 0, RBX, offsetof(registers, lf.op));
+	emit8(e, op);
+	x_mem(e, 0, 0, 0xC6, 0, RBX, offsetof(registers, lf.c));
+	emit8(e, c);
+}
+
+/*
+ * A op= ECX for ADD SUB AND XOR OR CP. The ops are done on byte registers
+ * so the host carry is the guest carry.
+ */
+static void emit_alu(emitter *e, uint8_t y)
+{
+	static const uint8_t hostop[8] = { 0x00, 0, 0x28, 0, 0x20, 0x30, 0x08, 0x28 };
+	static const uint8_t lfop[8] = { LF_ADD, 0, LF_SUB, 0, LF_AND, LF_OR, LF_OR, LF_SUB };
+
+	get8(e, RAX, GUEST_A);
+	x_rr(e, 0, 0, 0x89, RAX, RDX);
+	x_rr(e, 0, 1, hostop[y], RCX, RDX);
+	if (y == 0 || y == 2 || y == 7) {
+		x_mem(e, 0, 0, 0x0F92, 0, RSP, SLOT_CARRY);
+	} else {
+		x_mem(e, 0, 0, 0xC6, 0, RSP, SLOT_CARRY);
+		emit8(e, 0);
+	}
+	emit_lf(e, lfop[y], RDX, 0);
+	if (y != 7)
+		put8(e, GUEST_A, RDX);
+	e->zknown = 0x1;
+	e->cknown = 0x1;
+}
+
+/*
+ * INC r / DEC r, the carry is left alone.
+ */
+static void emit_incdec(emitter *e, uint8_t r, int dec)
+{
+	emit_carry(e);
+	get8(e, RAX, r);
+	x_movi(e, RCX, 1);
+	x_rr(e, 0, 0, 0x89, RAX, RDX);
+	x_rr(e, 0, 1, dec ? 0x28 : 0x00, RCX, RDX);
+	emit_lf(e, dec ? LF_DEC : LF_INC, RDX, 0);
+	x_mem(e, 0, 0, 0x0FB6, RSI, RSP, SLOT_CARRY);
+	x_mem(e, 0, 1, 0x88, RSI, RBX, offsetof(registers, lf.c));
+	put8(e, r, RDX);
+	e->zknown = 0x1;
+}
+
+/*
+ * HL+ or HL- after LD (HL+),A and friends.
+ */
+static void emit_hlstep(emitter *e, uint8_t p)
+{
+	if (p < 2)
+		return;
+	get16(e, RCX, RDX, 2);
+	x_ri(e, p == 2 ? 0 : 5, RCX, 1);
+	put16(e, 2, RCX);
+}
+
+static int classify(uint8_t opc)
+{
+	switch (OPX(opc)) {
+	case 0:
+		switch (OPZ(opc)) {
+		case 0:
+			if (opc == 0x00)
+				return (J_NOP);
+			if (opc == 0x18)
+				return (J_JR);
+			return (OPY(opc) >= 4 ? J_JR_CC : J_NONE);
+		case 1: return (OPQ(opc) ? J_NONE : J_LD_RR_NN);
+		case 2: return (OPQ(opc) ? J_LD_A_MRR : J_LD_MRR_A);
+		case 3: return (OPQ(opc) ? J_DEC_RR : J_INC_RR);
+		case 4: return (OPY(opc) == 6 ? J_NONE : J_INC_R);
+		case 5: return (OPY(opc) == 6 ? J_NONE : J_DEC_R);
+		case 6: return (OPY(opc) == 6 ? J_LD_MHL_N : J_LD_R_N);
+		default: return (J_NONE);
+		}
+	case 1:
+		if (opc == 0x76)
+			return (J_NONE);
+		if (OPZ(opc) == 6)
+			return (J_LD_R_MHL);
+		return (OPY(opc) == 6 ? J_LD_MHL_R : J_LD_R_R);
+	case 2:
+		//ADC and SBC need the carry in, they're left to the handlers
+		if (OPY(opc) == 1 || OPY(opc) == 3)
+			return (J_NONE);
+		return (OPZ(opc) == 6 ? J_ALU_MHL : J_ALU_R);
+	default:
+		switch (opc) {
+		case 0xC3: return (J_JP);
+		case 0xC2: case 0xCA: case 0xD2: case 0xDA: return (J_JP_CC);
+		case 0xC6: case 0xD6: case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+			return (J_ALU_N);
+		case 0xE0: return (J_LDH_N_A);
+		case 0xF0: return (J_LDH_A_N);
+		case 0xE2: return (J_LD_MC_A);
+		case 0xF2: return (J_LD_A_MC);
+		case 0xEA: return (J_LD_NN_A);
+		case 0xFA: return (J_LD_A_NN);
+		default: return (J_NONE);
+		}
+	}
+}
+
+/*
+ * Count how often the translated instructions touch each guest register.
+ */
+static void uses(uint8_t opc, unsigned cnt[8])
+{
+	uint8_t p = OPP(opc);
+
+	switch (classify(opc)) {
+	case J_LD_R_R: cnt[OPY(opc)]++; cnt[OPZ(opc)]++; break;
+	case J_LD_R_N:
+	case J_INC_R:
+	case J_DEC_R: cnt[OPY(opc)]++; break;
+	case J_LD_R_MHL: cnt[OPY(opc)]++; cnt[4]++; cnt[5]++; break;
+	case J_LD_MHL_R: cnt[OPZ(opc)]++; cnt[4]++; cnt[5]++; break;
+	case J_LD_MHL_N: cnt[4]++; cnt[5]++; break;
+	case J_LD_RR_NN:
+	case J_INC_RR:
+	case J_DEC_RR:
+		if (p < 3) {
+			cnt[2 * p]++;
+			cnt[2 * p + 1]++;
+		}
+		break;
+	case J_LD_MRR_A:
+	case J_LD_A_MRR:
+		p = p & 0x2 ? 2 : p;
+		cnt[2 * p]++;
+		cnt[2 * p + 1]++;
+		cnt[GUEST_A]++;
+		break;
+	case J_ALU_R: cnt[GUEST_A]++; cnt[OPZ(opc)]++; break;
+	case J_ALU_MHL: cnt[GUEST_A]++; cnt[4]++; cnt[5]++; break;
+	case J_LD_MC_A:
+	case J_LD_A_MC: cnt[GUEST_A]++; cnt[1]++; break;
+	case J_ALU_N:
+	case J_LD_NN_A:
+	case J_LD_A_NN:
+	case J_LDH_N_A:
+	case J_LDH_A_N: cnt[GUEST_A]++; break;
+	}
+}
+
+/*
+ * Give the most used guest registers of the block the host registers.
+ */
+static void allocate(emitter *e, const block *blk)
+{
+	unsigned cnt[8] = { 0 };
+	int i, r, best;
+
+	for (i = 0; i < blk->n; i++)
+		if (blk->code[i].opc != 0xCB)
+			uses(blk->code[i].opc, cnt);
+
+	memset(e->host, -1, sizeof(e->host));
+	for (i = 0; i < 4; i++) {
+		best = -1;
+		for (r = 0; r < 8; r++)
+			if (e->host[r] < 0 && cnt[r] && (best < 0 || cnt[r] > cnt[best]))
+				best = r;
+		if (best < 0)
+			break;
+		e->host[best] = hostregs[i];
+	}
+}
+
+/*
+ * Conditional exit: taken to target with the extra cycles, otherwise fall
+ * out to the next instruction.
+ */
+static void emit_branch(emitter *e, uint8_t opc, uint16_t target, unsigned extra)
+{
+	uint8_t *skip;
+
+	emit_cond(e, opc);
+	x_rr(e, 0, 0, 0x85, RAX, RAX);
+	skip = x_jcc(e, CC_E);
+	emit_exit(e, target, e->n, e->cycles + extra);
+	x_here(e, skip);
+	emit_exit(e, e->next, e->n, e->cycles);
+}
+
+/*
+ * Translate one instruction.
+ *
+ * Return 1 if it left the block on every path, 0 if it falls through and
+ * -1 if it has to be interpreted.
+ */
+static int emit_insn(emitter *e, const insn *in)
+{
+	uint8_t opc = in->opc;
+	uint8_t p = OPP(opc);
+
+	switch (classify(opc)) {
+	case J_NOP:
+		break;
+	case J_LD_R_R:
+		get8(e, RAX, OPZ(opc));
+		put8(e, OPY(opc), RAX);
+		break;
+	case J_LD_R_N:
+		x_movi(e, RAX, in->imm & 0xFF);
+		put8(e, OPY(opc), RAX);
+		break;
+	case J_LD_R_MHL:
+		get16(e, RCX, RDX, 2);
+		emit_rd(e);
+		put8(e, OPY(opc), RAX);
+		break;
+	case J_LD_MHL_R:
+		get16(e, RCX, RDX, 2);
+		get8(e, RAX, OPZ(opc));
+		emit_wr(e);
+		break;
+	case J_LD_MHL_N:
+		get16(e, RCX, RDX, 2);
+		x_movi(e, RAX, in->imm & 0xFF);
+		emit_wr(e);
+		break;
+	case J_LD_RR_NN:
+		x_movi(e, RAX, in->imm);
+		put16(e, p, RAX);
+		break;
+	case J_LD_MRR_A:
+		get16(e, RCX, RDX, p & 0x2 ? 2 : p);
+		get8(e, RAX, GUEST_A);
+		emit_wr(e);
+		emit_hlstep(e, p);
+		break;
+	case J_LD_A_MRR:
+		get16(e, RCX, RDX, p & 0x2 ? 2 : p);
+		emit_rd(e);
+		put8(e, GUEST_A, RAX);
+		emit_hlstep(e, p);
+		break;
+	case J_INC_RR:
+	case J_DEC_RR:
+		get16(e, RCX, RDX, p);
+		x_ri(e, OPQ(opc) ? 5 : 0, RCX, 1);
+		put16(e, p, RCX);
+		break;
+	case J_INC_R:
+		emit_incdec(e, OPY(opc), 0);
+		break;
+	case J_DEC_R:
+		emit_incdec(e, OPY(opc), 1);
+		break;
+	case J_ALU_R:
+		get8(e, RCX, OPZ(opc));
+		emit_alu(e, OPY(opc));
+		break;
+	case J_ALU_MHL:
+		get16(e, RCX, RDX, 2);
+		emit_rd(e);
+		x_rr(e, 0, 0, 0x89, RAX, RCX);
+		emit_alu(e, OPY(opc));
+		break;
+	case J_ALU_N:
+		x_movi(e, RCX, in->imm & 0xFF);
+		emit_alu(e, OPY(opc));
+		break;
+	case J_LD_NN_A:
+		x_movi(e, RCX, in->imm);
+		get8(e, RAX, GUEST_A);
+		emit_wr(e);
+		break;
+	case J_LD_A_NN:
+		x_movi(e, RCX, in->imm);
+		emit_rd(e);
+		put8(e, GUEST_A, RAX);
+		break;
+	case J_LDH_N_A:
+		x_movi(e, RCX, 0xFF00 | (in->imm & 0xFF));
+		get8(e, RAX, GUEST_A);
+		emit_wr(e);
+		break;
+	case J_LDH_A_N:
+		x_movi(e, RCX, 0xFF00 | (in->imm & 0xFF));
+		emit_rd(e);
+		put8(e, GUEST_A, RAX);
+		break;
+	case J_LD_MC_A:
+		get8(e, RCX, 1);
+		x_ri(e, 1, RCX, 0xFF00);
+		get8(e, RAX, GUEST_A);
+		emit_wr(e);
+		break;
+	case J_LD_A_MC:
+		get8(e, RCX, 1);
+		x_ri(e, 1, RCX, 0xFF00);
+		emit_rd(e);
+		put8(e, GUEST_A, RAX);
+		break;
+	case J_JR:
+		emit_exit(e, (uint16_t)(e->next + (int8_t)in->imm), e->n, e->cycles);
+		return (1);
+	case J_JR_CC:
+		emit_branch(e, opc, e->next + (int8_t)in->imm, 4);
+		return (1);
+	case J_JP:
+		emit_exit(e, in->imm, e->n, e->cycles);
+		return (1);
+	case J_JP_CC:
+		emit_branch(e, opc, in->imm, 4);
+		return (1);
+	default:
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Call the handler for an instruction that isn't translated. The guest
+ * registers go through memory around the call and nothing is known about
+ * the flags afterwards.
+ */
+static void emit_fallback(emitter *e, const insn *in)
+{
+	spill(e);
+	emit8(e, 0x66);
+	x_mem(e, 0, 0, 0xC7, 0, RBX, offsetof(registers, pc));
+	emit16(e, e->next);
+	x_rr(e, 1, 0, 0x89, RBP, RDI);
+	x_rr(e, 1, 0, 0x89, RBX, RSI);
+	x_movi(e, RDX, in->opc);
+	x_movi(e, RCX, in->imm);
+	emit_clock(e, 0);
+	x_call(e, (uintptr_t)execute_insn);
+	emit_clock(e, 5);
+	reload(e);
+	e->zknown = 0x0;
+	e->cknown = 0x0;
+	e->wrote = 0x1;
+}
+
+/*
+ * Translate blk into the code buffer.
+ *
+ * Return the entry point, NULL if the block can't be compiled.
+ */
+static jitcode compile(jitcache *jc, blockcache *bc, const block *blk)
+{
+	emitter e;
+	uint8_t *start;
+	const insn *in = blk->code;
+	int i, left = 0, interp = 0;
+
+	if (jc->size - jc->used < JIT_BLOCKMAX)
+		jit_flush(jc, bc);
+
+	start = jc->code + jc->used;
+	if (protect(jc, start, PROT_READ | PROT_WRITE) < 0)
+		return (NULL);
+	e.p = start;
+	e.lim = jc->code + jc->size;
+	e.zknown = 0x0;
+	e.cknown = 0x0;
+	e.next = blk->pc;
+	e.n = 0;
+	e.cycles = 0;
+	allocate(&e, blk);
+
+	//SysV frame: callee saved registers, then codegen and the carry slot
+	x_push(&e, RBX);
+	x_push(&e, RBP);
+	x_push(&e, R12);
+	x_push(&e, R13);
+	x_push(&e, R14);
+	x_push(&e, R15);
+	x_rr(&e, 1, 0, 0x83, 5, RSP);
+	emit8(&e, 0x8);
+	x_rr(&e, 1, 0, 0x89, RDI, RBX);
+	x_rr(&e, 1, 0, 0x89, RSI, RBP);
+	x_mem(&e, 0, 0, 0x8B, RAX, RBP, offsetof(bus, codegen));
+	x_mem(&e, 0, 0, 0x89, RAX, RSP, SLOT_GEN);
+	reload(&e);
+
+	for (i = 0; i < blk->n && !left; i++) {
+		in = &blk->code[i];
+		e.next += in->len;
+		e.n++;
+		e.cycles += in->cycles;
+		e.wrote = 0x0;
+
+		interp = 0;
+		if ((left = emit_insn(&e, in)) < 0) {
+			emit_fallback(&e, in);
+			left = 0;
+			interp = 1;
+		}
+		if (!left && e.wrote && i + 1 < blk->n)
+			emit_gencheck(&e);
+	}
+
+	//an interpreted jump, call or return decides the PC itself, and
+	//puts the taken cycles on the clock
+	if (!left)
+		emit_exit(&e, interp ? -1 : e.next, e.n, e.cycles);
+
+	//blocks sharing the pages can't run any more if they stay writable
+	if (protect(jc, start, PROT_READ | PROT_EXEC) < 0) {
+		jit_flush(jc, bc);
+		jc->enabled = 0;
+		return (NULL);
+	}
+	if (e.p > e.lim)
+		return (NULL);
+	jc->used = e.p - jc->code;
+	return ((jitcode)(void *)start);
+}
+
+/*
+ * Set prot on the buffer from the page holding from to its end, all a
+ * block can be emitted into.
+ *
+ * Return -1 if the host refuses.
+ */
+static int protect(jitcache *jc, uint8_t *from, int prot)
+{
+	uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uint8_t *at = (uint8_t *)((uintptr_t)from & ~(page - 1));
+
+	return (mprotect(at, jc->code + jc->size - at, prot));
+}
+
+/*
+ * Run a compiled block, then rerun it in the interpreter from the same
+ * state and compare. The interpreter run has the write hook unplugged so
+ * the block cache only sees the compiled run, and the compiled run's state
+ * is what's kept.
+ */
+static uint64_t lockstep(jitcache *jc, block *blk, bus *mem, registers *reg)
+{
+	bus *before = &jc->snap[0], *after = &jc->snap[1];
+	registers r0 = *reg, r1, r2;
+	uint32_t sramsize = mem->sramsize;
+	uint16_t pc = blk->pc;
+	uint64_t ret;
+	long n;
+	int bad = 0;
+
+	if (sramsize > jc->sramcap) {
+		free(jc->sramsnap);
+		if (!(jc->sramsnap = (uint8_t *)malloc(2 * (size_t)sramsize))) {
+			jc->sramcap = 0;
+			return (run_native(blk, mem, reg));
+		}
+		jc->sramcap = sramsize;
+	}
+
+	memcpy(before, mem, sizeof(bus));
+	if (sramsize)
+		memcpy(jc->sramsnap, mem->sram, sramsize);
+
+	ret = run_native(blk, mem, reg);
+
+	r1 = *reg;
+	memcpy(after, mem, sizeof(bus));
+	if (sramsize) {
+		memcpy(jc->sramsnap + sramsize, mem->sram, sramsize);
+		memcpy(mem->sram, jc->sramsnap, sramsize);
+	}
+	memcpy(mem, before, sizeof(bus));
+	mem->onwrite = NULL;
+	mem->apu = NULL; //and made the sound
+#ifdef TRACE
+	mem->trace = NULL; //the compiled run was traced
+#endif
+	*reg = r0;
+
+	//no events, the compiled run didn't fire any either
+	for (n = ret & 0xFFFFFFFF; n > 0; n--)
+		fetch_decode(mem, reg);
+
+	r2 = *reg;
+	if (r1.a != r2.a || r1.b != r2.b || r1.c != r2.c || r1.d != r2.d ||
+	    r1.e != r2.e || r1.h != r2.h || r1.l != r2.l || r1.sp != r2.sp ||
+	    r1.pc != r2.pc || r1.ime != r2.ime || r1.halt != r2.halt ||
+	    getf(&r1) != getf(&r2))
+		bad = 1;
+	//banking state, the clock and all of RAM, the page tables may
+	//legitimately differ
+	if (memcmp((uint8_t *)mem + offsetof(bus, mbc), (uint8_t *)after + offsetof(bus, mbc),
+	    sizeof(bus) - offsetof(bus, mbc)) != 0)
+		bad = 1;
+	if (memcmp(&mem->sched, &after->sched, sizeof(scheduler)) != 0)
+		bad = 1;
+	if (sramsize && memcmp(mem->sram, jc->sramsnap + sramsize, sramsize) != 0)
+		bad = 1;
+
+	if (bad) {
+		jc->mismatches++;
+		fprintf(stderr, "jit: block %04x diverges after %u insns\n"
+		    "  jit  pc %04x sp %04x a %02x f %02x bc %02x%02x de %02x%02x hl %02x%02x\n"
+		    "  interp pc %04x sp %04x a %02x f %02x bc %02x%02x de %02x%02x hl %02x%02x\n",
+		    pc, (unsigned)(ret & 0xFFFFFFFF),
+		    r1.pc, r1.sp, r1.a, getf(&r1), r1.b, r1.c, r1.d, r1.e, r1.h, r1.l,
+		    r2.pc, r2.sp, r2.a, getf(&r2), r2.b, r2.c, r2.d, r2.e, r2.h, r2.l);
+		//stays interpreted from now on
+		blk->native = NULL;
+		blk->runs = JIT_NEVER;
+	}
+
+	memcpy(mem, after, sizeof(bus));
+	if (sramsize)
+		memcpy(mem->sram, jc->sramsnap + sramsize, sramsize);
+	*reg = r1;
+	return (ret);
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "block.h"
+
+/*
+ * x86-64 recompiler for hot blocks. A block that has run JIT_HOT times out
+ * of the block cache is translated into host code: loads, stores, 8 bit
+ * ALU ops and jumps are emitted inline, the guest registers a block uses
+ * most live in host registers, and anything else calls back into the
+ * interpreter's handlers. Compiled code writes the same lazy flag records
+ * as the handlers, so both can run the same machine interchangeably.
+ *
+ * A compiled block runs to its end or to the first instruction that makes
+ * the bus bump codegen, exactly where the block executor would stop. It
+ * returns the instructions and T-cycles it ran. Blocks dropped from the
+ * cache leave their code behind until the buffer fills up and is flushed.
+ *
+ * Other hosts get stubs that never compile anything.
+ */
+#define JIT_CODESIZE	(1 << 20) //executable buffer
+#define JIT_BLOCKMAX	0x4000 //room a block needs before the buffer is flushed
+#define JIT_HOT		16 //runs before a block is compiled
+#define JIT_NEVER	0xFFFF //runs of a block that can't be compiled
+
+//compiled block: cycles << 32 | instructions
+typedef uint64_t (*jitcode)(registers *reg, bus *mem);
+
+typedef struct jitcache {
+	uint8_t		*code; //executable buffer
+	size_t		size;
+	size_t		used;
+	uint8_t		enabled; //run compiled blocks
+	uint8_t		lockstep; //check every block against the interpreter
+	uint64_t	cycles; //T-cycles run in compiled code
+	unsigned long	compiled;
+	unsigned long	failed;
+	unsigned long	runs;
+	unsigned long	flushes;
+	unsigned long	mismatches;
+	bus		*snap; //lockstep: state before and after a block
+	uint8_t		*sramsnap;
+	uint32_t	sramcap;
+} jitcache;
+
+int	init_jit(jitcache *jc, blockcache *bc);
+void	free_jit(jitcache *jc, blockcache *bc);
+void	jit_enable(jitcache *jc, int on);
+int	jit_lockstep(jitcache *jc, int on);
+long	jit_run(jitcache *jc, blockcache *bc, block *blk, bus *mem, registers *reg);
+void	jit_flush(jitcache *jc, blockcache *bc);
+
+#endif
@@ -0,0 +1,821 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "machine.h"
+#include "ppu.h"
+#include "apu.h"
+#include "telemetry.h"
+
+#define HUGEPAGE	0x200000 //2M, what MAP_HUGETLB gives by default
+
+static void	start_caches(machine *m, int flags);
+static void	onwrite(bus *mem, uint16_t addr, uint16_t len, uint8_t watch);
+static void	*relocate(const void *p, const machine *src, machine *dst);
+static uint32_t	nchunks(const machine *m);
+static uint8_t	*chunk_ram(machine *m, uint32_t i);
+static int	chunk_of(const machine *m, const uint8_t *p);
+static void	chunk_release(statechunk *c);
+static void	arm_dirty(machine *m);
+static int	ram_code(const machine *m);
+static void	save_core(machine *m, statecore *core);
+static void	load_core(machine *m, const statecore *core, uint8_t keep);
+static uint32_t	fnv(uint32_t h, const void *p, size_t len);
+static uint64_t	snap_start(const machine *m);
+static void	snap_end(machine *m, int kind, uint64_t start);
+
+//button names in input scripts, by JOY_* bit
+static const struct {
+	const char	*name;
+	uint8_t		bit;
+} buttons[] = {
+	{ "right", JOY_RIGHT }, { "left", JOY_LEFT }, { "up", JOY_UP },
+	{ "down", JOY_DOWN }, { "start", JOY_START }, { "select", JOY_SELECT },
+	{ "b", JOY_B }, { "a", JOY_A }
+};
+
+
+/**
+ * Map the arena for a machine, page aligned so it never shares a cache
+ * line with another one. With MACHINE_HUGE it's backed by huge pages
+ * when the host has them to spare, and hinted to be otherwise.
+ *
+ * Return NULL if there's no memory for it.
+ */
+machine *machine_new(int flags)
+{
+	size_t page = sysconf(_SC_PAGESIZE), size;
+	void *p = MAP_FAILED;
+	machine *m;
+
+#ifdef MAP_HUGETLB
+	if (flags & MACHINE_HUGE) {
+		size = (sizeof(machine) + HUGEPAGE - 1) & ~(size_t)(HUGEPAGE - 1);
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif
+	if (p == MAP_FAILED) {
+		size = (sizeof(machine) + page - 1) & ~(page - 1);
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return (NULL);
+#ifdef MADV_HUGEPAGE
+		if (flags & MACHINE_HUGE)
+			madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	m = (machine *)p;
+	m->arena = size;
+	return (m);
+}
+
+/**
+ * Unmap a machine from machine_new(), closed or never opened.
+ */
+void machine_delete(machine *m)
+{
+	if (m)
+		munmap(m, m->arena);
+}
+
+/**
+ * Open a ROM and power on a machine for it, in the state the boot ROM
+ * leaves behind. flags are MACHINE_* options.
+ *
+ * Return 0 or a CART_E* error.
+ */
+int machine_open(machine *m, const char *path, int flags)
+{
+	int err;
+
+	memset(m, 0, offsetof(machine, jc));
+	memset(&m->jc, 0, sizeof(jitcache));
+	memset(m->live, 0, sizeof(m->live));
+	if ((err = cart_open(&m->cart, path)) < 0)
+		return (err);
+
+	init_registers(&m->reg);
+	init_bus(&m->mem, m->cart.cgb != 0);
+	cart_attach(&m->cart, &m->mem, m->sram);
+	start_caches(m, flags);
+	//the boot ROM leaves 0x11 in A on a CGB
+	if (m->cart.cgb)
+		m->reg.a = 0x11;
+
+	m->flags = flags;
+	m->frameend = FRAME_CYCLES;
+	return (0);
+}
+
+/**
+ * Copy a running machine into dst, which has to be closed or never
+ * opened. Everything up to the caches is one copy, pointers into src's
+ * arena are moved over to dst's and the caches start out empty. The
+ * clone shares the ROM mapping, so it has to be closed before src.
+ */
+void machine_clone(machine *dst, const machine *src)
+{
+	int page;
+
+	memcpy(dst, src, offsetof(machine, jc));
+	memset(&dst->jc, 0, sizeof(jitcache));
+	for (page = 0; page < 256; page++) {
+		dst->mem.rd[page] = (const uint8_t *)relocate(dst->mem.rd[page], src, dst);
+		dst->mem.wr[page] = (uint8_t *)relocate(dst->mem.wr[page], src, dst);
+		dst->mem.wrpage[page] = (uint8_t *)relocate(dst->mem.wrpage[page], src, dst);
+	}
+	dst->mem.sram = (uint8_t *)relocate(dst->mem.sram, src, dst);
+	dst->mem.rewatch = 0x0;
+	dst->mem.tm = NULL; //src's counters stay with src
+	dst->mem.ppu = NULL; //and its screen
+	dst->mem.apu = NULL; //and sound
+	for (page = 0x80; page < 0x98; page++)
+		bus_unwatch(&dst->mem, page, WATCH_TILES);
+	bus_unwatch(&dst->mem, 0xFE, WATCH_OAM);
+#ifdef PROFILE
+	dst->mem.prof = NULL; //and its profile
+#endif
+#ifdef TRACE
+	dst->mem.trace = NULL; //and its trace
+#endif
+	dst->clone = 0x1;
+	//src's save states stay with src
+	memset(dst->live, 0, sizeof(dst->live));
+
+	//no blocks came along, so nothing is watched for them either
+	start_caches(dst, dst->flags);
+	block_flush(&dst->bc, &dst->mem);
+}
+
+void machine_close(machine *m)
+{
+	uint32_t i;
+
+	for (i = 0; i < STATE_CHUNKS; i++) {
+		chunk_release(m->live[i]);
+		m->live[i] = NULL;
+	}
+	if (m->jc.code)
+		free_jit(&m->jc, &m->bc);
+	if (!m->clone)
+		cart_close(&m->cart);
+	m->cart.data = NULL;
+}
+
+/**
+ * Draw the machine's screen with p from now on, NULL for none. Tile data
+ * and OAM are watched while there is one, so writes reach the tiles it
+ * decoded and its sprite lists.
+ */
+void machine_screen(machine *m, struct ppu *p)
+{
+	int page;
+
+	m->mem.ppu = p;
+	for (page = 0x80; page < 0x98; page++) {
+		if (p)
+			bus_watch(&m->mem, page, WATCH_TILES);
+		else
+			bus_unwatch(&m->mem, page, WATCH_TILES);
+	}
+	if (p) {
+		bus_watch(&m->mem, 0xFE, WATCH_OAM);
+		ppu_flush(p);
+	} else {
+		bus_unwatch(&m->mem, 0xFE, WATCH_OAM);
+	}
+}
+
+/**
+ * Make the machine's sound with a from now on, NULL for none. Whoever
+ * takes a off flushes it first.
+ */
+void machine_sound(machine *m, struct apu *a)
+{
+	m->mem.apu = a;
+	if (a)
+		apu_start(a, &m->mem);
+}
+
+/**
+ * Play script, sorted by frame, from the current frame on. The machine
+ * doesn't copy it.
+ */
+void machine_input(machine *m, const inputstep *script, size_t n)
+{
+	size_t lo = 0, hi = n, mid;
+
+	//first step not in the past
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (script[mid].frame < m->frame)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	m->script = script;
+	m->nsteps = n;
+	m->step = lo;
+}
+
+/**
+ * Run frames more frames, pressing buttons as the input script says at
+ * the start of each one. Frames are counted in T-cycles, so they go on
+ * with the LCD off. A CPU asleep with nothing to wake it ends its frame
+ * early. Sound made in a frame is sent off at its end.
+ *
+ * Return the number of instructions executed or -1 on an illegal opcode.
+ */
+long machine_run(machine *m, uint32_t frames)
+{
+	long total = 0, ran, slice, insns;
+	uint64_t start = 0, now = 0, slept = 0, idle = 0, sndstart;
+
+	while (frames-- > 0) {
+		if (m->mem.tm) {
+			start = tm_clock();
+			now = m->mem.sched.now;
+			slept = m->mem.sched.slept;
+			idle = m->bc.idlecycles;
+		}
+		insns = total;
+		while (m->step < m->nsteps && m->script[m->step].frame <= m->frame)
+			io_joypad(&m->mem, m->script[m->step++].held);
+
+		while (m->mem.sched.now < m->frameend) {
+			//no instruction is longer than 24 T-cycles, so this only
+			//runs past the end of the frame by the last one
+			slice = (m->frameend - m->mem.sched.now) / 24 + 1;
+			if (m->flags & MACHINE_INTERP)
+				ran = execute(&m->mem, &m->reg, slice);
+			else
+				ran = execute_blocks(&m->mem, &m->reg, &m->bc, slice);
+			if (ran < 0)
+				return (-1);
+			total += ran;
+			if (ran < slice) {
+				m->frameend = m->mem.sched.now;
+				break;
+			}
+		}
+		//the frame's sound goes out as it ends
+		if (m->mem.apu) {
+			sndstart = TM_BEGIN(&m->mem);
+			apu_flush(m->mem.apu, &m->mem);
+			TM_CHARGE(&m->mem, TM_APU, sndstart);
+		}
+		m->frameend += FRAME_CYCLES;
+		m->frame++;
+		if (m->mem.tm)
+			tm_frame(m->mem.tm, tm_clock() - start, total - insns,
+			    m->mem.sched.now - now, m->mem.sched.slept - slept,
+			    m->bc.idlecycles - idle);
+	}
+
+	return (total);
+}
+
+/**
+ * Hash the registers and RAM, to tell whether two runs ended up in the
+ * same state.
+ */
+uint32_t machine_hash(machine *m)
+{
+	registers *reg = &m->reg;
+	uint8_t r[12] = {
+		reg->a, getf(reg), reg->b, reg->c, reg->d, reg->e, reg->h, reg->l,
+		(uint8_t)(reg->sp >> 0x8), (uint8_t)reg->sp,
+		(uint8_t)(reg->pc >> 0x8), (uint8_t)reg->pc
+	};
+	uint32_t h = 0x811C9DC5;
+
+	h = fnv(h, r, sizeof(r));
+	h = fnv(h, m->mem.wram, sizeof(m->mem.wram));
+	h = fnv(h, m->mem.vram, sizeof(m->mem.vram));
+	h = fnv(h, m->mem.oam, sizeof(m->mem.oam));
+	h = fnv(h, m->mem.hram, sizeof(m->mem.hram));
+	if (m->mem.sramsize)
+		h = fnv(h, m->mem.sram, m->mem.sramsize);
+	return (h);
+}
+
+const char *machine_strerror(int err)
+{
+	if (err == MACHINE_ENOMEM)
+		return ("out of memory");
+	return (cart_strerror(err));
+}
+
+/**
+ * Save the state of a machine. Only RAM written since the last save or
+ * restore is copied, the rest is shared with earlier states. States stay
+ * valid after the machine moves on and can be restored any number of
+ * times, but only to the machine they came from and on its thread.
+ *
+ * Return NULL if there's no memory for it.
+ */
+savestate *machine_save(machine *m)
+{
+	uint64_t start = snap_start(m);
+	savestate *st;
+	uint32_t i;
+
+	if (!(st = (savestate *)malloc(sizeof(savestate))))
+		return (NULL);
+
+	save_core(m, &st->core);
+	st->nchunks = nchunks(m);
+
+	for (i = 0; i < st->nchunks; i++) {
+		if (!m->live[i]) {
+			if (!(m->live[i] = (statechunk *)malloc(sizeof(statechunk)))) {
+				st->nchunks = i;
+				state_free(st);
+				return (NULL);
+			}
+			m->live[i]->refs = 1;
+			memcpy(m->live[i]->data, chunk_ram(m, i), STATE_CHUNK);
+		}
+		st->chunk[i] = m->live[i];
+		st->chunk[i]->refs++;
+	}
+
+	arm_dirty(m);
+	snap_end(m, TM_SAVE, start);
+	return (st);
+}
+
+/**
+ * Put a machine back into a saved state. Only the RAM chunks it doesn't
+ * share with the state are copied, along with the registers and the rest
+ * of the bus. Cached code built from memory that changed is dropped.
+ *
+ * Return -1 if the state came from another machine.
+ */
+int machine_restore(machine *m, const savestate *st)
+{
+	uint64_t start = snap_start(m);
+	uint32_t i;
+	int code;
+
+	if (st->core.owner != m)
+		return (-1);
+
+	code = ram_code(m);
+	load_core(m, &st->core, WATCH_CODE);
+	for (i = 0; i < st->nchunks; i++) {
+		if (m->live[i] == st->chunk[i])
+			continue;
+		memcpy(chunk_ram(m, i), st->chunk[i]->data, STATE_CHUNK);
+		chunk_release(m->live[i]);
+		m->live[i] = st->chunk[i];
+		m->live[i]->refs++;
+		if (code)
+			block_invalidate_src(&m->bc, &m->mem, chunk_ram(m, i));
+	}
+
+	arm_dirty(m);
+	snap_end(m, TM_LOAD, start);
+	return (0);
+}
+
+void state_free(savestate *st)
+{
+	uint32_t i;
+
+	if (!st)
+		return;
+	for (i = 0; i < st->nchunks; i++)
+		chunk_release(st->chunk[i]);
+	free(st);
+}
+
+/**
+ * Bytes machine_pack() writes: a statecore and then all of RAM.
+ */
+size_t machine_statesize(const machine *m)
+{
+	return (sizeof(statecore) + nchunks(m) * STATE_CHUNK);
+}
+
+/**
+ * Write the whole state of a machine out flat, for callers that keep
+ * their own history. The same restrictions as for save states apply.
+ */
+void machine_pack(machine *m, uint8_t *buf)
+{
+	uint64_t start = snap_start(m);
+	uint32_t i;
+
+	save_core(m, (statecore *)buf);
+	buf += sizeof(statecore);
+	for (i = 0; i < nchunks(m); i++, buf += STATE_CHUNK)
+		memcpy(buf, chunk_ram(m, i), STATE_CHUNK);
+	snap_end(m, TM_SAVE, start);
+}
+
+/**
+ * Load a state written by machine_pack(). RAM chunks that didn't change
+ * keep being shared with save states.
+ *
+ * Return -1 if the state came from another machine.
+ */
+int machine_unpack(machine *m, const uint8_t *buf)
+{
+	const statecore *core = (const statecore *)buf;
+	uint64_t start = snap_start(m);
+	uint8_t *ram;
+	uint32_t i;
+	int code;
+
+	if (core->owner != m)
+		return (-1);
+
+	code = ram_code(m);
+	load_core(m, core, WATCH_CODE | WATCH_DIRTY);
+	buf += sizeof(statecore);
+	for (i = 0; i < nchunks(m); i++, buf += STATE_CHUNK) {
+		ram = chunk_ram(m, i);
+		if (memcmp(ram, buf, STATE_CHUNK) == 0)
+			continue;
+		memcpy(ram, buf, STATE_CHUNK);
+		chunk_release(m->live[i]);
+		m->live[i] = NULL;
+		if (code)
+			block_invalidate_src(&m->bc, &m->mem, ram);
+	}
+	snap_end(m, TM_LOAD, start);
+	return (0);
+}
+
+/**
+ * Bytes machine_export() writes: the frame count, the registers, the
+ * clock, the bus from the banking registers on and the cartridge RAM.
+ */
+size_t machine_exportsize(const machine *m)
+{
+	return (sizeof(uint32_t) + sizeof(uint64_t) + sizeof(registers) +
+	    sizeof(scheduler) + sizeof(bus) - offsetof(bus, mbc) + m->mem.sramsize);
+}
+
+/**
+ * Write the state of a machine out without any pointers, so it can be
+ * loaded into any machine running the same ROM on this build, in another
+ * process or on another thread. Slower than machine_pack(): nothing is
+ * shared and loading rebuilds the page tables and caches.
+ */
+void machine_export(machine *m, uint8_t *buf)
+{
+	uint64_t start = snap_start(m);
+
+	memcpy(buf, &m->frame, sizeof(uint32_t));
+	buf += sizeof(uint32_t);
+	memcpy(buf, &m->frameend, sizeof(uint64_t));
+	buf += sizeof(uint64_t);
+	memcpy(buf, &m->reg, sizeof(registers));
+	buf += sizeof(registers);
+	memcpy(buf, &m->mem.sched, sizeof(scheduler));
+	buf += sizeof(scheduler);
+	memcpy(buf, &m->mem.mbc, sizeof(bus) - offsetof(bus, mbc));
+	buf += sizeof(bus) - offsetof(bus, mbc);
+	memcpy(buf, m->mem.sram, m->mem.sramsize);
+	snap_end(m, TM_SAVE, start);
+}
+
+/**
+ * Load a state written by machine_export(). The banks it had mapped are
+ * mapped again, and all cached code and the machine's claims on save
+ * state RAM are dropped. The input script stays, picking up at the
+ * loaded frame.
+ *
+ * Return -1 if the state is for another kind of cartridge.
+ */
+int machine_import(machine *m, const uint8_t *buf, size_t len)
+{
+	//the bus part starts with the controller type and the CGB flag
+	const uint8_t *b = buf + sizeof(uint32_t) + sizeof(uint64_t) +
+	    sizeof(registers) + sizeof(scheduler);
+	uint64_t start = snap_start(m);
+	uint32_t i;
+
+	if (len != machine_exportsize(m) || b[0] != m->mem.mbc ||
+	    b[offsetof(bus, cgb) - offsetof(bus, mbc)] != m->mem.cgb)
+		return (-1);
+
+	memcpy(&m->frame, buf, sizeof(uint32_t));
+	buf += sizeof(uint32_t);
+	memcpy(&m->frameend, buf, sizeof(uint64_t));
+	buf += sizeof(uint64_t);
+	memcpy(&m->reg, buf, sizeof(registers));
+	buf += sizeof(registers);
+	memcpy(&m->mem.sched, buf, sizeof(scheduler));
+	buf += sizeof(scheduler);
+	memcpy(&m->mem.mbc, buf, sizeof(bus) - offsetof(bus, mbc));
+	buf += sizeof(bus) - offsetof(bus, mbc);
+	memcpy(m->mem.sram, buf, m->mem.sramsize);
+
+	for (i = 0; i < STATE_CHUNKS; i++) {
+		chunk_release(m->live[i]);
+		m->live[i] = NULL;
+	}
+	bus_remap(&m->mem);
+	block_flush(&m->bc, &m->mem);
+	if (m->mem.ppu)
+		ppu_flush(m->mem.ppu);
+	if (m->mem.apu)
+		apu_start(m->mem.apu, &m->mem);
+	machine_input(m, m->script, m->nsteps);
+	snap_end(m, TM_LOAD, start);
+	return (0);
+}
+
+/**
+ * Read an input script. Each line is a frame number and the buttons held
+ * from that frame on, - for none:
+ *
+ *	0 -
+ *	120 start
+ *	130 a right
+ *
+ * Lines starting with # are skipped. Frames have to go up.
+ *
+ * Return 0, -1 if the file can't be read or has a bad line.
+ */
+int input_load(const char *path, inputstep **script, size_t *n)
+{
+	FILE *fp;
+	char line[256], *tok, *end;
+	inputstep *steps = NULL, *grown;
+	size_t cap = 0, len = 0, i;
+	unsigned long frame;
+	uint8_t held;
+
+	if (!(fp = fopen(path, "r")))
+		return (-1);
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (!(tok = strtok(line, " \t\r\n")) || *tok == '#')
+			continue;
+		frame = strtoul(tok, &end, 10);
+		if (*end != '\0' || (len && frame < steps[len - 1].frame))
+			goto bad;
+
+		held = 0x0;
+		while ((tok = strtok(NULL, " \t\r\n")) && strcmp(tok, "-") != 0) {
+			for (i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++)
+				if (strcasecmp(tok, buttons[i].name) == 0)
+					break;
+			if (i == sizeof(buttons) / sizeof(buttons[0]))
+				goto bad;
+			held |= buttons[i].bit;
+		}
+
+		if (len == cap) {
+			cap = cap ? 2 * cap : 64;
+			if (!(grown = (inputstep *)realloc(steps, cap * sizeof(inputstep))))
+				goto bad;
+			steps = grown;
+		}
+		steps[len].frame = frame;
+		steps[len].held = held;
+		len++;
+	}
+
+	fclose(fp);
+	*script = steps;
+	*n = len;
+	return (0);
+
+bad:
+	fclose(fp);
+	free(steps);
+	return (-1);
+}
+
+/*
+ * Set up an empty block cache and, if asked for, the recompiler. Falls
+ * back to interpreting if the host has no recompiler.
+ */
+static void start_caches(machine *m, int flags)
+{
+	init_blockcache(&m->bc, &m->mem);
+	//the machine takes the write watch over to share it with save states
+	m->mem.onwrite = onwrite;
+	m->mem.ctx = m;
+	m->bc.idleskip = !(flags & MACHINE_EXACT);
+	if (flags & MACHINE_JIT && init_jit(&m->jc, &m->bc) == 0) {
+		if (flags & MACHINE_LOCKSTEP)
+			jit_lockstep(&m->jc, 1);
+		jit_enable(&m->jc, 1);
+	}
+}
+
+/*
+ * Writes to watched pages: drop cached code and decoded tiles the write
+ * hits, bring sprite lists up to date and drop the machine's claim on
+ * the RAM chunk it lands in. A page is only watched for the first write
+ * since the last save. A DMA run of several bytes has the sprite lists
+ * made again in one go.
+ */
+static void onwrite(bus *mem, uint16_t addr, uint16_t len, uint8_t watch)
+{
+	machine *m = (machine *)mem->ctx;
+	int i;
+
+	for (i = 0; i < len && (mem->watch[addr >> 0x8] & WATCH_CODE); i++)
+		block_invalidate(&m->bc, mem, addr + i);
+	//a tile is 16 bytes
+	for (i = 0; (watch & WATCH_TILES) && i < len; i += 0x10 - ((addr + i) & 0xF))
+		ppu_touch(mem->ppu, mem->vbank, addr + i);
+	if (watch & WATCH_OAM) {
+		if (len > 1)
+			ppu_resort(mem->ppu);
+		else
+			ppu_oam(mem->ppu, mem, addr);
+	}
+	if (!(watch & WATCH_DIRTY))
+		return;
+
+	if ((i = chunk_of(m, bus_backing(mem, addr))) >= 0) {
+		chunk_release(m->live[i]);
+		m->live[i] = NULL;
+	}
+	bus_unwatch(mem, addr >> 0x8, WATCH_DIRTY);
+}
+
+/*
+ * p moved from src's arena to the same place in dst's, anything outside
+ * it is shared and stays.
+ */
+static void *relocate(const void *p, const machine *src, machine *dst)
+{
+	uintptr_t lo = (uintptr_t)src, at = (uintptr_t)p;
+
+	if (at < lo || at >= lo + offsetof(machine, jc))
+		return ((void *)p);
+	return ((uint8_t *)dst + (at - lo));
+}
+
+/*
+ * RAM chunks the machine has: all of VRAM and WRAM, and the cartridge
+ * RAM.
+ */
+static uint32_t nchunks(const machine *m)
+{
+	return (STATE_SRAM + (m->mem.sramsize + STATE_CHUNK - 1) / STATE_CHUNK);
+}
+
+static uint8_t *chunk_ram(machine *m, uint32_t i)
+{
+	if (i < STATE_WRAM)
+		return (&m->mem.vram[0][0] + (i - STATE_VRAM) * STATE_CHUNK);
+	if (i < STATE_SRAM)
+		return (&m->mem.wram[0][0] + (i - STATE_WRAM) * STATE_CHUNK);
+	return (m->sram + (i - STATE_SRAM) * STATE_CHUNK);
+}
+
+/*
+ * The chunk p is in, -1 if it isn't RAM.
+ */
+static int chunk_of(const machine *m, const uint8_t *p)
+{
+	uintptr_t at = (uintptr_t)p;
+	uintptr_t vram = (uintptr_t)m->mem.vram, wram = (uintptr_t)m->mem.wram;
+	uintptr_t sram = (uintptr_t)m->sram;
+
+	if (at >= vram && at < vram + sizeof(m->mem.vram))
+		return (STATE_VRAM + (at - vram) / STATE_CHUNK);
+	if (at >= wram && at < wram + sizeof(m->mem.wram))
+		return (STATE_WRAM + (at - wram) / STATE_CHUNK);
+	if (at >= sram && at < sram + m->mem.sramsize)
+		return (STATE_SRAM + (at - sram) / STATE_CHUNK);
+	return (-1);
+}
+
+static void chunk_release(statechunk *c)
+{
+	if (c && --c->refs == 0)
+		free(c);
+}
+
+/*
+ * Watch every page backed by RAM, including the ones mapped in later,
+ * for the first write.
+ */
+static void arm_dirty(machine *m)
+{
+	int page;
+
+	m->mem.rewatch = WATCH_DIRTY;
+	for (page = 0; page < 256; page++)
+		if (!(m->mem.watch[page] & WATCH_DIRTY) && bus_backing(&m->mem, page << 0x8))
+			bus_watch(&m->mem, page, WATCH_DIRTY);
+}
+
+/*
+ * Whether any blocks were built from RAM.
+ */
+static int ram_code(const machine *m)
+{
+	int page;
+
+	for (page = 0x80; page < 0x100; page++)
+		if (m->mem.watch[page] & WATCH_CODE)
+			return (1);
+	return (0);
+}
+
+static void save_core(machine *m, statecore *core)
+{
+	core->owner = m;
+	core->reg = m->reg;
+	memcpy(core->head, &m->mem, sizeof(core->head));
+	memcpy(core->tail, m->mem.oam, sizeof(core->tail));
+	core->frame = m->frame;
+	core->frameend = m->frameend;
+	core->step = m->step;
+}
+
+/*
+ * Put the registers and the bus back, keeping the watches in keep as they
+ * are now: they belong to the block cache and the live chunks, which
+ * don't go back in time with the rest. The screen's are always kept, and
+ * what it has decoded is dropped. Sound goes on from the clock loaded.
+ * OAM may hold different code afterwards.
+ */
+static void load_core(machine *m, const statecore *core, uint8_t keep)
+{
+	uint8_t watch[256], rewatch = m->mem.rewatch;
+	uint32_t gen = m->mem.codegen;
+	struct telemetry *tm = m->mem.tm;
+	struct ppu *ppu = m->mem.ppu;
+	struct apu *apu = m->mem.apu;
+#ifdef PROFILE
+	struct profile *prof = m->mem.prof;
+#endif
+#ifdef TRACE
+	struct tracer *trace = m->mem.trace;
+#endif
+	int page;
+
+	for (page = 0; page < 256; page++)
+		watch[page] = m->mem.watch[page] & (keep | WATCH_TILES | WATCH_OAM);
+
+	m->reg = core->reg;
+	memcpy(&m->mem, core->head, sizeof(core->head));
+	memcpy(m->mem.oam, core->tail, sizeof(core->tail));
+	m->mem.codegen = gen + 1;
+	m->mem.rewatch = rewatch;
+	m->mem.tm = tm;
+	m->mem.ppu = ppu;
+	m->mem.apu = apu;
+#ifdef PROFILE
+	m->mem.prof = prof;
+#endif
+#ifdef TRACE
+	m->mem.trace = trace;
+#endif
+	m->frame = core->frame;
+	m->frameend = core->frameend;
+	m->step = core->step;
+	bus_setwatch(&m->mem, watch);
+	if (ppu)
+		ppu_flush(ppu);
+	if (apu)
+		apu_start(apu, &m->mem);
+
+	if (watch[0xFE] & WATCH_CODE)
+		block_invalidate_src(&m->bc, &m->mem, m->mem.oam);
+}
+
+/*
+ * 32 bit FNV-1a.
+ */
+static uint32_t fnv(uint32_t h, const void *p, size_t len)
+{
+	const uint8_t *b = (const uint8_t *)p;
+
+	while (len-- > 0)
+		h = (h ^ *b++) * 0x01000193;
+	return (h);
+}
+
+/*
+ * Clock at the start of a snapshot, if the machine publishes telemetry.
+ */
+static uint64_t snap_start(const machine *m)
+{
+	return (m->mem.tm ? tm_clock() : 0);
+}
+
+static void snap_end(machine *m, int kind, uint64_t start)
+{
+	if (m->mem.tm)
+		tm_snapshot(m->mem.tm, kind, tm_clock() - start);
+}
@@ -0,0 +1,122 @@
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "mem.h"
+#include "rom.h"
+#include "io.h"
+#include "block.h"
+#include "jit.h"
+
+/*
+ * One emulated Game Boy: CPU, bus and peripherals, cartridge RAM and the
+ * caches built over them. Everything an instance touches lives in one
+ * arena of its own and nothing is global, so any number of them can run
+ * side by side on different threads without sharing a cache line.
+ * Instances of the same ROM share its read-only mapping.
+ *
+ * The arena is laid out hottest first: the registers, then the bus with
+ * the clock and the page tables, then RAM, then state only touched now
+ * and then, and last the block cache and recompiler, which are rebuilt
+ * rather than copied when a machine is cloned.
+ */
+#define MACHINE_JIT		0x1 //recompile hot blocks
+#define MACHINE_LOCKSTEP	0x2 //and check them against the interpreter
+#define MACHINE_EXACT		0x4 //run polling loops instead of skipping them
+#define MACHINE_HUGE		0x8 //back the arena with huge pages if possible
+#define MACHINE_INTERP		0x10 //run the plain interpreter, no block cache
+
+//machine errors, past the CART_E* ones
+#define MACHINE_ENOMEM		-5
+
+//T-cycles in a frame, the LCD refresh rate
+#define FRAME_CYCLES		(LCD_LINE * LCD_LINES)
+
+//the buttons held from a frame on, see input_load()
+typedef struct {
+	uint32_t	frame;
+	uint8_t		held; //JOY_* bits
+} inputstep;
+
+/*
+ * Save states share RAM with each other copy-on-write, in chunks of one
+ * bus page. Saving arms a write watch on every RAM page, and the first
+ * write to one after that drops the machine's claim on the chunk it
+ * landed in. The next save only copies those chunks and shares the rest
+ * with the state before it, and restoring only copies back chunks the
+ * machine doesn't share with the state already.
+ */
+#define STATE_CHUNK		0x100 //bytes of RAM in a chunk
+#define STATE_VRAM		0 //first chunk of each kind of RAM
+#define STATE_WRAM		(STATE_VRAM + 2 * VRAMBANK / STATE_CHUNK)
+#define STATE_SRAM		(STATE_WRAM + 8 * WRAMBANK / STATE_CHUNK)
+#define STATE_CHUNKS		(STATE_SRAM + CART_RAMMAX / STATE_CHUNK)
+
+typedef struct {
+	uint32_t	refs; //states and machines holding it
+	uint8_t		data[STATE_CHUNK];
+} statechunk;
+
+//everything in a state but RAM
+typedef struct {
+	const struct machine *owner; //the only machine it can be restored to
+	registers	reg;
+	uint8_t		head[offsetof(bus, vram)]; //the bus up to VRAM
+	uint8_t		tail[sizeof(bus) - offsetof(bus, oam)]; //OAM, I/O and HRAM
+	uint32_t	frame;
+	uint64_t	frameend;
+	size_t		step;
+} statecore;
+
+typedef struct {
+	statecore	core;
+	uint32_t	nchunks; //chunks of RAM the cartridge has
+	statechunk	*chunk[STATE_CHUNKS];
+} savestate;
+
+typedef struct machine {
+	registers	reg;
+	bus		mem;
+	uint8_t		sram[CART_RAMMAX];
+
+	cartridge	cart;
+	uint8_t		clone; //shares the ROM mapping of the machine it came from
+	int		flags; //MACHINE_*
+	const inputstep	*script; //NULL for no input
+	size_t		nsteps;
+	size_t		step; //next step to apply
+	uint32_t	frame; //frames run
+	uint64_t	frameend; //clock at the end of the current frame
+
+	jitcache	jc;
+	blockcache	bc;
+	statechunk	*live[STATE_CHUNKS]; //chunk RAM still matches, NULL once written
+	size_t		arena; //bytes mapped for the machine
+} machine;
+
+machine		*machine_new(int flags);
+void		machine_delete(machine *m);
+int		machine_open(machine *m, const char *path, int flags);
+void		machine_clone(machine *dst, const machine *src);
+void		machine_close(machine *m);
+void		machine_input(machine *m, const inputstep *script, size_t n);
+void		machine_screen(machine *m, struct ppu *p);
+void		machine_sound(machine *m, struct apu *a);
+long		machine_run(machine *m, uint32_t frames);
+uint32_t	machine_hash(machine *m);
+const char	*machine_strerror(int err);
+savestate	*machine_save(machine *m);
+int		machine_restore(machine *m, const savestate *st);
+void		state_free(savestate *st);
+size_t		machine_statesize(const machine *m);
+void		machine_pack(machine *m, uint8_t *buf);
+int		machine_unpack(machine *m, const uint8_t *buf);
+size_t		machine_exportsize(const machine *m);
+void		machine_export(machine *m, uint8_t *buf);
+int		machine_import(machine *m, const uint8_t *buf, size_t len);
+int		input_load(const char *path, inputstep **script, size_t *n);
+
+#endif
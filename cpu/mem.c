@@ -0,0 +1,512 @@
+#include <string.h>
+
+#include "mem.h"
+#include "io.h"
+
+#define VBK	0x4F //CGB VRAM bank select
+#define SVBK	0x70 //CGB WRAM bank select
+
+//what a cartridge controller write has to map again
+#define REMAP_ROM	0x1
+#define REMAP_SRAM	0x2
+
+static uint8_t	open_rd(bus *mem, uint16_t addr);
+static void	mbc_wr(bus *mem, uint16_t addr, uint8_t val);
+static uint8_t	sram_rd(bus *mem, uint16_t addr);
+static void	sram_wr(bus *mem, uint16_t addr, uint8_t val);
+static void	oam_wr(bus *mem, uint16_t addr, uint8_t val);
+static void	watch_wr(bus *mem, uint16_t addr, uint8_t val);
+static uint8_t	io_rd(bus *mem, uint16_t addr);
+static void	io_wr(bus *mem, uint16_t addr, uint8_t val);
+static void	map_rom(bus *mem);
+static void	map_sram(bus *mem);
+static void	map_vram(bus *mem);
+static void	map_wram(bus *mem);
+
+
+/**
+ * Set up an empty bus: RAM mapped, no cartridge.
+ */
+void init_bus(bus *mem, uint8_t cgb)
+{
+	int page;
+
+	memset(mem, 0, sizeof(bus));
+	mem->cgb = cgb;
+	mem->rombank = 0x1;
+	mem->wbank = 0x1;
+
+	for (page = 0x00; page < 0x80; page++)
+		bus_map_io(mem, page, open_rd, mbc_wr);
+	for (page = 0xA0; page < 0xC0; page++)
+		bus_map_io(mem, page, sram_rd, sram_wr);
+	bus_map_io(mem, 0xFE, open_rd, oam_wr);
+	bus_map_io(mem, 0xFF, io_rd, io_wr);
+
+	for (page = 0xC0; page < 0xD0; page++)
+		bus_map_page(mem, page, mem->wram[0] + (page - 0xC0) * 0x100,
+		    mem->wram[0] + (page - 0xC0) * 0x100);
+	//echo of 0xC000-0xDDFF
+	for (page = 0xE0; page < 0xF0; page++)
+		bus_map_page(mem, page, mem->rd[page - 0x20], mem->wrpage[page - 0x20]);
+	mem->rd[0xFE] = mem->oam;
+
+	map_vram(mem);
+	map_wram(mem);
+	init_io(mem);
+}
+
+/**
+ * Map a cartridge ROM. The bus only keeps the pointer, the image has to
+ * stay valid for the life of the bus.
+ */
+void bus_map_rom(bus *mem, const uint8_t *rom, uint32_t size, uint8_t mbc)
+{
+	mem->rom = rom;
+	mem->romsize = size;
+	mem->mbc = mbc;
+	mem->rombank = 0x1;
+	mem->mode = 0x0;
+	//carts without a controller have their RAM always on
+	mem->ramen = (mbc == MBC_NONE);
+	map_rom(mem);
+	map_sram(mem);
+}
+
+/**
+ * Map cartridge RAM at 0xA000.
+ */
+void bus_map_sram(bus *mem, uint8_t *sram, uint32_t size)
+{
+	mem->sram = sram;
+	mem->sramsize = size;
+	map_sram(mem);
+}
+
+/**
+ * Map the banks the banking registers select, for a bus whose registers
+ * were loaded from elsewhere.
+ */
+void bus_remap(bus *mem)
+{
+	map_rom(mem);
+	map_sram(mem);
+	map_vram(mem);
+	map_wram(mem);
+	mem->rd[0xFE] = mem->dma ? 0 : mem->oam;
+}
+
+/**
+ * Point a page straight at its backing store. Either pointer may be NULL
+ * to send that direction through the page's callback.
+ */
+void bus_map_page(bus *mem, uint8_t page, const uint8_t *rd, uint8_t *wr)
+{
+	mem->rd[page] = rd;
+	mem->wrpage[page] = wr;
+	if (wr)
+		mem->watch[page] |= mem->rewatch;
+	mem->wr[page] = mem->watch[page] ? 0 : wr;
+	if (wr && mem->watch[page])
+		mem->wrfn[page] = watch_wr;
+}
+
+/**
+ * Route a page through callbacks.
+ */
+void bus_map_io(bus *mem, uint8_t page, bus_rdfn rdfn, bus_wrfn wrfn)
+{
+	mem->rd[page] = 0;
+	mem->wr[page] = 0;
+	mem->wrpage[page] = 0;
+	mem->rdfn[page] = rdfn;
+	mem->wrfn[page] = wrfn;
+}
+
+/**
+ * Send writes to a page through onwrite until every reason in mask is
+ * unwatched again. Pages that are plain memory lose their direct write
+ * pointer while watched, callback pages report from their callback.
+ */
+void bus_watch(bus *mem, uint8_t page, uint8_t mask)
+{
+	mem->watch[page] |= mask;
+	if (mem->wrpage[page]) {
+		mem->wr[page] = 0;
+		mem->wrfn[page] = watch_wr;
+	}
+}
+
+void bus_unwatch(bus *mem, uint8_t page, uint8_t mask)
+{
+	mem->watch[page] &= ~mask;
+	if (!mem->watch[page] && mem->wrpage[page])
+		mem->wr[page] = mem->wrpage[page];
+}
+
+/**
+ * Replace the WATCH_* bits of every page, for tables copied in from
+ * elsewhere that were watched for other reasons.
+ */
+void bus_setwatch(bus *mem, const uint8_t *watch)
+{
+	int page;
+
+	for (page = 0; page < 256; page++) {
+		mem->watch[page] = 0x0;
+		if (mem->wrpage[page])
+			mem->wr[page] = mem->wrpage[page];
+		if (watch[page])
+			bus_watch(mem, page, watch[page]);
+	}
+}
+
+/**
+ * The byte of RAM a write to addr ends up in, NULL if it doesn't go to
+ * plain memory. MBC2 RAM counts even while it's disabled.
+ */
+uint8_t *bus_backing(bus *mem, uint16_t addr)
+{
+	uint8_t page = addr >> 0x8;
+
+	if (mem->wrpage[page])
+		return (mem->wrpage[page] + (addr & 0xFF));
+	if (page >= 0xA0 && page < 0xC0 && mem->mbc == MBC_2 && mem->sramsize)
+		return (mem->sram + (addr & 0x1FF) % mem->sramsize);
+	return (0);
+}
+
+/**
+ * Read len bytes from addr on into buf the way DMA does, a page at a time
+ * through the page table. Only pages without a read pointer are read a
+ * byte at a time, through their callback.
+ */
+void bus_read(bus *mem, uint16_t addr, uint8_t *buf, uint16_t len)
+{
+	const uint8_t *p;
+	uint16_t n, i;
+
+	while (len > 0) {
+		n = 0x100 - (addr & 0xFF);
+		if (n > len)
+			n = len;
+		if ((p = mem->rd[addr >> 0x8])) {
+			memcpy(buf, p + (addr & 0xFF), n);
+		} else {
+			for (i = 0; i < n; i++)
+				buf[i] = mem->rdfn[addr >> 0x8](mem, addr + i);
+		}
+		addr += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/**
+ * Write len bytes from buf to addr on the way DMA does, straight into the
+ * backing store of each page, watched or not, and then telling onwrite
+ * about the whole run. Pages without a backing store get their callback
+ * a byte at a time.
+ */
+void bus_write(bus *mem, uint16_t addr, const uint8_t *buf, uint16_t len)
+{
+	uint8_t *p;
+	uint16_t n, i;
+
+	while (len > 0) {
+		n = 0x100 - (addr & 0xFF);
+		if (n > len)
+			n = len;
+		if ((p = mem->wrpage[addr >> 0x8])) {
+			memcpy(p + (addr & 0xFF), buf, n);
+			bus_written(mem, addr, n);
+		} else {
+			for (i = 0; i < n; i++)
+				mem->wrfn[addr >> 0x8](mem, addr + i, buf[i]);
+		}
+		addr += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+/**
+ * len bytes from addr on, all on one page, were changed without going
+ * through the bus. Tell onwrite if the page is watched.
+ */
+void bus_written(bus *mem, uint16_t addr, uint16_t len)
+{
+	uint8_t watch = mem->watch[addr >> 0x8];
+
+	if (watch && mem->onwrite)
+		mem->onwrite(mem, addr, len, watch);
+}
+
+/*
+ * Write to a watched memory page.
+ */
+static void watch_wr(bus *mem, uint16_t addr, uint8_t val)
+{
+	uint8_t page = addr >> 0x8;
+
+	mem->wrpage[page][addr & 0xFF] = val;
+	if (mem->onwrite)
+		mem->onwrite(mem, addr, 1, mem->watch[page]);
+}
+
+/*
+ * Unmapped reads float high.
+ */
+static uint8_t open_rd(bus *mem, uint16_t addr)
+{
+	return (0xFF);
+}
+
+/*
+ * Map the fixed and switchable ROM banks for the current MBC state.
+ */
+static void map_rom(bus *mem)
+{
+	uint32_t nbanks = mem->romsize / ROMBANK;
+	uint32_t lo = 0, hi = mem->rombank;
+	int i;
+
+	mem->codegen++;
+
+	if (nbanks == 0)
+		return;
+
+	//MBC1 mode 1 also switches the upper bank bits into 0x0000
+	if (mem->mbc == MBC_1) {
+		hi = (mem->rombank & 0x1F) | (mem->rambank & 0x3) << 0x5;
+		if (mem->mode)
+			lo = (mem->rambank & 0x3) << 0x5;
+	}
+	lo %= nbanks;
+	hi %= nbanks;
+
+	for (i = 0; i < 0x40; i++) {
+		mem->rd[i] = mem->rom + lo * ROMBANK + i * 0x100;
+		mem->rd[0x40 + i] = mem->rom + hi * ROMBANK + i * 0x100;
+	}
+}
+
+/*
+ * Map cartridge RAM if it's enabled and plain memory, otherwise leave the
+ * pages on the callbacks.
+ */
+static void map_sram(bus *mem)
+{
+	uint32_t bank = mem->rambank;
+	int page;
+
+	mem->codegen++;
+
+	if (mem->mbc == MBC_1 && !mem->mode)
+		bank = 0;
+
+	for (page = 0xA0; page < 0xC0; page++) {
+		uint32_t off;
+
+		if (!mem->ramen || !mem->sramsize || mem->mbc == MBC_2 ||
+		    (mem->mbc == MBC_3 && bank >= 0x08)) {
+			bus_map_io(mem, page, sram_rd, sram_wr);
+			continue;
+		}
+		off = (bank * SRAMBANK + (page - 0xA0) * 0x100) % mem->sramsize;
+		bus_map_page(mem, page, mem->sram + off, mem->sram + off);
+	}
+}
+
+static void map_vram(bus *mem)
+{
+	int page;
+
+	mem->codegen++;
+
+	for (page = 0x80; page < 0xA0; page++)
+		bus_map_page(mem, page, mem->vram[mem->vbank] + (page - 0x80) * 0x100,
+		    mem->vram[mem->vbank] + (page - 0x80) * 0x100);
+}
+
+static void map_wram(bus *mem)
+{
+	uint8_t *base = mem->wram[mem->wbank];
+	int page;
+
+	mem->codegen++;
+
+	for (page = 0xD0; page < 0xE0; page++)
+		bus_map_page(mem, page, base + (page - 0xD0) * 0x100,
+		    base + (page - 0xD0) * 0x100);
+	//the echo only reaches up to 0xFDFF
+	for (page = 0xF0; page < 0xFE; page++)
+		bus_map_page(mem, page, base + (page - 0xF0) * 0x100,
+		    base + (page - 0xF0) * 0x100);
+}
+
+/*
+ * Writes to the ROM area go to the cartridge controller. Only the banks a
+ * register picks are mapped again, each remap stops the code running.
+ */
+static void mbc_wr(bus *mem, uint16_t addr, uint8_t val)
+{
+	uint8_t remap = 0x0;
+
+	switch (mem->mbc) {
+	case MBC_1:
+		if (addr < 0x2000) {
+			mem->ramen = (val & 0xF) == 0xA;
+			remap = REMAP_SRAM;
+		} else if (addr < 0x4000) {
+			mem->rombank = val & 0x1F ? val & 0x1F : 0x1;
+			remap = REMAP_ROM;
+		} else if (addr < 0x6000) {
+			//the RAM bank bits are the upper ROM bank bits too
+			mem->rambank = val & 0x3;
+			remap = REMAP_ROM | REMAP_SRAM;
+		} else {
+			mem->mode = val & 0x1;
+			remap = REMAP_ROM | REMAP_SRAM;
+		}
+		break;
+	case MBC_2:
+		if (addr >= 0x4000)
+			return;
+		//address bit 8 picks between RAM enable and ROM bank
+		if (addr & 0x100) {
+			mem->rombank = val & 0xF ? val & 0xF : 0x1;
+			remap = REMAP_ROM;
+		} else {
+			mem->ramen = (val & 0xF) == 0xA;
+			remap = REMAP_SRAM;
+		}
+		break;
+	case MBC_3:
+		if (addr < 0x2000) {
+			mem->ramen = (val & 0xF) == 0xA;
+			remap = REMAP_SRAM;
+		} else if (addr < 0x4000) {
+			mem->rombank = val & 0x7F ? val & 0x7F : 0x1;
+			remap = REMAP_ROM;
+		} else if (addr < 0x6000) {
+			mem->rambank = val & 0xF;
+			remap = REMAP_SRAM;
+		}
+		//0x6000 latches the clock, which doesn't run yet
+		break;
+	case MBC_5:
+		if (addr < 0x2000) {
+			mem->ramen = (val & 0xF) == 0xA;
+			remap = REMAP_SRAM;
+		} else if (addr < 0x3000) {
+			mem->rombank = (mem->rombank & 0x100) | val;
+			remap = REMAP_ROM;
+		} else if (addr < 0x4000) {
+			mem->rombank = (mem->rombank & 0xFF) | (val & 0x1) << 0x8;
+			remap = REMAP_ROM;
+		} else if (addr < 0x6000) {
+			mem->rambank = val & 0xF;
+			remap = REMAP_SRAM;
+		}
+		break;
+	default:
+		return;
+	}
+
+	if (remap & REMAP_ROM)
+		map_rom(mem);
+	if (remap & REMAP_SRAM)
+		map_sram(mem);
+}
+
+/*
+ * Cartridge RAM that isn't plain memory: disabled, MBC2's built in 4 bit
+ * RAM or the MBC3 clock registers.
+ */
+static uint8_t sram_rd(bus *mem, uint16_t addr)
+{
+	if (!mem->ramen)
+		return (0xFF);
+	if (mem->mbc == MBC_2 && mem->sramsize)
+		return (mem->sram[(addr & 0x1FF) % mem->sramsize] | 0xF0);
+	if (mem->mbc == MBC_3 && mem->rambank >= 0x08 && mem->rambank <= 0x0C)
+		return (mem->rtc[mem->rambank - 0x08]);
+	return (0xFF);
+}
+
+static void sram_wr(bus *mem, uint16_t addr, uint8_t val)
+{
+	if (!mem->ramen)
+		return;
+	if (mem->mbc == MBC_2 && mem->sramsize) {
+		mem->sram[(addr & 0x1FF) % mem->sramsize] = val & 0xF;
+		if (mem->watch[addr >> 0x8] && mem->onwrite)
+			mem->onwrite(mem, addr, 1, mem->watch[addr >> 0x8]);
+	} else if (mem->mbc == MBC_3 && mem->rambank >= 0x08 && mem->rambank <= 0x0C)
+		mem->rtc[mem->rambank - 0x08] = val;
+}
+
+/*
+ * OAM is read directly, writes past 0xFE9F are dropped, and so are all of
+ * them while OAM DMA has it.
+ */
+static void oam_wr(bus *mem, uint16_t addr, uint8_t val)
+{
+	if (mem->dma)
+		return;
+	if ((addr & 0xFF) < 0xA0)
+		mem->oam[addr & 0xFF] = val;
+	if (mem->watch[0xFE] && mem->onwrite)
+		mem->onwrite(mem, addr, 1, mem->watch[0xFE]);
+}
+
+/*
+ * I/O registers and HRAM share the top page. The banking registers are
+ * handled here, everything else by the peripherals.
+ */
+static uint8_t io_rd(bus *mem, uint16_t addr)
+{
+	uint8_t reg = addr & 0xFF;
+
+	if (reg >= 0x80)
+		return (mem->hram[reg - 0x80]);
+
+	switch (reg) {
+	case VBK: return (mem->cgb ? 0xFE | mem->vbank : 0xFF);
+	case SVBK: return (mem->cgb ? 0xF8 | mem->wbank : 0xFF);
+	default: return (io_read(mem, reg));
+	}
+}
+
+static void io_wr(bus *mem, uint16_t addr, uint8_t val)
+{
+	uint8_t reg = addr & 0xFF;
+
+	if (reg >= 0x80) {
+		mem->hram[reg - 0x80] = val;
+		if (reg == IO_IE)
+			sched_poke(&mem->sched);
+		if (mem->watch[0xFF] && mem->onwrite)
+			mem->onwrite(mem, addr, 1, mem->watch[0xFF]);
+		return;
+	}
+
+	switch (reg) {
+	case VBK:
+		if (mem->cgb) {
+			mem->vbank = val & 0x1;
+			map_vram(mem);
+		}
+		break;
+	case SVBK:
+		if (mem->cgb) {
+			mem->wbank = val & 0x7 ? val & 0x7 : 0x1;
+			map_wram(mem);
+		}
+		break;
+	default:
+		io_write(mem, reg, val);
+		break;
+	}
+}
@@ -0,0 +1,198 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include <stdint.h>
+
+#include "scheduler.h"
+
+#if defined(__GNUC__)
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+#else
+#define likely(x)	(x)
+#define unlikely(x)	(x)
+#endif
+
+/*
+ * Memory bus. The 16 bit address space is split into 256 pages of 256
+ * bytes. Each page has a direct read and write pointer into its backing
+ * store, so ROM, RAM and VRAM accesses are one table lookup. Pages with
+ * side effects (MBC registers, I/O, disabled cartridge RAM) have a NULL
+ * pointer and go through the page's callback instead. Bank switches only
+ * rewrite table entries.
+ */
+struct bus;
+struct profile;
+struct tracer;
+struct telemetry;
+struct ppu;
+struct apu;
+
+typedef uint8_t	(*bus_rdfn)(struct bus *mem, uint16_t addr);
+typedef void	(*bus_wrfn)(struct bus *mem, uint16_t addr, uint8_t val);
+//len bytes from addr on, all on one page, were written
+typedef void	(*bus_hook)(struct bus *mem, uint16_t addr, uint16_t len, uint8_t watch);
+
+#define ROMBANK		0x4000
+#define VRAMBANK	0x2000
+#define SRAMBANK	0x2000
+#define WRAMBANK	0x1000
+
+//cartridge controllers
+#define MBC_NONE	0x0
+#define MBC_1		0x1
+#define MBC_2		0x2
+#define MBC_3		0x3
+#define MBC_5		0x5
+
+//reasons to watch writes to a page
+#define WATCH_CODE	0x1 //page holds cached code
+#define WATCH_DIRTY	0x2 //page is backed by RAM a save state still shares
+#define WATCH_TILES	0x4 //page holds tile data the ppu keeps decoded
+#define WATCH_OAM	0x8 //page is OAM the ppu keeps sprite lists of
+
+//sound channel, see apu.h
+typedef struct {
+	uint8_t		on; //playing, as NR52 shows
+	uint8_t		vol; //envelope volume
+	uint8_t		envtimer; //sequencer steps to the next envelope step
+	uint16_t	length; //steps left, counted while NRx4 bit 6 is set
+	uint16_t	pos; //duty step, wave sample or noise LFSR
+	uint32_t	period; //T-cycles per step, 0 for never
+	uint64_t	next; //clock of the next step
+} sndchan;
+
+typedef struct {
+	sndchan		ch[4];
+	uint8_t		seq; //frame sequencer step next
+	uint8_t		sweeptimer; //sweep steps to the next sweep
+	uint8_t		sweepon;
+	uint16_t	shadow; //square 1 period the sweep works from
+	uint64_t	time; //clock the channels are up to
+} sndstate;
+
+typedef struct bus {
+	scheduler	sched; //clock and peripheral events, first for the hot path
+	const uint8_t	*rd[256]; //direct read pointer per page, NULL for rdfn
+	uint8_t		*wr[256]; //direct write pointer per page, NULL for wrfn
+	bus_rdfn	rdfn[256]; //read fallback per page
+	bus_wrfn	wrfn[256]; //write fallback per page
+	uint8_t		*wrpage[256]; //backing store of writable pages, watched or not
+	uint8_t		watch[256]; //WATCH_* bits, writes to watched pages call onwrite
+	uint8_t		rewatch; //WATCH_* bits every newly mapped RAM page gets
+	bus_hook	onwrite;
+	void		*ctx; //owner of the hook
+	uint32_t	codegen; //bumped whenever mapped code may have changed
+	struct telemetry *tm; //NULL unless published, see telemetry.h
+	struct ppu	*ppu; //NULL for no video, see ppu.h
+	struct apu	*apu; //NULL for no sound, see apu.h
+#ifdef PROFILE
+	struct profile	*prof; //NULL unless profiling, see profile.h
+#endif
+#ifdef TRACE
+	struct tracer	*trace; //NULL unless tracing, see trace.h
+#endif
+
+	const uint8_t	*rom; //cartridge ROM
+	uint32_t	romsize;
+	uint8_t		*sram; //cartridge RAM
+	uint32_t	sramsize;
+
+	uint8_t		mbc; //MBC_* controller type
+	uint8_t		cgb; //CGB mode, enables VRAM and WRAM banking
+	uint16_t	rombank; //bank mapped at 0x4000
+	uint8_t		rambank; //bank mapped at 0xA000
+	uint8_t		ramen; //cartridge RAM enabled
+	uint8_t		mode; //MBC1 banking mode
+	uint8_t		vbank; //CGB VRAM bank at 0x8000
+	uint8_t		wbank; //CGB WRAM bank at 0xD000
+	uint8_t		rtc[5]; //MBC3 clock registers 0x08-0x0C
+
+	uint64_t	divbase; //clock when DIV was last reset
+	uint64_t	timabase; //clock TIMA was last brought up to date at
+	uint8_t		dma; //OAM DMA in progress, OAM is off the bus
+	uint8_t		hdma; //CGB HBlank DMA in progress, see io.h
+	uint8_t		joypad; //buttons held, see io_joypad()
+	uint8_t		bgpal[64]; //CGB palette RAM, 8 palettes of 4 RGB555 colors
+	uint8_t		objpal[64];
+	sndstate	snd; //what the sound registers show, see apu.h
+
+	uint8_t		vram[2][VRAMBANK];
+	uint8_t		wram[8][WRAMBANK];
+	uint8_t		oam[0x100]; //0xFEA0 up is unusable and reads 0
+	uint8_t		io[0x80];
+	uint8_t		hram[0x80]; //0xFFFF is the interrupt enable register
+} bus;
+
+void	init_bus(bus *mem, uint8_t cgb);
+void	bus_map_rom(bus *mem, const uint8_t *rom, uint32_t size, uint8_t mbc);
+void	bus_map_sram(bus *mem, uint8_t *sram, uint32_t size);
+void	bus_remap(bus *mem);
+void	bus_map_page(bus *mem, uint8_t page, const uint8_t *rd, uint8_t *wr);
+void	bus_map_io(bus *mem, uint8_t page, bus_rdfn rdfn, bus_wrfn wrfn);
+void	bus_watch(bus *mem, uint8_t page, uint8_t mask);
+void	bus_unwatch(bus *mem, uint8_t page, uint8_t mask);
+void	bus_setwatch(bus *mem, const uint8_t *watch);
+uint8_t	*bus_backing(bus *mem, uint16_t addr);
+void	bus_read(bus *mem, uint16_t addr, uint8_t *buf, uint16_t len);
+void	bus_write(bus *mem, uint16_t addr, const uint8_t *buf, uint16_t len);
+void	bus_written(bus *mem, uint16_t addr, uint16_t len);
+#ifdef TRACE
+void	trace_write(struct tracer *t, uint16_t addr, uint8_t val);
+#endif
+
+/*
+ * Read a byte. Mapped pages are a single lookup, the callback only runs
+ * for side-effecting regions.
+ */
+static inline uint8_t rd8(bus *mem, uint16_t addr)
+{
+	const uint8_t *p = mem->rd[addr >> 0x8];
+
+	if (likely(p != 0))
+		return (p[addr & 0xFF]);
+	return (mem->rdfn[addr >> 0x8](mem, addr));
+}
+
+/*
+ * Write a byte.
+ */
+static inline void wr8(bus *mem, uint16_t addr, uint8_t val)
+{
+	uint8_t *p = mem->wr[addr >> 0x8];
+
+#ifdef TRACE
+	if (mem->trace)
+		trace_write(mem->trace, addr, val);
+#endif
+	if (likely(p != 0))
+		p[addr & 0xFF] = val;
+	else
+		mem->wrfn[addr >> 0x8](mem, addr, val);
+}
+
+/*
+ * The page showing the same memory through the echo area, or page itself.
+ * Anything watching writes to WRAM has to watch both.
+ */
+static inline uint8_t bus_mirror(uint8_t page)
+{
+	if (page >= 0xC0 && page < 0xDE)
+		return (page + 0x20);
+	if (page >= 0xE0 && page < 0xFE)
+		return (page - 0x20);
+	return (page);
+}
+
+static inline uint16_t rd16(bus *mem, uint16_t addr)
+{
+	return (rd8(mem, addr) | (rd8(mem, addr + 1) << 0x8));
+}
+
+static inline void wr16(bus *mem, uint16_t addr, uint16_t val)
+{
+	wr8(mem, addr, val & 0xFF);
+	wr8(mem, addr + 1, val >> 0x8);
+}
+
+#endif
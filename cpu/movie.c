@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "array.h"
+#include "movie.h"
+#include "rewind.h"
+
+#define MOVIE_MAGIC	"GBMV"
+#define MOVIE_VERSION	1
+
+//on disk, followed by the steps, the keyframe index and the keyframes
+typedef struct {
+	char		magic[4];
+	uint32_t	version;
+	char		title[16];
+	uint16_t	globalsum;
+	uint8_t		cgb;
+	uint8_t		pad;
+	uint32_t	start;
+	uint32_t	end;
+	uint32_t	hash;
+	uint32_t	keyevery;
+	uint32_t	size;
+	uint32_t	nsteps;
+	uint32_t	nkeys;
+} moviehdr;
+
+//a step on disk: the frame and then the buttons
+#define STEP_BYTES	5
+
+static int	add_key(movie *mv, machine *m);
+static int	same_rom(const movie *mv, const machine *m);
+static uint16_t	globalsum(const machine *m);
+
+
+/**
+ * Start recording a movie of m from its current frame on, with a keyframe
+ * every keyevery frames, 0 for MOVIE_KEYEVERY.
+ *
+ * Return 0 or MOVIE_ENOMEM.
+ */
+int movie_record(movie *mv, machine *m, uint32_t keyevery)
+{
+	memset(mv, 0, sizeof(movie));
+	memcpy(mv->title, m->cart.title, sizeof(mv->title));
+	mv->globalsum = globalsum(m);
+	mv->cgb = m->mem.cgb;
+	mv->start = m->frame;
+	mv->end = m->frame;
+	mv->keyevery = keyevery ? keyevery : MOVIE_KEYEVERY;
+	mv->size = machine_exportsize(m);
+	if (!(mv->img = (uint8_t *)malloc(mv->size)))
+		return (MOVIE_ENOMEM);
+	return (0);
+}
+
+/**
+ * Run the next frame of a recording with held buttons, JOY_* bits. The
+ * buttons go in as an input step, so the frame runs exactly like it
+ * will when the movie is played back.
+ *
+ * Return 0 or a MOVIE_E* error, MOVIE_ERANGE if m isn't at the end of the
+ * recording.
+ */
+int movie_frame(movie *mv, machine *m, uint8_t held)
+{
+	int err;
+
+	if (m->frame != mv->end || !mv->img)
+		return (MOVIE_ERANGE);
+	if ((m->frame - mv->start) % mv->keyevery == 0 && (err = add_key(mv, m)) < 0)
+		return (err);
+
+	if (!mv->nsteps || mv->steps[mv->nsteps - 1].held != held) {
+		if (array_reserve(&mv->steps, &mv->capsteps, mv->nsteps + 1,
+		    sizeof(inputstep)) < 0)
+			return (MOVIE_ENOMEM);
+		mv->steps[mv->nsteps].frame = m->frame;
+		mv->steps[mv->nsteps].held = held;
+		mv->nsteps++;
+	}
+
+	machine_input(m, mv->steps, mv->nsteps);
+	if (machine_run(m, 1) < 0)
+		return (MOVIE_EILLEGAL);
+	mv->end = m->frame;
+	return (0);
+}
+
+/**
+ * End a recording, noting the state it ended in so playback can be
+ * checked against it.
+ */
+void movie_stop(movie *mv, machine *m)
+{
+	mv->hash = machine_hash(m);
+	free(mv->img);
+	mv->img = NULL;
+}
+
+/**
+ * Return 0 or MOVIE_EOPEN.
+ */
+int movie_save(const movie *mv, const char *path)
+{
+	FILE *fp;
+	moviehdr hdr;
+	uint8_t step[STEP_BYTES];
+	size_t i;
+	int ok;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MOVIE_MAGIC, sizeof(hdr.magic));
+	hdr.version = MOVIE_VERSION;
+	memcpy(hdr.title, mv->title, sizeof(hdr.title));
+	hdr.globalsum = mv->globalsum;
+	hdr.cgb = mv->cgb;
+	hdr.start = mv->start;
+	hdr.end = mv->end;
+	hdr.hash = mv->hash;
+	hdr.keyevery = mv->keyevery;
+	hdr.size = mv->size;
+	hdr.nsteps = mv->nsteps;
+	hdr.nkeys = mv->nkeys;
+
+	if (!(fp = fopen(path, "wb")))
+		return (MOVIE_EOPEN);
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	for (i = 0; ok && i < mv->nsteps; i++) {
+		memcpy(step, &mv->steps[i].frame, sizeof(uint32_t));
+		step[4] = mv->steps[i].held;
+		ok = fwrite(step, STEP_BYTES, 1, fp) == 1;
+	}
+	if (ok && mv->nkeys)
+		ok = fwrite(mv->keys, sizeof(moviekey), mv->nkeys, fp) == mv->nkeys;
+	if (ok && mv->used)
+		ok = fwrite(mv->data, 1, mv->used, fp) == mv->used;
+	if (fclose(fp) != 0)
+		ok = 0;
+	return (ok ? 0 : MOVIE_EOPEN);
+}
+
+/**
+ * Read a movie written by movie_save().
+ *
+ * Return 0 or a MOVIE_E* error, MOVIE_EFORMAT if the file isn't a movie.
+ */
+int movie_load(movie *mv, const char *path)
+{
+	FILE *fp;
+	moviehdr hdr;
+	uint8_t step[STEP_BYTES];
+	long size;
+	size_t i, rest;
+
+	memset(mv, 0, sizeof(movie));
+	if (!(fp = fopen(path, "rb")))
+		return (MOVIE_EOPEN);
+	if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET) != 0)
+		goto bad;
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, MOVIE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != MOVIE_VERSION || hdr.nkeys == 0 || hdr.end < hdr.start)
+		goto bad;
+	rest = size - sizeof(hdr);
+	if ((uint64_t)hdr.nsteps * STEP_BYTES + (uint64_t)hdr.nkeys * sizeof(moviekey) > rest)
+		goto bad;
+	rest -= hdr.nsteps * STEP_BYTES + hdr.nkeys * sizeof(moviekey);
+
+	memcpy(mv->title, hdr.title, sizeof(mv->title));
+	mv->globalsum = hdr.globalsum;
+	mv->cgb = hdr.cgb;
+	mv->start = hdr.start;
+	mv->end = hdr.end;
+	mv->hash = hdr.hash;
+	mv->keyevery = hdr.keyevery;
+	mv->size = hdr.size;
+	mv->nsteps = mv->capsteps = hdr.nsteps;
+	mv->nkeys = mv->capkeys = hdr.nkeys;
+	mv->used = mv->cap = rest;
+	mv->steps = (inputstep *)malloc((mv->nsteps ? mv->nsteps : 1) * sizeof(inputstep));
+	mv->keys = (moviekey *)malloc(mv->nkeys * sizeof(moviekey));
+	mv->data = (uint8_t *)malloc(rest ? rest : 1);
+	if (!mv->steps || !mv->keys || !mv->data) {
+		fclose(fp);
+		movie_free(mv);
+		return (MOVIE_ENOMEM);
+	}
+
+	for (i = 0; i < mv->nsteps; i++) {
+		if (fread(step, STEP_BYTES, 1, fp) != 1)
+			goto bad;
+		memcpy(&mv->steps[i].frame, step, sizeof(uint32_t));
+		mv->steps[i].held = step[4];
+		if (i && mv->steps[i].frame < mv->steps[i - 1].frame)
+			goto bad;
+	}
+	if (fread(mv->keys, sizeof(moviekey), mv->nkeys, fp) != mv->nkeys ||
+	    (rest && fread(mv->data, 1, rest, fp) != rest))
+		goto bad;
+	//keyframes go up from the start and stay inside the data
+	for (i = 0; i < mv->nkeys; i++)
+		if (mv->keys[i].frame < (i ? mv->keys[i - 1].frame + 1 : mv->start) ||
+		    mv->keys[i].frame > mv->end || mv->keys[i].off > rest ||
+		    mv->keys[i].len > rest - mv->keys[i].off)
+			goto bad;
+	if (mv->keys[0].frame != mv->start)
+		goto bad;
+
+	fclose(fp);
+	return (0);
+
+bad:
+	fclose(fp);
+	movie_free(mv);
+	return (MOVIE_EFORMAT);
+}
+
+/**
+ * Put m at the start of frame of the movie, playing the movie's input
+ * from there on. A machine already playing it, between the keyframe
+ * before frame and frame, runs on from where it is, anything else loads
+ * that keyframe first. m has to be running the ROM the movie was made
+ * with.
+ *
+ * Return 0 or a MOVIE_E* error.
+ */
+int movie_seek(const movie *mv, machine *m, uint32_t frame)
+{
+	const moviekey *k;
+	uint8_t *img;
+	size_t lo = 0, hi = mv->nkeys, mid;
+	int err;
+
+	if (!same_rom(mv, m))
+		return (MOVIE_EROM);
+	if (!mv->nkeys || frame < mv->start || frame > mv->end)
+		return (MOVIE_ERANGE);
+
+	//last keyframe not past frame
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (mv->keys[mid].frame <= frame)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	k = &mv->keys[lo - 1];
+
+	if (m->script != mv->steps || m->frame < k->frame || m->frame > frame) {
+		if (!(img = (uint8_t *)calloc(1, mv->size)))
+			return (MOVIE_ENOMEM);
+		if (rewind_decode(img, mv->size, mv->data + k->off, k->len) < 0) {
+			free(img);
+			return (MOVIE_EFORMAT);
+		}
+		machine_input(m, mv->steps, mv->nsteps);
+		err = machine_import(m, img, mv->size);
+		free(img);
+		if (err < 0)
+			return (MOVIE_EROM);
+	}
+
+	if (machine_run(m, frame - m->frame) < 0)
+		return (MOVIE_EILLEGAL);
+	return (0);
+}
+
+void movie_free(movie *mv)
+{
+	free(mv->steps);
+	free(mv->keys);
+	free(mv->data);
+	free(mv->img);
+	memset(mv, 0, sizeof(movie));
+}
+
+const char *movie_strerror(int err)
+{
+	switch (err) {
+	case MOVIE_EOPEN: return ("can't open movie");
+	case MOVIE_EFORMAT: return ("not a movie");
+	case MOVIE_EROM: return ("movie is for another ROM");
+	case MOVIE_ERANGE: return ("frame outside the movie");
+	case MOVIE_ENOMEM: return ("out of memory");
+	case MOVIE_EILLEGAL: return ("illegal opcode");
+	default: return ("unknown error");
+	}
+}
+
+/*
+ * Keep the machine's state at the start of the current frame.
+ */
+static int add_key(movie *mv, machine *m)
+{
+	moviekey *k;
+
+	if (array_reserve(&mv->keys, &mv->capkeys, mv->nkeys + 1,
+	    sizeof(moviekey)) < 0 ||
+	    array_reserve(&mv->data, &mv->cap, mv->used + REWIND_ENCMAX(mv->size), 1) < 0)
+		return (MOVIE_ENOMEM);
+
+	machine_export(m, mv->img);
+	k = &mv->keys[mv->nkeys++];
+	k->frame = m->frame;
+	k->off = mv->used;
+	k->len = rewind_encode(mv->img, NULL, mv->size, mv->data + mv->used);
+	mv->used += k->len;
+	return (0);
+}
+
+static int same_rom(const movie *mv, const machine *m)
+{
+	return (strncmp(mv->title, m->cart.title, sizeof(mv->title)) == 0 &&
+	    mv->globalsum == globalsum(m) && mv->cgb == m->mem.cgb &&
+	    mv->size == machine_exportsize(m));
+}
+
+static uint16_t globalsum(const machine *m)
+{
+	return (m->cart.data[HDR_GLOBALSUM] << 0x8 | m->cart.data[HDR_GLOBALSUM + 1]);
+}
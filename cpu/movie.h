@@ -0,0 +1,67 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "machine.h"
+
+/*
+ * Input movies. A movie is the joypad state of every frame of a run,
+ * kept as the frames it changes at, plus a keyframe every so often: the
+ * whole machine state at the start of that frame, exported and run
+ * length encoded. Playing it back from a keyframe gives the same run bit
+ * for bit, so seeking to a frame is loading the nearest keyframe before
+ * it and running the rest of the way.
+ *
+ * On disk a movie is a header, the input steps, the keyframe index and
+ * the keyframes, in host byte order like the states in them.
+ */
+#define MOVIE_KEYEVERY	600 //frames between keyframes, 10 seconds
+
+//movie errors
+#define MOVIE_EOPEN	-1 //can't read or write the file
+#define MOVIE_EFORMAT	-2 //not a movie or a damaged one
+#define MOVIE_EROM	-3 //made with another ROM
+#define MOVIE_ERANGE	-4 //frame outside the movie
+#define MOVIE_ENOMEM	-5
+#define MOVIE_EILLEGAL	-6 //ran into an illegal opcode
+
+typedef struct {
+	uint32_t	frame; //machine frame it starts
+	uint32_t	len; //encoded length
+	uint64_t	off; //in data
+} moviekey;
+
+typedef struct {
+	char		title[16]; //of the ROM it was made with
+	uint16_t	globalsum;
+	uint8_t		cgb;
+	uint32_t	start; //frame of the first keyframe
+	uint32_t	end; //frame after the last one recorded
+	uint32_t	hash; //machine_hash() at end, 0 if not known
+	uint32_t	keyevery;
+	uint32_t	size; //machine_exportsize()
+
+	inputstep	*steps;
+	size_t		nsteps;
+	size_t		capsteps;
+	moviekey	*keys;
+	size_t		nkeys;
+	size_t		capkeys;
+	uint8_t		*data; //encoded keyframes
+	size_t		used;
+	size_t		cap;
+	uint8_t		*img; //scratch state while recording
+} movie;
+
+int		movie_record(movie *mv, machine *m, uint32_t keyevery);
+int		movie_frame(movie *mv, machine *m, uint8_t held);
+void		movie_stop(movie *mv, machine *m);
+int		movie_save(const movie *mv, const char *path);
+int		movie_load(movie *mv, const char *path);
+int		movie_seek(const movie *mv, machine *m, uint32_t frame);
+void		movie_free(movie *mv);
+const char	*movie_strerror(int err);
+
+#endif
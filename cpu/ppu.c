@@ -0,0 +1,659 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <tmmintrin.h>
+#endif
+
+#include "ppu.h"
+#include "io.h"
+
+#define LINE_TILES	21 //tiles a line can touch, with fine scrolling
+#define MAP0		0x1800 //tile maps, offsets into VRAM
+#define MAP1		0x1C00
+#define PAD		8 //sprite line margin, sprites start up to 8 pixels left of it
+
+//a tile's pixel bit, leftmost first, as bytes of a little endian word
+#define BITS		0x0102040810204080ULL
+#define BCAST		0x0101010101010101ULL
+
+typedef struct {
+	//n rows of tile data, low byte then high byte, to a color per pixel
+	void	(*expand)(const uint8_t *src, int n, uint8_t *out);
+	//a sprite row's colors over the sprites already on the line
+	void	(*place)(uint8_t *obj, uint64_t px, uint8_t tag);
+	//background and sprites to colors
+	void	(*mix)(const uint8_t *bg, const uint8_t *obj, uint8_t master, const ppu *p,
+		    uint16_t *out);
+} kernels;
+
+static void	draw(ppu *p, const bus *mem, const kernels *k, int cached, uint8_t ly,
+		    uint16_t *out);
+static int	window(const bus *mem, uint8_t ly);
+static void	fetch(ppu *p, const bus *mem, const kernels *k, int cached, uint16_t map,
+		    uint8_t tx, uint8_t y, uint8_t *out);
+static uint64_t	tilerow(const ppu *p, const bus *mem, const kernels *k, int cached,
+		    uint8_t bank, uint16_t tile, uint8_t row);
+static void	decode(ppu *p, const bus *mem, const kernels *k);
+static void	sprites(ppu *p, const bus *mem, const kernels *k, int cached, uint8_t ly,
+		    uint8_t *obj);
+static void	cover(ppu *p, int i, int on);
+static void	cover_all(ppu *p, const bus *mem, uint8_t h);
+static void	list(ppu *p, const bus *mem, uint8_t ly);
+static void	byx(const bus *mem, uint8_t *order, int n);
+static void	palettes(ppu *p, const bus *mem);
+static void	expand_c(const uint8_t *src, int n, uint8_t *out);
+static void	place_c(uint8_t *obj, uint64_t px, uint8_t tag);
+static void	mix_c(const uint8_t *bg, const uint8_t *obj, uint8_t master, const ppu *p,
+		    uint16_t *out);
+#ifdef __SSE2__
+static void	expand_v(const uint8_t *src, int n, uint8_t *out);
+static void	place_v(uint8_t *obj, uint64_t px, uint8_t tag);
+static void	mix_v(const uint8_t *bg, const uint8_t *obj, uint8_t master, const ppu *p,
+		    uint16_t *out);
+static void	mix_v3(const uint8_t *bg, const uint8_t *obj, uint8_t master, const ppu *p,
+		    uint16_t *out);
+#endif
+
+//by PPU_* level
+static const kernels kernel[3] = {
+	{ expand_c, place_c, mix_c },
+#ifdef __SSE2__
+	{ expand_v, place_v, mix_v },
+	{ expand_v, place_v, mix_v3 },
+#endif
+};
+
+//DMG shades as RGB555, lightest first
+static const uint16_t grey[4] = { 0x7FFF, 0x56B5, 0x294A, 0x0000 };
+
+
+/**
+ * Make a renderer, with the best kernels there are and a white screen.
+ *
+ * Return NULL if there's no memory for it.
+ */
+ppu *ppu_new(void)
+{
+	ppu *p;
+
+	if (!(p = (ppu *)calloc(1, sizeof(ppu))))
+		return (NULL);
+	p->simd = ppu_simd();
+	p->cgb = 0xFF; //no palettes yet
+	ppu_flush(p);
+	ppu_blank(p);
+	p->front ^= 1;
+	ppu_blank(p);
+	return (p);
+}
+
+void ppu_free(ppu *p)
+{
+	free(p);
+}
+
+/**
+ * Draw line ly of the frame in progress as the bus has it now. With
+ * check set it's drawn again by the scalar kernels straight from VRAM,
+ * without the decoded tiles, and lines that come out different are
+ * counted.
+ */
+void ppu_line(ppu *p, const bus *mem, uint8_t ly)
+{
+	const uint8_t *io = mem->io;
+	uint16_t *out, other[LCD_WIDTH];
+
+	if (ly >= LCD_HEIGHT)
+		return;
+
+	out = p->fb[p->front ^ 1][ly];
+	palettes(p, mem);
+	draw(p, mem, &kernel[p->simd], 1, ly, out);
+	if (p->check) {
+		draw(p, mem, &kernel[PPU_SCALAR], 0, ly, other);
+		if (memcmp(out, other, sizeof(other)) != 0)
+			p->mismatches++;
+	}
+	//the window only moves down on lines it was drawn on
+	if ((mem->cgb || io[IO_LCDC] & 0x1) && window(mem, ly))
+		p->winline++;
+	p->lines++;
+}
+
+/**
+ * The frame in progress is done and shows from now on.
+ */
+void ppu_vblank(ppu *p)
+{
+	p->front ^= 1;
+	p->winline = 0;
+	p->frames++;
+}
+
+/**
+ * The LCD went off, which shows white.
+ */
+void ppu_blank(ppu *p)
+{
+	int x, y;
+
+	for (y = 0; y < LCD_HEIGHT; y++)
+		for (x = 0; x < LCD_WIDTH; x++)
+			p->fb[p->front][y][x] = 0x7FFF;
+	p->winline = 0;
+}
+
+/**
+ * A write to addr in VRAM bank bank, which makes the tile there dirty.
+ */
+void ppu_touch(ppu *p, uint8_t bank, uint16_t addr)
+{
+	uint16_t tile = (addr & 0x1FFF) >> 4;
+
+	if (tile < PPU_TILES) {
+		p->dirty[bank & 0x1][tile >> 5] |= 1u << (tile & 31);
+		p->stale = 1;
+	}
+}
+
+/**
+ * A write to addr in OAM. A sprite moving up or down changes the lists of
+ * the lines it leaves and enters, on the DMG moving sideways changes the
+ * order on its lines.
+ */
+void ppu_oam(ppu *p, const bus *mem, uint16_t addr)
+{
+	int i = (addr & 0xFF) >> 2;
+
+	//no lines to keep up to date until they're made again
+	if (!p->objh || i >= 40)
+		return;
+	if ((addr & 0x3) == 0) {
+		cover(p, i, 0);
+		p->objy[i] = mem->oam[4 * i];
+		cover(p, i, 1);
+	} else if ((addr & 0x3) == 1 && !mem->cgb) {
+		cover(p, i, 1);
+	}
+}
+
+/**
+ * OAM was rewritten as a whole, the sprite lists are made again before
+ * the next line rather than updated write by write.
+ */
+void ppu_resort(ppu *p)
+{
+	p->objh = 0;
+}
+
+/**
+ * VRAM and OAM may hold anything now, every tile is decoded again and
+ * every sprite list made again.
+ */
+void ppu_flush(ppu *p)
+{
+	memset(p->dirty, 0xFF, sizeof(p->dirty));
+	p->stale = 1;
+	p->objh = 0;
+}
+
+/**
+ * Return the best kernels this host runs, PPU_SCALAR if there are no
+ * vector ones.
+ */
+int ppu_simd(void)
+{
+#ifdef __SSE2__
+	return (__builtin_cpu_supports("ssse3") ? PPU_SSSE3 : PPU_SSE2);
+#else
+	return (PPU_SCALAR);
+#endif
+}
+
+/**
+ * Write the frame showing as a binary PPM. Frames written one after
+ * another to the same file make a stream video tools can read.
+ *
+ * Return 0, -1 if writing failed.
+ */
+int ppu_ppm(const ppu *p, FILE *fp)
+{
+	uint8_t row[LCD_WIDTH * 3];
+	uint16_t c;
+	int x, y;
+
+	fprintf(fp, "P6\n%d %d\n255\n", LCD_WIDTH, LCD_HEIGHT);
+	for (y = 0; y < LCD_HEIGHT; y++) {
+		for (x = 0; x < LCD_WIDTH; x++) {
+			c = p->fb[p->front][y][x];
+			row[3 * x] = (c & 0x1F) << 3 | (c & 0x1F) >> 2;
+			row[3 * x + 1] = (c >> 5 & 0x1F) << 3 | (c >> 5 & 0x1F) >> 2;
+			row[3 * x + 2] = (c >> 10 & 0x1F) << 3 | (c >> 10 & 0x1F) >> 2;
+		}
+		fwrite(row, sizeof(row), 1, fp);
+	}
+	return (ferror(fp) ? -1 : 0);
+}
+
+/*
+ * Draw one line with kernels k, from the decoded tiles if cached is set.
+ * The DMG blanks the background and window with LCDC bit 0, the CGB
+ * keeps them and only takes their priority over sprites away.
+ */
+static void draw(ppu *p, const bus *mem, const kernels *k, int cached, uint8_t ly,
+    uint16_t *out)
+{
+	uint8_t bg[8 * LINE_TILES], win[8 * LINE_TILES], obj[PAD + 0x100 + 8];
+	const uint8_t *io = mem->io;
+	uint8_t lcdc = io[IO_LCDC], *line = bg;
+	int wx, from;
+
+	if (cached && p->stale)
+		decode(p, mem, k);
+
+	if (mem->cgb || lcdc & 0x1) {
+		fetch(p, mem, k, cached, lcdc & 0x8 ? MAP1 : MAP0, io[IO_SCX] >> 3,
+		    io[IO_SCY] + ly, bg);
+		line = bg + (io[IO_SCX] & 0x7);
+		if (window(mem, ly)) {
+			wx = io[IO_WX] - 7;
+			fetch(p, mem, k, cached, lcdc & 0x40 ? MAP1 : MAP0, 0, p->winline, win);
+			from = wx < 0 ? 0 : wx;
+			memcpy(line + from, win + from - wx, LCD_WIDTH - from);
+		}
+	} else {
+		memset(bg, 0, sizeof(bg));
+	}
+
+	memset(obj, 0, sizeof(obj));
+	if (lcdc & 0x2)
+		sprites(p, mem, k, cached, ly, obj);
+	k->mix(line, obj + PAD, mem->cgb && !(lcdc & 0x1) ? 0x0 : 0xFF, p, out);
+}
+
+/*
+ * Whether the window covers part of line ly.
+ */
+static int window(const bus *mem, uint8_t ly)
+{
+	const uint8_t *io = mem->io;
+
+	return ((io[IO_LCDC] & 0x20) && io[IO_WY] <= ly && io[IO_WX] <= 166);
+}
+
+/*
+ * Pixels of LINE_TILES tiles of map from column tx on, row y of the map,
+ * with the palette and priority from their CGB attributes.
+ */
+static void fetch(ppu *p, const bus *mem, const kernels *k, int cached, uint16_t map,
+    uint8_t tx, uint8_t y, uint8_t *out)
+{
+	uint8_t lcdc = mem->io[IO_LCDC], tile, attr = 0x0, row;
+	uint16_t at;
+	uint64_t px, line[LINE_TILES];
+	int i;
+
+	for (i = 0; i < LINE_TILES; i++) {
+		at = map + (y >> 3) * 32 + ((tx + i) & 31);
+		tile = mem->vram[0][at];
+		if (mem->cgb)
+			attr = mem->vram[1][at];
+		row = attr & 0x40 ? 7 - (y & 0x7) : y & 0x7;
+		px = tilerow(p, mem, k, cached, attr >> 3 & 0x1,
+		    lcdc & 0x10 ? tile : 0x100 + (int8_t)tile, row);
+		if (attr & 0x20)
+			px = __builtin_bswap64(px);
+		line[i] = px | ((attr & PX_PRIO) | (attr & 0x7) << 2) * BCAST;
+	}
+	memcpy(out, line, sizeof(line));
+	if (cached)
+		p->tilerows += LINE_TILES;
+}
+
+/*
+ * Colors of row row of tile, numbered from 0x8000 in VRAM bank bank,
+ * leftmost in the low byte: decoded ones, or straight from VRAM without
+ * cached.
+ */
+static uint64_t tilerow(const ppu *p, const bus *mem, const kernels *k, int cached,
+    uint8_t bank, uint16_t tile, uint8_t row)
+{
+	uint64_t px;
+
+	if (cached)
+		return (p->tiles[bank][tile][row]);
+	k->expand(mem->vram[bank] + tile * 16 + row * 2, 1, (uint8_t *)&px);
+	return (px);
+}
+
+/*
+ * Decode the tiles written since they last were, all of them at once so
+ * lines only look rows up.
+ */
+static void decode(ppu *p, const bus *mem, const kernels *k)
+{
+	uint32_t w;
+	int bank, i, tile;
+
+	for (bank = 0; bank < 2; bank++) {
+		for (i = 0; i < PPU_TILES / 32; i++) {
+			for (w = p->dirty[bank][i]; w; w &= w - 1) {
+				tile = 32 * i + __builtin_ctz(w);
+				k->expand(mem->vram[bank] + tile * 16, 8,
+				    (uint8_t *)p->tiles[bank][tile]);
+				p->tilemisses++;
+			}
+			p->dirty[bank][i] = 0;
+		}
+	}
+	p->stale = 0;
+}
+
+/*
+ * Put the first PPU_SPRITES sprites in OAM that are on line ly on the
+ * sprite line, which starts PAD bytes into obj. Sprites placed first
+ * win: on the CGB that's OAM order, on the DMG the leftmost. With cached
+ * set they come from the line's list, otherwise OAM is searched.
+ */
+static void sprites(ppu *p, const bus *mem, const kernels *k, int cached, uint8_t ly,
+    uint8_t *obj)
+{
+	uint8_t h = mem->io[IO_LCDC] & 0x4 ? 16 : 8, found[PPU_SPRITES], *order = found;
+	uint8_t attr, tile, bank;
+	const uint8_t *s;
+	uint64_t px;
+	int n = 0, i, row;
+
+	if (cached) {
+		if (p->objh != h)
+			cover_all(p, mem, h);
+		if (p->objstale[ly])
+			list(p, mem, ly);
+		order = p->objlist[ly];
+		n = p->objn[ly];
+	} else {
+		for (i = 0; i < 40 && n < PPU_SPRITES; i++) {
+			row = ly + 16 - mem->oam[4 * i];
+			if (row >= 0 && row < h)
+				found[n++] = i;
+		}
+		if (!mem->cgb)
+			byx(mem, found, n);
+	}
+
+	for (i = 0; i < n; i++) {
+		s = mem->oam + 4 * order[i];
+		attr = s[3];
+		row = ly + 16 - s[0];
+		if (attr & 0x40)
+			row = h - 1 - row;
+		tile = h == 16 ? s[2] & 0xFE : s[2];
+		bank = mem->cgb ? attr >> 3 & 0x1 : 0;
+		px = tilerow(p, mem, k, cached, bank, tile + (row >> 3), row & 0x7);
+		p->tilerows += cached;
+		if (attr & 0x20)
+			px = __builtin_bswap64(px);
+		k->place(obj + PAD + s[1] - 8, px, PX_OBJ |
+		    (mem->cgb ? attr & 0x7 : attr >> 4 & 0x1) << 2 | (attr & 0x80 ? PX_BEHIND : 0));
+	}
+}
+
+/*
+ * Put sprite i on the lines its Y has it on, or take it off them. Their
+ * lists are made again.
+ */
+static void cover(ppu *p, int i, int on)
+{
+	uint64_t bit = (uint64_t)1 << i;
+	int top = p->objy[i] - 16, ly;
+
+	for (ly = top < 0 ? 0 : top; ly < top + p->objh && ly < LCD_HEIGHT; ly++) {
+		p->objcover[ly] = on ? p->objcover[ly] | bit : p->objcover[ly] & ~bit;
+		p->objstale[ly] = 1;
+	}
+}
+
+/*
+ * Which sprites are on which lines with sprites h pixels high, from all
+ * of OAM.
+ */
+static void cover_all(ppu *p, const bus *mem, uint8_t h)
+{
+	int i;
+
+	memset(p->objcover, 0, sizeof(p->objcover));
+	memset(p->objstale, 1, sizeof(p->objstale));
+	p->objh = h;
+	for (i = 0; i < 40; i++) {
+		p->objy[i] = mem->oam[4 * i];
+		cover(p, i, 1);
+	}
+}
+
+/*
+ * Line ly's list: its first PPU_SPRITES sprites in the order they're
+ * placed.
+ */
+static void list(ppu *p, const bus *mem, uint8_t ly)
+{
+	uint64_t on;
+	int n = 0;
+
+	for (on = p->objcover[ly]; on && n < PPU_SPRITES; on &= on - 1)
+		p->objlist[ly][n++] = __builtin_ctzll(on);
+	if (!mem->cgb)
+		byx(mem, p->objlist[ly], n);
+	p->objn[ly] = n;
+	p->objstale[ly] = 0;
+	p->objlists++;
+}
+
+/*
+ * Sort sprites by X, ties staying in OAM order.
+ */
+static void byx(const bus *mem, uint8_t *order, int n)
+{
+	uint8_t next;
+	int i, j;
+
+	for (i = 1; i < n; i++) {
+		next = order[i];
+		for (j = i; j > 0 && mem->oam[4 * order[j - 1] + 1] > mem->oam[4 * next + 1]; j--)
+			order[j] = order[j - 1];
+		order[j] = next;
+	}
+}
+
+/*
+ * Bring the colors of every palette entry a pixel can have up to date:
+ * 8 background and 8 sprite palettes from CGB palette RAM, or BGP, OBP0
+ * and OBP1 in shades of grey. They rarely change, so they're only made
+ * again when what they're made from did.
+ */
+static void palettes(ppu *p, const bus *mem)
+{
+	const uint8_t *io = mem->io;
+	uint16_t *rgb = p->rgb;
+	int i;
+
+	if (mem->cgb) {
+		if (p->cgb == 1 && memcmp(p->palkey + 3, mem->bgpal, 64) == 0 &&
+		    memcmp(p->palkey + 3 + 64, mem->objpal, 64) == 0)
+			return;
+		memcpy(p->palkey + 3, mem->bgpal, 64);
+		memcpy(p->palkey + 3 + 64, mem->objpal, 64);
+		for (i = 0; i < 32; i++) {
+			rgb[i] = (mem->bgpal[2 * i] | mem->bgpal[2 * i + 1] << 8) & 0x7FFF;
+			rgb[32 + i] = (mem->objpal[2 * i] | mem->objpal[2 * i + 1] << 8) & 0x7FFF;
+		}
+	} else {
+		if (p->cgb == 0 && p->palkey[0] == io[IO_BGP] && p->palkey[1] == io[IO_OBP0] &&
+		    p->palkey[2] == io[IO_OBP1])
+			return;
+		p->palkey[0] = io[IO_BGP];
+		p->palkey[1] = io[IO_OBP0];
+		p->palkey[2] = io[IO_OBP1];
+		memset(rgb, 0, 64 * sizeof(uint16_t));
+		for (i = 0; i < 4; i++) {
+			rgb[i] = grey[io[IO_BGP] >> 2 * i & 0x3];
+			rgb[32 + i] = grey[io[IO_OBP0] >> 2 * i & 0x3];
+			rgb[36 + i] = grey[io[IO_OBP1] >> 2 * i & 0x3];
+		}
+	}
+	p->cgb = mem->cgb != 0;
+	for (i = 0; i < 64; i++) {
+		p->split[0][i] = rgb[i] & 0xFF;
+		p->split[1][i] = rgb[i] >> 0x8;
+	}
+}
+
+static void expand_c(const uint8_t *src, int n, uint8_t *out)
+{
+	int r, b;
+
+	for (r = 0; r < n; r++, src += 2)
+		for (b = 7; b >= 0; b--)
+			*out++ = (src[0] >> b & 0x1) | (src[1] >> b & 0x1) << 1;
+}
+
+static void place_c(uint8_t *obj, uint64_t px, uint8_t tag)
+{
+	uint8_t c;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		c = px >> 8 * i & PX_COLOR;
+		if (c && !obj[i])
+			obj[i] = tag | c;
+	}
+}
+
+/*
+ * A sprite pixel shows unless it's transparent, or the background pixel
+ * under it has a color and either of them asks for the background to be
+ * on top. master clears that for all of the line.
+ */
+static void mix_c(const uint8_t *bg, const uint8_t *obj, uint8_t master, const ppu *p,
+    uint16_t *out)
+{
+	const uint16_t *rgb = p->rgb;
+	uint8_t o, b;
+	int x;
+
+	for (x = 0; x < LCD_WIDTH; x++) {
+		o = obj[x];
+		b = bg[x];
+		if (o && !(master && (b & PX_COLOR) && (o & PX_BEHIND || b & PX_PRIO)))
+			out[x] = rgb[o & (PX_OBJ | PX_PAL | PX_COLOR)];
+		else
+			out[x] = rgb[b & (PX_PAL | PX_COLOR)];
+	}
+}
+
+#ifdef __SSE2__
+/*
+ * Two rows, or one in the low half with the other half 0: every byte of
+ * a row is ANDed with its pixel's bit, then compared with it.
+ */
+static inline __m128i expand2(uint8_t lo0, uint8_t hi0, uint8_t lo1, uint8_t hi1)
+{
+	__m128i bits = _mm_set1_epi64x(BITS);
+	__m128i l = _mm_set_epi64x(lo1 * BCAST, lo0 * BCAST);
+	__m128i h = _mm_set_epi64x(hi1 * BCAST, hi0 * BCAST);
+
+	l = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(l, bits), bits), _mm_set1_epi8(0x1));
+	h = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(h, bits), bits), _mm_set1_epi8(0x2));
+	return (_mm_or_si128(l, h));
+}
+
+static void expand_v(const uint8_t *src, int n, uint8_t *out)
+{
+	int r;
+
+	for (r = 0; r + 1 < n; r += 2, src += 4, out += 16)
+		_mm_storeu_si128((__m128i *)out, expand2(src[0], src[1], src[2], src[3]));
+	if (r < n)
+		_mm_storel_epi64((__m128i *)out, expand2(src[0], src[1], 0, 0));
+}
+
+static void place_v(uint8_t *obj, uint64_t px, uint8_t tag)
+{
+	__m128i cur = _mm_loadl_epi64((const __m128i *)obj);
+	__m128i v = _mm_loadl_epi64((const __m128i *)&px);
+	__m128i zero = _mm_setzero_si128();
+	__m128i clear = _mm_cmpeq_epi8(v, zero);
+
+	//only opaque pixels where nothing is yet
+	v = _mm_and_si128(_mm_cmpeq_epi8(cur, zero), _mm_or_si128(v, _mm_set1_epi8(tag)));
+	_mm_storel_epi64((__m128i *)obj, _mm_or_si128(cur, _mm_andnot_si128(clear, v)));
+}
+
+/*
+ * Palette entries of 16 pixels, see mix_c().
+ */
+static inline __m128i mix16(const uint8_t *bg, const uint8_t *obj, __m128i master)
+{
+	__m128i zero = _mm_setzero_si128(), o, b, none, bgclear, nopri, back;
+
+	o = _mm_loadu_si128((const __m128i *)obj);
+	b = _mm_loadu_si128((const __m128i *)bg);
+	none = _mm_cmpeq_epi8(o, zero);
+	bgclear = _mm_cmpeq_epi8(_mm_and_si128(b, _mm_set1_epi8(PX_COLOR)), zero);
+	nopri = _mm_cmpeq_epi8(_mm_or_si128(_mm_and_si128(o, _mm_set1_epi8(PX_BEHIND)),
+	    _mm_and_si128(b, _mm_set1_epi8((char)PX_PRIO))), zero);
+	//the background shows where there's no sprite or it's hidden
+	back = _mm_or_si128(none, _mm_andnot_si128(bgclear, _mm_andnot_si128(nopri, master)));
+	return (_mm_or_si128(
+	    _mm_andnot_si128(back, _mm_and_si128(o, _mm_set1_epi8(PX_OBJ | PX_PAL | PX_COLOR))),
+	    _mm_and_si128(back, _mm_and_si128(b, _mm_set1_epi8(PX_PAL | PX_COLOR)))));
+}
+
+/*
+ * SSE2 has no table lookup, the entries are looked up one by one.
+ */
+static void mix_v(const uint8_t *bg, const uint8_t *obj, uint8_t master, const ppu *p,
+    uint16_t *out)
+{
+	__m128i m = _mm_set1_epi8(master);
+	uint8_t ent[16];
+	int x, i;
+
+	for (x = 0; x < LCD_WIDTH; x += 16) {
+		_mm_storeu_si128((__m128i *)ent, mix16(bg + x, obj + x, m));
+		for (i = 0; i < 16; i++)
+			out[x + i] = p->rgb[ent[i]];
+	}
+}
+
+/*
+ * With SSSE3 the 64 entries are four byte shuffles, each for the low and
+ * the high bytes of 16 of them.
+ */
+__attribute__((target("ssse3")))
+static void mix_v3(const uint8_t *bg, const uint8_t *obj, uint8_t master, const ppu *p,
+    uint16_t *out)
+{
+	__m128i m = _mm_set1_epi8(master), zero = _mm_setzero_si128();
+	__m128i idx, lo, hi, nib, grp, sel, tlo[4], thi[4];
+	int x, k;
+
+	for (k = 0; k < 4; k++) {
+		tlo[k] = _mm_loadu_si128((const __m128i *)&p->split[0][16 * k]);
+		thi[k] = _mm_loadu_si128((const __m128i *)&p->split[1][16 * k]);
+	}
+	for (x = 0; x < LCD_WIDTH; x += 16) {
+		idx = mix16(bg + x, obj + x, m);
+		lo = zero;
+		hi = zero;
+		nib = _mm_and_si128(idx, _mm_set1_epi8(0xF));
+		grp = _mm_and_si128(_mm_srli_epi16(idx, 4), _mm_set1_epi8(0xF));
+		for (k = 0; k < 4; k++) {
+			sel = _mm_cmpeq_epi8(grp, _mm_set1_epi8(k));
+			lo = _mm_or_si128(lo, _mm_and_si128(sel, _mm_shuffle_epi8(tlo[k], nib)));
+			hi = _mm_or_si128(hi, _mm_and_si128(sel, _mm_shuffle_epi8(thi[k], nib)));
+		}
+		_mm_storeu_si128((__m128i *)(out + x), _mm_unpacklo_epi8(lo, hi));
+		_mm_storeu_si128((__m128i *)(out + x + 8), _mm_unpackhi_epi8(lo, hi));
+	}
+}
+#endif
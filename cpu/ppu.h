@@ -0,0 +1,89 @@
+#ifndef PPU_H
+#define PPU_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mem.h"
+
+/*
+ * Scanline renderer. The LCD timing in io.c hands every visible line to
+ * ppu_line() as its transfer ends, with the registers as they are then,
+ * so effects timed by line work and changes in the middle of one don't.
+ * Only machines with a ppu on the bus render, the rest pay nothing.
+ *
+ * A line is drawn in three passes. Background and window tiles become a
+ * byte per pixel holding the palette, the color and the CGB priority bit,
+ * sprites go on a second line the same way, and the two are mixed by
+ * priority into palette entries and looked up. With SSE2 the passes run
+ * on 8 or 16 pixels at once, and the lookup too on hosts with SSSE3 byte
+ * shuffles. The scalar kernels do the same a pixel at a time and are what
+ * other hosts get.
+ *
+ * Tiles are kept decoded, a color byte per pixel, so lines are put
+ * together from ready rows. The machine watches the tile data while it
+ * has a screen and ppu_touch() marks the tiles written as dirty, they're
+ * decoded again before the next line is drawn. Sprites are found the
+ * same way: every line keeps a list of the sprites on it, which OAM writes
+ * passed to ppu_oam() keep up to date, and OAM DMA has made again in one
+ * go with ppu_resort(). Anything that changes VRAM or OAM behind the
+ * bus's back has to call ppu_flush().
+ */
+#define LCD_WIDTH	160
+#define LCD_HEIGHT	144
+#define PPU_SPRITES	10 //per line
+#define PPU_PALKEY	(3 + 2 * 64) //what palette entries are made from
+#define PPU_TILES	384 //per VRAM bank
+
+//kernels, by what they need
+#define PPU_SCALAR	0
+#define PPU_SSE2	1
+#define PPU_SSSE3	2
+
+//pixel bytes
+#define PX_COLOR	0x03 //color in the tile, 0 is transparent for sprites
+#define PX_PAL		0x1C //palette
+#define PX_OBJ		0x20 //sprite, its palette entries follow the background's
+#define PX_BEHIND	0x40 //sprite behind background colors 1-3
+#define PX_PRIO		0x80 //CGB background over sprites
+
+typedef struct ppu {
+	uint16_t	fb[2][LCD_HEIGHT][LCD_WIDTH]; //RGB555, red in the low bits
+	uint8_t		front; //frame buffer finished last
+	uint8_t		winline; //window line drawn next
+	uint8_t		simd; //PPU_* kernels drawing
+	uint8_t		check; //draw every line with the scalar ones from VRAM too and compare
+	uint8_t		cgb; //palettes below are CGB ones
+	uint8_t		palkey[PPU_PALKEY]; //BGP, OBP0, OBP1 and palette RAM they're from
+	uint16_t	rgb[64]; //palette entries, background then sprites
+	uint8_t		split[2][64]; //their low and high bytes, for byte shuffles
+	uint64_t	tiles[2][PPU_TILES][8]; //decoded rows, leftmost pixel in the low byte
+	uint32_t	dirty[2][PPU_TILES / 32]; //tiles to decode before they're used
+	uint8_t		stale; //some are
+	uint64_t	objcover[LCD_HEIGHT]; //sprites on each line, a bit each by OAM index
+	uint8_t		objlist[LCD_HEIGHT][PPU_SPRITES]; //first ones of them, in the order placed
+	uint8_t		objn[LCD_HEIGHT]; //in the list
+	uint8_t		objstale[LCD_HEIGHT]; //list to make again from objcover
+	uint8_t		objy[40]; //Y each sprite covers its lines for
+	uint8_t		objh; //sprite height they're for, 0 to find them all again
+	uint64_t	frames; //finished
+	uint64_t	lines;
+	uint64_t	mismatches; //lines the kernels drew differently
+	uint64_t	tilerows; //decoded tile rows used
+	uint64_t	tilemisses; //tiles decoded, each a miss for the row that needed it
+	uint64_t	objlists; //sprite lists made
+} ppu;
+
+ppu		*ppu_new(void);
+void		ppu_free(ppu *p);
+void		ppu_line(ppu *p, const bus *mem, uint8_t ly);
+void		ppu_vblank(ppu *p);
+void		ppu_blank(ppu *p);
+void		ppu_touch(ppu *p, uint8_t bank, uint16_t addr);
+void		ppu_oam(ppu *p, const bus *mem, uint16_t addr);
+void		ppu_resort(ppu *p);
+void		ppu_flush(ppu *p);
+int		ppu_simd(void);
+int		ppu_ppm(const ppu *p, FILE *fp);
+
+#endif
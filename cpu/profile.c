@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "profile.h"
+
+typedef struct {
+	const char	*name;
+	uint64_t	count;
+	uint64_t	ticks;
+} profclass;
+
+static void	enter(profile *p, uint32_t func);
+static void	leave(profile *p);
+static void	where(const profile *p, uint32_t index, char *buf, size_t len);
+static void	stack(const profile *p, uint32_t n, FILE *fp);
+static int	by_ticks(const void *a, const void *b);
+
+
+/**
+ * A profile for a cartridge of romsize bytes, to hang on a bus.
+ */
+profile *prof_new(uint32_t romsize)
+{
+	profile *p;
+
+	if (!(p = (profile *)calloc(1, sizeof(profile))))
+		return (NULL);
+	p->nbanks = romsize / ROMBANK ? romsize / ROMBANK : 2;
+	p->hits = (uint64_t *)calloc((p->nbanks + 2) * (size_t)ROMBANK, sizeof(uint64_t));
+	p->node = (profnode *)calloc(PROF_NODES, sizeof(profnode));
+	if (!p->hits || !p->node) {
+		prof_free(p);
+		return (NULL);
+	}
+	p->nnodes = 1;
+	return (p);
+}
+
+void prof_free(profile *p)
+{
+	if (!p)
+		return;
+	free(p->hits);
+	free(p->node);
+	free(p);
+}
+
+/**
+ * The instruction before was a call or a return, taken if it didn't fall
+ * through to pc.
+ */
+void prof_settle(profile *p, const bus *mem, uint16_t pc)
+{
+	uint8_t kind = p->prevkind;
+
+	p->prevkind = PK_NONE;
+	if (pc == (uint16_t)(p->prevpc + p->prevlen))
+		return;
+	if (kind == PK_CALL)
+		enter(p, prof_index(p, mem, pc));
+	else
+		leave(p);
+}
+
+/**
+ * An interrupt is taken, returning to ret.
+ */
+void prof_irq(profile *p, const bus *mem, uint16_t ret, uint16_t vector)
+{
+	if (p->prevkind != PK_NONE)
+		prof_settle(p, mem, ret);
+	enter(p, prof_index(p, mem, vector));
+}
+
+/**
+ * Write the counts, tab separated, one per line with the kind first:
+ * op and cb per opcode, class per handler class by host time, bank per
+ * ROM bank or RAM and pc for the hottest addresses in each.
+ *
+ * Return 0, -1 if writing failed.
+ */
+int prof_report(const profile *p, FILE *fp)
+{
+	profclass cls[512];
+	struct {
+		uint32_t	at; //PC index
+		uint64_t	count;
+	} top[PROF_TOP];
+	uint64_t total = 0, inbank, *h;
+	uint32_t bank, i, j, n = 0, ntop;
+	char name[16];
+	int op;
+
+	for (op = 0; op < 512; op++)
+		total += p->ticks[op];
+	fprintf(fp, "#%lu instructions, %lu ticks, %u call stacks, %lu calls untracked\n",
+	    (unsigned long)p->insns, (unsigned long)total, p->nnodes, (unsigned long)p->lost);
+
+	fprintf(fp, "#kind\topcode\tname\tcount\tticks\n");
+	for (op = 0; op < 512; op++) {
+		const uint64_t count = op < 256 ? p->ops[op] : p->cbops[op - 256];
+
+		if (!count)
+			continue;
+		fprintf(fp, "%s\t%02X\t%s\t%lu\t%lu\n", op < 256 ? "op" : "cb", op & 0xFF,
+		    opcode_name(op & 0xFF, op >= 256), (unsigned long)count,
+		    (unsigned long)p->ticks[op]);
+	}
+
+	//opcodes sharing a handler are one class
+	for (op = 0; op < 512; op++) {
+		const char *cname = opcode_name(op & 0xFF, op >= 256);
+
+		for (i = 0; i < n && strcmp(cls[i].name, cname) != 0; i++)
+			;
+		if (i == n) {
+			cls[n].name = cname;
+			cls[n].count = cls[n].ticks = 0;
+			n++;
+		}
+		cls[i].count += op < 256 ? p->ops[op] : p->cbops[op - 256];
+		cls[i].ticks += p->ticks[op];
+	}
+	qsort(cls, n, sizeof(profclass), by_ticks);
+	fprintf(fp, "#kind\tclass\tcount\tticks\tshare\tticks_insn\n");
+	for (i = 0; i < n && cls[i].count; i++)
+		fprintf(fp, "class\t%s\t%lu\t%lu\t%.2f%%\t%.1f\n", cls[i].name,
+		    (unsigned long)cls[i].count, (unsigned long)cls[i].ticks,
+		    total ? 100.0 * cls[i].ticks / total : 0.0,
+		    (double)cls[i].ticks / cls[i].count);
+
+	fprintf(fp, "#kind\twhere\tcount\n");
+	for (bank = 0; bank <= p->nbanks; bank++) {
+		h = p->hits + (size_t)bank * ROMBANK;
+		inbank = 0;
+		ntop = 0;
+		//RAM is twice the size of a bank
+		for (j = 0; j < (bank < p->nbanks ? ROMBANK : 2 * ROMBANK); j++) {
+			if (!h[j])
+				continue;
+			inbank += h[j];
+			if (ntop < PROF_TOP)
+				ntop++;
+			else if (h[j] <= top[ntop - 1].count)
+				continue;
+			//keep the hottest, hottest first
+			for (i = ntop - 1; i > 0 && top[i - 1].count < h[j]; i--)
+				top[i] = top[i - 1];
+			top[i].count = h[j];
+			top[i].at = bank * ROMBANK + j;
+		}
+		if (!inbank)
+			continue;
+		if (bank < p->nbanks)
+			fprintf(fp, "bank\trom%u\t%lu\n", bank, (unsigned long)inbank);
+		else
+			fprintf(fp, "bank\tram\t%lu\n", (unsigned long)inbank);
+		for (i = 0; i < ntop; i++) {
+			where(p, top[i].at, name, sizeof(name));
+			fprintf(fp, "pc\t%s\t%lu\n", name, (unsigned long)top[i].count);
+		}
+	}
+	return (ferror(fp) ? -1 : 0);
+}
+
+/**
+ * Write host time per guest call stack in the folded format flame graph
+ * tools read: the functions from the outermost in, separated by ;, then
+ * the time spent in the innermost one itself.
+ *
+ * Return 0, -1 if writing failed.
+ */
+int prof_folded(const profile *p, FILE *fp)
+{
+	uint32_t n;
+
+	for (n = 0; n < p->nnodes; n++) {
+		if (!p->node[n].ticks)
+			continue;
+		stack(p, n, fp);
+		fprintf(fp, " %lu\n", (unsigned long)p->node[n].ticks);
+	}
+	return (ferror(fp) ? -1 : 0);
+}
+
+/*
+ * Go into the callee func of the running node, past the tree's limits the
+ * caller gets its time.
+ */
+static void enter(profile *p, uint32_t func)
+{
+	profnode *cur = &p->node[p->cur], *c;
+	uint32_t n;
+
+	if (p->deep || cur->depth >= PROF_DEPTH) {
+		p->deep++;
+		p->lost++;
+		return;
+	}
+	for (n = cur->child; n; n = p->node[n].sibling) {
+		if (p->node[n].func == func) {
+			p->cur = n;
+			return;
+		}
+	}
+	if (p->nnodes == PROF_NODES) {
+		p->deep++;
+		p->lost++;
+		return;
+	}
+
+	n = p->nnodes++;
+	c = &p->node[n];
+	c->func = func;
+	c->parent = p->cur;
+	c->sibling = cur->child;
+	c->depth = cur->depth + 1;
+	cur->child = n;
+	p->cur = n;
+}
+
+static void leave(profile *p)
+{
+	if (p->deep)
+		p->deep--;
+	else if (p->cur)
+		p->cur = p->node[p->cur].parent;
+}
+
+/*
+ * Name a PC index: rom3:4A20 or ram:C000.
+ */
+static void where(const profile *p, uint32_t index, char *buf, size_t len)
+{
+	uint32_t bank = index / ROMBANK;
+
+	if (bank >= p->nbanks)
+		snprintf(buf, len, "ram:%04X", 2 * ROMBANK + index - p->nbanks * ROMBANK);
+	else
+		snprintf(buf, len, "rom%u:%04X", bank, (bank ? ROMBANK : 0) + index % ROMBANK);
+}
+
+static void stack(const profile *p, uint32_t n, FILE *fp)
+{
+	char name[16];
+
+	if (n == 0) {
+		fputs("main", fp);
+		return;
+	}
+	stack(p, p->node[n].parent, fp);
+	where(p, p->node[n].func, name, sizeof(name));
+	fprintf(fp, ";%s", name);
+}
+
+static int by_ticks(const void *a, const void *b)
+{
+	const profclass *x = (const profclass *)a, *y = (const profclass *)b;
+
+	if (x->ticks != y->ticks)
+		return (x->ticks < y->ticks ? 1 : -1);
+	return (x->count < y->count ? 1 : x->count > y->count ? -1 : 0);
+}
@@ -0,0 +1,169 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+#endif
+
+#include "mem.h"
+
+/*
+ * Guest code profiler. Built in only with PROFILE defined, otherwise the
+ * PROF_* hooks in the interpreters expand to nothing and the bus has no
+ * profile pointer, so a normal build pays nothing for it.
+ *
+ * Every interpreted instruction is counted per opcode, base and CB, and
+ * per PC, which is keyed by the ROM bank mapped there, or one shared
+ * region for code in RAM. The host time between two instructions goes to
+ * the first one. Calls, RSTs and interrupts that are taken enter a node
+ * of a calling context tree and returns leave it, so time can also be
+ * reported per guest call stack, as folded stacks for flame graphs.
+ *
+ * Profiled machines don't run recompiled blocks, the hooks only see
+ * interpreted code.
+ */
+#define PROF_NODES	4096 //call stacks told apart, deeper ones go to the caller
+#define PROF_DEPTH	64 //deepest call stack tracked
+#define PROF_TOP	16 //hottest addresses reported per bank
+
+//what the instruction before may have done to the call stack
+#define PK_NONE		0
+#define PK_CALL		1 //CALL, CALL cc or RST
+#define PK_RET		2 //RET, RET cc or RETI
+
+typedef struct {
+	uint32_t	func; //PC index of the first instruction, see prof_index()
+	uint32_t	parent;
+	uint32_t	child; //first callee
+	uint32_t	sibling; //next callee of the parent
+	uint32_t	depth;
+	uint64_t	insns; //run in the function itself
+	uint64_t	ticks;
+} profnode;
+
+typedef struct profile {
+	uint64_t	ops[256];
+	uint64_t	cbops[256];
+	uint64_t	ticks[512]; //host time per opcode, CB ones from 256 on
+	uint64_t	insns;
+	uint64_t	*hits; //per PC index
+	uint32_t	nbanks; //ROM banks, RAM code comes after them
+
+	profnode	*node; //node 0 is the code outside any call
+	uint32_t	nnodes;
+	uint32_t	cur; //node running now
+	uint32_t	deep; //calls past the tree still to return from
+	uint64_t	lost; //calls that got no node of their own
+
+	uint64_t	last; //clock at the last instruction, 0 before the first
+	uint32_t	prevnode;
+	uint16_t	prevop; //opcode, 256 up for CB ones
+	uint16_t	prevpc;
+	uint8_t		prevlen;
+	uint8_t		prevkind; //PK_*
+} profile;
+
+profile	*prof_new(uint32_t romsize);
+void	prof_free(profile *p);
+void	prof_settle(profile *p, const bus *mem, uint16_t pc);
+void	prof_irq(profile *p, const bus *mem, uint16_t ret, uint16_t vector);
+int	prof_report(const profile *p, FILE *fp);
+int	prof_folded(const profile *p, FILE *fp);
+
+/*
+ * Host clock, cheap enough to read every instruction.
+ */
+static inline uint64_t prof_clock(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	return (__rdtsc());
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+/*
+ * Where pc is in ROM or RAM: bank * 0x4000 plus the offset into the bank
+ * for ROM, past the last bank for RAM.
+ */
+static inline uint32_t prof_index(const profile *p, const bus *mem, uint16_t pc)
+{
+	if (pc < ROMBANK)
+		return (pc);
+	if (pc < 2 * ROMBANK)
+		return ((mem->rombank % p->nbanks) * ROMBANK + pc - ROMBANK);
+	return (p->nbanks * ROMBANK + pc - 2 * ROMBANK);
+}
+
+/*
+ * An instruction at pc is about to run.
+ */
+static inline void prof_insn(profile *p, const bus *mem, uint16_t pc, uint8_t opc)
+{
+	uint64_t now = prof_clock();
+
+	if (p->last) {
+		p->ticks[p->prevop] += now - p->last;
+		p->node[p->prevnode].ticks += now - p->last;
+	}
+	p->last = now;
+	if (p->prevkind != PK_NONE)
+		prof_settle(p, mem, pc);
+
+	p->ops[opc]++;
+	p->insns++;
+	p->hits[prof_index(p, mem, pc)]++;
+	p->node[p->cur].insns++;
+	p->prevop = opc;
+	p->prevpc = pc;
+	p->prevnode = p->cur;
+	if (opc == 0xCD || (opc & 0xE7) == 0xC4 || (opc & 0xC7) == 0xC7) {
+		p->prevkind = PK_CALL;
+		p->prevlen = (opc & 0xC7) == 0xC7 ? 1 : 3;
+	} else if (opc == 0xC9 || opc == 0xD9 || (opc & 0xE7) == 0xC0) {
+		p->prevkind = PK_RET;
+		p->prevlen = 1;
+	}
+}
+
+/*
+ * The instruction just counted was a CB prefix for opc.
+ */
+static inline void prof_cb(profile *p, uint8_t opc)
+{
+	p->cbops[opc]++;
+	p->prevop = 0x100 + opc;
+}
+
+#ifdef PROFILE
+#define PROF_INSN(mem, pc, opc) \
+	do { if ((mem)->prof) prof_insn((mem)->prof, mem, pc, opc); } while (0)
+#define PROF_CB(mem, opc) \
+	do { if ((mem)->prof) prof_cb((mem)->prof, opc); } while (0)
+//an instruction with its immediate, the CB opcode for a CB prefix
+#define PROF_OP(mem, pc, opc, imm) \
+	do { \
+		if ((mem)->prof) { \
+			prof_insn((mem)->prof, mem, pc, opc); \
+			if ((opc) == 0xCB) \
+				prof_cb((mem)->prof, imm); \
+		} \
+	} while (0)
+#define PROF_IRQ(mem, ret, vector) \
+	do { if ((mem)->prof) prof_irq((mem)->prof, mem, ret, vector); } while (0)
+#define PROF_ACTIVE(mem)	((mem)->prof != NULL)
+#else
+#define PROF_INSN(mem, pc, opc)
+#define PROF_CB(mem, opc)
+#define PROF_OP(mem, pc, opc, imm)
+#define PROF_IRQ(mem, ret, vector)
+#define PROF_ACTIVE(mem)	0
+#endif
+
+#endif
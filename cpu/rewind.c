@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+
+#define ENTRY(rw, i)	(&(rw)->frames[((rw)->first + (i)) % (rw)->maxframes])
+#define NEWEST(rw)	ENTRY(rw, (rw)->n - 1)
+
+static void	drop_oldest(rewinder *rw);
+static void	drop_newest(rewinder *rw);
+static uint8_t	*put_varint(uint8_t *out, size_t v);
+static int	get_varint(const uint8_t **in, const uint8_t *end, size_t *v);
+
+
+/**
+ * Set up an empty history of bytes bytes for m, with a keyframe every
+ * keyevery frames, 0 for REWIND_KEYEVERY.
+ *
+ * Return -1 if there's no memory for it or bytes is 4G or more.
+ */
+int rewind_init(rewinder *rw, const machine *m, size_t bytes, uint32_t keyevery)
+{
+	memset(rw, 0, sizeof(rewinder));
+	if (bytes > UINT32_MAX)
+		return (-1);
+	rw->cap = bytes;
+	rw->keyevery = keyevery ? keyevery : REWIND_KEYEVERY;
+	rw->size = machine_statesize(m);
+	//frames that small are rare, past that the ring is the limit
+	rw->maxframes = bytes / 128 + 1;
+
+	rw->ring = (uint8_t *)malloc(bytes);
+	rw->frames = (rewindframe *)malloc(rw->maxframes * sizeof(rewindframe));
+	rw->cur = (uint8_t *)malloc(rw->size);
+	rw->img = (uint8_t *)malloc(rw->size);
+	rw->enc = (uint8_t *)malloc(2 * REWIND_ENCMAX(rw->size));
+	if (!rw->ring || !rw->frames || !rw->cur || !rw->img || !rw->enc) {
+		rewind_free(rw);
+		return (-1);
+	}
+	return (0);
+}
+
+void rewind_free(rewinder *rw)
+{
+	free(rw->ring);
+	free(rw->frames);
+	free(rw->cur);
+	free(rw->img);
+	free(rw->enc);
+	memset(rw, 0, sizeof(rewinder));
+}
+
+/**
+ * Add the machine's current state as the newest frame. Frames at or past
+ * its frame number are dropped first, so pushing after going back starts
+ * a new timeline from there.
+ *
+ * Return -1 if m isn't the machine the history is for or a frame doesn't
+ * fit in the ring at all.
+ */
+int rewind_push(rewinder *rw, machine *m)
+{
+	rewindframe *e;
+	size_t dlen = 0, klen = 0, off;
+	uint8_t *swap;
+	int wrap;
+
+	if (machine_statesize(m) != rw->size)
+		return (-1);
+	while (rw->n && NEWEST(rw)->frame >= m->frame)
+		drop_newest(rw);
+
+	machine_pack(m, rw->img);
+	if (rw->n)
+		dlen = rewind_encode(rw->img, rw->cur, rw->size, rw->enc);
+	if (rw->n == 0 || ++rw->sincekey >= rw->keyevery) {
+		klen = rewind_encode(rw->img, NULL, rw->size, rw->enc + dlen);
+		rw->sincekey = 0;
+	}
+	if (dlen + klen > rw->cap)
+		return (-1);
+
+	//frames are never split, one that doesn't fit at the end goes to the
+	//start and everything left past wpos is older than what's before it
+	off = rw->wpos;
+	wrap = off + dlen + klen > rw->cap;
+	if (wrap) {
+		off = 0;
+		while (rw->n && ENTRY(rw, 0)->off >= rw->wpos)
+			drop_oldest(rw);
+	}
+	while (rw->n && (rw->n == rw->maxframes ||
+	    (ENTRY(rw, 0)->off >= off && ENTRY(rw, 0)->off < off + dlen + klen)))
+		drop_oldest(rw);
+
+	memcpy(rw->ring + off, rw->enc, dlen + klen);
+	rw->n++;
+	e = NEWEST(rw);
+	e->frame = m->frame;
+	e->off = off;
+	e->dlen = dlen;
+	e->klen = klen;
+	rw->wpos = off + dlen + klen;
+	rw->used += dlen + klen;
+
+	swap = rw->cur;
+	rw->cur = rw->img;
+	rw->img = swap;
+	return (0);
+}
+
+/**
+ * Put the machine back one frame, dropping the newest one.
+ *
+ * Return -1 if there's nothing to go back to or the frame doesn't decode.
+ */
+int rewind_back(rewinder *rw, machine *m)
+{
+	rewindframe *e;
+
+	if (rw->n < 2)
+		return (-1);
+	e = NEWEST(rw);
+	if (rewind_decode(rw->cur, rw->size, rw->ring + e->off, e->dlen) < 0)
+		return (-1);
+	drop_newest(rw);
+	return (machine_unpack(m, rw->cur));
+}
+
+/**
+ * Put the machine back to frame, dropping every frame after it. Starts
+ * from the newest frame or the closest keyframe, whichever is fewer
+ * deltas away.
+ *
+ * Return -1 if the frame isn't in the history or doesn't decode.
+ */
+int rewind_seek(rewinder *rw, machine *m, uint32_t frame)
+{
+	rewindframe *e;
+	size_t lo = 0, hi = rw->n, j, k, from, cost;
+	uint8_t *swap;
+
+	while (lo < hi) {
+		j = (lo + hi) / 2;
+		if (ENTRY(rw, j)->frame < frame)
+			lo = j + 1;
+		else
+			hi = j;
+	}
+	if (lo == rw->n || ENTRY(rw, lo)->frame != frame)
+		return (-1);
+	j = lo;
+
+	//from the newest frame back, or the nearest keyframe either side
+	from = rw->n - 1;
+	cost = from - j;
+	for (k = j; k < rw->n && k - j + 1 < cost; k++) {
+		if (ENTRY(rw, k)->klen) {
+			from = k;
+			cost = k - j + 1;
+			break;
+		}
+	}
+	for (k = j + 1; k-- > 0 && j - k + 1 < cost;) {
+		if (ENTRY(rw, k)->klen) {
+			from = k;
+			cost = j - k + 1;
+			break;
+		}
+	}
+
+	if (from != rw->n - 1) {
+		e = ENTRY(rw, from);
+		memset(rw->img, 0, rw->size);
+		if (rewind_decode(rw->img, rw->size, rw->ring + e->off + e->dlen,
+		    e->klen) < 0)
+			return (-1);
+		swap = rw->cur;
+		rw->cur = rw->img;
+		rw->img = swap;
+	}
+	//deltas work both ways
+	for (k = from; k > j; k--) {
+		e = ENTRY(rw, k);
+		if (rewind_decode(rw->cur, rw->size, rw->ring + e->off, e->dlen) < 0)
+			return (-1);
+	}
+	for (k = from + 1; k <= j; k++) {
+		e = ENTRY(rw, k);
+		if (rewind_decode(rw->cur, rw->size, rw->ring + e->off, e->dlen) < 0)
+			return (-1);
+	}
+
+	while (rw->n > j + 1)
+		drop_newest(rw);
+	return (machine_unpack(m, rw->cur));
+}
+
+void rewind_stats(const rewinder *rw, rewindstats *st)
+{
+	size_t i;
+
+	memset(st, 0, sizeof(rewindstats));
+	st->frames = rw->n;
+	for (i = 0; i < rw->n; i++)
+		if (ENTRY(rw, i)->klen)
+			st->keyframes++;
+	st->bytes = rw->used;
+	st->raw = (uint64_t)rw->n * rw->size;
+	st->memory = rw->cap + rw->maxframes * sizeof(rewindframe) +
+	    2 * rw->size + 2 * REWIND_ENCMAX(rw->size);
+	st->ratio = st->bytes ? (double)st->raw / st->bytes : 0.0;
+}
+
+/**
+ * Run length encode a XOR b, b NULL for zeros: pairs of a count of zero
+ * bytes to skip and a count of literal bytes that follow, both varints.
+ * Literals only end at four zeros in a row, so a pair costs at most two
+ * bytes more than the five it covers, and trailing zeros cost nothing.
+ *
+ * Return the encoded length.
+ */
+size_t rewind_encode(const uint8_t *a, const uint8_t *b, size_t n, uint8_t *out)
+{
+	uint8_t *o = out;
+	size_t i = 0, z, lit, k;
+	uint64_t wa, wb = 0;
+
+#define SAME(i)	(a[i] == (b ? b[i] : 0))
+	while (i < n) {
+		z = i;
+		for (; i + 8 <= n; i += 8) {
+			memcpy(&wa, a + i, 8);
+			if (b)
+				memcpy(&wb, b + i, 8);
+			if (wa != wb)
+				break;
+		}
+		while (i < n && SAME(i))
+			i++;
+		if (i == n)
+			break;
+		z = i - z;
+
+		lit = i;
+		while (i < n) {
+			for (k = 0; k < 4 && i + k < n && SAME(i + k); k++)
+				;
+			if (k == 4 || i + k == n)
+				break;
+			i += k + 1;
+		}
+		o = put_varint(o, z);
+		o = put_varint(o, i - lit);
+		for (k = lit; k < i; k++)
+			*o++ = a[k] ^ (b ? b[k] : 0);
+	}
+#undef SAME
+
+	return (o - out);
+}
+
+/**
+ * XOR an encoding of len bytes into the n bytes at dst.
+ *
+ * Return -1 if it's cut short or runs past the end of dst, which is then
+ * only partly decoded.
+ */
+int rewind_decode(uint8_t *dst, size_t n, const uint8_t *in, size_t len)
+{
+	const uint8_t *end = in + len;
+	size_t at = 0, skip, lit;
+
+	while (in < end) {
+		if (get_varint(&in, end, &skip) < 0 || skip > n - at)
+			return (-1);
+		at += skip;
+		if (get_varint(&in, end, &lit) < 0 || lit > n - at ||
+		    lit > (size_t)(end - in))
+			return (-1);
+		while (lit-- > 0)
+			dst[at++] ^= *in++;
+	}
+	return (0);
+}
+
+static void drop_oldest(rewinder *rw)
+{
+	rewindframe *e = ENTRY(rw, 0);
+
+	rw->used -= e->dlen + e->klen;
+	rw->first = (rw->first + 1) % rw->maxframes;
+	rw->n--;
+	rw->dropped++;
+}
+
+static void drop_newest(rewinder *rw)
+{
+	rewindframe *e = NEWEST(rw);
+
+	rw->used -= e->dlen + e->klen;
+	rw->n--;
+	rw->wpos = rw->n ? NEWEST(rw)->off + NEWEST(rw)->dlen + NEWEST(rw)->klen : 0;
+}
+
+static uint8_t *put_varint(uint8_t *out, size_t v)
+{
+	while (v >= 0x80) {
+		*out++ = v | 0x80;
+		v >>= 0x7;
+	}
+	*out++ = v;
+	return (out);
+}
+
+static int get_varint(const uint8_t **in, const uint8_t *end, size_t *v)
+{
+	const uint8_t *q = *in;
+	int shift;
+
+	*v = 0;
+	for (shift = 0; q < end && shift < 64; shift += 7) {
+		*v |= (size_t)(*q & 0x7F) << shift;
+		if (!(*q++ & 0x80)) {
+			*in = q;
+			return (0);
+		}
+	}
+	return (-1);
+}
@@ -0,0 +1,67 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "machine.h"
+
+/*
+ * Rewind history. After every frame the whole machine state is packed
+ * and only its XOR against the frame before goes into a fixed size ring,
+ * run length encoded, since little of it changes from one frame to the
+ * next. The newest state is kept unpacked, so stepping back one frame is
+ * decoding one delta over it. Every so often a frame also keeps a full
+ * encoded state, so getting to any frame takes at most half the distance
+ * between two of those keyframes. Once the ring is full the oldest frames
+ * make room.
+ */
+#define REWIND_KEYEVERY	300 //frames between keyframes, 5 seconds
+
+//longest encoding of n bytes, see rewind_encode()
+#define REWIND_ENCMAX(n)	((n) + (n) / 2 + 16)
+
+typedef struct {
+	uint32_t	frame; //machine frame it holds
+	uint32_t	off; //start in the ring
+	uint32_t	dlen; //encoded delta from the frame before
+	uint32_t	klen; //encoded full state after the delta, 0 if not a keyframe
+} rewindframe;
+
+typedef struct {
+	uint8_t		*ring;
+	size_t		cap;
+	size_t		wpos; //where the next frame goes
+	rewindframe	*frames; //oldest at first
+	size_t		maxframes;
+	size_t		first;
+	size_t		n;
+	uint32_t	keyevery;
+	uint32_t	sincekey; //frames pushed since the last keyframe
+	size_t		size; //machine_statesize()
+	uint8_t		*cur; //state of the newest frame
+	uint8_t		*img; //scratch state
+	uint8_t		*enc; //scratch encoding, room for a delta and a keyframe
+	size_t		used; //bytes of the ring frames hold
+	unsigned long	dropped; //frames the ring ran out of room for
+} rewinder;
+
+typedef struct {
+	size_t		frames; //frames held
+	size_t		keyframes;
+	size_t		bytes; //encoded size of the frames held
+	uint64_t	raw; //their size unpacked
+	size_t		memory; //everything the rewinder allocated
+	double		ratio; //raw / bytes
+} rewindstats;
+
+int	rewind_init(rewinder *rw, const machine *m, size_t bytes, uint32_t keyevery);
+void	rewind_free(rewinder *rw);
+int	rewind_push(rewinder *rw, machine *m);
+int	rewind_back(rewinder *rw, machine *m);
+int	rewind_seek(rewinder *rw, machine *m, uint32_t frame);
+void	rewind_stats(const rewinder *rw, rewindstats *st);
+size_t	rewind_encode(const uint8_t *a, const uint8_t *b, size_t n, uint8_t *out);
+int	rewind_decode(uint8_t *dst, size_t n, const uint8_t *in, size_t len);
+
+#endif
@@ -1,20 +1,202 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-int main()
+#include "rom.h"
+
+static int	parse_header(cartridge *cart);
+static int	cart_mbc(uint8_t type, uint8_t *mbc, uint8_t *battery);
+
+
+/**
+ * Map a ROM file read-only and validate its header. The mapping is shared
+ * so other processes opening the same ROM use the same physical pages, and
+ * only the header is touched, so opening doesn't scale with ROM size.
+ *
+ * Return 0 on success or a CART_E* error.
+ */
+int cart_open(cartridge *cart, const char *path)
+{
+	struct stat st;
+	void *data;
+	int fd;
+	int err;
+
+	memset(cart, 0, sizeof(cartridge));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (CART_EOPEN);
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return (CART_EOPEN);
+	}
+	if (st.st_size < HDR_END) {
+		close(fd);
+		return (CART_ESIZE);
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	//the mapping keeps the file referenced
+	close(fd);
+	if (data == MAP_FAILED)
+		return (CART_EOPEN);
+
+	cart->data = (const uint8_t *)data;
+	cart->size = st.st_size;
+
+	if ((err = parse_header(cart)) < 0) {
+		cart_close(cart);
+		return (err);
+	}
+
+	return (0);
+}
+
+/**
+ * Unmap the ROM. Buses it was attached to must not be used afterwards.
+ */
+void cart_close(cartridge *cart)
+{
+	if (cart->data)
+		munmap((void *)cart->data, cart->size);
+	cart->data = NULL;
+	cart->size = 0;
+}
+
+/**
+ * Map the cartridge into a bus. sram has to hold cart->ramsize bytes and
+ * belongs to the caller, the ROM itself is never copied.
+ */
+void cart_attach(const cartridge *cart, bus *mem, uint8_t *sram)
+{
+	bus_map_rom(mem, cart->data, cart->romsize, cart->mbc);
+	bus_map_sram(mem, sram, sram ? cart->ramsize : 0);
+}
+
+/**
+ * Pointer to the start of a 16K ROM bank, wrapping like the hardware does
+ * for banks past the end.
+ */
+const uint8_t *cart_bank(const cartridge *cart, uint32_t bank)
+{
+	return (cart->data + (bank % cart->nbanks) * ROMBANK);
+}
+
+/**
+ * Check the global checksum. This reads the whole ROM so it's left out of
+ * cart_open, the hardware doesn't check it either.
+ *
+ * Return 0 if it matches, CART_ECHECKSUM otherwise.
+ */
+int cart_verify(const cartridge *cart)
+{
+	uint16_t sum = 0;
+	uint16_t want;
+	size_t i;
+
+	for (i = 0; i < cart->romsize; i++)
+		if (i != HDR_GLOBALSUM && i != HDR_GLOBALSUM + 1)
+			sum += cart->data[i];
+
+	want = cart->data[HDR_GLOBALSUM] << 0x8 | cart->data[HDR_GLOBALSUM + 1];
+	return (sum == want ? 0 : CART_ECHECKSUM);
+}
+
+const char *cart_strerror(int err)
+{
+	switch (err) {
+	case 0: return ("ok");
+	case CART_EOPEN: return ("can't open ROM");
+	case CART_ESIZE: return ("ROM smaller than its header says");
+	case CART_ETYPE: return ("unsupported cartridge type");
+	case CART_ECHECKSUM: return ("bad checksum");
+	default: return ("unknown error");
+	}
+}
+
+/*
+ * Fill in the cartridge fields from the header at 0x100-0x14F.
+ */
+static int parse_header(cartridge *cart)
+{
+	const uint8_t *hdr = cart->data;
+	uint8_t sum = 0;
+	int i;
+
+	//header checksum covers the title through the version byte
+	for (i = HDR_TITLE; i < HDR_CHECKSUM; i++)
+		sum = sum - hdr[i] - 1;
+	if (sum != hdr[HDR_CHECKSUM])
+		return (CART_ECHECKSUM);
+
+	cart->type = hdr[HDR_TYPE];
+	if (cart_mbc(cart->type, &cart->mbc, &cart->battery) < 0)
+		return (CART_ETYPE);
+
+	cart->cgb = hdr[HDR_CGB] & 0x80 ? hdr[HDR_CGB] & 0xC0 : 0x0;
+	//CGB titles are 11 or 15 characters, the rest is manufacturer and flag
+	memcpy(cart->title, hdr + HDR_TITLE, cart->cgb ? 15 : 16);
+	for (i = 0; i < 16; i++)
+		if (cart->title[i] && (cart->title[i] < 0x20 || cart->title[i] > 0x7E))
+			cart->title[i] = '\0';
+
+	if (hdr[HDR_ROMSIZE] > 0x8)
+		return (CART_ESIZE);
+	cart->romsize = 0x8000 << hdr[HDR_ROMSIZE];
+	if (cart->size < cart->romsize)
+		return (CART_ESIZE);
+	cart->nbanks = cart->romsize / ROMBANK;
+
+	switch (hdr[HDR_RAMSIZE]) {
+	case 0x1: cart->ramsize = 0x800; break;
+	case 0x2: cart->ramsize = 0x2000; break;
+	case 0x3: cart->ramsize = 0x8000; break;
+	case 0x4: cart->ramsize = 0x20000; break;
+	case 0x5: cart->ramsize = 0x10000; break;
+	default: cart->ramsize = 0x0; break;
+	}
+	if (cart->mbc == MBC_2)
+		cart->ramsize = 0x200;
+
+	return (0);
+}
+
+/*
+ * Controller for a cartridge type byte.
+ *
+ * Return -1 for types the bus can't emulate.
+ */
+static int cart_mbc(uint8_t type, uint8_t *mbc, uint8_t *battery)
 {
-	FILE *fileptr;
-	char *buffer;
-	long filelen;
+	*battery = 0x0;
 
-	fileptr = fopen("../psilver.gbc", "rb");
-	fseek(fileptr, 0, SEEK_END);
-	filelen = ftell(fileptr);
-	rewind(fileptr);
+	switch (type) {
+	case 0x00: *mbc = MBC_NONE; break;
+	case 0x08: *mbc = MBC_NONE; break;
+	case 0x09: *mbc = MBC_NONE; *battery = 0x1; break;
+	case 0x01:
+	case 0x02: *mbc = MBC_1; break;
+	case 0x03: *mbc = MBC_1; *battery = 0x1; break;
+	case 0x05: *mbc = MBC_2; break;
+	case 0x06: *mbc = MBC_2; *battery = 0x1; break;
+	case 0x11:
+	case 0x12: *mbc = MBC_3; break;
+	case 0x0F:
+	case 0x10:
+	case 0x13: *mbc = MBC_3; *battery = 0x1; break;
+	case 0x19:
+	case 0x1A:
+	case 0x1C:
+	case 0x1D: *mbc = MBC_5; break;
+	case 0x1B:
+	case 0x1E: *mbc = MBC_5; *battery = 0x1; break;
+	default: return (-1);
+	}
 
-	buffer = (char *)malloc((filelen+1)*sizeof(char)); 
-	fread(buffer, filelen, 1, fileptr);
-	fclose(fileptr); 
-	
-	printf("%lu", ((uint8_t *)buffer)[0]);
-}
\ No newline at end of file
+	return (0);
+}
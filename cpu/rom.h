@@ -0,0 +1,53 @@
+#ifndef ROM_H
+#define ROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem.h"
+
+/*
+ * A cartridge image mapped read-only straight from the ROM file. Nothing
+ * is copied: the header fields are parsed in place and banks are pointers
+ * into the mapping, so every emulator instance running the same ROM shares
+ * the one page cache copy and pages are only faulted in when a bank is
+ * actually used.
+ */
+typedef struct {
+	const uint8_t	*data; //the mapping
+	size_t		size; //file size
+	char		title[17];
+	uint8_t		type; //cartridge type byte at 0x147
+	uint8_t		mbc; //MBC_* controller
+	uint8_t		battery; //RAM is battery backed
+	uint8_t		cgb; //0x80 CGB enhanced, 0xC0 CGB only, 0 DMG
+	uint32_t	romsize; //ROM size from the header
+	uint32_t	ramsize; //cartridge RAM size, MBC2 has 512 nibbles built in
+	uint16_t	nbanks; //number of 16K ROM banks
+} cartridge;
+
+#define HDR_TITLE	0x134
+#define HDR_CGB		0x143
+#define HDR_TYPE	0x147
+#define HDR_ROMSIZE	0x148
+#define HDR_RAMSIZE	0x149
+#define HDR_CHECKSUM	0x14D
+#define HDR_GLOBALSUM	0x14E
+#define HDR_END		0x150
+
+#define CART_RAMMAX	0x20000 //largest cartridge RAM a header can ask for
+
+//cart_open errors
+#define CART_EOPEN	-1 //can't open or map the file
+#define CART_ESIZE	-2 //file shorter than the header says
+#define CART_ETYPE	-3 //unsupported cartridge type
+#define CART_ECHECKSUM	-4 //header checksum mismatch
+
+int		cart_open(cartridge *cart, const char *path);
+void		cart_close(cartridge *cart);
+void		cart_attach(const cartridge *cart, bus *mem, uint8_t *sram);
+const uint8_t	*cart_bank(const cartridge *cart, uint32_t bank);
+int		cart_verify(const cartridge *cart);
+const char	*cart_strerror(int err);
+
+#endif
@@ -0,0 +1,52 @@
+; ALU heavy: an 8x8 multiply by shifts and adds, a CRC-8 of each
+; product and a BCD count of the rounds, all in registers and HRAM.
+
+	title "ALU"
+
+COUNT	equ $80			; BCD rounds, in HRAM
+
+	org $150
+start:	ld sp, $FFFE
+	ld de, $0000		; multiplicands
+	ld c, $FF		; CRC
+	xor a
+	ldh [COUNT], a
+
+loop:	ld hl, 0		; HL = D * E
+	ld b, 8
+.bit:	add hl, hl
+	sla d
+	jr nc, .skip
+	ld a, l
+	add a, e
+	ld l, a
+	ld a, h
+	adc a, 0
+	ld h, a
+.skip:	dec b
+	jr nz, .bit
+
+	ld a, l
+	call crc8
+	ld a, h
+	call crc8
+
+	ldh a, [COUNT]
+	add a, 1
+	daa
+	ldh [COUNT], a
+
+	ld d, c			; the CRC is the next multiplier
+	inc e
+	jr loop
+
+; C = CRC-8, polynomial 7, of C and A
+crc8:	xor c
+	ld b, 8
+.bit:	sla a
+	jr nc, .next
+	xor $07
+.next:	dec b
+	jr nz, .bit
+	ld c, a
+	ret
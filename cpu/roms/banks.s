@@ -0,0 +1,93 @@
+; Bank switch stress on MBC5: every round goes through ROM banks 1 to 7,
+; calling into each and summing a table in it, and writes the sum to
+; one of the four SRAM banks.
+
+	title "BANKS"
+	cart $1A		; MBC5 and RAM
+	ramsize $03		; 32K, four banks
+
+RAMG	equ $0000
+ROMB	equ $2000
+RAMB	equ $4000
+SRAM	equ $A000
+TABLE	equ $4010
+
+	org $150
+start:	ld sp, $FFFE
+	ld a, $0A
+	ld [RAMG], a
+	ld hl, SRAM
+
+loop:	ld b, 1
+.bank:	ld a, b
+	ld [ROMB], a
+	call $4000		; says which bank it is
+	cp b
+	jr nz, fail
+
+	ld de, TABLE		; C = sum of the table
+	ld c, 0
+.sum:	ld a, [de]
+	add a, c
+	ld c, a
+	inc e
+	jr nz, .sum
+
+	ld a, b
+	and 3
+	ld [RAMB], a
+	ld a, c
+	ld [hl+], a
+	ld a, h			; stay in 0xA000-0xBFFF
+	and $1F
+	or $A0
+	ld h, a
+	inc b
+	ld a, b
+	cp 8
+	jr nz, .bank
+	jr loop
+
+fail:	jr fail
+
+	bank 1
+	ld a, 1
+	ret
+	org TABLE
+	ds 240, 1
+
+	bank 2
+	ld a, 2
+	ret
+	org TABLE
+	ds 240, 2
+
+	bank 3
+	ld a, 3
+	ret
+	org TABLE
+	ds 240, 3
+
+	bank 4
+	ld a, 4
+	ret
+	org TABLE
+	ds 240, 4
+
+	bank 5
+	ld a, 5
+	ret
+	org TABLE
+	ds 240, 5
+
+	bank 6
+	ld a, 6
+	ret
+	org TABLE
+	ds 240, 6
+
+	bank 7
+	ld a, 7
+	ret
+	org TABLE
+	ds 240, 7
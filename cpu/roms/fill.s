@@ -0,0 +1,57 @@
+; Long unrolled fill: every round fills a 30 byte row with one straight
+; run of stores and folds where it ended into a checksum. Recompiled, the
+; run is one block with 30 stores, next to 32 interpreted records, 30 with
+; a store, which is what trace diffs have to line up.
+
+	title "FILL"
+
+LCDC	equ $40
+ROW	equ $C100			; row the runs go over
+SUM	equ $80				; checksum, in HRAM
+
+	org $150
+start:	ld sp, $FFFE
+	xor a
+	ldh [LCDC], a			; no LCD deadlines to split the run
+	ldh [SUM], a
+	ld b, a
+
+loop:	ld hl, ROW
+	ld a, b
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+	ld [hl+], a
+
+	ldh a, [SUM]
+	add a, l
+	xor b
+	ldh [SUM], a
+	inc b
+	jr loop
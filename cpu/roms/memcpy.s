@@ -0,0 +1,94 @@
+; memcpy and memset loops over WRAM: a byte at a time, unrolled by eight
+; and a fill, switching the WRAM bank at 0xD000 every round.
+
+	title "MEMCPY"
+	cgb $80
+
+SVBK	equ $70
+BANK	equ $80			; WRAM bank in use, in HRAM
+SRC	equ $C000
+DST	equ $D000
+LEN	equ $0800
+
+	org $150
+start:	ld sp, $FFFE
+	ld hl, SRC
+	ld bc, LEN
+	ld a, $5A
+	call memset
+	ld a, 1
+	ldh [BANK], a
+
+loop:	ldh a, [BANK]		; banks 1 to 7
+	inc a
+	and 7
+	jr nz, .bank
+	inc a
+.bank:	ldh [BANK], a
+	ldh [SVBK], a
+
+	ld hl, SRC
+	ld de, DST
+	ld bc, LEN
+	call memcpy
+	ld hl, DST
+	ld de, SRC + LEN
+	ld bc, LEN / 8
+	call memcpy8
+	ld hl, DST + LEN
+	ld bc, LEN
+	ldh a, [BANK]
+	call memset
+	jr loop
+
+; BC bytes of A from HL
+memset:	ld e, a
+.loop:	ld a, e
+	ld [hl+], a
+	dec bc
+	ld a, b
+	or c
+	jr nz, .loop
+	ret
+
+; BC bytes from HL to DE
+memcpy:	ld a, [hl+]
+	ld [de], a
+	inc de
+	dec bc
+	ld a, b
+	or c
+	jr nz, memcpy
+	ret
+
+; BC * 8 bytes from HL to DE
+memcpy8:
+	ld a, [hl+]
+	ld [de], a
+	inc de
+	ld a, [hl+]
+	ld [de], a
+	inc de
+	ld a, [hl+]
+	ld [de], a
+	inc de
+	ld a, [hl+]
+	ld [de], a
+	inc de
+	ld a, [hl+]
+	ld [de], a
+	inc de
+	ld a, [hl+]
+	ld [de], a
+	inc de
+	ld a, [hl+]
+	ld [de], a
+	inc de
+	ld a, [hl+]
+	ld [de], a
+	inc de
+	dec bc
+	ld a, b
+	or c
+	jr nz, memcpy8
+	ret
@@ -0,0 +1,70 @@
+; Interrupt heavy: the timer overflows every 128 T-cycles and LYC
+; matches every eighth line, the main loop halts in between and samples
+; DIV.
+
+	title "TIMER"
+
+DIV	equ $04
+TIMA	equ $05
+TMA	equ $06
+TAC	equ $07
+IF	equ $0F
+LCDC	equ $40
+STAT	equ $41
+LYC	equ $45
+IE	equ $FF
+TICKS	equ $81			; timer interrupts, 16 bits in HRAM
+
+	org $48
+	jp stat
+	org $50
+	jp timer
+
+	org $150
+start:	ld sp, $FFFE
+	xor a
+	ldh [TICKS], a
+	ldh [TICKS + 1], a
+	ldh [LYC], a
+	ld a, $F8		; overflow every 8 ticks
+	ldh [TMA], a
+	ldh [TIMA], a
+	ld a, $05		; on, a tick every 16 T-cycles
+	ldh [TAC], a
+	ld a, $40		; STAT on LYC
+	ldh [STAT], a
+	ld a, $91
+	ldh [LCDC], a
+	xor a
+	ldh [IF], a
+	ld a, $06		; timer and STAT
+	ldh [IE], a
+	ei
+
+loop:	halt
+	nop
+	ld hl, $C000
+	ldh a, [DIV]
+	ld l, a
+	inc [hl]
+	jr loop
+
+timer:	push af
+	ldh a, [TICKS]
+	add a, 1
+	ldh [TICKS], a
+	ldh a, [TICKS + 1]
+	adc a, 0
+	ldh [TICKS + 1], a
+	pop af
+	reti
+
+stat:	push af
+	ldh a, [LYC]
+	add a, 8
+	cp 144
+	jr c, .set
+	xor a
+.set:	ldh [LYC], a
+	pop af
+	reti
@@ -0,0 +1,82 @@
+; VRAM heavy: with the LCD on, every round rewrites all 256 tiles of
+; bank 0, the tile map and its attributes in bank 1 and the background
+; palettes, then waits for VBlank, which scrolls the screen.
+
+	title "VRAM"
+	cgb $80
+
+LCDC	equ $40
+SCX	equ $43
+VBK	equ $4F
+BCPS	equ $68
+BCPD	equ $69
+IE	equ $FF
+FRAME	equ $80			; VBlanks seen, in HRAM
+
+	org $40
+	jp vblank
+
+	org $150
+start:	ld sp, $FFFE
+	xor a
+	ldh [FRAME], a
+	ld a, $01		; VBlank
+	ldh [IE], a
+	ld a, $91		; LCD and background on, tiles at 0x8000
+	ldh [LCDC], a
+	ei
+
+loop:	halt
+	nop
+	ldh a, [FRAME]
+	ld e, a
+
+	ld a, $80		; palette 0 colour 0, counting up
+	ldh [BCPS], a
+	ld b, 64
+.pal:	ld a, e
+	add a, b
+	ldh [BCPD], a
+	dec b
+	jr nz, .pal
+
+	xor a
+	ldh [VBK], a
+	ld hl, $8000		; tiles
+	ld bc, $1000
+.tile:	ld a, c
+	xor e
+	ld [hl+], a
+	dec bc
+	ld a, b
+	or c
+	jr nz, .tile
+	ld d, $FF		; tile numbers
+	call map
+
+	ld a, 1
+	ldh [VBK], a
+	ld d, $07		; palette numbers
+	call map
+	jr loop
+
+; the 32x32 map at 0x9800, entry i = (i + E) & D
+map:	ld hl, $9800
+	ld bc, $0400
+.loop:	ld a, c
+	add a, e
+	and d
+	ld [hl+], a
+	dec bc
+	ld a, b
+	or c
+	jr nz, .loop
+	ret
+
+vblank:	push af
+	ldh a, [FRAME]
+	inc a
+	ldh [FRAME], a
+	ldh [SCX], a
+	pop af
+	reti
@@ -0,0 +1,124 @@
+#include <string.h>
+
+#include "scheduler.h"
+
+#define NOPOS	0xFF
+
+static void	sift_up(scheduler *s, uint8_t i);
+static void	sift_down(scheduler *s, uint8_t i);
+static void	swap_slots(scheduler *s, uint8_t i, uint8_t j);
+
+
+/**
+ * Set the clock to 0 with nothing pending.
+ */
+void init_sched(scheduler *s)
+{
+	memset(s, 0, sizeof(scheduler));
+	memset(s->pos, NOPOS, sizeof(s->pos));
+	s->next = SCHED_NEVER;
+}
+
+/**
+ * Schedule ev for when, moving it if it's already pending. A deadline in
+ * the past fires at the next instruction boundary.
+ */
+void sched_at(scheduler *s, uint8_t ev, uint64_t when)
+{
+	uint8_t i = s->pos[ev];
+
+	if (i == NOPOS) {
+		i = s->n++;
+		s->heap[i] = ev;
+		s->pos[ev] = i;
+		s->when[ev] = when;
+		sift_up(s, i);
+	} else if (when < s->when[ev]) {
+		s->when[ev] = when;
+		sift_up(s, i);
+	} else {
+		s->when[ev] = when;
+		sift_down(s, i);
+	}
+
+	if (when < s->next)
+		s->next = when;
+}
+
+void sched_cancel(scheduler *s, uint8_t ev)
+{
+	uint8_t i = s->pos[ev];
+
+	if (i == NOPOS)
+		return;
+
+	s->n--;
+	if (i != s->n) {
+		swap_slots(s, i, s->n);
+		sift_down(s, i);
+		sift_up(s, i);
+	}
+	s->pos[ev] = NOPOS;
+	//next may now be early, that only costs a look
+}
+
+/**
+ * Take the earliest event that is due by now off the heap. With nothing
+ * due, next is brought up to the earliest deadline.
+ *
+ * Return the event and its deadline, or -1.
+ */
+int sched_due(scheduler *s, uint64_t *when)
+{
+	uint8_t ev;
+
+	if (s->n == 0 || s->when[s->heap[0]] > s->now) {
+		s->next = s->n ? s->when[s->heap[0]] : SCHED_NEVER;
+		return (-1);
+	}
+
+	ev = s->heap[0];
+	*when = s->when[ev];
+	sched_cancel(s, ev);
+	return (ev);
+}
+
+static void swap_slots(scheduler *s, uint8_t i, uint8_t j)
+{
+	uint8_t ev = s->heap[i];
+
+	s->heap[i] = s->heap[j];
+	s->heap[j] = ev;
+	s->pos[s->heap[i]] = i;
+	s->pos[s->heap[j]] = j;
+}
+
+static void sift_up(scheduler *s, uint8_t i)
+{
+	uint8_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (s->when[s->heap[parent]] <= s->when[s->heap[i]])
+			break;
+		swap_slots(s, i, parent);
+		i = parent;
+	}
+}
+
+static void sift_down(scheduler *s, uint8_t i)
+{
+	uint8_t child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= s->n)
+			break;
+		if (child + 1 < s->n && s->when[s->heap[child + 1]] < s->when[s->heap[child]])
+			child++;
+		if (s->when[s->heap[i]] <= s->when[s->heap[child]])
+			break;
+		swap_slots(s, i, child);
+		i = child;
+	}
+}
@@ -0,0 +1,61 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+/*
+ * Event scheduler. The CPU adds every instruction's T-cycles to now and
+ * only looks at the peripherals when now reaches next, the earliest
+ * pending deadline. Peripherals schedule their own next state change
+ * (timer overflow, LCD mode, end of a transfer) instead of being stepped
+ * after every instruction, and work out anything in between, like DIV,
+ * when their registers are read.
+ *
+ * The pending events are a binary min-heap on their deadline. Each event
+ * can be pending once, scheduling it again moves it.
+ */
+#define SCHED_NEVER	UINT64_MAX
+
+//events
+#define EV_TIMER	0 //TIMA overflow
+#define EV_LCD		1 //next LCD mode change
+#define EV_SERIAL	2 //serial transfer done
+#define EV_DMA		3 //OAM DMA done
+#define EV_HDMA		4 //CGB HBlank DMA block due
+#define EV_COUNT	5
+
+typedef struct {
+	uint64_t	now; //T-cycles since power on
+	uint64_t	next; //no deadline comes before this, 0 forces a look
+	uint64_t	when[EV_COUNT]; //deadline per event
+	uint8_t		heap[EV_COUNT]; //pending events, earliest first
+	uint8_t		pos[EV_COUNT]; //heap index per event, 0xFF if not pending
+	uint8_t		n; //pending events
+	uint64_t	slept; //T-cycles skipped in HALT
+} scheduler;
+
+void	init_sched(scheduler *s);
+void	sched_at(scheduler *s, uint8_t ev, uint64_t when);
+void	sched_cancel(scheduler *s, uint8_t ev);
+int	sched_due(scheduler *s, uint64_t *when);
+
+/*
+ * Make the CPU stop at the next instruction boundary, for state changes
+ * that aren't events, like an interrupt being requested or enabled.
+ */
+static inline void sched_poke(scheduler *s)
+{
+	s->next = 0;
+}
+
+/*
+ * Make the CPU stop once it ran one more instruction, which takes at least
+ * a T-cycle.
+ */
+static inline void sched_step(scheduler *s)
+{
+	if (s->next > s->now + 1)
+		s->next = s->now + 1;
+}
+
+#endif
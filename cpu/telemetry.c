@@ -0,0 +1,285 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "telemetry.h"
+
+static void	counter(FILE *fp, const telemetry *t, const char *name, const char *help,
+		    const char *type, double val);
+static uint64_t	bucket_top(unsigned b);
+static uint64_t	clock_cost(void);
+
+static const char *const unitname[TM_UNITS] = { "cpu", "ppu", "apu", "dma" };
+static const char *const snapname[TM_SNAPS] = { "save", "load" };
+
+
+/**
+ * Create the shared memory segment name, a single path component without
+ * the leading slash, for a machine to publish its counters in.
+ *
+ * Return NULL if it can't be created.
+ */
+telemetry *tm_open(const char *name)
+{
+	char path[sizeof(((telemetry *)0)->name) + 1];
+	telemetry *t;
+	void *p;
+	int fd;
+
+	if (strlen(name) + 1 >= sizeof(path) || strchr(name, '/'))
+		return (NULL);
+	snprintf(path, sizeof(path), "/%s", name);
+	if ((fd = shm_open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		return (NULL);
+	if (ftruncate(fd, sizeof(telemetry)) < 0) {
+		close(fd);
+		shm_unlink(path);
+		return (NULL);
+	}
+	p = mmap(NULL, sizeof(telemetry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(path);
+		return (NULL);
+	}
+
+	t = (telemetry *)p;
+	memset(t, 0, sizeof(telemetry));
+	strcpy(t->name, name);
+	t->pid = getpid();
+	t->version = TM_VERSION;
+	t->clockns = clock_cost();
+	//readers check the magic, so it goes in last
+	__atomic_store_n(&t->magic, TM_MAGIC, __ATOMIC_RELEASE);
+	return (t);
+}
+
+/**
+ * Unmap the segment and remove its name.
+ */
+void tm_close(telemetry *t)
+{
+	char path[sizeof(t->name) + 1];
+
+	if (!t)
+		return;
+	snprintf(path, sizeof(path), "/%s", t->name);
+	munmap(t, sizeof(telemetry));
+	shm_unlink(path);
+}
+
+/**
+ * Map another process's segment to read it.
+ *
+ * Return NULL if there's no such segment or it isn't telemetry.
+ */
+const telemetry *tm_attach(const char *name)
+{
+	char path[sizeof(((telemetry *)0)->name) + 1];
+	const telemetry *t;
+	void *p;
+	int fd;
+
+	if (strlen(name) + 1 >= sizeof(path) || strchr(name, '/'))
+		return (NULL);
+	snprintf(path, sizeof(path), "/%s", name);
+	if ((fd = shm_open(path, O_RDONLY, 0)) < 0)
+		return (NULL);
+	p = mmap(NULL, sizeof(telemetry), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return (NULL);
+
+	t = (const telemetry *)p;
+	if (__atomic_load_n(&t->magic, __ATOMIC_ACQUIRE) != TM_MAGIC || t->version != TM_VERSION) {
+		munmap(p, sizeof(telemetry));
+		return (NULL);
+	}
+	return (t);
+}
+
+void tm_detach(const telemetry *t)
+{
+	if (t)
+		munmap((void *)t, sizeof(telemetry));
+}
+
+/**
+ * A frame took ns of host time to run insns instructions and cycles
+ * T-cycles, halted of them asleep and skipped of them in skipped polling
+ * loops.
+ */
+void tm_frame(telemetry *t, uint64_t ns, uint64_t insns, uint64_t cycles,
+    uint64_t halted, uint64_t skipped)
+{
+	tm_add(&t->frames, 1);
+	tm_add(&t->insns, insns);
+	tm_add(&t->cycles, cycles);
+	tm_add(&t->halted, halted);
+	tm_add(&t->skipped, skipped);
+	tm_set(&t->lastinsns, insns);
+	tm_set(&t->lastns, ns);
+	if (ns > t->maxns)
+		tm_set(&t->maxns, ns);
+	tm_add(&t->framens, ns);
+	tm_add(&t->hist[tm_bucket(ns)], 1);
+
+	//sampling can charge a bit more than the frame took
+	tm_add(&t->ns[TM_CPU], ns > t->charged ? ns - t->charged : 0);
+	t->charged = 0;
+}
+
+/**
+ * A snapshot of kind TM_SAVE or TM_LOAD took ns.
+ */
+void tm_snapshot(telemetry *t, int kind, uint64_t ns)
+{
+	tm_add(&t->snaps[kind], 1);
+	tm_add(&t->snapns[kind], ns);
+}
+
+/**
+ * Frame time at quantile q, 0.5 for the median, from the histogram: the
+ * top of the bucket it falls in, but no more than the slowest frame.
+ */
+uint64_t tm_quantile(const telemetry *t, double q)
+{
+	uint64_t total = 0, seen = 0, want, max = tm_get(&t->maxns);
+	uint64_t hist[TM_BUCKETS];
+	unsigned b;
+
+	for (b = 0; b < TM_BUCKETS; b++)
+		total += hist[b] = tm_get(&t->hist[b]);
+	if (!total)
+		return (0);
+	want = (uint64_t)(q * total + 0.5);
+	if (want < 1)
+		want = 1;
+	for (b = 0; b < TM_BUCKETS - 1; b++)
+		if ((seen += hist[b]) >= want)
+			break;
+	return (bucket_top(b) < max ? bucket_top(b) : max);
+}
+
+/**
+ * Write the counters in the Prometheus text format, labelled with the
+ * segment's name.
+ *
+ * Return 0, -1 if writing failed.
+ */
+int tm_prometheus(const telemetry *t, FILE *fp)
+{
+	uint64_t cycles = tm_get(&t->cycles), frames = tm_get(&t->frames);
+	int i;
+
+	counter(fp, t, "gbc_frames_total", "Frames run.", "counter", frames);
+	counter(fp, t, "gbc_instructions_total", "Instructions executed.", "counter",
+	    tm_get(&t->insns));
+	counter(fp, t, "gbc_frame_instructions", "Instructions in the last frame.", "gauge",
+	    tm_get(&t->lastinsns));
+	counter(fp, t, "gbc_cycles_total", "T-cycles emulated.", "counter", cycles);
+	counter(fp, t, "gbc_halted_cycles_total", "T-cycles slept in HALT.", "counter",
+	    tm_get(&t->halted));
+	counter(fp, t, "gbc_skipped_cycles_total", "T-cycles of skipped polling loops.",
+	    "counter", tm_get(&t->skipped));
+	counter(fp, t, "gbc_halt_ratio", "Share of T-cycles halted.", "gauge",
+	    cycles ? (double)tm_get(&t->halted) / cycles : 0.0);
+	counter(fp, t, "gbc_idle_skip_ratio", "Share of T-cycles skipped.", "gauge",
+	    cycles ? (double)tm_get(&t->skipped) / cycles : 0.0);
+
+	fprintf(fp, "# HELP gbc_frame_seconds Host time per frame.\n"
+	    "# TYPE gbc_frame_seconds summary\n");
+	fprintf(fp, "gbc_frame_seconds{instance=\"%s\",quantile=\"0.5\"} %.9f\n", t->name,
+	    tm_quantile(t, 0.5) / 1e9);
+	fprintf(fp, "gbc_frame_seconds{instance=\"%s\",quantile=\"0.99\"} %.9f\n", t->name,
+	    tm_quantile(t, 0.99) / 1e9);
+	fprintf(fp, "gbc_frame_seconds_sum{instance=\"%s\"} %.9f\n", t->name,
+	    tm_get(&t->framens) / 1e9);
+	fprintf(fp, "gbc_frame_seconds_count{instance=\"%s\"} %lu\n", t->name,
+	    (unsigned long)frames);
+	counter(fp, t, "gbc_frame_seconds_max", "Host time of the slowest frame.", "gauge",
+	    tm_get(&t->maxns) / 1e9);
+
+	fprintf(fp, "# HELP gbc_host_seconds_total Host time per emulated unit.\n"
+	    "# TYPE gbc_host_seconds_total counter\n");
+	for (i = 0; i < TM_UNITS; i++)
+		fprintf(fp, "gbc_host_seconds_total{instance=\"%s\",unit=\"%s\"} %.9f\n",
+		    t->name, unitname[i], tm_get(&t->ns[i]) / 1e9);
+	fprintf(fp, "# HELP gbc_snapshots_total Snapshots taken and loaded.\n"
+	    "# TYPE gbc_snapshots_total counter\n");
+	for (i = 0; i < TM_SNAPS; i++)
+		fprintf(fp, "gbc_snapshots_total{instance=\"%s\",kind=\"%s\"} %lu\n", t->name,
+		    snapname[i], (unsigned long)tm_get(&t->snaps[i]));
+	fprintf(fp, "# HELP gbc_snapshot_seconds_total Host time in snapshots.\n"
+	    "# TYPE gbc_snapshot_seconds_total counter\n");
+	for (i = 0; i < TM_SNAPS; i++)
+		fprintf(fp, "gbc_snapshot_seconds_total{instance=\"%s\",kind=\"%s\"} %.9f\n",
+		    t->name, snapname[i], tm_get(&t->snapns[i]) / 1e9);
+	return (ferror(fp) ? -1 : 0);
+}
+
+/**
+ * Replace the file at path with the counters in the Prometheus text
+ * format. The file is written next to it and renamed over it, so a
+ * collector never reads half of it.
+ *
+ * Return 0, -1 if it can't be written.
+ */
+int tm_dump(const telemetry *t, const char *path)
+{
+	char tmp[4096];
+	FILE *fp;
+	int err;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		return (-1);
+	if (!(fp = fopen(tmp, "w")))
+		return (-1);
+	err = tm_prometheus(t, fp);
+	if (fclose(fp) != 0)
+		err = -1;
+	if (err == 0 && rename(tmp, path) < 0)
+		err = -1;
+	if (err < 0)
+		unlink(tmp);
+	return (err);
+}
+
+static void counter(FILE *fp, const telemetry *t, const char *name, const char *help,
+    const char *type, double val)
+{
+	fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s{instance=\"%s\"} %.15g\n", name, help, name,
+	    type, name, t->name, val);
+}
+
+/*
+ * Largest frame time that goes into bucket b.
+ */
+static uint64_t bucket_top(unsigned b)
+{
+	unsigned e = b >> 2;
+
+	if (b < 4)
+		return (b);
+	return (((uint64_t)(0x4 | (b & 0x3)) << (e - 2)) + ((uint64_t)1 << (e - 2)) - 1);
+}
+
+/*
+ * Least time between two readings of the clock, which every timed event
+ * pays for on top of its own.
+ */
+static uint64_t clock_cost(void)
+{
+	uint64_t best = ~(uint64_t)0, t0, t1;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		t0 = tm_clock();
+		t1 = tm_clock();
+		if (t1 - t0 < best)
+			best = t1 - t0;
+	}
+	return (best);
+}
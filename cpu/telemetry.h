@@ -0,0 +1,154 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Live counters of a running machine, in a POSIX shared memory segment
+ * another process can map and sample while it runs. The machine's thread
+ * is the only writer and every counter is a 64 bit word stored with a
+ * relaxed atomic, so readers see whole values without taking a lock,
+ * though not all of them from the same instant.
+ *
+ * Frames are timed on the host and go into a histogram for percentiles.
+ * Host time is split by unit: one in every TM_SAMPLE peripheral events is
+ * timed and charged TM_SAMPLE times over to its unit, and the CPU gets
+ * what's left of the frame.
+ */
+#define TM_MAGIC	0x4C455447 //GTEL
+#define TM_VERSION	1
+#define TM_SAMPLE	32 //events per timed one, a power of two
+#define TM_BUCKETS	256 //frame time histogram, see tm_bucket()
+
+//where host time goes
+#define TM_CPU		0 //running code, and everything not charged elsewhere
+#define TM_PPU		1 //LCD events
+#define TM_APU		2 //sound registers and making samples
+#define TM_DMA		3 //OAM and VRAM DMA copies
+#define TM_UNITS	4
+
+//snapshots
+#define TM_SAVE		0 //machine_save, machine_pack, machine_export
+#define TM_LOAD		1 //and the way back
+#define TM_SNAPS	2
+
+typedef struct telemetry {
+	uint32_t	magic;
+	uint32_t	version;
+	char		name[64]; //of the segment
+	int64_t		pid; //of the writer
+
+	uint64_t	frames;
+	uint64_t	insns;
+	uint64_t	cycles; //T-cycles emulated
+	uint64_t	halted; //of them slept in HALT
+	uint64_t	skipped; //of them skipped in polling loops
+	uint64_t	lastinsns; //in the last frame
+	uint64_t	lastns; //host time of the last frame
+	uint64_t	maxns; //of the slowest
+	uint64_t	framens; //of all of them
+	uint64_t	hist[TM_BUCKETS]; //frames by host time
+
+	uint64_t	ns[TM_UNITS]; //host time per unit
+	uint64_t	events; //peripheral events
+	uint64_t	snaps[TM_SNAPS];
+	uint64_t	snapns[TM_SNAPS];
+
+	uint64_t	charged; //writer only: ns charged to units this frame
+	uint64_t	clockns; //writer only: what reading the clock costs
+} telemetry;
+
+telemetry	*tm_open(const char *name);
+void		tm_close(telemetry *t);
+const telemetry	*tm_attach(const char *name);
+void		tm_detach(const telemetry *t);
+void		tm_frame(telemetry *t, uint64_t ns, uint64_t insns, uint64_t cycles,
+		    uint64_t halted, uint64_t skipped);
+void		tm_snapshot(telemetry *t, int kind, uint64_t ns);
+uint64_t	tm_quantile(const telemetry *t, double q);
+int		tm_prometheus(const telemetry *t, FILE *fp);
+int		tm_dump(const telemetry *t, const char *path);
+
+static inline uint64_t tm_get(const uint64_t *c)
+{
+	return (__atomic_load_n(c, __ATOMIC_RELAXED));
+}
+
+static inline void tm_set(uint64_t *c, uint64_t v)
+{
+	__atomic_store_n(c, v, __ATOMIC_RELAXED);
+}
+
+/*
+ * There's one writer, so a plain load and store do without a locked add.
+ */
+static inline void tm_add(uint64_t *c, uint64_t v)
+{
+	tm_set(c, tm_get(c) + v);
+}
+
+/*
+ * Host clock in ns.
+ */
+static inline uint64_t tm_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * Host clock in seconds, for timing whole runs.
+ */
+static inline double tm_seconds(void)
+{
+	return (tm_clock() / 1e9);
+}
+
+/*
+ * Histogram bucket of a frame time: exact below 4 ns, then 4 buckets to
+ * every power of two, so a bucket is within 25% of what's in it.
+ */
+static inline unsigned tm_bucket(uint64_t ns)
+{
+	unsigned e;
+
+	if (ns < 4)
+		return (ns);
+	e = 63 - __builtin_clzll(ns);
+	return (e << 2 | (ns >> (e - 2) & 0x3));
+}
+
+/*
+ * A peripheral event starts. Return the clock if it's one of the events
+ * that get timed, 0 otherwise.
+ */
+static inline uint64_t tm_begin(telemetry *t)
+{
+	uint64_t n = t->events;
+
+	tm_set(&t->events, n + 1);
+	return ((n & (TM_SAMPLE - 1)) == 0 ? tm_clock() : 0);
+}
+
+/*
+ * The timed event that started at start is over.
+ */
+static inline void tm_charge(telemetry *t, int unit, uint64_t start)
+{
+	uint64_t ns;
+
+	ns = tm_clock() - start;
+	ns = (ns > t->clockns ? ns - t->clockns : 0) * TM_SAMPLE;
+	tm_add(&t->ns[unit], ns);
+	t->charged += ns;
+}
+
+#define TM_BEGIN(mem)	((mem)->tm ? tm_begin((mem)->tm) : 0)
+#define TM_CHARGE(mem, unit, start) \
+	do { if (start) tm_charge((mem)->tm, unit, start); } while (0)
+
+#endif
@@ -0,0 +1,763 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "array.h"
+#include "trace.h"
+
+#define TRACE_INDEX	"GBTI" //ends a trace with a keyframe index
+#define TRACE_HEADER	8 //magic, version, 3 bytes spare
+#define KEY_BYTES	24 //an index entry on disk
+#define RECORD_MAX	32 //biggest record without its stores
+#define DIFF_CHUNK	65536 //bytes compared at a time while the traces agree
+
+//what two stretches of steps disagree on
+#define DIFF_PC		0x1
+#define DIFF_OP		0x2
+#define DIFF_REGS	0x4
+#define DIFF_STORES	0x8
+
+//consecutive records on one side of a diff covering the same steps as
+//the other side, as one compiled block does a run of instructions
+typedef struct {
+	tracerec	first;
+	uint64_t	end; //step after the last
+	uint8_t		regs[TR_NREGS]; //after the last
+	const uint8_t	*stores;
+	size_t		nstores;
+	uint8_t		*buf; //the stores once there's more than one record
+	size_t		cap;
+} tracerun;
+
+static void	emit(tracer *t, const registers *reg);
+static void	flush(tracer *t);
+static uint32_t	predict(uint8_t flags, uint16_t pc, uint8_t opc);
+static uint8_t	*putvar(uint8_t *p, uint64_t v);
+static uint8_t	*put64(uint8_t *p, uint64_t v);
+static int	getvar(const uint8_t **p, const uint8_t *end, uint64_t *v);
+static uint64_t	get64(const uint8_t *p);
+static size_t	common(const tracefile *a, const tracefile *b);
+static void	begin(tracerun *r, const tracerec *rec);
+static int	extend(tracefile *tf, tracerun *r);
+static int	agree(const tracerun *a, const tracerun *b);
+static void	report(FILE *fp, const tracerun *a, const tracerun *b, int what);
+static void	describe(FILE *fp, const char *side, const tracerun *r);
+
+static const char *const regname[TR_NREGS] = {
+	"a", "f", "b", "c", "d", "e", "h", "l", "sp", "sp", "ime", "halt"
+};
+
+
+/**
+ * Start a trace in the file at path, to hang on a bus.
+ */
+tracer *trace_open(const char *path)
+{
+	tracer *t;
+
+	if (!(t = (tracer *)calloc(1, sizeof(tracer))))
+		return (NULL);
+	t->buf = (uint8_t *)malloc(TRACE_BUF);
+	t->stores = (uint8_t *)malloc(3 * TRACE_WRITES);
+	if (!t->buf || !t->stores ||
+	    (t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		free(t->buf);
+		free(t->stores);
+		free(t);
+		return (NULL);
+	}
+	memcpy(t->buf, TRACE_MAGIC, 4);
+	t->buf[4] = TRACE_VERSION;
+	memset(t->buf + 5, 0, TRACE_HEADER - 5);
+	t->len = TRACE_HEADER;
+	t->next = 0x10000;
+	return (t);
+}
+
+/**
+ * Write out the last record, reg being the state after it, and the
+ * keyframe index, and free the tracer.
+ *
+ * Return 0, TRACE_EOPEN if a write failed.
+ */
+int trace_close(tracer *t, const registers *reg)
+{
+	uint8_t *p;
+	size_t i;
+	int err;
+
+	trace_end(t, reg);
+	for (i = 0; i < t->nkeys; i++) {
+		if (t->len + KEY_BYTES > TRACE_BUF)
+			flush(t);
+		p = t->buf + t->len;
+		p = put64(p, t->keys[i].off);
+		p = put64(p, t->keys[i].step);
+		p = put64(p, t->keys[i].record);
+		t->len = p - t->buf;
+	}
+	if (t->len + 12 > TRACE_BUF)
+		flush(t);
+	p = put64(t->buf + t->len, t->nkeys);
+	memcpy(p, TRACE_INDEX, 4);
+	t->len += 12;
+	flush(t);
+
+	err = close(t->fd) < 0 || t->err ? TRACE_EOPEN : 0;
+	free(t->buf);
+	free(t->stores);
+	free(t->keys);
+	free(t);
+	return (err);
+}
+
+/**
+ * An instruction at pc is about to run. reg is the state the one before
+ * left.
+ */
+void trace_insn(tracer *t, const registers *reg, uint16_t pc, uint8_t opc)
+{
+	trace_end(t, reg);
+	t->open = 0x1;
+	t->flags = 0x0;
+	t->pc = pc;
+	t->opc = opc;
+	t->count = 1;
+}
+
+/**
+ * The instruction just started was a CB prefix for opc.
+ */
+void trace_cb(tracer *t, uint8_t opc)
+{
+	t->flags |= TR_CB;
+	t->cb = opc;
+}
+
+/**
+ * An interrupt is taken, with the PC it returns to still in reg.
+ */
+void trace_irq(tracer *t, const registers *reg, uint16_t vector)
+{
+	trace_end(t, reg);
+	t->open = 0x1;
+	t->flags = TR_IRQ;
+	t->pc = reg->pc;
+	t->opc = vector;
+	t->count = 1;
+}
+
+/**
+ * Write out the open record, reg being the state it left. Stores made
+ * from here on wait for trace_block() or get dropped by the next record.
+ */
+void trace_end(tracer *t, const registers *reg)
+{
+	if (t->open)
+		emit(t, reg);
+	t->open = 0x0;
+	t->nstores = 0;
+}
+
+/**
+ * A compiled block from pc ran n instructions since trace_end(), opc and
+ * cb being the first one's.
+ */
+void trace_block(tracer *t, uint16_t pc, uint8_t opc, uint8_t cb, uint32_t n)
+{
+	t->open = 0x1;
+	t->flags = opc == 0xCB ? TR_CB : 0x0;
+	t->pc = pc;
+	t->opc = opc;
+	t->cb = cb;
+	t->count = n;
+}
+
+/**
+ * A store the CPU made, called by wr8() before it lands.
+ */
+void trace_write(tracer *t, uint16_t addr, uint8_t val)
+{
+	uint8_t *p = t->stores + 3 * t->nstores;
+
+	if (t->nstores == TRACE_WRITES) {
+		t->dropped++;
+		return;
+	}
+	p[0] = addr & 0xFF;
+	p[1] = addr >> 0x8;
+	p[2] = val;
+	t->nstores++;
+}
+
+/**
+ * Map the trace at path for reading, from its first record.
+ *
+ * Return 0 or a TRACE_E* error.
+ */
+int trace_load(tracefile *tf, const char *path)
+{
+	const uint8_t *p;
+	struct stat st;
+	uint64_t n;
+	size_t i;
+	void *map;
+	int fd;
+
+	memset(tf, 0, sizeof(tracefile));
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return (TRACE_EOPEN);
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return (TRACE_EOPEN);
+	}
+	if ((size_t)st.st_size < TRACE_HEADER) {
+		close(fd);
+		return (TRACE_EFORMAT);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return (TRACE_EOPEN);
+	tf->map = (uint8_t *)map;
+	tf->size = st.st_size;
+	if (memcmp(tf->map, TRACE_MAGIC, 4) != 0 || tf->map[4] != TRACE_VERSION) {
+		trace_unload(tf);
+		return (TRACE_EFORMAT);
+	}
+	madvise(tf->map, tf->size, MADV_SEQUENTIAL);
+
+	//a trace that was cut short has no index and is decoded from the start
+	tf->end = tf->size;
+	tf->cut = 0x1;
+	if (tf->size >= TRACE_HEADER + 12 &&
+	    memcmp(tf->map + tf->size - 4, TRACE_INDEX, 4) == 0) {
+		n = get64(tf->map + tf->size - 12);
+		if (n > (tf->size - TRACE_HEADER - 12) / KEY_BYTES) {
+			trace_unload(tf);
+			return (TRACE_ECORRUPT);
+		}
+		tf->end = tf->size - 12 - n * KEY_BYTES;
+		if (n && !(tf->keys = (tracekey *)malloc(n * sizeof(tracekey)))) {
+			trace_unload(tf);
+			return (TRACE_ENOMEM);
+		}
+		for (i = 0, p = tf->map + tf->end; i < n; i++, p += KEY_BYTES) {
+			tf->keys[i].off = get64(p);
+			tf->keys[i].step = get64(p + 8);
+			tf->keys[i].record = get64(p + 16);
+		}
+		tf->nkeys = n;
+		tf->cut = 0x0;
+	}
+	tf->pos = TRACE_HEADER;
+	tf->next = 0x10000;
+	return (0);
+}
+
+void trace_unload(tracefile *tf)
+{
+	if (tf->map)
+		munmap(tf->map, tf->size);
+	free(tf->keys);
+	memset(tf, 0, sizeof(tracefile));
+}
+
+/**
+ * Go to a keyframe, NULL for the first record.
+ *
+ * Return 0, TRACE_ECORRUPT if it's outside the records.
+ */
+int trace_seek(tracefile *tf, const tracekey *key)
+{
+	if (key && (key->off < TRACE_HEADER || key->off >= tf->end))
+		return (TRACE_ECORRUPT);
+	tf->pos = key ? key->off : TRACE_HEADER;
+	tf->records = key ? key->record : 0;
+	tf->steps = key ? key->step : 0;
+	tf->next = 0x10000;
+	tf->keyed = 0x0;
+	return (0);
+}
+
+/**
+ * Decode the next record into tf->rec.
+ *
+ * Return 1, 0 past the last record, TRACE_ECORRUPT if it doesn't decode.
+ * In a trace that was cut short a record that runs past the end is
+ * taken as the end.
+ */
+int trace_next(tracefile *tf)
+{
+	const uint8_t *p = tf->map + tf->pos, *end = tf->map + tf->end;
+	tracerec *r = &tf->rec;
+	uint64_t v;
+	uint8_t mask;
+	int i, j;
+
+	if (tf->pos >= tf->end)
+		return (0);
+	r->flags = *p++;
+	if (r->flags & TR_PC) {
+		if (end - p < 2)
+			goto cut;
+		r->pc = p[0] | p[1] << 0x8;
+		p += 2;
+	} else if (tf->next > 0xFFFF) {
+		return (TRACE_ECORRUPT);
+	} else {
+		r->pc = tf->next;
+	}
+	if (end - p < 1 + !!(r->flags & TR_CB))
+		goto cut;
+	r->opc = *p++;
+	r->cb = r->flags & TR_CB ? *p++ : 0x0;
+	r->count = 1;
+	if (r->flags & TR_COUNT) {
+		if (getvar(&p, end, &v) < 0)
+			goto cut;
+		if (v >= 0xFFFFFFFF)
+			return (TRACE_ECORRUPT);
+		r->count = v + 1;
+	}
+
+	if (r->flags & TR_KEY) {
+		if (end - p < TR_NREGS)
+			goto cut;
+		memcpy(r->regs, p, TR_NREGS);
+		p += TR_NREGS;
+		tf->keyed = 0x1;
+	} else if (!tf->keyed) {
+		return (TRACE_ECORRUPT);
+	}
+	for (j = 0; j < 2; j++) {
+		if (!(r->flags & (j ? TR_MORE : TR_REGS)))
+			continue;
+		if (end - p < 1)
+			goto cut;
+		mask = *p++;
+		for (i = 0; i < 8; i++) {
+			if (!(mask & (0x1 << i)))
+				continue;
+			if (8 * j + i >= TR_NREGS)
+				return (TRACE_ECORRUPT);
+			if (end - p < 1)
+				goto cut;
+			r->regs[8 * j + i] = *p++;
+		}
+	}
+
+	r->nstores = 0;
+	r->stores = p;
+	if (r->flags & TR_WRITES) {
+		if (getvar(&p, end, &v) < 0 || v > (uint64_t)(end - p) / 3)
+			goto cut;
+		r->nstores = v;
+		r->stores = p;
+		p += 3 * v;
+	}
+
+	r->record = tf->records++;
+	r->step = tf->steps;
+	tf->steps += r->count;
+	tf->next = predict(r->flags, r->pc, r->opc);
+	tf->pos = p - tf->map;
+	return (1);
+
+cut:
+	//the writer stopped in the middle of it
+	if (tf->cut)
+		return (0);
+	return (TRACE_ECORRUPT);
+}
+
+/**
+ * Compare two traces step by step and report where they first disagree
+ * to fp, or that they don't. While the files are byte for byte the same
+ * they're only compared as memory, the records are decoded from the last
+ * keyframe before the first byte that differs. Runs of records on one
+ * side are held against a compiled block's record on the other.
+ *
+ * Return 0 if the traces agree, 1 if not, a TRACE_E* error.
+ */
+int trace_diff(tracefile *a, tracefile *b, FILE *fp)
+{
+	tracerun ra, rb;
+	const tracekey *from = NULL;
+	size_t same, lo = 0, hi = a->nkeys, mid;
+	int na, nb, what, err = 0;
+
+	same = common(a, b);
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (a->keys[mid].off < same)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0)
+		from = &a->keys[lo - 1];
+	//bytes before same are b's too, so its records start at the same place
+	if ((err = trace_seek(a, from)) < 0 || (err = trace_seek(b, from)) < 0)
+		return (err);
+
+	memset(&ra, 0, sizeof(ra));
+	memset(&rb, 0, sizeof(rb));
+	for (;;) {
+		na = trace_next(a);
+		nb = trace_next(b);
+		if (na > 0 && nb > 0) {
+			begin(&ra, &a->rec);
+			begin(&rb, &b->rec);
+			while (na > 0 && nb > 0 && ra.end != rb.end) {
+				if (ra.end < rb.end)
+					na = extend(a, &ra);
+				else
+					nb = extend(b, &rb);
+			}
+		}
+		if (na < 0 || nb < 0) {
+			err = na < 0 ? na : nb;
+			break;
+		}
+		if (!na && !nb) {
+			fprintf(fp, "traces agree, %lu steps\n", (unsigned long)a->steps);
+			break;
+		}
+		if (!na || !nb) {
+			fprintf(fp, "%s trace ends at step %lu, the other goes on\n",
+			    na ? "second" : "first", (unsigned long)(na ? b->steps : a->steps));
+			err = 1;
+			break;
+		}
+		if ((what = agree(&ra, &rb)) != 0) {
+			report(fp, &ra, &rb, what);
+			err = 1;
+			break;
+		}
+	}
+
+	free(ra.buf);
+	free(rb.buf);
+	return (err);
+}
+
+const char *trace_strerror(int err)
+{
+	switch (err) {
+	case TRACE_EOPEN: return ("can't open trace");
+	case TRACE_EFORMAT: return ("not a trace");
+	case TRACE_ECORRUPT: return ("damaged trace");
+	case TRACE_ENOMEM: return ("out of memory");
+	default: return ("unknown error");
+	}
+}
+
+/*
+ * Encode the open record against the state after the one before, every
+ * TRACE_KEYEVERY records a keyframe with all of it.
+ */
+static void emit(tracer *t, const registers *reg)
+{
+	registers r = *reg;
+	uint8_t now[TR_NREGS], mask[2] = { 0x0, 0x0 }, flags = t->flags, *p;
+	int i, j, key = t->records % TRACE_KEYEVERY == 0;
+
+	now[TR_A] = r.a;
+	now[TR_F] = getf(&r); //on a copy, the run's flags stay pending
+	now[TR_B] = r.b;
+	now[TR_C] = r.c;
+	now[TR_D] = r.d;
+	now[TR_E] = r.e;
+	now[TR_H] = r.h;
+	now[TR_L] = r.l;
+	now[TR_SPL] = r.sp & 0xFF;
+	now[TR_SPH] = r.sp >> 0x8;
+	now[TR_IME] = r.ime;
+	now[TR_HALT] = r.halt;
+
+	if (t->count > 1)
+		flags |= TR_COUNT;
+	if (key || t->pc != t->next)
+		flags |= TR_PC;
+	if (key) {
+		flags |= TR_KEY;
+	} else {
+		for (i = 0; i < TR_NREGS; i++)
+			if (now[i] != t->last[i])
+				mask[i / 8] |= 0x1 << (i % 8);
+		if (mask[0])
+			flags |= TR_REGS;
+		if (mask[1])
+			flags |= TR_MORE;
+	}
+	if (t->nstores)
+		flags |= TR_WRITES;
+
+	if (t->len + RECORD_MAX + 3 * t->nstores > TRACE_BUF)
+		flush(t);
+	//an unindexed keyframe only costs the diff some decoding
+	if (key && array_reserve(&t->keys, &t->capkeys, t->nkeys + 1,
+	    sizeof(tracekey)) == 0) {
+		t->keys[t->nkeys].off = t->off + t->len;
+		t->keys[t->nkeys].step = t->steps;
+		t->keys[t->nkeys].record = t->records;
+		t->nkeys++;
+	}
+
+	p = t->buf + t->len;
+	*p++ = flags;
+	if (flags & TR_PC) {
+		*p++ = t->pc & 0xFF;
+		*p++ = t->pc >> 0x8;
+	}
+	*p++ = t->opc;
+	if (flags & TR_CB)
+		*p++ = t->cb;
+	if (flags & TR_COUNT)
+		p = putvar(p, t->count - 1);
+	if (key) {
+		memcpy(p, now, TR_NREGS);
+		p += TR_NREGS;
+	}
+	for (j = 0; j < 2; j++) {
+		if (!mask[j])
+			continue;
+		*p++ = mask[j];
+		for (i = 0; i < 8; i++)
+			if (mask[j] & (0x1 << i))
+				*p++ = now[8 * j + i];
+	}
+	if (flags & TR_WRITES) {
+		p = putvar(p, t->nstores);
+		memcpy(p, t->stores, 3 * t->nstores);
+		p += 3 * t->nstores;
+	}
+	t->len = p - t->buf;
+
+	memcpy(t->last, now, TR_NREGS);
+	t->records++;
+	t->steps += t->count;
+	t->next = predict(flags, t->pc, t->opc);
+}
+
+/*
+ * Hand the buffer to the file. After a failed write the rest of the
+ * trace is dropped.
+ */
+static void flush(tracer *t)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (!t->err && done < t->len) {
+		if ((n = write(t->fd, t->buf + done, t->len - done)) < 0) {
+			if (errno != EINTR)
+				t->err = 1;
+			continue;
+		}
+		done += n;
+	}
+	t->off += t->len;
+	t->len = 0;
+}
+
+/*
+ * Where the record after one starts if it gives no PC. Past 0xFFFF after
+ * a compiled block, which can end anywhere.
+ */
+static uint32_t predict(uint8_t flags, uint16_t pc, uint8_t opc)
+{
+	if (flags & TR_COUNT)
+		return (0x10000);
+	if (flags & TR_IRQ)
+		return (opc);
+	return ((uint16_t)(pc + opcode_len(opc)));
+}
+
+static uint8_t *putvar(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (v & 0x7F) | 0x80;
+		v >>= 0x7;
+	}
+	*p++ = v;
+	return (p);
+}
+
+static uint8_t *put64(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		*p++ = v >> (8 * i);
+	return (p);
+}
+
+/*
+ * Return 0, -1 if the number runs past end or doesn't fit.
+ */
+static int getvar(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+	const uint8_t *q = *p;
+	int shift;
+
+	*v = 0;
+	for (shift = 0; q < end && shift < 64; shift += 7) {
+		*v |= (uint64_t)(*q & 0x7F) << shift;
+		if (!(*q++ & 0x80)) {
+			*p = q;
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+	return (v);
+}
+
+/*
+ * Offset of the first byte the records of a and b differ at, a chunk at
+ * a time while they're the same.
+ */
+static size_t common(const tracefile *a, const tracefile *b)
+{
+	size_t n = a->end < b->end ? a->end : b->end, i = TRACE_HEADER, len;
+
+	for (; i < n; i += len) {
+		len = n - i < DIFF_CHUNK ? n - i : DIFF_CHUNK;
+		if (memcmp(a->map + i, b->map + i, len) != 0)
+			break;
+	}
+	while (i < n && a->map[i] == b->map[i])
+		i++;
+	return (i);
+}
+
+static void begin(tracerun *r, const tracerec *rec)
+{
+	r->first = *rec;
+	r->end = rec->step + rec->count;
+	memcpy(r->regs, rec->regs, TR_NREGS);
+	r->stores = rec->stores;
+	r->nstores = rec->nstores;
+}
+
+/*
+ * Add the next record of tf to the run.
+ *
+ * Return 1, 0 past the last record, a TRACE_E* error.
+ */
+static int extend(tracefile *tf, tracerun *r)
+{
+	const tracerec *rec = &tf->rec;
+	int n, inbuf;
+
+	if ((n = trace_next(tf)) <= 0)
+		return (n);
+	//the first record's stores are still in the file, later ones are in
+	//the buffer, which growing it may move
+	inbuf = r->stores == r->buf;
+	if (array_reserve(&r->buf, &r->cap, 3 * (r->nstores + rec->nstores), 1) < 0)
+		return (TRACE_ENOMEM);
+	if (!inbuf)
+		memmove(r->buf, r->stores, 3 * r->nstores);
+	memcpy(r->buf + 3 * r->nstores, rec->stores, 3 * rec->nstores);
+	r->stores = r->buf;
+	r->nstores += rec->nstores;
+	r->end = rec->step + rec->count;
+	memcpy(r->regs, rec->regs, TR_NREGS);
+	return (1);
+}
+
+/*
+ * Return the DIFF_* things two runs over the same steps disagree on.
+ */
+static int agree(const tracerun *a, const tracerun *b)
+{
+	int what = 0;
+
+	if (a->first.pc != b->first.pc)
+		what |= DIFF_PC;
+	//a compiled block only tells how it starts
+	if (a->first.opc != b->first.opc ||
+	    (a->first.flags & (TR_IRQ | TR_CB)) != (b->first.flags & (TR_IRQ | TR_CB)) ||
+	    a->first.cb != b->first.cb)
+		what |= DIFF_OP;
+	if (memcmp(a->regs, b->regs, TR_NREGS) != 0)
+		what |= DIFF_REGS;
+	if (a->nstores != b->nstores || memcmp(a->stores, b->stores, 3 * a->nstores) != 0)
+		what |= DIFF_STORES;
+	return (what);
+}
+
+static void report(FILE *fp, const tracerun *a, const tracerun *b, int what)
+{
+	int i;
+
+	fprintf(fp, "traces diverge at step %lu, record %lu of the first, %lu of the second\n",
+	    (unsigned long)a->first.step, (unsigned long)a->first.record,
+	    (unsigned long)b->first.record);
+	describe(fp, "first", a);
+	describe(fp, "second", b);
+	fprintf(fp, "  differ in");
+	if (what & DIFF_PC)
+		fprintf(fp, " pc");
+	if (what & DIFF_OP)
+		fprintf(fp, " opcode");
+	for (i = 0; i < TR_NREGS; i++) {
+		if (a->regs[i] == b->regs[i])
+			continue;
+		//sp once
+		if (i == TR_SPH && a->regs[TR_SPL] != b->regs[TR_SPL])
+			continue;
+		fprintf(fp, " %s", regname[i]);
+	}
+	if (what & DIFF_STORES)
+		fprintf(fp, " stores");
+	fprintf(fp, "\n");
+}
+
+/*
+ * One side of a divergence: where it starts, the state after it and the
+ * first stores.
+ */
+static void describe(FILE *fp, const char *side, const tracerun *r)
+{
+	const tracerec *f = &r->first;
+	const uint8_t *s = r->stores;
+	size_t i;
+
+	fprintf(fp, "  %s: pc %04x, ", side, f->pc);
+	if (f->flags & TR_IRQ)
+		fprintf(fp, "interrupt to %04x", f->opc);
+	else if (f->flags & TR_CB)
+		fprintf(fp, "op cb %02x", f->cb);
+	else
+		fprintf(fp, "op %02x", f->opc);
+	if (r->end - f->step > 1)
+		fprintf(fp, ", %lu steps", (unsigned long)(r->end - f->step));
+	fprintf(fp, "\n    a %02x f %02x bc %02x%02x de %02x%02x hl %02x%02x sp %02x%02x ime %u halt %u\n",
+	    r->regs[TR_A], r->regs[TR_F], r->regs[TR_B], r->regs[TR_C], r->regs[TR_D],
+	    r->regs[TR_E], r->regs[TR_H], r->regs[TR_L], r->regs[TR_SPH], r->regs[TR_SPL],
+	    r->regs[TR_IME], r->regs[TR_HALT]);
+	fprintf(fp, "    stores");
+	for (i = 0; i < r->nstores && i < 8; i++, s += 3)
+		fprintf(fp, " %04x=%02x", s[0] | s[1] << 0x8, s[2]);
+	if (r->nstores > 8)
+		fprintf(fp, " and %lu more", (unsigned long)(r->nstores - 8));
+	else if (!r->nstores)
+		fprintf(fp, " none");
+	fprintf(fp, "\n");
+}
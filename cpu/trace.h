@@ -0,0 +1,191 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cpu.h"
+
+/*
+ * Binary execution traces. The writer is built in only with TRACE
+ * defined, otherwise the TRACE_* hooks expand to nothing and the bus has
+ * no tracer pointer. Reading and diffing traces is always there.
+ *
+ * A trace is a header, one record per step, where a step is an executed
+ * instruction or a taken interrupt, and an index of keyframes at the end.
+ * Records only hold what changed:
+ *
+ *	flags		TR_* bits
+ *	pc		2 bytes, with TR_PC, otherwise the PC after the record
+ *			before: past its instruction, at the vector after an
+ *			interrupt, a compiled block is always followed by one
+ *	opcode		the vector for an interrupt
+ *	cb		with TR_CB
+ *	count - 1	with TR_COUNT, LEB128
+ *	registers	a keyframe has all TR_NREGS of them, other records a
+ *			mask byte and the changed ones for TR_REGS (A F B C D
+ *			E H L), then the same for TR_MORE (SP low and high,
+ *			IME, HALT state)
+ *	writes		with TR_WRITES, a LEB128 count and then address, low
+ *			byte first, and value of every store
+ *
+ * Registers are the state after the step, the PC is where it started.
+ * Everything is little endian, so a reference emulator's log can be
+ * converted into the same format: PCs can always be given, and only the
+ * first record has to be a keyframe.
+ *
+ * Recompiled blocks run as a whole and get one record for all their
+ * instructions, with the first instruction's opcode and every store they
+ * made. Traces only line up if the runs are otherwise the same: skipped
+ * polling loops leave steps out, so compare runs made with -e.
+ */
+#define TRACE_MAGIC	"GBTR"
+#define TRACE_VERSION	1
+#define TRACE_BUF	(1 << 20) //bytes buffered between writes
+#define TRACE_KEYEVERY	65536 //records between keyframes
+#define TRACE_WRITES	4096 //stores kept per record, later ones are dropped
+
+//record flags
+#define TR_PC		0x01
+#define TR_COUNT	0x02 //several instructions of a compiled block
+#define TR_CB		0x04
+#define TR_IRQ		0x08
+#define TR_REGS		0x10
+#define TR_MORE		0x20
+#define TR_WRITES	0x40
+#define TR_KEY		0x80
+
+//registers in record order
+#define TR_A		0
+#define TR_F		1
+#define TR_B		2
+#define TR_C		3
+#define TR_D		4
+#define TR_E		5
+#define TR_H		6
+#define TR_L		7
+#define TR_SPL		8
+#define TR_SPH		9
+#define TR_IME		10
+#define TR_HALT		11
+#define TR_NREGS	12
+
+//trace errors
+#define TRACE_EOPEN	-1 //can't read or write the file
+#define TRACE_EFORMAT	-2 //not a trace
+#define TRACE_ECORRUPT	-3 //a record doesn't decode
+#define TRACE_ENOMEM	-4
+
+typedef struct {
+	uint64_t	off; //of the keyframe record in the file
+	uint64_t	step; //steps before it
+	uint64_t	record; //records before it
+} tracekey;
+
+typedef struct tracer {
+	int		fd;
+	int		err; //a write failed, the trace is cut short there
+	uint8_t		*buf;
+	size_t		len; //bytes in buf
+	uint64_t	off; //file offset buf starts at
+	uint64_t	records;
+	uint64_t	steps;
+	uint64_t	dropped; //stores past TRACE_WRITES
+
+	//the record still taking stores, written out when the next starts
+	uint8_t		open;
+	uint8_t		flags; //TR_CB, TR_IRQ
+	uint16_t	pc;
+	uint8_t		opc;
+	uint8_t		cb;
+	uint32_t	count;
+	uint32_t	next; //PC a reader expects, past 0xFFFF for none
+	uint8_t		last[TR_NREGS]; //state after the last record
+	uint8_t		*stores; //3 bytes each
+	uint32_t	nstores;
+
+	tracekey	*keys;
+	size_t		nkeys;
+	size_t		capkeys;
+} tracer;
+
+typedef struct {
+	uint64_t	record; //records before this one
+	uint64_t	step; //steps before this one
+	uint32_t	count; //steps it stands for
+	uint16_t	pc;
+	uint8_t		flags;
+	uint8_t		opc;
+	uint8_t		cb;
+	uint8_t		regs[TR_NREGS];
+	uint32_t	nstores;
+	const uint8_t	*stores; //in the file, 3 bytes each
+} tracerec;
+
+typedef struct {
+	uint8_t		*map;
+	size_t		size;
+	size_t		pos; //next record
+	size_t		end; //where the records stop
+	tracekey	*keys;
+	size_t		nkeys;
+	uint32_t	next; //PC of a record without TR_PC
+	uint64_t	records; //read so far
+	uint64_t	steps;
+	uint8_t		keyed; //a keyframe was read, registers are known
+	uint8_t		cut; //no index, the writer didn't finish
+	tracerec	rec; //the last record read
+} tracefile;
+
+tracer	*trace_open(const char *path);
+int	trace_close(tracer *t, const registers *reg);
+void	trace_insn(tracer *t, const registers *reg, uint16_t pc, uint8_t opc);
+void	trace_cb(tracer *t, uint8_t opc);
+void	trace_irq(tracer *t, const registers *reg, uint16_t vector);
+void	trace_end(tracer *t, const registers *reg);
+void	trace_block(tracer *t, uint16_t pc, uint8_t opc, uint8_t cb, uint32_t n);
+void	trace_write(tracer *t, uint16_t addr, uint8_t val);
+
+int		trace_load(tracefile *tf, const char *path);
+void		trace_unload(tracefile *tf);
+int		trace_seek(tracefile *tf, const tracekey *key);
+int		trace_next(tracefile *tf);
+int		trace_diff(tracefile *a, tracefile *b, FILE *fp);
+const char	*trace_strerror(int err);
+
+#ifdef TRACE
+#define TRACE_INSN(mem, reg, pc, opc) \
+	do { if ((mem)->trace) trace_insn((mem)->trace, reg, pc, opc); } while (0)
+#define TRACE_CB(mem, opc) \
+	do { if ((mem)->trace) trace_cb((mem)->trace, opc); } while (0)
+//an instruction with its immediate, the CB opcode for a CB prefix
+#define TRACE_OP(mem, reg, pc, opc, imm) \
+	do { \
+		if ((mem)->trace) { \
+			trace_insn((mem)->trace, reg, pc, opc); \
+			if ((opc) == 0xCB) \
+				trace_cb((mem)->trace, imm); \
+		} \
+	} while (0)
+#define TRACE_IRQ(mem, reg, vector) \
+	do { if ((mem)->trace) trace_irq((mem)->trace, reg, vector); } while (0)
+//around a compiled block: close the record before, then claim its stores
+#define TRACE_END(mem, reg) \
+	do { if ((mem)->trace) trace_end((mem)->trace, reg); } while (0)
+#define TRACE_BLOCK(mem, blk, n) \
+	do { \
+		if ((mem)->trace && (n) > 0) \
+			trace_block((mem)->trace, (blk)->pc, (blk)->code[0].opc, \
+			    (blk)->code[0].imm, n); \
+	} while (0)
+#else
+#define TRACE_INSN(mem, reg, pc, opc)
+#define TRACE_CB(mem, opc)
+#define TRACE_OP(mem, reg, pc, opc, imm)
+#define TRACE_IRQ(mem, reg, vector)
+#define TRACE_END(mem, reg)
+#define TRACE_BLOCK(mem, blk, n)
+#endif
+
+#endif